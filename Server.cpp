@@ -1,4 +1,3 @@
-#include <iostream>
 #include <cstdlib>
 #include <string>
 #include <cstring>
@@ -6,6 +5,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <thread>
 #include <algorithm> 
@@ -13,35 +13,93 @@
 #include "handle_redis_commands.h"
 #include "redis_parser.h"
 #include "database.h"
+#include "replication.h"
+#include "io_threads.h"
+#include "shards.h"
+#include "io_uring_loop.h"
+#include "defrag.h"
+#include "slowlog.h"
+#include "latency_monitor.h"
+#include "clients.h"
+#include "pubsub.h"
+#include "tracking.h"
+#include "hotkeys.h"
+#include "stats.h"
+#include "logger.h"
 
 using namespace std;
 using std::thread;
 
-void handle_client(int client_fd,const vector<pair<string, string>> &replica_info) {
-  char buffer[1024];
+void handle_client(int client_fd, const vector<pair<string, string>> &replica_info, ClientState client, string input) {
+  client.fd = client_fd;
+  if (!client.info) {
+    register_client(client, client_fd);
+  }
+
+  // Requests can span reads and one read can carry several pipelined requests,
+  // so input accumulates here and every complete command is run before the
+  // replies, which the handlers append to client.output, go out in a single write.
+  // A connection handed over by an I/O thread arrives with input already read.
+  char buffer[16 * 1024];
+  const size_t output_keep_capacity = 64 * 1024;
+  client.output.text.reserve(output_keep_capacity);
 
   while(1){
 
-    int bytes_read = read(client_fd, buffer, sizeof(buffer));
-    if(bytes_read<=0){
-      cerr<< "failed to read\n";
-      close(client_fd);
-      return;
-    }
-    
-    string input(buffer);
     RESPParser parser;
+    size_t consumed = 0;
     try{
-      RESPObject obj = parser.parse(input);
-      string response = handle_command(obj, client_fd, replica_info);
-      write(client_fd, response.c_str(),response.size()); 
+      while(consumed < input.size()){
+        RESPObject obj = parser.parse(input);
+        consumed = parser.get_position();
+        if(shard_count > 0){
+          run_on_owning_shard(obj, client, replica_info);
+        }
+        else{
+          handle_command(obj, client, replica_info);
+        }
+      }
+    }
+    catch(const RESPIncompleteError&){
     }
     catch(const exception& ex){
-      cout << "Parse error: "<< ex.what() << "\n";
+      static LogRateLimit parse_errors;
+      log_limited(parse_errors, LogLevel::Warning, "Protocol error from fd ", client_fd, ": ", ex.what());
+      Reply(client.output).error("ERR Protocol error: " + string(ex.what()));
+      consumed = input.size();
+    }
+    input.erase(0, consumed);
+
+    if(!client.output.empty()){
+      if(!client.output.flush(client_fd)){
+        log_message(LogLevel::Verbose, "Failed to write to client on fd ", client_fd);
+        break;
+      }
+      // Don't let one huge reply pin its buffer for the rest of the connection.
+      if(client.output.text.capacity() > 16 * output_keep_capacity){
+        string().swap(client.output.text);
+        client.output.text.reserve(output_keep_capacity);
+      }
+    }
+    note_client_buffers(client, input.size());
+
+    // A subscriber also wakes up for published messages, which go out on the
+    // next pass round the loop.
+    if(client.subscriber && !wait_for_input_or_messages(client)){
+      continue;
     }
 
+    int bytes_read = read(client_fd, buffer, sizeof(buffer));
+    if(bytes_read<=0){
+      log_message(LogLevel::Verbose, "Client on fd ", client_fd, " closed the connection");
+      break;
+    }
+    input.append(buffer, bytes_read);
   }
 
+  release_client_state(client);
+  unregister_client(client);
+  remove_replica(client_fd);
   close(client_fd);
 }
 
@@ -66,90 +124,258 @@ vector<pair<string, string>> parse_info(int port, const string& replica_host, in
 }
 
 
+static bool is_getack(const RESPObject& obj) {
+  if (obj.get_type() != RESPType::Array || obj.get_array().size() < 2) {
+    return false;
+  }
+  string command = obj.get_array()[0].get_string_value();
+  string subcommand = obj.get_array()[1].get_string_value();
+  transform(command.begin(), command.end(), command.begin(), ::toupper);
+  transform(subcommand.begin(), subcommand.end(), subcommand.begin(), ::toupper);
+  return command == "REPLCONF" && subcommand == "GETACK";
+}
+
 void connect_to_master(const string& replica_host, int master_port, int replica_port, const vector<pair<string, string>>& replica_info) {
+  struct addrinfo hints = {};
+  struct addrinfo *master_addr = nullptr;
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(replica_host.c_str(), to_string(master_port).c_str(), &hints, &master_addr) != 0) {
+      log_message(LogLevel::Warning, "Failed to resolve master host ", replica_host);
+      return;
+  }
+
   int sockfd = socket(AF_INET, SOCK_STREAM, 0);
   if (sockfd < 0) {
-      cerr << "Failed to create socket for master connection\n";
+      log_message(LogLevel::Warning, "Failed to create socket for master connection");
+      freeaddrinfo(master_addr);
       return;
   }
 
-  struct sockaddr_in server_addr;
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_port = htons(master_port);
-
-  if (connect(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-      cerr << "Failed to connect to master: " << strerror(errno) << "\n";
+  if (connect(sockfd, master_addr->ai_addr, master_addr->ai_addrlen) < 0) {
+      log_message(LogLevel::Warning, "Failed to connect to master: ", strerror(errno));
+      freeaddrinfo(master_addr);
       close(sockfd);
       return;
   }
+  freeaddrinfo(master_addr);
 
+  // ACKs are tiny; don't let Nagle hold them back while WAIT is pending.
+  int nodelay = 1;
+  setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
 
-  auto send_and_recv = [&](const string& message, const string& tag) -> string {
-      if (send(sockfd, message.c_str(), message.size(), 0) < 0) {
-          cerr << "Failed to send " << tag << "\n";
-          return "";
-      }
+  // Everything read from the master lands in one growable buffer; replies, the
+  // RDB payload and pipelined commands are parsed out of it as they complete.
+  string buffer;
 
-      char buffer[1028];
-      int len = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
+  auto fill_buffer = [&]() -> bool {
+      char chunk[16 * 1024];
+      int len = recv(sockfd, chunk, sizeof(chunk), 0);
+      if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          return true; // receive timeout, the link is still up
+      }
       if (len <= 0) {
-          cerr << "Failed to receive " << tag << " response\n";
-          return "";
+          return false;
       }
-      buffer[len] = '\0';
-      return string(buffer);
+      buffer.append(chunk, len);
+      replica_last_io_ms = duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+      return true;
   };
 
-  string response;
+  // Parses one complete value off the front of the buffer, reading more as needed.
+  auto read_value = [&](bool rdb_transfer) -> RESPObject {
+      while (true) {
+          RESPParser parser;
+          try {
+              RESPObject obj = rdb_transfer ? parser.parse_rdb_transfer(buffer) : parser.parse(buffer);
+              buffer.erase(0, parser.get_position());
+              return obj;
+          }
+          catch (const RESPIncompleteError&) {
+              if (!fill_buffer()) {
+                  throw runtime_error("connection closed by master");
+              }
+          }
+      }
+  };
 
-  // 1. Send PING
-  response = send_and_recv("*1\r\n$4\r\nPING\r\n", "PING");
-  
+  auto send_and_recv = [&](const string& message, const string& tag) -> string {
+      if (send(sockfd, message.c_str(), message.size(), 0) < 0) {
+          throw runtime_error("failed to send " + tag);
+      }
+      return read_value(false).get_string_value();
+  };
 
-  // 2. Send REPLCONF listening-port
-  string replconf_port = "*3\r\n$8\r\nREPLCONF\r\n$14\r\nlistening-port\r\n$" + to_string(to_string(replica_port).size()) + "\r\n" + to_string(replica_port) + "\r\n";
-  response = send_and_recv(replconf_port, "REPLCONF listening-port");
-  cout << "[Master Reply - REPLCONF port]: " << response;
+  try {
+    string response;
 
-  // 3. Send REPLCONF capa psync2
-  string replconf_capa = "*3\r\n$8\r\nREPLCONF\r\n$4\r\ncapa\r\n$6\r\npsync2\r\n";
-  response = send_and_recv(replconf_capa, "REPLCONF capa");
-  cout << "[Master Reply - REPLCONF capa]: " << response;
+    // 1. Send PING
+    response = send_and_recv("*1\r\n$4\r\nPING\r\n", "PING");
 
-  // 4. Send PSYNC ? -1
-  string psync = "*3\r\n$5\r\nPSYNC\r\n$1\r\n?\r\n$2\r\n-1\r\n";
-  response = send_and_recv(psync, "PSYNC");
-  cout << "[Master Reply - PSYNC]: " << response;
+    // 2. Send REPLCONF listening-port
+    string replconf_port = "*3\r\n$8\r\nREPLCONF\r\n$14\r\nlistening-port\r\n$" + to_string(to_string(replica_port).size()) + "\r\n" + to_string(replica_port) + "\r\n";
+    response = send_and_recv(replconf_port, "REPLCONF listening-port");
+    log_message(LogLevel::Verbose, "Master replied to REPLCONF listening-port: ", response);
 
-  char buffer[1024];
-  while(1){
+    // 3. Send REPLCONF capa psync2
+    string replconf_capa = "*3\r\n$8\r\nREPLCONF\r\n$4\r\ncapa\r\n$6\r\npsync2\r\n";
+    response = send_and_recv(replconf_capa, "REPLCONF capa");
+    log_message(LogLevel::Verbose, "Master replied to REPLCONF capa: ", response);
 
-    int bytes_received = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
-    if(bytes_received<=0){
-      cerr<< "failed to read\n";
-      close(sockfd);
-      return;
+    // 4. Send PSYNC ? -1, answered with "FULLRESYNC <replid> <offset>" and the RDB
+    string psync = "*3\r\n$5\r\nPSYNC\r\n$1\r\n?\r\n$2\r\n-1\r\n";
+    response = send_and_recv(psync, "PSYNC");
+    log_message(LogLevel::Notice, "Master replied to PSYNC: ", response);
+
+    int64_t offset = 0;
+    size_t offset_pos = response.rfind(' ');
+    if (offset_pos != string::npos) {
+      offset = stoll(response.substr(offset_pos + 1));
+    }
+
+    // The payload is either an RDB file ("$<len>\r\n...", skipped: it only ever
+    // describes an empty keyspace) or a diskless snapshot ("$EOF:<mark>\r\n"
+    // followed by commands that rebuild the keyspace, then the mark again).
+    while (buffer.find("\r\n") == string::npos) {
+      if (!fill_buffer()) {
+        throw runtime_error("connection closed by master");
+      }
+    }
+    {
+      AllKeyspacesLock lock;
+      flush_all_stores(true);
+    }
+    if (buffer.compare(0, 5, "$EOF:") == 0) {
+      size_t line_end = buffer.find("\r\n");
+      string mark = buffer.substr(5, line_end - 5);
+      buffer.erase(0, line_end + 2);
+
+      int64_t snapshot_commands = 0;
+      ClientState loader;
+      vector<RESPObject> batch;
+      while (true) {
+        RESPParser parser;
+        size_t consumed = 0;
+        bool done = false;
+        try {
+          while (consumed < buffer.size()) {
+            if (buffer[consumed] != '*') {
+              if (buffer.size() - consumed < mark.size()) {
+                break;
+              }
+              if (buffer.compare(consumed, mark.size(), mark) != 0) {
+                throw runtime_error("bad snapshot terminator");
+              }
+              consumed += mark.size();
+              done = true;
+              break;
+            }
+            batch.push_back(parser.parse(buffer));
+            consumed = parser.get_position();
+          }
+        }
+        catch (const RESPIncompleteError&) {
+        }
+
+        snapshot_commands += batch.size();
+        apply_replication_batch(batch, loader);
+        batch.clear();
+        buffer.erase(0, consumed);
+        if (done) {
+          break;
+        }
+        if (!fill_buffer()) {
+          throw runtime_error("connection closed during snapshot");
+        }
+      }
+      log_message(LogLevel::Notice, "Loaded snapshot of ", snapshot_commands, " commands from master");
+    }
+    else {
+      RESPObject rdb = read_value(true);
+      log_message(LogLevel::Notice, "Received RDB payload of ", rdb.get_string_value().size(), " bytes");
     }
-    
-    string input(buffer);
+
+    replica_read_offset = offset + buffer.size();
+    replica_repl_offset = offset;
+    replica_link_up = true;
+  }
+  catch (const exception& ex) {
+    log_message(LogLevel::Warning, "Replication handshake failed: ", ex.what());
+    close(sockfd);
+    return;
+  }
+
+  steady_clock::time_point last_ack;
+  auto send_ack = [&]() {
+      string offset = to_string(replica_repl_offset.load());
+      string ack = "*3\r\n$8\r\nREPLCONF\r\n$3\r\nACK\r\n$" + to_string(offset.size()) + "\r\n" + offset + "\r\n";
+      send(sockfd, ack.c_str(), ack.size(), MSG_NOSIGNAL);
+      last_ack = steady_clock::now();
+  };
+
+  // Wake up at least once a second so ACKs keep flowing while the link is idle.
+  struct timeval ack_interval = {1, 0};
+  setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &ack_interval, sizeof(ack_interval));
+  send_ack();
+
+  // Stream phase: parse every complete command in the buffer and apply them as
+  // one batch, then keep the incomplete tail for the next read.
+  ClientState master_client;
+  vector<RESPObject> batch;
+  while (1) {
     RESPParser parser;
-    try{
-      RESPObject obj = parser.parse(input);
-      string response = handle_command(obj, -1, vector<pair<string, string>>());
+    size_t consumed = 0;
+    size_t counted = 0; // bytes of the buffer already added to replica_repl_offset
+    try {
+      while (consumed < buffer.size()) {
+        RESPObject obj = parser.parse(buffer);
+        if (is_getack(obj)) {
+          // The ACK has to cover every command before GETACK, so apply those first.
+          apply_replication_batch(batch, master_client);
+          batch.clear();
+          replica_repl_offset += consumed - counted;
+          counted = consumed;
+          send_ack();
+        }
+        else {
+          batch.push_back(std::move(obj));
+        }
+        consumed = parser.get_position();
+      }
     }
-    catch(const exception& ex){
-      cout << "Parse error: "<< ex.what() << "\n";
+    catch (const RESPIncompleteError&) {
+    }
+    catch (const exception& ex) {
+      log_message(LogLevel::Warning, "Corrupt replication stream: ", ex.what());
+      break;
     }
 
+    if (!batch.empty()) {
+      apply_replication_batch(batch, master_client);
+      batch.clear();
+    }
+    replica_repl_offset += consumed - counted;
+    buffer.erase(0, consumed);
+
+    if (steady_clock::now() - last_ack >= seconds(1)) {
+      send_ack();
+    }
+
+    if (!fill_buffer()) {
+      log_message(LogLevel::Warning, "Lost connection to master");
+      break;
+    }
+    replica_read_offset = replica_repl_offset + buffer.size();
   }
-    
+
+  replica_link_up = false;
   close(sockfd);
 }
 
 int main(int argc, char **argv){
-  // Flush after every std::cout / std::cerr
-  cout << unitbuf;
-  cerr << unitbuf;
+  // Lines go out from the logger's own thread; see logger.h.
+  start_logger();
+  calibrate_stats_clock();
 
   int port = 6379;
   string replica_host="";
@@ -159,6 +385,54 @@ int main(int argc, char **argv){
         if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
             port = atoi(argv[i + 1]);
             i += 1;
+        } else if (strcmp(argv[i], "--repl-diskless-sync") == 0 && i + 1 < argc) {
+            repl_diskless_sync = strcmp(argv[i + 1], "yes") == 0;
+            i += 1;
+        } else if (strcmp(argv[i], "--repl-diskless-sync-delay") == 0 && i + 1 < argc) {
+            repl_diskless_sync_delay = max(0, atoi(argv[i + 1]));
+            i += 1;
+        } else if (strcmp(argv[i], "--io-threads") == 0 && i + 1 < argc) {
+            io_threads_count = max(0, atoi(argv[i + 1]));
+            i += 1;
+        } else if (strcmp(argv[i], "--io-uring") == 0 && i + 1 < argc) {
+            io_uring_enabled = strcmp(argv[i + 1], "yes") == 0;
+            i += 1;
+        } else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+            shard_count = min(MAX_SHARDS, max(0, atoi(argv[i + 1])));
+            i += 1;
+        } else if (strcmp(argv[i], "--activedefrag") == 0 && i + 1 < argc) {
+            active_defrag_enabled = strcmp(argv[i + 1], "yes") == 0;
+            i += 1;
+        } else if (strcmp(argv[i], "--active-defrag-threshold") == 0 && i + 1 < argc) {
+            active_defrag_threshold = max(1, atoi(argv[i + 1]));
+            i += 1;
+        } else if (strcmp(argv[i], "--slowlog-log-slower-than") == 0 && i + 1 < argc) {
+            slowlog_log_slower_than = atoll(argv[i + 1]);
+            i += 1;
+        } else if (strcmp(argv[i], "--slowlog-max-len") == 0 && i + 1 < argc) {
+            slowlog_max_len = max(0LL, atoll(argv[i + 1]));
+            i += 1;
+        } else if (strcmp(argv[i], "--latency-monitor-threshold") == 0 && i + 1 < argc) {
+            latency_monitor_threshold_ms = max(0LL, atoll(argv[i + 1]));
+            i += 1;
+        } else if (strcmp(argv[i], "--client-output-buffer-limit") == 0 && i + 1 < argc) {
+            if (!parse_output_buffer_limit(argv[i + 1])) {
+                log_message(LogLevel::Warning, "Error: --client-output-buffer-limit takes \"<normal|replica|pubsub> <hard> <soft> <seconds>\"");
+                exit(1);
+            }
+            i += 1;
+        } else if (strcmp(argv[i], "--tracking-table-max-keys") == 0 && i + 1 < argc) {
+            tracking_table_max_keys = max(0LL, atoll(argv[i + 1]));
+            i += 1;
+        } else if (strcmp(argv[i], "--hotkeys-sample-rate") == 0 && i + 1 < argc) {
+            hotkeys_sample_rate = max(0, atoi(argv[i + 1]));
+            i += 1;
+        } else if (strcmp(argv[i], "--loglevel") == 0 && i + 1 < argc) {
+            if (!parse_log_level(argv[i + 1], log_level)) {
+                log_message(LogLevel::Warning, "Error: --loglevel takes debug, verbose, notice or warning");
+                exit(1);
+            }
+            i += 1;
         } else if (strcmp(argv[i], "--replicaof") == 0 && i + 1 < argc) {
             string host_port = argv[i + 1];
             size_t space_pos = host_port.find(' ');
@@ -166,7 +440,7 @@ int main(int argc, char **argv){
                 replica_host = host_port.substr(0, space_pos);
                 replica_port = stoi(host_port.substr(space_pos + 1));
             } else {
-                cerr << "Error: --replicaof requires a quoted host and port, e.g., \"127.0.0.1 6379\"\n";
+                log_message(LogLevel::Warning, "Error: --replicaof requires a quoted host and port, e.g., \"127.0.0.1 6379\"");
                 exit(1);
             }
             i += 1;
@@ -174,13 +448,20 @@ int main(int argc, char **argv){
     }
 
     if (port <= 0 || port > 65535) {
-        cerr << "Invalid port number. Using default port 6379.\n";
+        log_message(LogLevel::Warning, "Invalid port number. Using default port 6379.");
         port = 6379;
     }
   }
 
   vector<pair<string, string>> replica_info = parse_info(port, replica_host, replica_port);
 
+  if (shard_count > 0) {
+    init_shards();
+  }
+  if (active_defrag_enabled) {
+    start_active_defrag();
+  }
+
   if(!replica_host.empty() && replica_port != 0){
     thread replica_thread(connect_to_master, replica_host, replica_port, port, ref(replica_info));
     replica_thread.detach();
@@ -190,9 +471,16 @@ int main(int argc, char **argv){
   // cout<<replica_host<<endl;
   // cout<<replica_port<<endl;
 
+  if (shard_count > 0) {
+    // The shard threads listen and accept themselves.
+    log_message(LogLevel::Notice, "Ready to accept connections on port ", port, " with ", shard_count, " shards");
+    run_shards(port, replica_info);
+    return 1;
+  }
+
   int server_fd = socket(AF_INET, SOCK_STREAM, 0);
   if (server_fd < 0) {
-   cerr << "Failed to create server socket\n";
+   log_message(LogLevel::Warning, "Failed to create server socket");
    return 1;
   }
   
@@ -200,7 +488,7 @@ int main(int argc, char **argv){
   // ensures that we don't run into 'Address already in use' errors
   int reuse = 1;
   if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
-    cerr << "setsockopt failed\n";
+    log_message(LogLevel::Warning, "setsockopt failed");
     return 1;
   }
   
@@ -210,29 +498,42 @@ int main(int argc, char **argv){
   server_addr.sin_port = htons(port);
   
   if (bind(server_fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) != 0) {
-    cerr << "Failed to bind to port 6379\n";
+    log_message(LogLevel::Warning, "Failed to bind to port ", port);
     return 1;
   }
   
-  int connection_backlog = 5;
+  // Room for a burst of clients connecting at once; with a handful, connects
+  // beyond it stall on SYN retransmits.
+  int connection_backlog = 511;
   if (listen(server_fd, connection_backlog) != 0) {
-    cerr << "listen failed\n";
+    log_message(LogLevel::Warning, "listen failed");
     return 1;
   }
   
   struct sockaddr_in client_addr;
   int client_addr_len = sizeof(client_addr);
+  log_message(LogLevel::Notice, "Ready to accept connections on port ", port);
 
+  if (io_uring_enabled) {
+    // Returns only if io_uring can't be used on this build or kernel.
+    run_io_uring(server_fd, replica_info);
+    log_message(LogLevel::Warning, "io_uring is not available, falling back to epoll I/O threads");
+    io_threads_count = max(io_threads_count, 1);
+  }
 
-  while(1){
-    cout << "Waiting for a client to connect...\n";
+  if (io_threads_count > 0) {
+    start_io_threads(replica_info);
+  }
 
-    // You can use print statements as follows for debugging, they'll be visible when running tests.
-    cout << "Logs from your program will appear here!\n";
 
+  while(1){
     int client_fd = accept(server_fd, (struct sockaddr *) &client_addr, (socklen_t *) &client_addr_len);
-    cout << "Client connected\n";
-    thread client_thread(handle_client, client_fd, ref(replica_info));
+    log_message(LogLevel::Debug, "Client connected on fd ", client_fd);
+    if (io_threads_count > 0) {
+      add_io_connection(client_fd);
+      continue;
+    }
+    thread client_thread(handle_client, client_fd, ref(replica_info), ClientState(), string());
     client_thread.detach();
   }
   
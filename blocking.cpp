@@ -0,0 +1,284 @@
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include "blocking.h"
+#include "handle_redis_commands.h"
+#include "replication.h"
+#include "reply.h"
+
+using namespace std;
+using namespace std::chrono;
+
+thread_local BlockedCommand* block_slot = nullptr;
+
+static thread_local BlockedClients* local_blocked = nullptr;
+
+// Every loop's registry, for the signals from threads that aren't loops. Never
+// destroyed, as the shards' registries unregister from it at exit.
+static mutex& registries_mutex = *new mutex;
+static vector<BlockedClients*>& registries = *new vector<BlockedClients*>;
+// Commands parked on keys in any registry, so writes from the replica link
+// skip the registries while there are none.
+static atomic<int> parked_on_keys{0};
+
+struct BlockedClients::Entry {
+    void* connection;
+    BlockedCommand command;
+    vector<list<Entry*>::iterator> key_positions;
+    multimap<steady_clock::time_point, Entry*>::iterator deadline_position;
+    multimap<int64_t, Entry*>::iterator wait_position;
+};
+
+bool block_on_keys(vector<string> keys, steady_clock::time_point deadline, vector<RESPObject> retry) {
+    BlockedCommand& slot = *block_slot;
+    if (slot.expired) {
+        return false;
+    }
+    if (!slot.resumed) {
+        slot.deadline = deadline;
+    }
+    if (!retry.empty()) {
+        slot.command = RESPObject(RESPType::Array, "", 0, std::move(retry));
+    }
+    slot.keys = std::move(keys);
+    slot.parked = true;
+    return true;
+}
+
+bool block_for_acks(int64_t offset, int numreplicas, steady_clock::time_point deadline) {
+    BlockedCommand& slot = *block_slot;
+    if (slot.expired) {
+        return false;
+    }
+    if (!slot.resumed) {
+        slot.deadline = deadline;
+    }
+    slot.wait_offset = offset;
+    slot.wait_replicas = numreplicas;
+    slot.parked = true;
+    return true;
+}
+
+void signal_key_ready(const string& key) {
+    if (local_blocked) {
+        local_blocked->key_ready(key);
+        return;
+    }
+    if (parked_on_keys.load(memory_order_relaxed) == 0) {
+        return;
+    }
+    lock_guard<mutex> lock(registries_mutex);
+    for (BlockedClients* blocked : registries) {
+        blocked->foreign_key_ready(key);
+    }
+}
+
+void signal_replica_acks(int64_t offset) {
+    lock_guard<mutex> lock(registries_mutex);
+    for (BlockedClients* blocked : registries) {
+        if (blocked->lowest_wait_offset.load() <= offset) {
+            blocked->acks_changed = true;
+            blocked->wake();
+        }
+    }
+}
+
+BlockedClients::BlockedClients(function<void()> wake) : wake(std::move(wake)) {
+    lock_guard<mutex> lock(registries_mutex);
+    registries.push_back(this);
+}
+
+BlockedClients::~BlockedClients() {
+    {
+        lock_guard<mutex> lock(registries_mutex);
+        registries.erase(find(registries.begin(), registries.end(), this));
+    }
+    while (!parked.empty()) {
+        unpark(parked.begin()->second);
+    }
+}
+
+void BlockedClients::serve_on_this_thread() {
+    local_blocked = this;
+}
+
+void BlockedClients::park(void* connection, BlockedCommand command) {
+    Entry* entry = new Entry();
+    entry->connection = connection;
+    entry->command = std::move(command);
+    entry->command.parked = false;
+    for (const string& key : entry->command.keys) {
+        list<Entry*>& queue = by_key[key];
+        entry->key_positions.push_back(queue.insert(queue.end(), entry));
+    }
+    if (!entry->command.keys.empty()) {
+        parked_on_keys++;
+    }
+    entry->deadline_position = by_deadline.emplace(entry->command.deadline, entry);
+    if (entry->command.wait_offset >= 0) {
+        entry->wait_position = waits.emplace(entry->command.wait_offset, entry);
+        lowest_wait_offset = waits.begin()->first;
+    }
+    parked[connection] = entry;
+}
+
+BlockedCommand BlockedClients::unpark(Entry* entry) {
+    for (size_t i = 0; i < entry->command.keys.size(); ++i) {
+        auto queue = by_key.find(entry->command.keys[i]);
+        queue->second.erase(entry->key_positions[i]);
+        if (queue->second.empty()) {
+            by_key.erase(queue);
+        }
+    }
+    if (!entry->command.keys.empty()) {
+        parked_on_keys--;
+    }
+    by_deadline.erase(entry->deadline_position);
+    if (entry->command.wait_offset >= 0) {
+        waits.erase(entry->wait_position);
+        lowest_wait_offset = waits.empty() ? INT64_MAX : waits.begin()->first;
+    }
+    parked.erase(entry->connection);
+    BlockedCommand command = std::move(entry->command);
+    delete entry;
+    return command;
+}
+
+void BlockedClients::remove(void* connection) {
+    auto it = parked.find(connection);
+    if (it != parked.end()) {
+        unpark(it->second);
+    }
+}
+
+void BlockedClients::key_ready(const string& key) {
+    if (!by_key.empty() && by_key.count(key)) {
+        ready_keys.push_back(key);
+    }
+}
+
+void BlockedClients::foreign_key_ready(const string& key) {
+    lock_guard<mutex> lock(foreign_mutex);
+    foreign_ready_keys.push_back(key);
+    foreign_work = true;
+    wake();
+}
+
+bool BlockedClients::has_ready() {
+    if (!ready_keys.empty() || foreign_work.load() || acks_changed.load()) {
+        return true;
+    }
+    if (by_deadline.empty() || by_deadline.begin()->first == steady_clock::time_point::max()) {
+        return false;
+    }
+    return by_deadline.begin()->first <= steady_clock::now();
+}
+
+int BlockedClients::timeout_ms() {
+    if (has_ready()) {
+        return 0;
+    }
+    if (by_deadline.empty() || by_deadline.begin()->first == steady_clock::time_point::max()) {
+        return -1;
+    }
+    auto left = duration_cast<milliseconds>(by_deadline.begin()->first - steady_clock::now()).count();
+    return (int)min<int64_t>(max<int64_t>(left + 1, 0), 60 * 1000);
+}
+
+void BlockedClients::take(Entry* entry, bool expired, vector<Ready>& ready) {
+    void* connection = entry->connection;
+    BlockedCommand command = unpark(entry);
+    command.resumed = true;
+    command.expired = expired;
+    ready.push_back({connection, std::move(command)});
+}
+
+void BlockedClients::take_ready(vector<Ready>& ready) {
+    if (foreign_work.exchange(false)) {
+        lock_guard<mutex> lock(foreign_mutex);
+        for (const string& key : foreign_ready_keys) {
+            key_ready(key);
+        }
+        foreign_ready_keys.clear();
+    }
+
+    // Every command parked on a written key runs again, in the order they
+    // parked. Those that find nothing park again, still in that order.
+    for (const string& key : ready_keys) {
+        auto queue = by_key.find(key);
+        while (queue != by_key.end()) {
+            take(queue->second.front(), false, ready);
+            queue = by_key.find(key);
+        }
+    }
+    ready_keys.clear();
+
+    // Replicas acknowledge offsets in order, so once one offset has no ACK
+    // the later ones have none either.
+    if (acks_changed.exchange(false)) {
+        for (auto it = waits.begin(); it != waits.end();) {
+            Entry* entry = it->second;
+            int acked = acked_replica_count(it->first);
+            ++it;
+            if (acked >= entry->command.wait_replicas) {
+                take(entry, false, ready);
+            }
+            else if (acked == 0) {
+                break;
+            }
+        }
+    }
+
+    steady_clock::time_point now = steady_clock::now();
+    while (!by_deadline.empty() && by_deadline.begin()->first <= now) {
+        take(by_deadline.begin()->second, true, ready);
+    }
+}
+
+bool run_loop_command(RESPObject& obj, ClientState& client, const vector<pair<string, string>>& replica_info,
+                      BlockedClients& blocked, void* connection) {
+    BlockedCommand slot;
+    block_slot = &slot;
+    size_t reply_start = client.output.text.size();
+    try {
+        handle_command(obj, client, replica_info);
+    }
+    catch (const exception& ex) {
+        client.output.truncate(reply_start);
+        Reply(client.output).error("ERR Protocol error: " + string(ex.what()));
+        slot.parked = false;
+    }
+    block_slot = nullptr;
+    if (!slot.parked) {
+        return false;
+    }
+    if (slot.command.get_array().empty()) {
+        slot.command = std::move(obj);
+    }
+    blocked.park(connection, std::move(slot));
+    return true;
+}
+
+bool resume_loop_command(BlockedCommand& command, ClientState& client, const vector<pair<string, string>>& replica_info,
+                         BlockedClients& blocked, void* connection) {
+    command.parked = false;
+    block_slot = &command;
+    size_t reply_start = client.output.text.size();
+    try {
+        handle_command(command.command, client, replica_info);
+    }
+    catch (const exception& ex) {
+        client.output.truncate(reply_start);
+        Reply(client.output).error("ERR Protocol error: " + string(ex.what()));
+        command.parked = false;
+    }
+    block_slot = nullptr;
+    if (!command.parked) {
+        return false;
+    }
+    blocked.park(connection, std::move(command));
+    return true;
+}
@@ -0,0 +1,113 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <utility>
+#include <functional>
+#include <unordered_map>
+#include "redis_parser.h"
+#include "client.h"
+
+using namespace std;
+
+// Blocking commands in the event-loop modes (BLPOP, BZPOPMIN, XREAD BLOCK,
+// WAIT). A loop can't let a handler sleep, so it runs each command with
+// block_slot pointing at a BlockedCommand. A handler with nothing to return
+// yet fills it in and returns without a reply; the loop then parks the
+// connection in its BlockedClients and runs the command again once one of its
+// keys is written, the replicas acknowledge the offset it waits for, or its
+// deadline passes. In the default mode block_slot is null and handlers wait on
+// the keyspace condition variables, on the connection's own thread.
+struct BlockedCommand {
+    RESPObject command{RESPType::Array};    // what runs again, e.g. XREAD with $ resolved
+    vector<string> keys;
+    int64_t wait_offset = -1;               // WAIT: the offset to be acknowledged...
+    int wait_replicas = 0;                  // ...by this many replicas
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point::max();
+    bool parked = false;        // set by the handler: no reply yet
+    bool resumed = false;       // set by the loop when it runs the command again
+    bool expired = false;       // ...because the deadline passed: reply as timed out
+};
+
+extern thread_local BlockedCommand* block_slot;
+
+// For handlers, when block_slot is set: parks the command until a key in keys
+// is written or deadline passes. On a later run the first deadline is kept.
+// Returns false if the command has timed out, so the handler replies so.
+// retry is what runs then; empty means the same command.
+bool block_on_keys(vector<string> keys, chrono::steady_clock::time_point deadline, vector<RESPObject> retry = {});
+// Same for WAIT: parks until numreplicas replicas have acknowledged offset.
+bool block_for_acks(int64_t offset, int numreplicas, chrono::steady_clock::time_point deadline);
+
+// Called by handlers after a write to key, so commands parked on it run again.
+void signal_key_ready(const string& key);
+// Called by the replication code after a replica acknowledged offset.
+void signal_replica_acks(int64_t offset);
+
+// The commands parked on one loop. Only the loop's thread uses it, except for
+// the signals above from other threads (the replica links), which call wake.
+class BlockedClients {
+public:
+    struct Ready {
+        void* connection;
+        BlockedCommand command;
+    };
+
+    explicit BlockedClients(function<void()> wake);
+    ~BlockedClients();
+
+    // Parks connection with the command block_slot was filled in by.
+    void park(void* connection, BlockedCommand command);
+    // Forgets a connection that is closing.
+    void remove(void* connection);
+    bool empty() const { return parked.empty(); }
+
+    // Moves the commands that can run again to ready, oldest first, and the
+    // expired ones after them.
+    void take_ready(vector<Ready>& ready);
+    // True if take_ready has something to return without waiting.
+    bool has_ready();
+    // How long the loop may sleep before the next deadline: -1 if none, 0 if
+    // something is ready now.
+    int timeout_ms();
+
+    // Makes signal_key_ready on this thread go to this registry.
+    void serve_on_this_thread();
+
+private:
+    struct Entry;
+    BlockedCommand unpark(Entry* entry);
+    void take(Entry* entry, bool expired, vector<Ready>& ready);
+    void key_ready(const string& key);
+    void foreign_key_ready(const string& key);
+
+    unordered_map<void*, Entry*> parked;
+    unordered_map<string, list<Entry*>> by_key;
+    multimap<chrono::steady_clock::time_point, Entry*> by_deadline;
+    multimap<int64_t, Entry*> waits;            // WAITs by target offset
+    vector<string> ready_keys;
+
+    function<void()> wake;
+    mutex foreign_mutex;
+    vector<string> foreign_ready_keys;          // written by the replica link
+    atomic<bool> foreign_work{false};
+    atomic<int64_t> lowest_wait_offset{INT64_MAX};
+    atomic<bool> acks_changed{false};
+
+    friend void signal_key_ready(const string& key);
+    friend void signal_replica_acks(int64_t offset);
+};
+
+// Runs one command for an event loop. A handler that throws answers with an
+// error, as in handle_client, and a command that parks is moved to blocked.
+// Returns true if it parked.
+bool run_loop_command(RESPObject& obj, ClientState& client, const vector<pair<string, string>>& replica_info,
+                      BlockedClients& blocked, void* connection);
+// Runs a command taken from take_ready again. Returns true if it parked again.
+bool resume_loop_command(BlockedCommand& command, ClientState& client, const vector<pair<string, string>>& replica_info,
+                         BlockedClients& blocked, void* connection);
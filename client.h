@@ -0,0 +1,48 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include "redis_parser.h"
+#include "output_buffer.h"
+
+using namespace std;
+
+struct ClientInfo;
+struct Subscriber;
+class MailboxLoop;
+
+// Per-connection state, owned by the thread that serves the connection. The
+// replication link to the master has one too, with fd -1.
+struct ClientState {
+    int fd = -1;
+
+    // What CLIENT LIST shows about the connection (clients.h); null for the
+    // link to the master.
+    shared_ptr<ClientInfo> info;
+
+    // Replies to the commands read so far, written out after each read. Kept
+    // across reads so its capacity is reused.
+    OutputBuffer output;
+
+    // MULTI: commands are moved here as they arrive and run by EXEC, unless
+    // one was refused on the way, which makes EXEC discard them all.
+    bool in_multi = false;
+    bool multi_failed = false;
+    vector<RESPObject> queued_commands;
+
+    // WATCH: each key with the version it had when it was watched.
+    vector<pair<string, uint64_t>> watched_keys;
+
+    // SUBSCRIBE/PSUBSCRIBE: the connection's channels, patterns and message
+    // mailbox (pubsub.h); null while it has no subscriptions.
+    shared_ptr<Subscriber> subscriber;
+    // The event loop serving the connection, and the connection as the loop
+    // knows it, for publishers to wake; null on a thread of its own.
+    MailboxLoop* mailbox_loop = nullptr;
+    void* loop_connection = nullptr;
+
+    // CLIENT TRACKING in the default mode: the keys of its reads are
+    // remembered for invalidation (tracking.h).
+    bool tracking_reads = false;
+};
@@ -0,0 +1,224 @@
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "clients.h"
+#include "stats.h"
+#include "logger.h"
+
+using namespace std;
+using namespace chrono;
+
+// Redis's defaults: no limit for ordinary clients, generous ones for replicas,
+// whose stream is buffered while a full sync runs.
+OutputBufferLimit output_buffer_limits[CLIENT_CLASS_COUNT] = {
+    {0, 0, 0},
+    {256 * 1024 * 1024, 64 * 1024 * 1024, 60},
+    {32 * 1024 * 1024, 8 * 1024 * 1024, 60},
+};
+
+static mutex clients_mutex;
+static map<uint64_t, shared_ptr<ClientInfo>> clients;
+static uint64_t next_client_id = 1;
+
+static int64_t now_ms() {
+    return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static bool parse_size(string value, size_t& bytes) {
+    transform(value.begin(), value.end(), value.begin(), ::tolower);
+    size_t digits = 0;
+    while (digits < value.size() && isdigit((unsigned char)value[digits])) {
+        digits++;
+    }
+    if (digits == 0) {
+        return false;
+    }
+    string unit = value.substr(digits);
+    size_t multiplier;
+    if (unit == "") multiplier = 1;
+    else if (unit == "k") multiplier = 1000;
+    else if (unit == "kb") multiplier = 1024;
+    else if (unit == "m") multiplier = 1000 * 1000;
+    else if (unit == "mb") multiplier = 1024 * 1024;
+    else if (unit == "g") multiplier = 1000 * 1000 * 1000;
+    else if (unit == "gb") multiplier = 1024 * 1024 * 1024;
+    else return false;
+    bytes = strtoull(value.c_str(), nullptr, 10) * multiplier;
+    return true;
+}
+
+bool parse_output_buffer_limit(const string& spec) {
+    char cls[32], hard[32], soft[32];
+    long long seconds;
+    if (sscanf(spec.c_str(), "%31s %31s %31s %lld", cls, hard, soft, &seconds) != 4 || seconds < 0) {
+        return false;
+    }
+    string name = cls;
+    int index;
+    if (name == "normal") index = (int)ClientClass::Normal;
+    else if (name == "replica" || name == "slave") index = (int)ClientClass::Replica;
+    else if (name == "pubsub") index = (int)ClientClass::PubSub;
+    else return false;
+
+    OutputBufferLimit limit;
+    if (!parse_size(hard, limit.hard_bytes) || !parse_size(soft, limit.soft_bytes)) {
+        return false;
+    }
+    limit.soft_seconds = seconds;
+    output_buffer_limits[index] = limit;
+    return true;
+}
+
+bool output_limit_reached(ClientClass cls, size_t bytes, int64_t& soft_since_ms) {
+    const OutputBufferLimit& limit = output_buffer_limits[(int)cls];
+    if (limit.hard_bytes > 0 && bytes >= limit.hard_bytes) {
+        return true;
+    }
+    if (limit.soft_bytes == 0 || bytes < limit.soft_bytes) {
+        soft_since_ms = 0;
+        return false;
+    }
+    int64_t now = now_ms();
+    if (soft_since_ms == 0) {
+        soft_since_ms = now;
+    }
+    return now - soft_since_ms >= limit.soft_seconds * 1000;
+}
+
+static string peer_address(int fd) {
+    sockaddr_storage addr = {};
+    socklen_t length = sizeof(addr);
+    if (getpeername(fd, (sockaddr*)&addr, &length) != 0) {
+        return "?:0";
+    }
+    char host[INET6_ADDRSTRLEN] = "?";
+    int port = 0;
+    if (addr.ss_family == AF_INET) {
+        sockaddr_in* in = (sockaddr_in*)&addr;
+        inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+        port = ntohs(in->sin_port);
+    }
+    else if (addr.ss_family == AF_INET6) {
+        sockaddr_in6* in6 = (sockaddr_in6*)&addr;
+        inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+        port = ntohs(in6->sin6_port);
+    }
+    return string(host) + ":" + to_string(port);
+}
+
+void register_client(ClientState& client, int fd) {
+    shared_ptr<ClientInfo> info = make_shared<ClientInfo>();
+    info->fd = fd;
+    info->addr = peer_address(fd);
+    info->created_ms = now_ms();
+    info->last_ticks = stats_clock();
+
+    lock_guard<mutex> lock(clients_mutex);
+    info->id = next_client_id++;
+    clients[info->id] = info;
+    client.info = std::move(info);
+}
+
+void unregister_client(ClientState& client) {
+    if (!client.info) {
+        return;
+    }
+    lock_guard<mutex> lock(clients_mutex);
+    clients.erase(client.info->id);
+}
+
+void enforce_output_limit(ClientState& client) {
+    ClientInfo& info = *client.info;
+    size_t bytes = client.output.size();
+    info.output_bytes.store(bytes, memory_order_relaxed);
+    if (!output_limit_reached(info.client_class.load(memory_order_relaxed), bytes, info.soft_limit_since_ms)) {
+        return;
+    }
+    static LogRateLimit limit_closes;
+    log_limited(limit_closes, LogLevel::Warning, "Client ", describe_client(info), " closed for overcoming of output buffer limits.");
+    // The serving thread is the one here, so the socket can't be closed under us.
+    info.closing = true;
+    client.output.clear();
+    shutdown(info.fd, SHUT_RDWR);
+}
+
+vector<shared_ptr<ClientInfo>> list_clients() {
+    vector<shared_ptr<ClientInfo>> list;
+    lock_guard<mutex> lock(clients_mutex);
+    for (const auto& entry : clients) {
+        list.push_back(entry.second);
+    }
+    return list;
+}
+
+string describe_client(ClientInfo& info) {
+    string name;
+    {
+        lock_guard<mutex> lock(info.name_mutex);
+        name = info.name;
+    }
+    string flags;
+    ClientClass cls = info.client_class.load(memory_order_relaxed);
+    if (cls == ClientClass::Replica) flags += 'S';
+    if (cls == ClientClass::PubSub) flags += 'P';
+    if (info.blocked.load(memory_order_relaxed)) flags += 'b';
+    if (info.tracking.load(memory_order_relaxed)) flags += 't';
+    if (info.closing.load(memory_order_relaxed)) flags += 'A';
+    if (flags.empty()) flags = "N";
+
+    int command = info.last_command.load(memory_order_relaxed);
+    string command_text = command >= 0 ? command_stats_name(command) : "NULL";
+    transform(command_text.begin(), command_text.end(), command_text.begin(), ::tolower);
+
+    uint64_t ticks = stats_clock() - info.last_ticks.load(memory_order_relaxed);
+    char line[512];
+    snprintf(line, sizeof(line), "id=%llu addr=%s fd=%d name=%s age=%lld idle=%lld flags=%s qbuf=%zu omem=%zu resp=%d cmd=%s",
+             (unsigned long long)info.id, info.addr.c_str(), info.fd, name.c_str(),
+             (long long)((now_ms() - info.created_ms) / 1000), (long long)(ticks_to_ns(ticks) / 1e9), flags.c_str(),
+             info.input_bytes.load(memory_order_relaxed), info.output_bytes.load(memory_order_relaxed),
+             info.resp.load(memory_order_relaxed), command_text.c_str());
+    return line;
+}
+
+size_t kill_clients(const function<bool(ClientInfo&)>& match, const ClientInfo* self) {
+    // Under the registry lock no client can be unregistered, and so none of
+    // these sockets can be closed, and its descriptor reused, before shutdown().
+    lock_guard<mutex> lock(clients_mutex);
+    size_t killed = 0;
+    for (auto& entry : clients) {
+        ClientInfo& info = *entry.second;
+        if (info.closing.load() || !match(info)) {
+            continue;
+        }
+        info.closing = true;
+        shutdown(info.fd, &info == self ? SHUT_RD : SHUT_RDWR);
+        killed++;
+    }
+    return killed;
+}
+
+void append_clients_info(string& body) {
+    size_t connected = 0;
+    size_t blocked = 0;
+    {
+        lock_guard<mutex> lock(clients_mutex);
+        for (const auto& entry : clients) {
+            connected++;
+            blocked += entry.second->blocked.load(memory_order_relaxed);
+        }
+    }
+    body += "# Clients\r\n";
+    body += "connected_clients:" + to_string(connected) + "\r\n";
+    body += "blocked_clients:" + to_string(blocked) + "\r\n";
+}
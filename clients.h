@@ -0,0 +1,96 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include "client.h"
+
+using namespace std;
+
+// Every connection is registered here while it is open, for CLIENT LIST, KILL
+// and SETNAME and the Clients section of INFO. A connection's ClientInfo is
+// shared by its ClientState, which moves between threads when a connection is
+// handed off, and the registry: the thread serving the connection updates it
+// with relaxed stores, CLIENT reads it from any thread.
+//
+// Replies that pile up for a client that doesn't read them are bounded by the
+// output buffer limits of its class, as in Redis: a client whose pending
+// output passes the hard limit, or stays over the soft limit for the soft
+// limit's seconds, is disconnected. Replicas are held to their limits on the
+// replication stream buffered for them.
+
+enum class ClientClass { Normal, Replica, PubSub };
+const int CLIENT_CLASS_COUNT = 3;
+
+struct OutputBufferLimit {
+    size_t hard_bytes;          // 0 for none
+    size_t soft_bytes;          // 0 for none
+    int64_t soft_seconds;
+};
+
+extern OutputBufferLimit output_buffer_limits[CLIENT_CLASS_COUNT];
+
+// Sets a class's limits from "<class> <hard> <soft> <soft seconds>", the value of
+// --client-output-buffer-limit; sizes take k/kb/m/mb/g/gb suffixes. Returns
+// false if spec doesn't parse.
+bool parse_output_buffer_limit(const string& spec);
+
+// Whether bytes of pending output break cls's limits. soft_since_ms is the
+// caller's record of when the soft limit was first passed, 0 while under it.
+bool output_limit_reached(ClientClass cls, size_t bytes, int64_t& soft_since_ms);
+
+struct ClientInfo {
+    uint64_t id;
+    int fd;
+    string addr;                        // ip:port of the peer
+    int64_t created_ms;
+
+    mutex name_mutex;
+    string name;                        // CLIENT SETNAME
+
+    atomic<ClientClass> client_class{ClientClass::Normal};
+    atomic<uint64_t> last_ticks{0};     // stats_clock() when the last command started
+    atomic<int> last_command{-1};       // its command_stats_id
+    atomic<size_t> input_bytes{0};      // read but not yet run
+    atomic<size_t> output_bytes{0};     // replies not yet written
+    atomic<bool> blocked{false};        // waiting in BLPOP, BZPOPMIN, XREAD BLOCK or WAIT
+    atomic<int> resp{2};                // protocol version, set by HELLO
+    atomic<bool> tracking{false};       // CLIENT TRACKING on
+    // Killed, or over its output limit: no more commands run and the socket
+    // is shut down, so whichever loop serves it closes it.
+    atomic<bool> closing{false};
+
+    int64_t soft_limit_since_ms = 0;    // serving thread only
+};
+
+void register_client(ClientState& client, int fd);
+// Called where the connection is closed, not when it is handed to another thread.
+void unregister_client(ClientState& client);
+
+// Records what's pending in the client's buffers after a read or a write.
+inline void note_client_buffers(ClientState& client, size_t input_bytes) {
+    if (client.info) {
+        client.info->input_bytes.store(input_bytes, memory_order_relaxed);
+        client.info->output_bytes.store(client.output.size(), memory_order_relaxed);
+    }
+}
+
+// Checks the client's pending output against its class's limits after a
+// command, and closes the client if they're broken.
+void enforce_output_limit(ClientState& client);
+
+// Open connections, in the order they connected.
+vector<shared_ptr<ClientInfo>> list_clients();
+// A client's CLIENT LIST line, without the newline.
+string describe_client(ClientInfo& info);
+
+// Closes every registered client that match accepts: marks it closing and
+// shuts its socket down. self, the client asking, keeps the write side of its
+// socket open, so the reply to CLIENT KILL still goes out. Returns how many
+// were closed.
+size_t kill_clients(const function<bool(ClientInfo&)>& match, const ClientInfo* self);
+
+void append_clients_info(string& body);
@@ -1,27 +1,227 @@
 #include <unordered_map>
+#include <memory>
 #include <string>
 #include <mutex>
 #include <chrono>
 #include <deque>
+#include <atomic>
 #include <condition_variable>
 #include "database.h"
 #include "redis_parser.h"
+#include "lazy_free.h"
+#include "tracking.h"
+#include "shards.h"
 
 using namespace std;
 using namespace chrono;
 
-condition_variable list_cv;
-bool list_updated = false;
-condition_variable stream_cv;
-bool stream_updated = false;
-
-unordered_map<string, string> global_store;
-unordered_map<string, steady_clock::time_point> global_key_expirations;
-unordered_map<string, deque<string>> global_list_store;
-unordered_map<string, deque<StreamEntry>> global_stream_store;
-unordered_map<int, bool> global_transaction_flags;
-unordered_map<int, vector<vector<RESPObject>>> global_transaction_queue;
-
-mutex store_mutex;
-mutex list_store_mutex;
-mutex stream_store_mutex;
+static Keyspace default_keyspace;
+thread_local Keyspace* keyspace = &default_keyspace;
+vector<Keyspace*> keyspaces{&default_keyspace};
+
+thread_local unsigned held_store_locks = 0;
+
+atomic<bool> replica_link_up(false);
+atomic<int64_t> replica_read_offset(0);
+atomic<int64_t> replica_repl_offset(0);
+atomic<int64_t> replica_last_io_ms(0);
+
+static mutex& keyspace_mutex(Keyspace& ks, unsigned lock_bit) {
+    switch (lock_bit) {
+        case LIST_STORE_LOCK: return ks.list_mutex;
+        case STREAM_STORE_LOCK: return ks.stream_mutex;
+        case HASH_STORE_LOCK: return ks.hash_mutex;
+        case ZSET_STORE_LOCK: return ks.zset_mutex;
+        default: return ks.string_mutex;
+    }
+}
+
+mutex& store_mutex_for(unsigned lock_bit) {
+    return keyspace_mutex(*keyspace, lock_bit);
+}
+
+StoreLock::StoreLock(unsigned lock_bit) : lock(store_mutex_for(lock_bit), defer_lock) {
+    if (!(held_store_locks & lock_bit)) {
+        lock.lock();
+    }
+}
+
+// Swaps store for an empty one and frees the old contents in the background.
+template <typename Store>
+static void clear_lazily(Store& store) {
+    auto old = make_unique<Store>();
+    old->swap(store);
+    free_lazily(move(old));
+}
+
+void flush_all_stores(bool lazy) {
+    for (Keyspace* ks : keyspaces) {
+        if (lazy) {
+            clear_lazily(ks->strings);
+            clear_lazily(ks->expirations);
+            clear_lazily(ks->lists);
+            clear_lazily(ks->streams);
+            clear_lazily(ks->hashes);
+            clear_lazily(ks->zsets);
+            continue;
+        }
+        ks->strings.clear();
+        ks->expirations.clear();
+        ks->lists.clear();
+        ks->streams.clear();
+        ks->hashes.clear();
+        ks->zsets.clear();
+    }
+
+    tracking_invalidate_all();
+    for (Keyspace* ks : keyspaces) {
+        lock_guard<mutex> watch_lock(ks->watch_mutex);
+        for (auto& entry : ks->watched_keys) {
+            entry.second.version++;
+        }
+    }
+}
+
+void for_each_store(const function<void(Keyspace&, unsigned)>& fn) {
+    if (shard_count > 0) {
+        ShardPause pause;
+        for (Keyspace* ks : keyspaces) {
+            for (unsigned bit : {STRING_STORE_LOCK, LIST_STORE_LOCK, STREAM_STORE_LOCK, HASH_STORE_LOCK, ZSET_STORE_LOCK}) {
+                fn(*ks, bit);
+            }
+        }
+        return;
+    }
+    for (Keyspace* ks : keyspaces) {
+        for (unsigned bit : {STRING_STORE_LOCK, LIST_STORE_LOCK, STREAM_STORE_LOCK, HASH_STORE_LOCK, ZSET_STORE_LOCK}) {
+            unique_lock<mutex> lock(keyspace_mutex(*ks, bit), defer_lock);
+            if (ks != keyspace || !(held_store_locks & bit)) {
+                // Waiting for another keyspace's store while holding locks of
+                // our own could deadlock with a shard doing the same.
+                if (held_store_locks == 0) {
+                    lock.lock();
+                }
+                else if (!lock.try_lock()) {
+                    continue;
+                }
+            }
+            fn(*ks, bit);
+        }
+    }
+}
+
+void count_keys(size_t& keys, size_t& expires) {
+    keys = 0;
+    expires = 0;
+    for_each_store([&](Keyspace& ks, unsigned bit) {
+        switch (bit) {
+            case STRING_STORE_LOCK:
+                keys += ks.strings.size();
+                expires += ks.expirations.size();
+                break;
+            case LIST_STORE_LOCK: keys += ks.lists.size(); break;
+            case STREAM_STORE_LOCK: keys += ks.streams.size(); break;
+            case HASH_STORE_LOCK: keys += ks.hashes.size(); break;
+            default: keys += ks.zsets.size(); break;
+        }
+    });
+}
+
+void touch_key(const string& key) {
+    if (tracking_client_count.load(memory_order_relaxed) != 0) {
+        tracking_invalidate_key(key, tracking_caller_id);
+    }
+    if (keyspace->watched_count.load(memory_order_relaxed) == 0) {
+        return;
+    }
+    lock_guard<mutex> lock(keyspace->watch_mutex);
+    auto it = keyspace->watched_keys.find(key);
+    if (it != keyspace->watched_keys.end()) {
+        it->second.version++;
+    }
+}
+
+// WATCH runs on the shard serving the connection, which need not own the key.
+static Keyspace& keyspace_holding(const string& key) {
+    return shard_count > 0 ? *keyspaces[shard_for_key(key)] : *keyspace;
+}
+
+uint64_t watch_key(const string& key) {
+    Keyspace& ks = keyspace_holding(key);
+    lock_guard<mutex> lock(ks.watch_mutex);
+    WatchedKey& watched = ks.watched_keys[key];
+    if (watched.watchers++ == 0) {
+        ks.watched_count++;
+    }
+    return watched.version;
+}
+
+void unwatch_key(const string& key) {
+    Keyspace& ks = keyspace_holding(key);
+    lock_guard<mutex> lock(ks.watch_mutex);
+    auto it = ks.watched_keys.find(key);
+    if (it != ks.watched_keys.end() && --it->second.watchers == 0) {
+        ks.watched_keys.erase(it);
+        ks.watched_count--;
+    }
+}
+
+bool watched_keys_changed(const vector<pair<string, uint64_t>>& watched) {
+    for (const auto& entry : watched) {
+        Keyspace& ks = keyspace_holding(entry.first);
+        lock_guard<mutex> lock(ks.watch_mutex);
+        auto it = ks.watched_keys.find(entry.first);
+        if ((it == ks.watched_keys.end() ? 0 : it->second.version) != entry.second) {
+            return true;
+        }
+    }
+    return false;
+}
+
+StoreBatchLock::StoreBatchLock(unsigned lock_bits) {
+    for (unsigned bit : {STRING_STORE_LOCK, LIST_STORE_LOCK, STREAM_STORE_LOCK, HASH_STORE_LOCK, ZSET_STORE_LOCK}) {
+        if ((lock_bits & bit) && !(held_store_locks & bit)) {
+            store_mutex_for(bit).lock();
+            acquired |= bit;
+        }
+    }
+    held_store_locks |= acquired;
+}
+
+StoreBatchLock::~StoreBatchLock() {
+    for (unsigned bit : {ZSET_STORE_LOCK, HASH_STORE_LOCK, STREAM_STORE_LOCK, LIST_STORE_LOCK, STRING_STORE_LOCK}) {
+        if (acquired & bit) {
+            store_mutex_for(bit).unlock();
+        }
+    }
+    held_store_locks &= ~acquired;
+}
+
+// Keyspaces are locked in shard order. Nothing else ever holds the locks of two
+// keyspaces at once, so this can't deadlock.
+AllKeyspacesLock::AllKeyspacesLock() : held_keyspace(keyspace), already_held(held_store_locks) {
+    if (shard_count > 0) {
+        pause.reset(new ShardPause());
+        return;
+    }
+    for (Keyspace* ks : keyspaces) {
+        for (unsigned bit : {STRING_STORE_LOCK, LIST_STORE_LOCK, STREAM_STORE_LOCK, HASH_STORE_LOCK, ZSET_STORE_LOCK}) {
+            if (ks != held_keyspace || !(already_held & bit)) {
+                keyspace_mutex(*ks, bit).lock();
+            }
+        }
+    }
+}
+
+AllKeyspacesLock::~AllKeyspacesLock() {
+    if (pause) {
+        return;
+    }
+    for (auto it = keyspaces.rbegin(); it != keyspaces.rend(); ++it) {
+        for (unsigned bit : {ZSET_STORE_LOCK, HASH_STORE_LOCK, STREAM_STORE_LOCK, LIST_STORE_LOCK, STRING_STORE_LOCK}) {
+            if (*it != held_keyspace || !(already_held & bit)) {
+                keyspace_mutex(**it, bit).unlock();
+            }
+        }
+    }
+}
@@ -4,31 +4,178 @@
 #include <mutex>
 #include <chrono>
 #include <deque>
+#include <atomic>
 #include <condition_variable>
+#include <vector>
+#include <functional>
+#include <memory>
 #include "redis_parser.h"
+#include "dict.h"
+#include "string_value.h"
+#include "hash_value.h"
+#include "zset_value.h"
+#include "slab_allocator.h"
+#include "tracking.h"
 
 using namespace std;
 using namespace chrono;
 
+class ShardPause;
+
+using StreamFields = unordered_map<string, string, hash<string>, equal_to<string>, SlabAllocator<pair<const string, string>>>;
+
 struct StreamEntry {
     string id;
-    unordered_map<string, string> fields;
+    StreamFields fields;
+};
+
+// List and stream values keep their blocks in the keyspace slabs.
+using ListValue = deque<string, SlabAllocator<string>>;
+using StreamValue = deque<StreamEntry, SlabAllocator<StreamEntry>>;
+
+// Keys that some connection is WATCHing. Every write to one bumps its version, so
+// EXEC can tell whether a watched key changed since WATCH. Entries exist only
+// while watched; watched_count lets writers skip the lookup when none are.
+struct WatchedKey {
+    uint64_t version = 0;
+    int watchers = 0;
+};
+
+// The stores of one keyspace, with the mutexes that guard them and the
+// condition variables blocked readers wait on, and the WATCH and tracking
+// registries of its keys. Normally there is a single keyspace; with --shards
+// every shard thread owns one and takes none of its store locks (shards.h).
+struct Keyspace {
+    Dict<StringValue> strings;
+    unordered_map<string, steady_clock::time_point> expirations;
+    Dict<ListValue> lists;
+    Dict<StreamValue> streams;
+    Dict<HashValue> hashes;
+    Dict<ZSetValue> zsets;
+
+    mutex string_mutex;
+    mutex list_mutex;
+    mutex stream_mutex;
+    mutex hash_mutex;
+    mutex zset_mutex;
+
+    condition_variable list_cv;
+    bool list_updated = false;
+    condition_variable stream_cv;
+    bool stream_updated = false;
+    condition_variable zset_cv;
+    bool zset_updated = false;
+
+    // WATCH and EXEC reach these from the shard serving the connection, which
+    // need not own the key.
+    unordered_map<string, WatchedKey> watched_keys;
+    atomic<int> watched_count{0};
+    mutex watch_mutex;
+
+    TrackingTable tracking;
+};
+
+// The keyspace commands on the calling thread run against. Every thread starts
+// on keyspaces[0]; shard threads, and threads running a command for a shard,
+// point it elsewhere.
+extern thread_local Keyspace* keyspace;
+// All keyspaces, indexed by shard.
+extern vector<Keyspace*> keyspaces;
+
+// Bits naming the store mutexes of a keyspace. A thread that already holds some of them
+// (a replication batch, EXEC) records them in held_store_locks so the handlers it
+// calls don't try to lock them a second time. A shard thread, or one holding a
+// ShardPause (shards.h), has them all.
+enum StoreLockBits : unsigned {
+    STRING_STORE_LOCK = 1,
+    LIST_STORE_LOCK = 2,
+    STREAM_STORE_LOCK = 4,
+    HASH_STORE_LOCK = 8,
+    ZSET_STORE_LOCK = 16,
+    ALL_STORE_LOCKS = STRING_STORE_LOCK | LIST_STORE_LOCK | STREAM_STORE_LOCK | HASH_STORE_LOCK | ZSET_STORE_LOCK
 };
 
-extern condition_variable list_cv;
-extern bool list_updated;
-extern condition_variable stream_cv;
-extern bool stream_updated;
+extern thread_local unsigned held_store_locks;
+
+// The mutex for lock_bit in the calling thread's keyspace.
+mutex& store_mutex_for(unsigned lock_bit);
+
+// Locks one store mutex unless the calling thread already holds it.
+class StoreLock {
+private:
+    unique_lock<mutex> lock;
+
+public:
+    explicit StoreLock(unsigned lock_bit);
+
+    bool owns_lock() const { return lock.owns_lock(); }
+    unique_lock<mutex>& get() { return lock; }
+};
+
+// Locks every store named in lock_bits once, in a fixed order, for the lifetime
+// of the object so a whole batch of commands runs under a single acquisition.
+class StoreBatchLock {
+private:
+    unsigned acquired = 0;
+
+public:
+    explicit StoreBatchLock(unsigned lock_bits);
+    ~StoreBatchLock();
+
+    StoreBatchLock(const StoreBatchLock&) = delete;
+    StoreBatchLock& operator=(const StoreBatchLock&) = delete;
+};
+
+// Distance, in keys, that batch lookups prefetch ahead of the key being probed.
+const size_t KEY_PREFETCH_DISTANCE = 8;
+
+// Locks every store of every keyspace, so nothing at all can change while it is
+// held. Taken around the fork of a full sync and by FLUSHALL; the stores of its
+// own keyspace that the calling thread already holds (FLUSHALL inside EXEC,
+// which then holds all of them) are left alone. With --shards it stops the
+// shards instead.
+class AllKeyspacesLock {
+private:
+    Keyspace* held_keyspace;
+    unsigned already_held;
+    unique_ptr<ShardPause> pause;
+
+public:
+    AllKeyspacesLock();
+    ~AllKeyspacesLock();
+
+    AllKeyspacesLock(const AllKeyspacesLock&) = delete;
+    AllKeyspacesLock& operator=(const AllKeyspacesLock&) = delete;
+};
 
-extern unordered_map<string, string> global_store;
-extern unordered_map<string, steady_clock::time_point> global_key_expirations;
-extern unordered_map<string, deque<string>> global_list_store;
-extern unordered_map<string, deque<StreamEntry>> global_stream_store;
-extern unordered_map<int, bool> global_transaction_flags;
-extern unordered_map<int, vector<vector<RESPObject>>> global_transaction_queue;
+// Empties every keyspace: FLUSHALL, and a replica before loading a full sync.
+// With lazy set the old contents are swapped out and freed in the background.
+// The caller holds an AllKeyspacesLock.
+void flush_all_stores(bool lazy);
 
-extern mutex store_mutex;
-extern mutex list_store_mutex;
-extern mutex stream_store_mutex;
+// Calls fn(keyspace, lock_bit) for every store of every keyspace, under that
+// store's lock. Takes the store locks one at a time, except those the caller
+// already holds; a caller holding locks skips another keyspace's store that is
+// busy rather than wait for it. With --shards the shards are stopped instead,
+// for the whole walk.
+void for_each_store(const function<void(Keyspace&, unsigned)>& fn);
+// Keys, and keys with an expiry, across every keyspace, for INFO keyspace.
+void count_keys(size_t& keys, size_t& expires);
 
+// Marks a key of the calling thread's keyspace as modified for WATCH and
+// invalidates it for CLIENT TRACKING. Writers call it while holding the store
+// lock.
+void touch_key(const string& key);
+// Registers a watcher, in the keyspace that holds key whichever thread asks,
+// and returns the key's current version.
+uint64_t watch_key(const string& key);
+void unwatch_key(const string& key);
+// Whether any of the keys, with the versions watch_key returned, has been
+// written since.
+bool watched_keys_changed(const vector<pair<string, uint64_t>>& watched);
 
+// Replica side of the replication link, maintained by connect_to_master.
+extern atomic<bool> replica_link_up;
+extern atomic<int64_t> replica_read_offset;
+extern atomic<int64_t> replica_repl_offset;
+extern atomic<int64_t> replica_last_io_ms;
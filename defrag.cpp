@@ -0,0 +1,129 @@
+#include <thread>
+#include <chrono>
+#include <iterator>
+#include "defrag.h"
+#include "database.h"
+#include "shards.h"
+#include "slab_allocator.h"
+#include "latency_monitor.h"
+
+using namespace std;
+using namespace chrono;
+
+bool active_defrag_enabled = false;
+int active_defrag_threshold = 10;
+
+atomic<bool> active_defrag_running(false);
+atomic<uint64_t> active_defrag_hits(0);
+
+const int ACTIVE_DEFRAG_CHECK_MS = 100;
+// Buckets visited per hold of a store lock, and the pause between holds.
+const int ACTIVE_DEFRAG_STEP_BUCKETS = 256;
+const int ACTIVE_DEFRAG_PAUSE_US = 100;
+
+static size_t defrag_value(StringValue& value) {
+    return value.defrag() ? 1 : 0;
+}
+
+// Rebuilds a deque whose blocks are partly in draining slabs. Its elements are
+// moved, not copied, so only the blocks themselves are reallocated.
+template <typename Deque>
+static size_t defrag_deque(Deque& values) {
+    if (values.size() > DEFRAG_MAX_VALUE_ELEMENTS) {
+        return 0;
+    }
+    for (const auto& value : values) {
+        if (slab_should_move(&value, sizeof(value))) {
+            Deque fresh(make_move_iterator(values.begin()), make_move_iterator(values.end()));
+            values.swap(fresh);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static size_t defrag_value(ListValue& list) {
+    return defrag_deque(list);
+}
+
+static size_t defrag_value(StreamValue& stream) {
+    size_t moved = defrag_deque(stream);
+    if (stream.size() > DEFRAG_MAX_VALUE_ELEMENTS) {
+        return moved;
+    }
+    for (StreamEntry& entry : stream) {
+        for (const auto& field : entry.fields) {
+            if (slab_should_move(&field, sizeof(field))) {
+                StreamFields fresh(entry.fields.begin(), entry.fields.end());
+                entry.fields.swap(fresh);
+                moved++;
+                break;
+            }
+        }
+    }
+    return moved;
+}
+
+// Hashes and sorted sets keep their nodes in place; only the key moves.
+static size_t defrag_value(HashValue&) {
+    return 0;
+}
+
+static size_t defrag_value(ZSetValue&) {
+    return 0;
+}
+
+// Walks one store of the calling thread's keyspace, taking its lock for a few
+// buckets at a time; with --shards, stopping its shard instead.
+template <typename V>
+static void defrag_store(int shard, unsigned lock_bit, Dict<V>& store) {
+    uint64_t cursor = 0;
+    do {
+        size_t moved = 0;
+        {
+            LatencyTimer timer("active-defrag-cycle");
+            ShardPause pause(shard);
+            StoreLock lock(lock_bit);
+            for (int i = 0; i < ACTIVE_DEFRAG_STEP_BUCKETS; ++i) {
+                cursor = store.defrag(cursor, moved, [&](V& value) { moved += defrag_value(value); });
+                if (cursor == 0) {
+                    break;
+                }
+            }
+        }
+        active_defrag_hits += moved;
+        this_thread::sleep_for(microseconds(ACTIVE_DEFRAG_PAUSE_US));
+    } while (cursor != 0);
+}
+
+static void active_defrag_loop() {
+    while (true) {
+        this_thread::sleep_for(milliseconds(ACTIVE_DEFRAG_CHECK_MS));
+
+        SlabStats stats = slab_stats();
+        size_t waste = stats.active_bytes - stats.allocated_bytes;
+        if (waste < ACTIVE_DEFRAG_IGNORE_BYTES || waste * 100 < stats.allocated_bytes * active_defrag_threshold) {
+            continue;
+        }
+        if (slab_start_draining(2 * SLAB_SIZE) == 0) {
+            continue;
+        }
+
+        active_defrag_running = true;
+        for (size_t shard = 0; shard < keyspaces.size(); ++shard) {
+            Keyspace* ks = keyspace = keyspaces[shard];
+            defrag_store(shard, STRING_STORE_LOCK, ks->strings);
+            defrag_store(shard, LIST_STORE_LOCK, ks->lists);
+            defrag_store(shard, STREAM_STORE_LOCK, ks->streams);
+            defrag_store(shard, HASH_STORE_LOCK, ks->hashes);
+            defrag_store(shard, ZSET_STORE_LOCK, ks->zsets);
+        }
+        // Slabs still holding objects the walk can't move go back into use.
+        slab_stop_draining();
+        active_defrag_running = false;
+    }
+}
+
+void start_active_defrag() {
+    thread(active_defrag_loop).detach();
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+using namespace std;
+
+// --activedefrag yes: a background thread watches the keyspace slabs and, once
+// free slots in them exceed --active-defrag-threshold percent of the live data
+// (and ACTIVE_DEFRAG_IGNORE_BYTES), drains the sparsest slabs by walking every
+// store a few buckets at a time under its lock and moving what it finds there:
+// keys, string values, and the blocks of lists and streams up to
+// DEFRAG_MAX_VALUE_ELEMENTS long. Emptied slabs go back to the kernel.
+extern bool active_defrag_enabled;
+extern int active_defrag_threshold;
+
+// Fragmentation below this many bytes is never worth a pass.
+const size_t ACTIVE_DEFRAG_IGNORE_BYTES = 8 * 1024 * 1024;
+// Lists and streams longer than this are left where they are.
+const size_t DEFRAG_MAX_VALUE_ELEMENTS = 1024;
+
+extern atomic<bool> active_defrag_running;
+// Allocations moved out of draining slabs.
+extern atomic<uint64_t> active_defrag_hits;
+
+void start_active_defrag();
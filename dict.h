@@ -0,0 +1,309 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <functional>
+#include <algorithm>
+#include <type_traits>
+#include <new>
+#include "slab_allocator.h"
+#include "latency_monitor.h"
+
+using namespace std;
+
+// Chained hash table keyed by string, used for the keyspace stores. It keeps the
+// unordered_map interface the handlers already use, but its bucket count is
+// always a power of two. That makes the bucket layout predictable across a
+// resize: bucket i of a table of size n only splits into, or merges from,
+// buckets whose index has the same low bits. scan() relies on this to walk the
+// table with a cursor that stays valid between calls even if the table grows or
+// shrinks in the meantime, which unordered_map's prime-sized tables can't offer.
+template <typename V>
+class Dict {
+public:
+    using value_type = pair<const string, V>;
+
+private:
+    struct Node {
+        value_type kv;
+        size_t hash;
+        Node* next;
+    };
+
+    vector<Node*> table;        // empty or a power of two in size
+    size_t element_count = 0;
+
+    static size_t hash_key(const string& key) {
+        return std::hash<string>()(key);
+    }
+
+    size_t index_for(size_t hash) const {
+        return hash & (table.size() - 1);
+    }
+
+    Node* find_node(const string& key) const {
+        if (table.empty()) {
+            return nullptr;
+        }
+        size_t hash = hash_key(key);
+        for (Node* node = table[index_for(hash)]; node; node = node->next) {
+            if (node->hash == hash && node->kv.first == key) {
+                return node;
+            }
+        }
+        return nullptr;
+    }
+
+    // Nodes come from the keyspace slabs.
+    static Node* new_node(value_type&& kv, size_t hash, Node* next) {
+        return new (slab_alloc(sizeof(Node))) Node{std::move(kv), hash, next};
+    }
+
+    static void delete_node(Node* node) {
+        node->~Node();
+        slab_free(node, sizeof(Node));
+    }
+
+    void resize(size_t new_size) {
+        LatencyTimer timer("rehash", max(table.size(), new_size) >= LATENCY_REHASH_MIN_BUCKETS);
+        vector<Node*> new_table(new_size, nullptr);
+        for (Node* node : table) {
+            while (node) {
+                Node* next = node->next;
+                size_t index = node->hash & (new_size - 1);
+                node->next = new_table[index];
+                new_table[index] = node;
+                node = next;
+            }
+        }
+        table.swap(new_table);
+    }
+
+    static uint64_t next_cursor(uint64_t cursor, uint64_t mask) {
+        cursor |= ~mask;
+        cursor = reverse_bits(cursor);
+        cursor++;
+        return reverse_bits(cursor);
+    }
+
+    static uint64_t reverse_bits(uint64_t v) {
+        v = ((v >> 1) & 0x5555555555555555ULL) | ((v & 0x5555555555555555ULL) << 1);
+        v = ((v >> 2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) << 2);
+        v = ((v >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((v & 0x0F0F0F0F0F0F0F0FULL) << 4);
+        v = ((v >> 8) & 0x00FF00FF00FF00FFULL) | ((v & 0x00FF00FF00FF00FFULL) << 8);
+        v = ((v >> 16) & 0x0000FFFF0000FFFFULL) | ((v & 0x0000FFFF0000FFFFULL) << 16);
+        return (v >> 32) | (v << 32);
+    }
+
+public:
+    template <bool IsConst>
+    class Iterator {
+        friend class Dict;
+        template <bool> friend class Iterator;
+
+        const vector<Node*>* table = nullptr;
+        size_t bucket = 0;
+        Node* node = nullptr;
+
+        Iterator(const vector<Node*>* t, size_t b, Node* n) : table(t), bucket(b), node(n) {}
+
+        void skip_empty_buckets() {
+            while (!node && ++bucket < table->size()) {
+                node = (*table)[bucket];
+            }
+        }
+
+    public:
+        using reference = conditional_t<IsConst, const value_type&, value_type&>;
+        using pointer = conditional_t<IsConst, const value_type*, value_type*>;
+
+        Iterator() = default;
+        template <bool C = IsConst, typename = enable_if_t<C>>
+        Iterator(const Iterator<false>& other) : table(other.table), bucket(other.bucket), node(other.node) {}
+
+        reference operator*() const { return node->kv; }
+        pointer operator->() const { return &node->kv; }
+
+        Iterator& operator++() {
+            node = node->next;
+            if (!node) {
+                skip_empty_buckets();
+            }
+            return *this;
+        }
+
+        bool operator==(const Iterator& other) const { return node == other.node; }
+        bool operator!=(const Iterator& other) const { return node != other.node; }
+    };
+
+    using iterator = Iterator<false>;
+    using const_iterator = Iterator<true>;
+
+    Dict() = default;
+    Dict(const Dict&) = delete;
+    Dict& operator=(const Dict&) = delete;
+    ~Dict() { clear(); }
+
+    iterator begin() {
+        if (table.empty()) {
+            return end();
+        }
+        iterator it(&table, 0, table[0]);
+        if (!it.node) {
+            it.skip_empty_buckets();
+        }
+        return it;
+    }
+    iterator end() { return iterator(&table, table.size(), nullptr); }
+    const_iterator begin() const { return const_cast<Dict*>(this)->begin(); }
+    const_iterator end() const { return const_cast<Dict*>(this)->end(); }
+
+    size_t size() const { return element_count; }
+    bool empty() const { return element_count == 0; }
+    size_t bucket_count() const { return table.size(); }
+    // Bytes of the bucket array and the element nodes, keys and values
+    // included but not what they point to.
+    size_t overhead_bytes() const {
+        return heap_usable_size(table.capacity() * sizeof(Node*)) + element_count * node_bytes();
+    }
+    static size_t node_bytes() { return slab_usable_size(sizeof(Node)); }
+
+    iterator find(const string& key) {
+        Node* node = find_node(key);
+        if (!node) {
+            return end();
+        }
+        return iterator(&table, index_for(node->hash), node);
+    }
+    const_iterator find(const string& key) const { return const_cast<Dict*>(this)->find(key); }
+
+    size_t count(const string& key) const { return find_node(key) ? 1 : 0; }
+
+    V& operator[](const string& key) {
+        Node* node = find_node(key);
+        if (node) {
+            return node->kv.second;
+        }
+        if (table.empty()) {
+            resize(4);
+        }
+        else if (element_count >= table.size()) {
+            resize(table.size() * 2);
+        }
+        size_t hash = hash_key(key);
+        size_t index = index_for(hash);
+        node = new_node(value_type(key, V()), hash, table[index]);
+        table[index] = node;
+        element_count++;
+        return node->kv.second;
+    }
+
+    // Removes the element at it and returns the one after it. Never resizes, so
+    // it is safe to call while iterating.
+    iterator erase(iterator it) {
+        iterator next = it;
+        ++next;
+        Node** link = &table[it.bucket];
+        while (*link != it.node) {
+            link = &(*link)->next;
+        }
+        *link = it.node->next;
+        delete_node(it.node);
+        element_count--;
+        return next;
+    }
+
+    // Removes key if present. May shrink a sparse table, which invalidates
+    // iterators just like an insert can.
+    size_t erase(const string& key) {
+        iterator it = find(key);
+        if (it == end()) {
+            return 0;
+        }
+        erase(it);
+        if (table.size() > 4 && element_count < table.size() / 8) {
+            resize(table.size() / 2);
+        }
+        return 1;
+    }
+
+    void clear() {
+        for (Node*& head : table) {
+            while (head) {
+                Node* next = head->next;
+                delete_node(head);
+                head = next;
+            }
+        }
+        table.clear();
+        element_count = 0;
+    }
+
+    void swap(Dict& other) {
+        table.swap(other.table);
+        std::swap(element_count, other.element_count);
+    }
+
+    void reserve(size_t n) {
+        size_t new_size = 4;
+        while (new_size < n) {
+            new_size *= 2;
+        }
+        if (new_size > table.size()) {
+            resize(new_size);
+        }
+    }
+
+    // Starts loading the bucket a key hashes to into cache without waiting for
+    // it, so a loop over many keys can overlap its cache misses.
+    void prefetch(const string& key) const {
+        if (table.empty()) {
+            return;
+        }
+        Node* head = table[index_for(hash_key(key))];
+        if (head) {
+            __builtin_prefetch(head);
+        }
+    }
+
+    // Calls fn on every element in the bucket named by cursor and returns the
+    // cursor for the next call, or 0 once the whole table has been visited. The
+    // cursor counts through bucket indexes with its bits reversed, so buckets
+    // that split or merge in a resize between calls are visited next to each
+    // other and no element present for the whole walk is ever missed (some may
+    // be returned twice).
+    template <typename Fn>
+    uint64_t scan(uint64_t cursor, Fn&& fn) const {
+        if (table.empty()) {
+            return 0;
+        }
+        uint64_t mask = table.size() - 1;
+        for (Node* node = table[cursor & mask]; node; node = node->next) {
+            fn(node->kv);
+        }
+        return next_cursor(cursor, mask);
+    }
+
+    // Like scan(), but for active defragmentation: nodes in the bucket that sit
+    // in a draining slab are moved to fresh ones, and fn is then called on
+    // every value so it can move its own allocations. Adds the nodes it moved
+    // to moved.
+    template <typename Fn>
+    uint64_t defrag(uint64_t cursor, size_t& moved, Fn&& fn) {
+        if (table.empty()) {
+            return 0;
+        }
+        uint64_t mask = table.size() - 1;
+        for (Node** link = &table[cursor & mask]; *link; link = &(*link)->next) {
+            Node* node = *link;
+            if (slab_should_move(node, sizeof(Node))) {
+                *link = new_node(value_type(node->kv.first, std::move(node->kv.second)), node->hash, node->next);
+                delete_node(node);
+                moved++;
+            }
+            fn((*link)->kv.second);
+        }
+        return next_cursor(cursor, mask);
+    }
+};
@@ -9,111 +9,214 @@
 #include <condition_variable>
 #include <deque>
 #include <sstream>
+#include <string_view>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#include <charconv>
 #include "handle_redis_commands.h"
 #include "redis_parser.h"
 #include "database.h"
+#include "replication.h"
+#include "shards.h"
+#include "lazy_free.h"
+#include "slab_allocator.h"
+#include "defrag.h"
+#include "stats.h"
+#include "slowlog.h"
+#include "latency_monitor.h"
+#include "clients.h"
+#include "pubsub.h"
+#include "tracking.h"
+#include "hotkeys.h"
+#include "memory_usage.h"
+#include "blocking.h"
 
 
 using namespace std;
 
-string handle_echo(const vector<RESPObject> & args){
+void handle_echo(const vector<RESPObject> & args, Reply& reply) {
     if(args.size() !=2){
-        return "-ERR ECHO expects 1 argument\r\n";
+        return reply.error("ERR ECHO expects 1 argument");
     }
     const RESPObject& message_obj = args[1];
     if (message_obj.get_type() != RESPType::BulkString && message_obj.get_type() != RESPType::SimpleString) {
-        return "-ERR invalid argument type\r\n";
+        return reply.error("ERR invalid argument type");
     }
-    string value = message_obj.get_string_value();
-    string response = "$" + to_string(value.size()) + "\r\n" + value + "\r\n";
-    return response;
+    reply.bulk(message_obj.get_string_value());
 }
 
-string handle_multi(const vector<RESPObject>& args, int client_fd) {
+void handle_multi(const vector<RESPObject>& args, ClientState& client, Reply& reply) {
     if (args.size() != 1) {
-        return "-ERR wrong number of arguments for 'multi'\r\n";
+        return reply.error("ERR wrong number of arguments for 'multi'");
     }
     
-    lock_guard<mutex> lock(store_mutex);
-    if (global_transaction_flags.find(client_fd) != global_transaction_flags.end()) {
-        return "-ERR MULTI is already in progress for this client\r\n";
+    if (client.in_multi) {
+        return reply.error("ERR MULTI is already in progress for this client");
     }
 
-    global_transaction_flags[client_fd] = true;
-    global_transaction_queue[client_fd] = vector<vector<RESPObject>>();
-    stream_updated = false; 
-    stream_cv.notify_all(); 
+    client.in_multi = true;
+    client.multi_failed = false;
+    client.queued_commands.clear();
     
-    return "+OK\r\n";
+    return reply.simple("OK");
 }
 
-string handle_exec(const vector<RESPObject>& args, int client_fd, const vector<pair<string, string>>& replica_info) {
+static void unwatch_all(ClientState& client) {
+    for (const auto& watched : client.watched_keys) {
+        unwatch_key(watched.first);
+    }
+    client.watched_keys.clear();
+}
+
+void handle_exec(const vector<RESPObject>& args, ClientState& client, const vector<pair<string, string>>& replica_info, Reply& reply) {
     if(args.size() != 1){
-        return "-ERR wrong number of arguments for 'exec'\r\n";
+        return reply.error("ERR wrong number of arguments for 'exec'");
     }
 
-    vector<vector<RESPObject>> commands;
+    if(!client.in_multi){
+        return reply.error("ERR EXEC without MULTI");
+    }
 
-    {
-        lock_guard<mutex> lock(store_mutex);
+    vector<RESPObject> commands;
+    commands.swap(client.queued_commands);
+    client.in_multi = false;
 
-        auto flag_it = global_transaction_flags.find(client_fd);
-        if(flag_it == global_transaction_flags.end()){
-            return "-ERR EXEC without MULTI\r\n";
-        }
+    if (client.multi_failed) {
+        client.multi_failed = false;
+        unwatch_all(client);
+        return reply.error("EXECABORT Transaction discarded because of previous errors.");
+    }
 
-        global_transaction_flags.erase(flag_it);
+    // Take every store lock the transaction needs up front, once. No other client
+    // can interleave with it or see it half applied, and the queued handlers
+    // below find their locks already held.
+    unsigned lock_bits = 0;
+    for (const auto& command : commands) {
+        lock_bits |= store_locks_for_command(command_name(command));
+    }
+    StoreBatchLock lock(lock_bits);
 
-        auto queue_it = global_transaction_queue.find(client_fd);
-        if(queue_it == global_transaction_queue.end()){
-            return "*0\r\n"; 
+    if (!client.watched_keys.empty()) {
+        bool dirty = watched_keys_changed(client.watched_keys);
+        unwatch_all(client);
+        if (dirty) {
+            return reply.null_array();
         }
-
-        commands = queue_it->second;
-        global_transaction_queue.erase(queue_it);
     }
 
-    string response = "*" + to_string(commands.size()) + "\r\n";
-    for (const auto& command : commands) {  
-            RESPObject cmd_obj(RESPType::Array, "", 0, command);
-            response += handle_command(cmd_obj, client_fd, replica_info); 
+    // Nothing in a transaction waits: a blocking command answers as if its
+    // timeout had passed.
+    BlockedCommand no_wait;
+    no_wait.expired = true;
+    struct RestoreSlot {
+        BlockedCommand* saved;
+        ~RestoreSlot() { block_slot = saved; }
+    } restore{block_slot};
+    block_slot = &no_wait;
+
+    // Each queued command writes its reply straight after the array header.
+    reply.array(commands.size());
+    for (auto& command : commands) {  
+        handle_command(command, client, replica_info); 
     }
-    return response;
 }
 
-string handle_discard(const vector<RESPObject>& args, int client_fd) {
+void handle_discard(const vector<RESPObject>& args, ClientState& client, Reply& reply) {
     if (args.size() != 1) {
-        return "-ERR wrong number of arguments for 'discard'\r\n";
+        return reply.error("ERR wrong number of arguments for 'discard'");
     }
 
-    lock_guard<mutex> lock(store_mutex);
-    
-    auto flag_it = global_transaction_flags.find(client_fd);
-    if (flag_it == global_transaction_flags.end()) {
-        return "-ERR DISCARD without MULTI\r\n";
+    if (!client.in_multi) {
+        return reply.error("ERR DISCARD without MULTI");
     }
 
-    global_transaction_flags.erase(flag_it);
-    global_transaction_queue.erase(client_fd);
+    client.in_multi = false;
+    client.multi_failed = false;
+    client.queued_commands.clear();
+    unwatch_all(client);
 
-    return "+OK\r\n";
+    return reply.simple("OK");
 }
 
-string handle_set(const vector<RESPObject> & args, int client_fd){
-    if(args.size() != 3 && args.size() !=5){
-        return "-ERR wrong number of arguments for 'set'\r\n";
+void handle_watch(const vector<RESPObject>& args, ClientState& client, Reply& reply) {
+    if (args.size() < 2) {
+        return reply.error("ERR wrong number of arguments for 'watch'");
     }
 
-    {
-        lock_guard<mutex> lock(store_mutex);
-        if (global_transaction_flags.find(client_fd) != global_transaction_flags.end()) {
-            global_transaction_queue[client_fd].push_back(args);
-            return "+QUEUED\r\n";
-        }
+    if (client.in_multi) {
+        return reply.error("ERR WATCH inside MULTI is not allowed");
+    }
+
+    for (size_t i = 1; i < args.size(); ++i) {
+        const string& key = args[i].get_string_value();
+        client.watched_keys.push_back({key, watch_key(key)});
+    }
+    return reply.simple("OK");
+}
+
+void handle_unwatch(const vector<RESPObject>& args, ClientState& client, Reply& reply) {
+    if (args.size() != 1) {
+        return reply.error("ERR wrong number of arguments for 'unwatch'");
+    }
+
+    unwatch_all(client);
+    return reply.simple("OK");
+}
+
+void release_client_state(ClientState& client) {
+    client.in_multi = false;
+    client.multi_failed = false;
+    client.queued_commands.clear();
+    unwatch_all(client);
+    disable_tracking(client);
+    unsubscribe_all(client);
+}
+
+// Drops key from the string store if its expiry has passed. The caller holds
+// the string store lock.
+static void expire_if_needed(const string& key) {
+    if(keyspace->expirations.empty()){
+        return;
+    }
+    auto exp_it = keyspace->expirations.find(key);
+    if(exp_it != keyspace->expirations.end() && steady_clock::now() >= exp_it->second){
+        keyspace->strings.erase(key);
+        keyspace->expirations.erase(exp_it);
+        touch_key(key);
+    }
+}
+
+// Removes key from store. A value with more than LAZYFREE_THRESHOLD elements is
+// moved out first and destroyed by the lazy-free thread, so the store lock is
+// not held while millions of elements are freed.
+template <typename V>
+static size_t erase_key_lazily(Dict<V>& store, const string& key) {
+    auto it = store.find(key);
+    if(it != store.end() && it->second.size() > LAZYFREE_THRESHOLD){
+        free_lazily(move(it->second));
+    }
+    return store.erase(key);
+}
+
+// Large values go out by reference to their shared buffer, which stays alive
+// for the write even if the key changes after the store lock is released.
+static void reply_string_value(Reply& reply, const StringValue& value) {
+    if(value.shared()){
+        return reply.bulk(value.shared());
+    }
+    reply.bulk(value.view());
+}
+
+void handle_set(const vector<RESPObject> & args, Reply& reply) {
+    if(args.size() != 3 && args.size() !=5){
+        return reply.error("ERR wrong number of arguments for 'set'");
     }
 
     string key= args[1].get_string_value();
-    string value = args[2].get_string_value();
+    const string& value = args[2].get_string_value();
 
     steady_clock::time_point expiry_time;
 
@@ -129,7 +232,7 @@ string handle_set(const vector<RESPObject> & args, int client_fd){
         }
 
         if(option != "PX" && option != "px"){
-            return "-ERR syntax error\r\n";
+            return reply.error("ERR syntax error");
         } 
 
         try{
@@ -138,780 +241,3210 @@ string handle_set(const vector<RESPObject> & args, int client_fd){
             has_expiry = true;
         }
         catch(...){
-            return "-ERR PX value is not a valid integer\r\n";
+            return reply.error("ERR PX value is not a valid integer");
         }
     }
 
     {
-        lock_guard<mutex> lock(store_mutex);
-        global_store[key] = value;
+        StoreLock lock(STRING_STORE_LOCK);
+        keyspace->strings[key] = value;
         if(has_expiry){
-            global_key_expirations[key] = expiry_time;
+            keyspace->expirations[key] = expiry_time;
         }
         else{
-            global_key_expirations.erase(key);
+            keyspace->expirations.erase(key);
         }
+        touch_key(key);
+        propagate_command(args);
     }
 
-    return "+OK\r\n";
+    return reply.simple("OK");
 }
 
-string handle_incr(const vector<RESPObject> & args, int client_fd){
+void handle_incr(const vector<RESPObject> & args, Reply& reply) {
     if(args.size() != 2){
-        return "-ERR wrong number of arguments for 'incr'\r\n";
-    }
-
-    {
-        lock_guard<mutex> lock(store_mutex);
-        if (global_transaction_flags.find(client_fd) != global_transaction_flags.end()) {
-            global_transaction_queue[client_fd].push_back(args);
-            return "+QUEUED\r\n";
-        }
+        return reply.error("ERR wrong number of arguments for 'incr'");
     }
 
     string key = args[1].get_string_value();
 
-    lock_guard<mutex> lock(store_mutex);
+    StoreLock lock(STRING_STORE_LOCK);
 
-    auto it = global_store.find(key);
-    if(it == global_store.end()){
-        global_store[key] = "1"; // Initialize to 1 if key does not exist
-        return ":1\r\n";  
+    auto it = keyspace->strings.find(key);
+    if(it == keyspace->strings.end()){
+        keyspace->strings[key] = "1"; // Initialize to 1 if key does not exist
+        touch_key(key);
+        propagate_command(args);
+        return reply.integer(1);  
     }
 
     int64_t value;
     try {
-        value = stoll(it->second);
+        value = stoll(string(it->second.view()));
     } catch (...) {
-        return "-ERR value is not an integer or out of range\r\n";
+        return reply.error("ERR value is not an integer or out of range");
     }
 
     value++;
     it->second = to_string(value);
+    touch_key(key);
+    propagate_command(args);
 
-    return ":" + to_string(value) + "\r\n";
+    return reply.integer(value);
 }
 
-string handle_get(const vector<RESPObject> & args, int client_fd){
+void handle_get(const vector<RESPObject> & args, Reply& reply) {
     if(args.size() !=2){
-        return "-ERR wrong number of arguments for 'get'\r\n";
-    }
-
-    {
-        lock_guard<mutex> lock(store_mutex);
-        if (global_transaction_flags.find(client_fd) != global_transaction_flags.end()) {
-            global_transaction_queue[client_fd].push_back(args);
-            return "+QUEUED\r\n";
-        }
+        return reply.error("ERR wrong number of arguments for 'get'");
     }
 
     string key = args[1].get_string_value();
 
-    lock_guard<mutex> lock(store_mutex);
+    StoreLock lock(STRING_STORE_LOCK);
 
-    auto exp_it = global_key_expirations.find(key);
-    if(exp_it != global_key_expirations.end()){
-        if(steady_clock::now() >= exp_it-> second){
-            global_store.erase(key);
-            global_key_expirations.erase(key);
-        }
+    expire_if_needed(key);
+
+    auto it = keyspace->strings.find(key);
+    if(it == keyspace->strings.end()){
+        return reply.null_bulk();
     }
 
+    reply_string_value(reply, it->second);
+}
 
-    auto it = global_store.find(key);
-    if(it == global_store.end()){
-        return "$-1\r\n";
+void handle_mget(const vector<RESPObject>& args, Reply& reply) {
+    if(args.size() < 2){
+        return reply.error("ERR wrong number of arguments for 'mget'");
     }
 
-    string value = it->second;
-    string value_length = to_string(value.length());
-    string response = "$" + value_length + "\r\n" + value + "\r\n";
-    return response;
-    
+    size_t num_keys = args.size() - 1;
 
-}
+    StoreLock lock(STRING_STORE_LOCK);
 
-string handle_rpush(const vector<RESPObject> & args){
-    if(args.size() < 3){
-        return "-ERR wrong number of arguments for 'rpush'\r\n";
+    for(size_t i = 0; i < num_keys && i < KEY_PREFETCH_DISTANCE; ++i){
+        keyspace->strings.prefetch(args[i + 1].get_string_value());
     }
 
-    string key = args[1].get_string_value();
-    vector<string> values;
+    size_t reply_size = 16;
+    vector<const StringValue*> values(num_keys, nullptr);
+    for(size_t i = 0; i < num_keys; ++i){
+        if(i + KEY_PREFETCH_DISTANCE < num_keys){
+            keyspace->strings.prefetch(args[i + 1 + KEY_PREFETCH_DISTANCE].get_string_value());
+        }
+        const string& key = args[i + 1].get_string_value();
+        expire_if_needed(key);
+        auto it = keyspace->strings.find(key);
+        if(it != keyspace->strings.end()){
+            values[i] = &it->second;
+            reply_size += Reply::bulk_size(it->second.shared() ? 0 : it->second.size());
+        }
+        else{
+            reply_size += 5;
+        }
+    }
 
-    for(size_t i = 2; i < args.size(); ++i) {
-        if(args[i].get_type() != RESPType::BulkString && args[i].get_type() != RESPType::SimpleString) {
-            return "-ERR invalid argument type\r\n";
+    reply.reserve(reply_size);
+    reply.array(num_keys);
+    for(const StringValue* value : values){
+        if(value == nullptr){
+            reply.null_bulk();
+            continue;
         }
-        values.push_back(args[i].get_string_value());
+        reply_string_value(reply, *value);
     }
+}
 
-    unique_lock<mutex> lock(list_store_mutex);
-    for(auto &vals:values) {
-        global_list_store[key].push_back(vals);
+void handle_mset(const vector<RESPObject>& args, Reply& reply) {
+    if(args.size() < 3 || (args.size() - 1) % 2 != 0){
+        return reply.error("ERR wrong number of arguments for 'mset'");
+    }
+
+    StoreLock lock(STRING_STORE_LOCK);
+
+    for(size_t i = 1; i < args.size() && i < 2 * KEY_PREFETCH_DISTANCE; i += 2){
+        keyspace->strings.prefetch(args[i].get_string_value());
+    }
+    for(size_t i = 1; i < args.size(); i += 2){
+        if(i + 2 * KEY_PREFETCH_DISTANCE < args.size()){
+            keyspace->strings.prefetch(args[i + 2 * KEY_PREFETCH_DISTANCE].get_string_value());
+        }
+        const string& key = args[i].get_string_value();
+        keyspace->strings[key] = args[i + 1].get_string_value();
+        if(!keyspace->expirations.empty()){
+            keyspace->expirations.erase(key);
+        }
+        touch_key(key);
     }
+    propagate_command(args);
 
-    list_updated = true;
-    list_cv.notify_all();
+    return reply.simple("OK");
+}
 
-    string response = ":" + to_string(global_list_store[key].size()) + "\r\n";
-    return response;
+// Whether key exists in any store. The caller holds every store lock.
+static bool key_exists(const string& key) {
+    expire_if_needed(key);
+    return keyspace->strings.count(key) || keyspace->lists.count(key) || keyspace->streams.count(key) ||
+           keyspace->hashes.count(key) || keyspace->zsets.count(key);
 }
 
-string handle_lpush(const vector<RESPObject> & args){
-    if(args.size() < 3){
-        return "-ERR wrong number of arguments for 'lpush'\r\n";
+static void prefetch_key_everywhere(const string& key) {
+    keyspace->strings.prefetch(key);
+    keyspace->lists.prefetch(key);
+    keyspace->streams.prefetch(key);
+    keyspace->hashes.prefetch(key);
+    keyspace->zsets.prefetch(key);
+}
+
+void handle_msetnx(const vector<RESPObject>& args, Reply& reply) {
+    if(args.size() < 3 || (args.size() - 1) % 2 != 0){
+        return reply.error("ERR wrong number of arguments for 'msetnx'");
     }
 
-    string key = args[1].get_string_value();
-    vector<string> values;
+    StoreBatchLock lock(ALL_STORE_LOCKS);
 
-    for(size_t i = 2; i < args.size(); ++i) {
-        if(args[i].get_type() != RESPType::BulkString && args[i].get_type() != RESPType::SimpleString) {
-            return "-ERR invalid argument type\r\n";
+    for(size_t i = 1; i < args.size() && i < 2 * KEY_PREFETCH_DISTANCE; i += 2){
+        prefetch_key_everywhere(args[i].get_string_value());
+    }
+    for(size_t i = 1; i < args.size(); i += 2){
+        if(i + 2 * KEY_PREFETCH_DISTANCE < args.size()){
+            prefetch_key_everywhere(args[i + 2 * KEY_PREFETCH_DISTANCE].get_string_value());
+        }
+        if(key_exists(args[i].get_string_value())){
+            return reply.integer(0);
         }
-        values.push_back(args[i].get_string_value());
     }
 
-    unique_lock<mutex> lock(list_store_mutex);
-
-    for(auto &vals:values) {
-        global_list_store[key].push_front(vals);
+    for(size_t i = 1; i < args.size(); i += 2){
+        const string& key = args[i].get_string_value();
+        keyspace->strings[key] = args[i + 1].get_string_value();
+        touch_key(key);
     }
+    propagate_command(args);
 
-    list_updated = true;
-    list_cv.notify_all();
-
-    string response = ":" + to_string(global_list_store[key].size()) + "\r\n";
-    return response;
+    return reply.integer(1);
 }
 
-string handle_lrange(const vector<RESPObject> & args){
-    if(args.size() != 4){
-        return "-ERR wrong number of arguments for 'lrange'\r\n";
+void handle_del(const vector<RESPObject>& args, Reply& reply) {
+    if(args.size() < 2){
+        return reply.error("ERR wrong number of arguments for '" + args[0].get_string_value() + "'");
     }
 
-    string key = args[1].get_string_value();
-    int64_t start, end;
+    int64_t deleted = 0;
+    {
+        StoreBatchLock lock(ALL_STORE_LOCKS);
 
-    try {
-        start = stoll(args[2].get_string_value());
-        end = stoll(args[3].get_string_value());
-    } catch (...) {
-        return "-ERR invalid range values\r\n";
+        for(size_t i = 1; i < args.size() && i <= KEY_PREFETCH_DISTANCE; ++i){
+            prefetch_key_everywhere(args[i].get_string_value());
+        }
+        for(size_t i = 1; i < args.size(); ++i){
+            if(i + KEY_PREFETCH_DISTANCE < args.size()){
+                prefetch_key_everywhere(args[i + KEY_PREFETCH_DISTANCE].get_string_value());
+            }
+            const string& key = args[i].get_string_value();
+            expire_if_needed(key);
+            size_t removed = keyspace->strings.erase(key) + erase_key_lazily(keyspace->lists, key) +
+                             erase_key_lazily(keyspace->streams, key) + erase_key_lazily(keyspace->hashes, key) +
+                             erase_key_lazily(keyspace->zsets, key);
+            if(removed > 0){
+                if(!keyspace->expirations.empty()){
+                    keyspace->expirations.erase(key);
+                }
+                touch_key(key);
+                deleted++;
+            }
+        }
+
+        if(deleted > 0){
+            propagate_command(args);
+        }
     }
 
-    lock_guard<mutex> lock(list_store_mutex);
-    
-    auto it = global_list_store.find(key);
-    if(it == global_list_store.end() || it->second.empty()){
-        return "*0\r\n";
+    return reply.integer(deleted);
+}
+
+void handle_flushall(const vector<RESPObject>& args, Reply& reply) {
+    if(args.size() > 2){
+        return reply.error("ERR wrong number of arguments for '" + args[0].get_string_value() + "'");
     }
 
-    const deque<string>& list = it->second;
-    
-    if(start < 0) start += list.size();
-    if(end < 0) end += list.size();
-    if(start < 0) start = 0;
-    if(end >= list.size()) end = list.size() - 1;
-    if(start > end || start >= list.size()) {
-        return "*0\r\n";
+    bool lazy = false;
+    if(args.size() == 2){
+        string mode = args[1].get_string_value();
+        transform(mode.begin(), mode.end(), mode.begin(), ::toupper);
+        if(mode == "ASYNC"){
+            lazy = true;
+        }
+        else if(mode != "SYNC"){
+            return reply.error("ERR syntax error");
+        }
     }
-    
 
-    string response = "*" + to_string(end - start + 1) + "\r\n";
-    
-    for(int i = start; i <= end; ++i) {
-        response += "$" + to_string(list[i].size()) + "\r\n" + list[i] + "\r\n";
+    {
+        AllKeyspacesLock lock;
+        flush_all_stores(lazy);
+        propagate_command(args);
     }
-    
-    return response;
+
+    return reply.simple("OK");
 }
 
-string handle_lpop(const vector<RESPObject> & args){
-    if(args.size() != 2 && args.size() != 3){
-        return "-ERR wrong number of arguments for 'lpop'\r\n";
+void handle_exists(const vector<RESPObject>& args, Reply& reply) {
+    if(args.size() < 2){
+        return reply.error("ERR wrong number of arguments for 'exists'");
     }
 
-    string key = args[1].get_string_value();
+    int64_t count = 0;
+    StoreBatchLock lock(ALL_STORE_LOCKS);
 
-    lock_guard<mutex> lock(list_store_mutex);
-    
-    auto it = global_list_store.find(key);
-    if(it == global_list_store.end() || it->second.empty()){
-        return "$-1\r\n";
+    for(size_t i = 1; i < args.size() && i <= KEY_PREFETCH_DISTANCE; ++i){
+        prefetch_key_everywhere(args[i].get_string_value());
+    }
+    for(size_t i = 1; i < args.size(); ++i){
+        if(i + KEY_PREFETCH_DISTANCE < args.size()){
+            prefetch_key_everywhere(args[i + KEY_PREFETCH_DISTANCE].get_string_value());
+        }
+        if(key_exists(args[i].get_string_value())){
+            count++;
+        }
     }
 
-    int64_t num_items_to_remove;
-    if(args.size() == 3) {
-        try{
-            num_items_to_remove = stoll(args[2].get_string_value());
-            if(num_items_to_remove < 0) {
-                return "-ERR count must be a non-negative integer\r\n";
+    return reply.integer(count);
+}
+
+// Character class starting at pattern[p], for glob_match; moves p past it.
+static bool match_class(const string& pattern, size_t& p, char c) {
+    size_t i = p + 1;
+    bool negate = i < pattern.size() && pattern[i] == '^';
+    if (negate) {
+        i++;
+    }
+    bool matched = false;
+    while (i < pattern.size() && pattern[i] != ']') {
+        if (pattern[i] == '\\' && i + 1 < pattern.size()) {
+            matched |= pattern[i + 1] == c;
+            i += 2;
+        }
+        else if (i + 2 < pattern.size() && pattern[i + 1] == '-' && pattern[i + 2] != ']') {
+            char low = min(pattern[i], pattern[i + 2]);
+            char high = max(pattern[i], pattern[i + 2]);
+            matched |= c >= low && c <= high;
+            i += 3;
+        }
+        else {
+            matched |= pattern[i] == c;
+            i++;
+        }
+    }
+    p = i < pattern.size() ? i + 1 : i;
+    return matched != negate;
+}
+
+bool glob_match(const string& pattern, const string& str) {
+    size_t p = 0, s = 0;
+    size_t star_p = string::npos, star_s = 0;
+    while (s < str.size()) {
+        if (p < pattern.size()) {
+            char c = pattern[p];
+            if (c == '*') {
+                star_p = p++;
+                star_s = s;
+                continue;
+            }
+            size_t next_p = p + 1;
+            bool matched;
+            if (c == '?') {
+                matched = true;
+            }
+            else if (c == '[') {
+                next_p = p;
+                matched = match_class(pattern, next_p, str[s]);
+            }
+            else if (c == '\\' && p + 1 < pattern.size()) {
+                matched = pattern[p + 1] == str[s];
+                next_p = p + 2;
+            }
+            else {
+                matched = c == str[s];
+            }
+            if (matched) {
+                p = next_p;
+                s++;
+                continue;
             }
-        } 
-        catch(...){
-            return "-ERR invalid count value\r\n";
         }
+        // Mismatch: let the last '*' swallow one more character and retry.
+        if (star_p == string::npos) {
+            return false;
+        }
+        p = star_p + 1;
+        s = ++star_s;
     }
-    else{
-        num_items_to_remove = 1; 
+    while (p < pattern.size() && pattern[p] == '*') {
+        p++;
     }
+    return p == pattern.size();
+}
 
-    vector<string> values;
-    for(int64_t i = 0; i < num_items_to_remove && !it->second.empty(); ++i) {
-        values.push_back(it->second.front());
-        it->second.pop_front();
+// SCAN walks one keyspace after the other, and the stores of each in this
+// order. The top bits of a cursor say which store it is in, the next ones which
+// keyspace, and the rest is that store's Dict::scan cursor.
+enum ScanStore { SCAN_STRINGS, SCAN_LISTS, SCAN_STREAMS, SCAN_HASHES, SCAN_ZSETS, SCAN_STORE_COUNT };
+const int SCAN_STORE_SHIFT = 60;
+const int SCAN_SHARD_SHIFT = 52;
+const uint64_t SCAN_SHARD_MASK = (uint64_t(1) << (SCAN_STORE_SHIFT - SCAN_SHARD_SHIFT)) - 1;
+const uint64_t SCAN_POSITION_MASK = (uint64_t(1) << SCAN_SHARD_SHIFT) - 1;
+// Buckets visited per store lock acquisition, so a large COUNT still only
+// holds the lock for a few microseconds at a time.
+const size_t SCAN_BUCKETS_PER_LOCK = 64;
+const size_t HSCAN_MAX_BUCKETS = 1024;
+
+// Advances a SCAN through one store, collecting matching keys, until the store
+// is exhausted (returns 0), count keys are collected or budget buckets have
+// been visited.
+template <typename Store>
+static uint64_t scan_store(const Store& store, unsigned lock_bit, uint64_t cursor, size_t count,
+                           size_t& budget, const string& pattern, vector<string>& keys) {
+    auto now = steady_clock::now();
+    auto collect = [&](const typename Store::value_type& entry) {
+        if (!pattern.empty() && !glob_match(pattern, entry.first)) {
+            return;
+        }
+        if (lock_bit == STRING_STORE_LOCK && !keyspace->expirations.empty()) {
+            auto exp_it = keyspace->expirations.find(entry.first);
+            if (exp_it != keyspace->expirations.end() && now >= exp_it->second) {
+                return;
+            }
+        }
+        keys.push_back(entry.first);
+    };
+
+    while (budget > 0 && keys.size() < count) {
+        StoreLock lock(lock_bit);
+        for (size_t visited = 0; visited < SCAN_BUCKETS_PER_LOCK && budget > 0 && keys.size() < count; ++visited) {
+            budget--;
+            cursor = store.scan(cursor, collect);
+            if (cursor == 0) {
+                return 0;
+            }
+        }
     }
+    return cursor;
+}
 
-    if(it->second.empty()){
-        global_list_store.erase(it);
+int scan_cursor_shard(const vector<RESPObject>& args) {
+    uint64_t cursor = 0;
+    if (args.size() >= 2) {
+        const string& text = args[1].get_string_value();
+        from_chars(text.data(), text.data() + text.size(), cursor);
+    }
+    size_t shard = (cursor >> SCAN_SHARD_SHIFT) & SCAN_SHARD_MASK;
+    return shard < keyspaces.size() ? (int)shard : 0;
+}
+
+// What a SCAN takes along from one shard to the next.
+struct ScanTour {
+    uint64_t cursor;
+    size_t budget;
+    vector<string> keys;
+};
+
+void handle_scan(const vector<RESPObject>& args, Reply& reply) {
+    if (args.size() < 2 || args.size() % 2 != 0) {
+        return reply.error("ERR wrong number of arguments for 'scan'");
     }
 
-    if(num_items_to_remove == 1) {
-        if(values.empty()) {
-            return "$-1\r\n";
+    uint64_t cursor;
+    try {
+        size_t parsed;
+        cursor = stoull(args[1].get_string_value(), &parsed);
+        if (parsed != args[1].get_string_value().size()) {
+            return reply.error("ERR invalid cursor");
         }
-        string response = "$" + to_string(values[0].size()) + "\r\n" + values[0] + "\r\n";
-        return response;
     }
-    string response;
-    response += "*" + to_string(values.size()) + "\r\n";
-    for(auto &val : values) {
-        response += "$" + to_string(val.size()) + "\r\n" + val + "\r\n";
+    catch (...) {
+        return reply.error("ERR invalid cursor");
     }
-    return response;
-}
 
-string handle_llen(const vector<RESPObject> & args){
-    if(args.size() != 2){
-        return "-ERR wrong number of arguments for 'llen'\r\n";
+    string pattern;
+    size_t count = 10;
+    int only_store = -1;
+    for (size_t i = 2; i < args.size(); i += 2) {
+        string option = args[i].get_string_value();
+        for (auto& c : option) c = toupper(c);
+        const string& value = args[i + 1].get_string_value();
+        if (option == "MATCH") {
+            pattern = value == "*" ? "" : value;
+        }
+        else if (option == "COUNT") {
+            try {
+                long long parsed = stoll(value);
+                if (parsed < 1) {
+                    return reply.error("ERR syntax error");
+                }
+                count = parsed;
+            }
+            catch (...) {
+                return reply.error("ERR value is not an integer or out of range");
+            }
+        }
+        else if (option == "TYPE") {
+            string type = value;
+            for (auto& c : type) c = tolower(c);
+            if (type == "string") only_store = SCAN_STRINGS;
+            else if (type == "list") only_store = SCAN_LISTS;
+            else if (type == "stream") only_store = SCAN_STREAMS;
+            else if (type == "hash") only_store = SCAN_HASHES;
+            else if (type == "zset") only_store = SCAN_ZSETS;
+            else if (type == "set") only_store = SCAN_STORE_COUNT;
+            else return reply.error("ERR unknown type name '" + value + "'");
+        }
+        else {
+            return reply.error("ERR syntax error");
+        }
     }
 
-    string key = args[1].get_string_value();
+    shared_ptr<ScanTour> tour;
+    if (shard_tour && shard_tour->state) {
+        tour = static_pointer_cast<ScanTour>(shard_tour->state);
+        cursor = tour->cursor;
+    }
 
-    lock_guard<mutex> lock(list_store_mutex);
-    
-    auto it = global_list_store.find(key);
-    if(it == global_list_store.end()){
-        return ":0\r\n";
+    int store = cursor >> SCAN_STORE_SHIFT;
+    size_t shard = (cursor >> SCAN_SHARD_SHIFT) & SCAN_SHARD_MASK;
+    uint64_t position = cursor & SCAN_POSITION_MASK;
+    if (shard >= keyspaces.size()) {
+        store = SCAN_STORE_COUNT;   // not a cursor this server handed out
+        shard = keyspaces.size();
+    }
+    if (only_store >= 0 && store != only_store) {
+        // A TYPE filter only ever walks its own store.
+        position = 0;
+        store = store < only_store ? only_store : SCAN_STORE_COUNT;
     }
 
-    int length = it->second.size();
-    return ":" + to_string(length) + "\r\n";
+    // With --shards this runs on the cursor's shard, and goes on to the next
+    // ones (shards.h) until it has COUNT keys.
+    vector<string> keys;
+    size_t budget = count * 10;
+    if (tour) {
+        keys.swap(tour->keys);
+        budget = tour->budget;
+    }
+    while (store < SCAN_STORE_COUNT && budget > 0 && keys.size() < count) {
+        if (store == SCAN_STRINGS) {
+            position = scan_store(keyspace->strings, STRING_STORE_LOCK, position, count, budget, pattern, keys);
+        }
+        else if (store == SCAN_LISTS) {
+            position = scan_store(keyspace->lists, LIST_STORE_LOCK, position, count, budget, pattern, keys);
+        }
+        else if (store == SCAN_STREAMS) {
+            position = scan_store(keyspace->streams, STREAM_STORE_LOCK, position, count, budget, pattern, keys);
+        }
+        else if (store == SCAN_HASHES) {
+            position = scan_store(keyspace->hashes, HASH_STORE_LOCK, position, count, budget, pattern, keys);
+        }
+        else {
+            position = scan_store(keyspace->zsets, ZSET_STORE_LOCK, position, count, budget, pattern, keys);
+        }
+        if (position == 0) {
+            store = only_store >= 0 ? SCAN_STORE_COUNT : store + 1;
+        }
+    }
+    if (store >= SCAN_STORE_COUNT && shard + 1 < keyspaces.size()) {
+        shard++;
+        store = only_store >= 0 ? only_store : SCAN_STRINGS;
+        position = 0;
+        if (shard_tour && budget > 0 && keys.size() < count) {
+            if (!tour) {
+                tour = make_shared<ScanTour>();
+            }
+            tour->cursor = (uint64_t(store) << SCAN_STORE_SHIFT) | (uint64_t(shard) << SCAN_SHARD_SHIFT);
+            tour->budget = budget;
+            tour->keys = std::move(keys);
+            shard_tour->state = tour;
+            shard_tour->more = true;
+            return;
+        }
+    }
+
+    string next_cursor = store >= SCAN_STORE_COUNT ? "0" :
+        to_string((uint64_t(store) << SCAN_STORE_SHIFT) | (uint64_t(shard) << SCAN_SHARD_SHIFT) | position);
+    reply.array(2);
+    reply.bulk(next_cursor);
+    reply.array(keys.size());
+    for (const auto& key : keys) {
+        reply.bulk(key);
+    }
 }
 
-string handle_blpop(const vector<RESPObject> & args){     
-    if(args.size() != 3){         
-        return "-ERR wrong number of arguments for 'blpop'\r\n";     
-    }          
-    
-    string key = args[1].get_string_value();     
-    double timeout;     
-    try {         
-        timeout = stod(args[2].get_string_value());     
-    } catch (...) {         
-        return "-ERR invalid timeout value\r\n";     
-    }          
-    
-    if(timeout < 0) {         
-        return "-ERR timeout must be a non-negative number\r\n";     
-    }      
-    
-    steady_clock::time_point end_time;     
-    if(timeout == 0) {         
-        end_time = steady_clock::time_point::max();      
-    } else {         
-        end_time = steady_clock::now() + milliseconds(static_cast<int64_t>(timeout * 1000));     
-    }      
-    
-    unique_lock<mutex> lock(list_store_mutex);          
-    
-    while(true) {         
-        auto it = global_list_store.find(key);         
-        if(it != global_list_store.end() && !it->second.empty()) {             
-            string value = it->second.front();             
-            it->second.pop_front();             
-            if(it->second.empty()) {                 
-                global_list_store.erase(it);             
-            }                          
-            
-            string response = "*2\r\n";             
-            response += "$" + to_string(key.size()) + "\r\n" + key + "\r\n";             
-            response += "$" + to_string(value.size()) + "\r\n" + value + "\r\n";             
-            return response;         
-        }                  
-        
-        if (steady_clock::now() >= end_time) {             
-            return "*-1\r\n"; // Timeout - null array        
-        }          
-        
-        if (timeout == 0) {             
-            list_cv.wait(lock, [&] { return list_updated; });         
-        } else {             
-            auto now = steady_clock::now();             
-            if (now >= end_time) {
-                return "*-1\r\n"; // Timeout - null array
+// BIGKEYS reports, per type, the keys with the most elements and their
+// MEMORY USAGE, estimated from BIGKEYS_SAMPLES elements: a huge key costs as
+// many element reads as any other.
+const size_t BIGKEYS_SAMPLES = 64;
+
+struct BigKey {
+    string key;
+    size_t elements;
+    size_t bytes;
+};
+
+struct BigKeysFound {
+    vector<BigKey> lists;
+    vector<BigKey> streams;
+};
+
+// Walks a whole store of the current keyspace, SCAN_BUCKETS_PER_LOCK buckets
+// per store lock like SCAN, keeping the count largest keys in biggest,
+// largest first.
+template <typename Store>
+static void find_big_keys(const Store& store, unsigned lock_bit, size_t count, vector<BigKey>& biggest) {
+    auto consider = [&](const typename Store::value_type& entry) {
+        size_t elements = entry.second.size();
+        if (biggest.size() == count && elements <= biggest.back().elements) {
+            return;
+        }
+        BigKey big{entry.first, elements, key_memory_usage(entry, BIGKEYS_SAMPLES)};
+        auto at = upper_bound(biggest.begin(), biggest.end(), big,
+                              [](const BigKey& a, const BigKey& b) { return a.elements > b.elements; });
+        biggest.insert(at, std::move(big));
+        if (biggest.size() > count) {
+            biggest.pop_back();
+        }
+    };
+
+    uint64_t cursor = 0;
+    do {
+        StoreLock lock(lock_bit);
+        for (size_t visited = 0; visited < SCAN_BUCKETS_PER_LOCK; ++visited) {
+            cursor = store.scan(cursor, consider);
+            if (cursor == 0) {
+                break;
             }
-            auto time_left = end_time - now;             
-            bool signaled = list_cv.wait_for(lock, time_left, [&] { return list_updated; });             
-            if (!signaled) {                 
-                return "*-1\r\n"; // Timeout - null array            
-            }         
-        }                  
-        
-        list_updated = false;     
-    } 
+        }
+    } while (cursor != 0);
 }
 
-string handle_type(const vector<RESPObject>& args){
-    if(args.size() != 2){
-        return "-ERR wrong number of arguments for 'type'\r\n";
+void handle_bigkeys(const vector<RESPObject>& args, Reply& reply) {
+    size_t count = 10;
+    if (args.size() == 3) {
+        string option = args[1].get_string_value();
+        for (auto& c : option) c = toupper(c);
+        if (option != "COUNT") {
+            return reply.error("ERR syntax error");
+        }
+        try {
+            long long parsed = stoll(args[2].get_string_value());
+            if (parsed < 1) {
+                return reply.error("ERR syntax error");
+            }
+            count = parsed;
+        }
+        catch (...) {
+            return reply.error("ERR value is not an integer or out of range");
+        }
     }
+    else if (args.size() != 1) {
+        return reply.error("ERR wrong number of arguments for 'bigkeys'");
+    }
+
+    // With --shards each shard adds its own keys (shards.h) and the last one
+    // replies.
+    shared_ptr<BigKeysFound> found;
+    if (shard_tour && shard_tour->state) {
+        found = static_pointer_cast<BigKeysFound>(shard_tour->state);
+    }
+    else {
+        found = make_shared<BigKeysFound>();
+    }
+    vector<BigKey>& lists = found->lists;
+    vector<BigKey>& streams = found->streams;
+    find_big_keys(keyspace->lists, LIST_STORE_LOCK, count, lists);
+    find_big_keys(keyspace->streams, STREAM_STORE_LOCK, count, streams);
+    if (shard_tour && !shard_tour->last) {
+        shard_tour->state = found;
+        shard_tour->more = true;
+        return;
+    }
+
+    reply.array(lists.size() + streams.size());
+    auto reply_keys = [&](const char* type, const vector<BigKey>& keys) {
+        for (const BigKey& big : keys) {
+            reply.array(4);
+            reply.bulk(type);
+            reply.bulk(big.key);
+            reply.integer(big.elements);
+            reply.integer(big.bytes);
+        }
+    };
+    reply_keys("list", lists);
+    reply_keys("stream", streams);
+}
 
-    string key = args[1].get_string_value();
+void handle_hset(const vector<RESPObject>& args, Reply& reply) {
+    if (args.size() < 4 || args.size() % 2 != 0) {
+        return reply.error("ERR wrong number of arguments for 'hset'");
+    }
 
-    lock_guard<mutex> lock(store_mutex);
-    
-    if(global_store.find(key) != global_store.end()){
-        return "+string\r\n";
+    const string& key = args[1].get_string_value();
+    int64_t added = 0;
+    {
+        StoreLock lock(HASH_STORE_LOCK);
+        HashValue& hash = keyspace->hashes[key];
+        for (size_t i = 2; i < args.size(); i += 2) {
+            added += hash.set(args[i].get_string_value(), args[i + 1].get_string_value());
+        }
+        touch_key(key);
+        propagate_command(args);
     }
 
-    if(global_list_store.find(key) != global_list_store.end()){
-        return "+list\r\n";
+    return reply.integer(added);
+}
+
+void handle_hget(const vector<RESPObject>& args, Reply& reply) {
+    if (args.size() != 3) {
+        return reply.error("ERR wrong number of arguments for 'hget'");
     }
 
-    if(global_stream_store.find(key) != global_stream_store.end()){
-        return "+stream\r\n";
+    StoreLock lock(HASH_STORE_LOCK);
+    auto it = keyspace->hashes.find(args[1].get_string_value());
+    string_view value;
+    if (it == keyspace->hashes.end() || !it->second.get(args[2].get_string_value(), value)) {
+        return reply.null_bulk();
     }
 
-    return "+none\r\n"; 
+    reply.bulk(value);
 }
 
-string handle_xadd(const vector<RESPObject>& args) {
-    if (args.size()<4 || (args.size()-3)%2!=0) {
-        return "-ERR wrong number of arguments for 'xadd'\r\n";
+void handle_hmget(const vector<RESPObject>& args, Reply& reply) {
+    if (args.size() < 3) {
+        return reply.error("ERR wrong number of arguments for 'hmget'");
     }
 
-    string key = args[1].get_string_value();
-    string id = args[2].get_string_value();
-
-    string last_timestamp_str="0";
-    string last_sequence_str="0";
+    StoreLock lock(HASH_STORE_LOCK);
+    auto it = keyspace->hashes.find(args[1].get_string_value());
+    reply.array(args.size() - 2);
+    for (size_t i = 2; i < args.size(); ++i) {
+        string_view value;
+        if (it != keyspace->hashes.end() && it->second.get(args[i].get_string_value(), value)) {
+            reply.bulk(value);
+        }
+        else {
+            reply.null_bulk();
+        }
+    }
+}
+
+void handle_hgetall(const vector<RESPObject>& args, Reply& reply) {
+    if (args.size() != 2) {
+        return reply.error("ERR wrong number of arguments for 'hgetall'");
+    }
 
+    StoreLock lock(HASH_STORE_LOCK);
+    auto it = keyspace->hashes.find(args[1].get_string_value());
+    if (it == keyspace->hashes.end()) {
+        return reply.array(0);
+    }
+
+    reply.array(it->second.size() * 2);
+    it->second.for_each([&](string_view field, string_view value) {
+        reply.bulk(field);
+        reply.bulk(value);
+    });
+}
+
+void handle_hdel(const vector<RESPObject>& args, Reply& reply) {
+    if (args.size() < 3) {
+        return reply.error("ERR wrong number of arguments for 'hdel'");
+    }
+
+    const string& key = args[1].get_string_value();
+    int64_t removed = 0;
     {
-        lock_guard<mutex> lock(stream_store_mutex);
-        auto stream_it = global_stream_store.find(key);
-        if (stream_it != global_stream_store.end() && !stream_it->second.empty()) {
-            const auto& last_entry = stream_it->second.back();
-            string last_id = last_entry.id;
-            size_t last_separator_pos = last_id.find('-');
-            if (last_separator_pos != string::npos) {
-                last_timestamp_str = last_id.substr(0, last_separator_pos);
-                last_sequence_str = last_id.substr(last_separator_pos + 1);
+        StoreLock lock(HASH_STORE_LOCK);
+        auto it = keyspace->hashes.find(key);
+        if (it == keyspace->hashes.end()) {
+            return reply.integer(0);
+        }
+        for (size_t i = 2; i < args.size(); ++i) {
+            removed += it->second.erase(args[i].get_string_value());
+        }
+        if (it->second.size() == 0) {
+            keyspace->hashes.erase(key);
+        }
+        if (removed > 0) {
+            touch_key(key);
+            propagate_command(args);
+        }
+    }
+
+    return reply.integer(removed);
+}
+
+void handle_hincrby(const vector<RESPObject>& args, Reply& reply) {
+    if (args.size() != 4) {
+        return reply.error("ERR wrong number of arguments for 'hincrby'");
+    }
+
+    int64_t increment;
+    try {
+        size_t parsed;
+        increment = stoll(args[3].get_string_value(), &parsed);
+        if (parsed != args[3].get_string_value().size()) {
+            return reply.error("ERR value is not an integer or out of range");
+        }
+    }
+    catch (...) {
+        return reply.error("ERR value is not an integer or out of range");
+    }
+
+    const string& key = args[1].get_string_value();
+    const string& field = args[2].get_string_value();
+    int64_t result = 0;
+    {
+        StoreLock lock(HASH_STORE_LOCK);
+        HashValue& hash = keyspace->hashes[key];
+        string_view current;
+        if (hash.get(field, current)) {
+            try {
+                size_t parsed;
+                string current_value(current);
+                result = stoll(current_value, &parsed);
+                if (parsed != current_value.size()) {
+                    return reply.error("ERR hash value is not an integer");
+                }
             }
+            catch (...) {
+                return reply.error("ERR hash value is not an integer");
+            }
+        }
+        if (__builtin_add_overflow(result, increment, &result)) {
+            return reply.error("ERR increment or decrement would overflow");
         }
+        hash.set(field, to_string(result));
+        touch_key(key);
+        propagate_command(args);
     }
 
-    if (id == "*") {
-        auto now = system_clock::now();
-        auto ms = duration_cast<milliseconds>(now.time_since_epoch()).count();
-        string timestamp_str = to_string(ms);
+    return reply.integer(result);
+}
 
-        if (timestamp_str == last_timestamp_str) {
-            int64_t seq = stoll(last_sequence_str);
-            id = timestamp_str + "-" + to_string(seq + 1);
-        } else {
-            id = timestamp_str + "-0";
+void handle_hlen(const vector<RESPObject>& args, Reply& reply) {
+    if (args.size() != 2) {
+        return reply.error("ERR wrong number of arguments for 'hlen'");
+    }
+
+    StoreLock lock(HASH_STORE_LOCK);
+    auto it = keyspace->hashes.find(args[1].get_string_value());
+    return reply.integer(it == keyspace->hashes.end() ? 0 : it->second.size());
+}
+
+void handle_hscan(const vector<RESPObject>& args, Reply& reply) {
+    if (args.size() < 3 || args.size() % 2 != 1) {
+        return reply.error("ERR wrong number of arguments for 'hscan'");
+    }
+
+    uint64_t cursor;
+    try {
+        size_t parsed;
+        cursor = stoull(args[2].get_string_value(), &parsed);
+        if (parsed != args[2].get_string_value().size()) {
+            return reply.error("ERR invalid cursor");
         }
     }
+    catch (...) {
+        return reply.error("ERR invalid cursor");
+    }
 
-    // validating id (each id has two parts: timestamp and sequence number)
-    // the timestamp part should be greater than last entry's timestamp
-    // If the millisecondsTime part of the ID is equal to the millisecondsTime of the last entry,
-    // the sequenceNumber part of the ID should be greater than the sequenceNumber of the last entry.
-    // If the stream is empty, the ID should be greater than 0-0
+    string pattern;
+    size_t count = 10;
+    for (size_t i = 3; i < args.size(); i += 2) {
+        string option = args[i].get_string_value();
+        for (auto& c : option) c = toupper(c);
+        const string& value = args[i + 1].get_string_value();
+        if (option == "MATCH") {
+            pattern = value == "*" ? "" : value;
+        }
+        else if (option == "COUNT") {
+            try {
+                long long parsed = stoll(value);
+                if (parsed < 1) {
+                    return reply.error("ERR syntax error");
+                }
+                count = parsed;
+            }
+            catch (...) {
+                return reply.error("ERR value is not an integer or out of range");
+            }
+        }
+        else {
+            return reply.error("ERR syntax error");
+        }
+    }
+
+    // Views into the hash; the reply is written before the lock drops.
+    vector<pair<string_view, string_view>> found;
+    auto collect = [&](string_view field, string_view value) {
+        if (!pattern.empty() && !glob_match(pattern, string(field))) {
+            return;
+        }
+        found.emplace_back(field, value);
+    };
+
+    StoreLock lock(HASH_STORE_LOCK);
+    auto it = keyspace->hashes.find(args[1].get_string_value());
+    if (it == keyspace->hashes.end()) {
+        cursor = 0;
+    }
+    else if (const Dict<string>* table = it->second.get_table()) {
+        // The hash may be gone once the lock drops, so rather than re-locking
+        // like SCAN, a single call stops after a fixed number of buckets.
+        size_t budget = min(count * 10, HSCAN_MAX_BUCKETS);
+        do {
+            cursor = table->scan(cursor, [&](const pair<const string, string>& entry) {
+                collect(entry.first, entry.second);
+            });
+        } while (cursor != 0 && --budget > 0 && found.size() < count);
+    }
+    else {
+        // A packed hash is small by construction, so return it whole.
+        it->second.for_each(collect);
+        cursor = 0;
+    }
+
+    reply.array(2);
+    reply.bulk(to_string(cursor));
+    reply.array(found.size() * 2);
+    for (const auto& item : found) {
+        reply.bulk(item.first);
+        reply.bulk(item.second);
+    }
+}
+
+// Parses a sorted set score; accepts inf, +inf and -inf but not NaN.
+static bool parse_score(const string& text, double& score) {
+    if (text.empty()) {
+        return false;
+    }
+    char* end;
+    score = strtod(text.c_str(), &end);
+    return end == text.c_str() + text.size() && !isnan(score);
+}
+
+// Shortest text that reads back as the same double, as Redis prints scores.
+static string format_score(double score) {
+    if (isinf(score)) {
+        return score > 0 ? "inf" : "-inf";
+    }
+    char buffer[32];
+    auto result = to_chars(buffer, buffer + sizeof(buffer), score);
+    return string(buffer, result.ptr);
+}
+
+static void reply_zentry(Reply& reply, const ZEntry& entry, bool with_score) {
+    reply.bulk(entry.member);
+    if (with_score) {
+        reply.bulk(format_score(entry.score));
+    }
+}
+
+void handle_zadd(const vector<RESPObject>& args, Reply& reply) {
+    if (args.size() < 4) {
+        return reply.error("ERR wrong number of arguments for 'zadd'");
+    }
+
+    bool nx = false, xx = false, gt = false, lt = false, ch = false, incr = false;
+    size_t i = 2;
+    for (; i < args.size(); ++i) {
+        string flag = args[i].get_string_value();
+        for (auto& c : flag) c = toupper(c);
+        if (flag == "NX") nx = true;
+        else if (flag == "XX") xx = true;
+        else if (flag == "GT") gt = true;
+        else if (flag == "LT") lt = true;
+        else if (flag == "CH") ch = true;
+        else if (flag == "INCR") incr = true;
+        else break;
+    }
+
+    if (i >= args.size() || (args.size() - i) % 2 != 0) {
+        return reply.error("ERR syntax error");
+    }
+    if (nx && xx) {
+        return reply.error("ERR XX and NX options at the same time are not compatible");
+    }
+    if ((gt && lt) || (nx && (gt || lt))) {
+        return reply.error("ERR GT, LT, and/or NX options at the same time are not compatible");
+    }
+    if (incr && args.size() - i != 2) {
+        return reply.error("ERR INCR option supports a single increment-element pair");
+    }
+
+    vector<double> scores;
+    for (size_t j = i; j < args.size(); j += 2) {
+        double score;
+        if (!parse_score(args[j].get_string_value(), score)) {
+            return reply.error("ERR value is not a valid float");
+        }
+        scores.push_back(score);
+    }
+
+    const string& key = args[1].get_string_value();
+    int64_t added = 0, changed = 0;
+    bool incr_applied = false;
+    double incr_result = 0;
+    {
+        StoreLock lock(ZSET_STORE_LOCK);
+        auto it = keyspace->zsets.find(key);
+        ZSetValue* zset = it == keyspace->zsets.end() ? nullptr : &it->second;
+        for (size_t j = i, n = 0; j < args.size(); j += 2, ++n) {
+            const string& member = args[j + 1].get_string_value();
+            double current;
+            bool exists = zset && zset->get_score(member, current);
+            if ((nx && exists) || (xx && !exists)) {
+                continue;
+            }
+            double score = scores[n];
+            if (incr && exists) {
+                score += current;
+                if (isnan(score)) {
+                    return reply.error("ERR resulting score is not a number (NaN)");
+                }
+            }
+            if (exists && ((gt && score <= current) || (lt && score >= current))) {
+                continue;
+            }
+            if (!zset) {
+                zset = &keyspace->zsets[key];
+            }
+            if (zset->set(member, score)) {
+                added++;
+            }
+            else if (score != current) {
+                changed++;
+            }
+            incr_applied = true;
+            incr_result = score;
+        }
+
+        if (added + changed > 0) {
+            if (added > 0) {
+                keyspace->zset_updated = true;
+                keyspace->zset_cv.notify_all();
+                signal_key_ready(key);
+            }
+            touch_key(key);
+            propagate_command(args);
+        }
+    }
+
+    if (incr) {
+        if (!incr_applied) {
+            return reply.null_bulk();
+        }
+        return reply.bulk(format_score(incr_result));
+    }
+    return reply.integer(ch ? added + changed : added);
+}
+
+void handle_zincrby(const vector<RESPObject>& args, Reply& reply) {
+    if (args.size() != 4) {
+        return reply.error("ERR wrong number of arguments for 'zincrby'");
+    }
+    handle_zadd({args[0], args[1], RESPObject(RESPType::BulkString, "INCR"), args[2], args[3]}, reply);
+}
+
+// Bounds of a BYSCORE or BYLEX range. An exclusive bound is written "(x";
+// lex bounds are "[x", "(x", "-" or "+".
+struct ZRangeBound {
+    double score = 0;
+    string member;
+    bool exclusive = false;
+    bool unbounded_low = false;
+    bool unbounded_high = false;
+};
+
+static bool parse_score_bound(const string& text, ZRangeBound& bound) {
+    bound.exclusive = !text.empty() && text[0] == '(';
+    return parse_score(bound.exclusive ? text.substr(1) : text, bound.score);
+}
+
+static bool parse_lex_bound(const string& text, ZRangeBound& bound) {
+    if (text == "-") {
+        bound.unbounded_low = true;
+        return true;
+    }
+    if (text == "+") {
+        bound.unbounded_high = true;
+        return true;
+    }
+    if (text.empty() || (text[0] != '[' && text[0] != '(')) {
+        return false;
+    }
+    bound.exclusive = text[0] == '(';
+    bound.member = text.substr(1);
+    return true;
+}
+
+// Number of entries that sort before the range starting at min.
+static size_t zset_count_below(const ZSetValue& zset, const ZRangeBound& min, bool by_lex) {
+    if (by_lex) {
+        if (min.unbounded_low) return 0;
+        if (min.unbounded_high) return zset.size();
+        return zset.count_before([&](const ZEntry& e) {
+            return min.exclusive ? e.member <= min.member : e.member < min.member;
+        });
+    }
+    return zset.count_before([&](const ZEntry& e) {
+        return min.exclusive ? e.score <= min.score : e.score < min.score;
+    });
+}
+
+// Number of entries that sort before the end of the range ending at max.
+static size_t zset_count_through(const ZSetValue& zset, const ZRangeBound& max, bool by_lex) {
+    if (by_lex) {
+        if (max.unbounded_low) return 0;
+        if (max.unbounded_high) return zset.size();
+        return zset.count_before([&](const ZEntry& e) {
+            return max.exclusive ? e.member < max.member : e.member <= max.member;
+        });
+    }
+    return zset.count_before([&](const ZEntry& e) {
+        return max.exclusive ? e.score < max.score : e.score <= max.score;
+    });
+}
+
+void handle_zrange(const vector<RESPObject>& args, Reply& reply) {
+    if (args.size() < 4) {
+        return reply.error("ERR wrong number of arguments for 'zrange'");
+    }
+
+    bool by_score = false, by_lex = false, rev = false, with_scores = false, has_limit = false;
+    int64_t offset = 0, limit = -1;
+    for (size_t i = 4; i < args.size(); ++i) {
+        string option = args[i].get_string_value();
+        for (auto& c : option) c = toupper(c);
+        if (option == "BYSCORE") by_score = true;
+        else if (option == "BYLEX") by_lex = true;
+        else if (option == "REV") rev = true;
+        else if (option == "WITHSCORES") with_scores = true;
+        else if (option == "LIMIT" && i + 2 < args.size()) {
+            try {
+                offset = stoll(args[i + 1].get_string_value());
+                limit = stoll(args[i + 2].get_string_value());
+            }
+            catch (...) {
+                return reply.error("ERR value is not an integer or out of range");
+            }
+            has_limit = true;
+            i += 2;
+        }
+        else {
+            return reply.error("ERR syntax error");
+        }
+    }
+    if (by_score && by_lex) {
+        return reply.error("ERR syntax error");
+    }
+    if (has_limit && !by_score && !by_lex) {
+        return reply.error("ERR syntax error, LIMIT is only supported in combination with either BYSCORE or BYLEX");
+    }
+    if (by_lex && with_scores) {
+        return reply.error("ERR syntax error, WITHSCORES not supported in combination with BYLEX");
+    }
+
+    // REV takes its bounds high first.
+    const string& low_text = args[rev ? 3 : 2].get_string_value();
+    const string& high_text = args[rev ? 2 : 3].get_string_value();
+    ZRangeBound low, high;
+    int64_t start = 0, stop = 0;
+    if (by_score) {
+        if (!parse_score_bound(low_text, low) || !parse_score_bound(high_text, high)) {
+            return reply.error("ERR min or max is not a float");
+        }
+    }
+    else if (by_lex) {
+        if (!parse_lex_bound(low_text, low) || !parse_lex_bound(high_text, high)) {
+            return reply.error("ERR min or max not valid string range item");
+        }
+    }
+    else {
+        try {
+            start = stoll(args[2].get_string_value());
+            stop = stoll(args[3].get_string_value());
+        }
+        catch (...) {
+            return reply.error("ERR value is not an integer or out of range");
+        }
+    }
+
+    StoreLock lock(ZSET_STORE_LOCK);
+    auto it = keyspace->zsets.find(args[1].get_string_value());
+    if (it == keyspace->zsets.end()) {
+        return reply.array(0);
+    }
+    const ZSetValue& zset = it->second;
+    int64_t size = zset.size();
+
+    // Work out the ascending rank range [first, last) to return.
+    int64_t first, last;
+    if (by_score || by_lex) {
+        first = zset_count_below(zset, low, by_lex);
+        last = max(first, (int64_t)zset_count_through(zset, high, by_lex));
+        if (offset < 0) {
+            return reply.array(0);
+        }
+        int64_t available = max<int64_t>(0, last - first - offset);
+        int64_t taken = limit < 0 ? available : min(limit, available);
+        if (rev) {
+            last -= offset;
+            first = last - taken;
+        }
+        else {
+            first += offset;
+            last = first + taken;
+        }
+    }
+    else {
+        if (start < 0) start += size;
+        if (stop < 0) stop += size;
+        start = max<int64_t>(start, 0);
+        stop = min(stop, size - 1);
+        if (start > stop) {
+            return reply.array(0);
+        }
+        first = rev ? size - 1 - stop : start;
+        last = rev ? size - start : stop + 1;
+    }
+    if (first >= last) {
+        return reply.array(0);
+    }
+
+    vector<const ZEntry*> entries;
+    entries.reserve(last - first);
+    zset.for_range(first, last, [&](const ZEntry& entry) { entries.push_back(&entry); });
+    if (rev) {
+        reverse(entries.begin(), entries.end());
+    }
+
+    reply.array(entries.size() * (with_scores ? 2 : 1));
+    for (const ZEntry* entry : entries) {
+        reply_zentry(reply, *entry, with_scores);
+    }
+}
+
+void handle_zrank(const vector<RESPObject>& args, Reply& reply) {
+    bool with_score = args.size() == 4;
+    if (args.size() != 3 && !with_score) {
+        return reply.error("ERR wrong number of arguments for 'zrank'");
+    }
+    if (with_score) {
+        string option = args[3].get_string_value();
+        for (auto& c : option) c = toupper(c);
+        if (option != "WITHSCORE") {
+            return reply.error("ERR syntax error");
+        }
+    }
+
+    StoreLock lock(ZSET_STORE_LOCK);
+    auto it = keyspace->zsets.find(args[1].get_string_value());
+    const string& member = args[2].get_string_value();
+    int64_t rank = it == keyspace->zsets.end() ? -1 : it->second.rank(member);
+    if (rank < 0) {
+        return with_score ? reply.null_array() : reply.null_bulk();
+    }
+    if (!with_score) {
+        return reply.integer(rank);
+    }
+    double score = 0;
+    it->second.get_score(member, score);
+    reply.array(2);
+    reply.integer(rank);
+    reply.bulk(format_score(score));
+}
+
+void handle_zscore(const vector<RESPObject>& args, Reply& reply) {
+    if (args.size() != 3) {
+        return reply.error("ERR wrong number of arguments for 'zscore'");
+    }
+
+    StoreLock lock(ZSET_STORE_LOCK);
+    auto it = keyspace->zsets.find(args[1].get_string_value());
+    double score;
+    if (it == keyspace->zsets.end() || !it->second.get_score(args[2].get_string_value(), score)) {
+        return reply.null_bulk();
+    }
+    reply.bulk(format_score(score));
+}
+
+void handle_zcard(const vector<RESPObject>& args, Reply& reply) {
+    if (args.size() != 2) {
+        return reply.error("ERR wrong number of arguments for 'zcard'");
+    }
+
+    StoreLock lock(ZSET_STORE_LOCK);
+    auto it = keyspace->zsets.find(args[1].get_string_value());
+    return reply.integer(it == keyspace->zsets.end() ? 0 : it->second.size());
+}
+
+void handle_zrem(const vector<RESPObject>& args, Reply& reply) {
+    if (args.size() < 3) {
+        return reply.error("ERR wrong number of arguments for 'zrem'");
+    }
+
+    const string& key = args[1].get_string_value();
+    int64_t removed = 0;
+    {
+        StoreLock lock(ZSET_STORE_LOCK);
+        auto it = keyspace->zsets.find(key);
+        if (it == keyspace->zsets.end()) {
+            return reply.integer(0);
+        }
+        for (size_t i = 2; i < args.size(); ++i) {
+            removed += it->second.erase(args[i].get_string_value());
+        }
+        if (it->second.size() == 0) {
+            keyspace->zsets.erase(key);
+        }
+        if (removed > 0) {
+            touch_key(key);
+            propagate_command(args);
+        }
+    }
+
+    return reply.integer(removed);
+}
+
+// Pops up to count lowest entries of key. The caller holds the zset lock.
+static vector<ZEntry> zset_pop_min(const string& key, int64_t count) {
+    vector<ZEntry> popped;
+    auto it = keyspace->zsets.find(key);
+    if (it == keyspace->zsets.end()) {
+        return popped;
+    }
+    for (int64_t i = 0; i < count && it->second.size() > 0; ++i) {
+        popped.push_back(it->second.pop_min());
+    }
+    if (it->second.size() == 0) {
+        keyspace->zsets.erase(key);
+    }
+    return popped;
+}
+
+void handle_zpopmin(const vector<RESPObject>& args, Reply& reply) {
+    if (args.size() != 2 && args.size() != 3) {
+        return reply.error("ERR wrong number of arguments for 'zpopmin'");
+    }
+
+    int64_t count = 1;
+    if (args.size() == 3) {
+        try {
+            count = stoll(args[2].get_string_value());
+        }
+        catch (...) {
+            return reply.error("ERR value is not an integer or out of range");
+        }
+        if (count < 0) {
+            return reply.error("ERR value is out of range, must be positive");
+        }
+    }
+
+    const string& key = args[1].get_string_value();
+    vector<ZEntry> popped;
+    {
+        StoreLock lock(ZSET_STORE_LOCK);
+        popped = zset_pop_min(key, count);
+        if (!popped.empty()) {
+            touch_key(key);
+            propagate_command(args);
+        }
+    }
+
+    reply.array(popped.size() * 2);
+    for (const ZEntry& entry : popped) {
+        reply_zentry(reply, entry, true);
+    }
+}
+
+void handle_bzpopmin(const vector<RESPObject>& args, Reply& reply) {
+    if (args.size() < 3) {
+        return reply.error("ERR wrong number of arguments for 'bzpopmin'");
+    }
+
+    double timeout;
+    if (!parse_score(args.back().get_string_value(), timeout) || isinf(timeout)) {
+        return reply.error("ERR timeout is not a float or out of range");
+    }
+    if (timeout < 0) {
+        return reply.error("ERR timeout is negative");
+    }
+
+    steady_clock::time_point end_time = timeout == 0 ? steady_clock::time_point::max()
+        : steady_clock::now() + milliseconds(static_cast<int64_t>(timeout * 1000));
+
+    StoreLock lock(ZSET_STORE_LOCK);
+
+    while (true) {
+        for (size_t i = 1; i + 1 < args.size(); ++i) {
+            const string& key = args[i].get_string_value();
+            vector<ZEntry> popped = zset_pop_min(key, 1);
+            if (popped.empty()) {
+                continue;
+            }
+            touch_key(key);
+            propagate_command({RESPObject(RESPType::BulkString, "ZPOPMIN"), args[i]});
+
+            reply.array(3);
+            reply.bulk(key);
+            return reply_zentry(reply, popped[0], true);
+        }
+
+        if (block_slot) {
+            // An event loop, or EXEC: park until one of the keys is written.
+            vector<string> keys;
+            for (size_t i = 1; i + 1 < args.size(); ++i) {
+                keys.push_back(args[i].get_string_value());
+            }
+            if (!block_on_keys(std::move(keys), end_time)) {
+                return reply.null_array();
+            }
+            return;
+        }
+
+        // Inside a batch that already holds the zset lock we cannot wait on zset_cv.
+        if (!lock.owns_lock() || steady_clock::now() >= end_time) {
+            return reply.null_array();
+        }
+
+        if (timeout == 0) {
+            keyspace->zset_cv.wait(lock.get(), [&] { return keyspace->zset_updated; });
+        }
+        else if (!keyspace->zset_cv.wait_until(lock.get(), end_time, [&] { return keyspace->zset_updated; })) {
+            return reply.null_array();
+        }
+        keyspace->zset_updated = false;
+    }
+}
+
+void handle_rpush(const vector<RESPObject> & args, Reply& reply) {
+    if(args.size() < 3){
+        return reply.error("ERR wrong number of arguments for 'rpush'");
+    }
+
+    string key = args[1].get_string_value();
+    vector<string> values;
+
+    for(size_t i = 2; i < args.size(); ++i) {
+        if(args[i].get_type() != RESPType::BulkString && args[i].get_type() != RESPType::SimpleString) {
+            return reply.error("ERR invalid argument type");
+        }
+        values.push_back(args[i].get_string_value());
+    }
+
+    StoreLock lock(LIST_STORE_LOCK);
+    for(auto &vals:values) {
+        keyspace->lists[key].push_back(vals);
+    }
+
+    keyspace->list_updated = true;
+    keyspace->list_cv.notify_all();
+    signal_key_ready(key);
+    touch_key(key);
+    propagate_command(args);
+
+    reply.integer(keyspace->lists[key].size());
+}
+
+void handle_lpush(const vector<RESPObject> & args, Reply& reply) {
+    if(args.size() < 3){
+        return reply.error("ERR wrong number of arguments for 'lpush'");
+    }
+
+    string key = args[1].get_string_value();
+    vector<string> values;
+
+    for(size_t i = 2; i < args.size(); ++i) {
+        if(args[i].get_type() != RESPType::BulkString && args[i].get_type() != RESPType::SimpleString) {
+            return reply.error("ERR invalid argument type");
+        }
+        values.push_back(args[i].get_string_value());
+    }
+
+    StoreLock lock(LIST_STORE_LOCK);
+
+    for(auto &vals:values) {
+        keyspace->lists[key].push_front(vals);
+    }
+
+    keyspace->list_updated = true;
+    keyspace->list_cv.notify_all();
+    signal_key_ready(key);
+    touch_key(key);
+    propagate_command(args);
+
+    reply.integer(keyspace->lists[key].size());
+}
+
+void handle_lrange(const vector<RESPObject> & args, Reply& reply) {
+    if(args.size() != 4){
+        return reply.error("ERR wrong number of arguments for 'lrange'");
+    }
+
+    string key = args[1].get_string_value();
+    int64_t start, end;
+
+    try {
+        start = stoll(args[2].get_string_value());
+        end = stoll(args[3].get_string_value());
+    } catch (...) {
+        return reply.error("ERR invalid range values");
+    }
+
+    StoreLock lock(LIST_STORE_LOCK);
+    
+    auto it = keyspace->lists.find(key);
+    if(it == keyspace->lists.end() || it->second.empty()){
+        return reply.array(0);
+    }
+
+    const ListValue& list = it->second;
+    
+    if(start < 0) start += list.size();
+    if(end < 0) end += list.size();
+    if(start < 0) start = 0;
+    if(end >= list.size()) end = list.size() - 1;
+    if(start > end || start >= list.size()) {
+        return reply.array(0);
+    }
+    
+
+    size_t reply_size = 16;
+    for(int64_t i = start; i <= end; ++i) {
+        reply_size += Reply::bulk_size(list[i].size());
+    }
+    reply.reserve(reply_size);
+
+    reply.array(end - start + 1);
+    for(int64_t i = start; i <= end; ++i) {
+        reply.bulk(list[i]);
+    }
+}
+
+void handle_lpop(const vector<RESPObject> & args, Reply& reply) {
+    if(args.size() != 2 && args.size() != 3){
+        return reply.error("ERR wrong number of arguments for 'lpop'");
+    }
+
+    string key = args[1].get_string_value();
+
+    // With a count the reply is always an array, empty when there is nothing
+    // to pop.
+    bool has_count = args.size() == 3;
+    int64_t num_items_to_remove = 1;
+    if(has_count) {
+        try{
+            num_items_to_remove = stoll(args[2].get_string_value());
+            if(num_items_to_remove < 0) {
+                return reply.error("ERR count must be a non-negative integer");
+            }
+        } 
+        catch(...){
+            return reply.error("ERR invalid count value");
+        }
+    }
+
+    StoreLock lock(LIST_STORE_LOCK);
+    
+    auto it = keyspace->lists.find(key);
+    if(it == keyspace->lists.end() || it->second.empty()){
+        if(has_count) {
+            return reply.array(0);
+        }
+        return reply.null_bulk();
+    }
+
+    vector<string> values;
+    for(int64_t i = 0; i < num_items_to_remove && !it->second.empty(); ++i) {
+        values.push_back(it->second.front());
+        it->second.pop_front();
+    }
+
+    if(it->second.empty()){
+        keyspace->lists.erase(it);
+    }
+
+    if(!values.empty()) {
+        touch_key(key);
+        propagate_command(args);
+    }
+
+    if(!has_count) {
+        return reply.bulk(values[0]);
+    }
+    reply.array(values.size());
+    for(auto &val : values) {
+        reply.bulk(val);
+    }
+}
+
+void handle_llen(const vector<RESPObject> & args, Reply& reply) {
+    if(args.size() != 2){
+        return reply.error("ERR wrong number of arguments for 'llen'");
+    }
+
+    string key = args[1].get_string_value();
+
+    StoreLock lock(LIST_STORE_LOCK);
+    
+    auto it = keyspace->lists.find(key);
+    if(it == keyspace->lists.end()){
+        return reply.integer(0);
+    }
+
+    int length = it->second.size();
+    return reply.integer(length);
+}
+
+void handle_blpop(const vector<RESPObject> & args, Reply& reply) {     
+    if(args.size() != 3){         
+        return reply.error("ERR wrong number of arguments for 'blpop'");     
+    }          
+    
+    string key = args[1].get_string_value();     
+    double timeout;     
+    try {         
+        timeout = stod(args[2].get_string_value());     
+    } catch (...) {         
+        return reply.error("ERR invalid timeout value");     
+    }          
+    
+    if(timeout < 0) {         
+        return reply.error("ERR timeout must be a non-negative number");     
+    }      
+    
+    steady_clock::time_point end_time;     
+    if(timeout == 0) {         
+        end_time = steady_clock::time_point::max();      
+    } else {         
+        end_time = steady_clock::now() + milliseconds(static_cast<int64_t>(timeout * 1000));     
+    }      
+    
+    StoreLock lock(LIST_STORE_LOCK);          
+    
+    while(true) {         
+        auto it = keyspace->lists.find(key);         
+        if(it != keyspace->lists.end() && !it->second.empty()) {             
+            string value = it->second.front();             
+            it->second.pop_front();             
+            if(it->second.empty()) {                 
+                keyspace->lists.erase(it);             
+            }                          
+            touch_key(key);
+            propagate_command({RESPObject(RESPType::BulkString, "LPOP"), args[1]});
+            
+            reply.array(2);
+            reply.bulk(key);
+            return reply.bulk(value);
+        }                  
+        
+        if (steady_clock::now() >= end_time) {             
+            return reply.null_array(); // Timeout - null array        
+        }          
+
+        if (block_slot) {
+            // An event loop, or EXEC: park until the list is pushed to.
+            if (!block_on_keys({key}, end_time)) {
+                return reply.null_array();
+            }
+            return;
+        }
+
+        // Inside a batch that already holds the list lock we cannot wait on list_cv.
+        if (!lock.owns_lock()) {
+            return reply.null_array();
+        }
+        
+        if (timeout == 0) {             
+            keyspace->list_cv.wait(lock.get(), [&] { return keyspace->list_updated; });         
+        } else {             
+            auto now = steady_clock::now();             
+            if (now >= end_time) {
+                return reply.null_array(); // Timeout - null array
+            }
+            auto time_left = end_time - now;             
+            bool signaled = keyspace->list_cv.wait_for(lock.get(), time_left, [&] { return keyspace->list_updated; });             
+            if (!signaled) {                 
+                return reply.null_array(); // Timeout - null array            
+            }         
+        }                  
+        
+        keyspace->list_updated = false;     
+    } 
+}
+
+void handle_type(const vector<RESPObject>& args, Reply& reply) {
+    if(args.size() != 2){
+        return reply.error("ERR wrong number of arguments for 'type'");
+    }
+
+    string key = args[1].get_string_value();
+
+    StoreBatchLock lock(ALL_STORE_LOCKS);
+    
+    if(keyspace->strings.find(key) != keyspace->strings.end()){
+        return reply.simple("string");
+    }
+
+    if(keyspace->lists.find(key) != keyspace->lists.end()){
+        return reply.simple("list");
+    }
+
+    if(keyspace->streams.find(key) != keyspace->streams.end()){
+        return reply.simple("stream");
+    }
+
+    if(keyspace->hashes.find(key) != keyspace->hashes.end()){
+        return reply.simple("hash");
+    }
+
+    if(keyspace->zsets.find(key) != keyspace->zsets.end()){
+        return reply.simple("zset");
+    }
+
+    return reply.simple("none"); 
+}
+
+// Writes one stream entry as [id, [field, value, ...]].
+static void reply_stream_entry(Reply& reply, const StreamEntry& entry) {
+    reply.array(2);
+    reply.bulk(entry.id);
+    reply.array(entry.fields.size() * 2);
+    for (const auto& field : entry.fields) {
+        reply.bulk(field.first);
+        reply.bulk(field.second);
+    }
+}
+
+static size_t stream_entries_reply_size(const vector<const StreamEntry*>& entries) {
+    size_t size = 16;
+    for (const StreamEntry* entry : entries) {
+        size += 32 + Reply::bulk_size(entry->id.size());
+        for (const auto& field : entry->fields) {
+            size += Reply::bulk_size(field.first.size()) + Reply::bulk_size(field.second.size());
+        }
+    }
+    return size;
+}
+
+void handle_xadd(const vector<RESPObject>& args, Reply& reply) {
+    if (args.size()<4 || (args.size()-3)%2!=0) {
+        return reply.error("ERR wrong number of arguments for 'xadd'");
+    }
+
+    string key = args[1].get_string_value();
+    string id = args[2].get_string_value();
+
+    string last_timestamp_str="0";
+    string last_sequence_str="0";
+
+    {
+        StoreLock lock(STREAM_STORE_LOCK);
+        auto stream_it = keyspace->streams.find(key);
+        if (stream_it != keyspace->streams.end() && !stream_it->second.empty()) {
+            const auto& last_entry = stream_it->second.back();
+            string last_id = last_entry.id;
+            size_t last_separator_pos = last_id.find('-');
+            if (last_separator_pos != string::npos) {
+                last_timestamp_str = last_id.substr(0, last_separator_pos);
+                last_sequence_str = last_id.substr(last_separator_pos + 1);
+            }
+        }
+    }
+
+    if (id == "*") {
+        auto now = system_clock::now();
+        auto ms = duration_cast<milliseconds>(now.time_since_epoch()).count();
+        string timestamp_str = to_string(ms);
+
+        if (timestamp_str == last_timestamp_str) {
+            int64_t seq = stoll(last_sequence_str);
+            id = timestamp_str + "-" + to_string(seq + 1);
+        } else {
+            id = timestamp_str + "-0";
+        }
+    }
+
+    // validating id (each id has two parts: timestamp and sequence number)
+    // the timestamp part should be greater than last entry's timestamp
+    // If the millisecondsTime part of the ID is equal to the millisecondsTime of the last entry,
+    // the sequenceNumber part of the ID should be greater than the sequenceNumber of the last entry.
+    // If the stream is empty, the ID should be greater than 0-0
+
+    size_t separator_pos = id.find('-');
+    if (separator_pos == string::npos) {
+        return reply.error("ERR invalid ID format");
+    }
+
+    string timestamp_str = id.substr(0, separator_pos);
+    string sequence_str = id.substr(separator_pos + 1);
+
+    if (sequence_str == "*"){
+        if (last_timestamp_str == timestamp_str) {
+            int64_t last_sequence = stoll(last_sequence_str);
+            sequence_str = to_string(last_sequence + 1);
+        }
+        else{
+            sequence_str = "0";
+        }
+
+        id = timestamp_str + "-" + sequence_str;
+
+    }
+
+    int64_t timestamp = stoll(timestamp_str);
+    int64_t sequence = stoll(sequence_str);
+
+    int64_t last_timestamp = stoll(last_timestamp_str);
+    int64_t last_sequence = stoll(last_sequence_str);
+    
+    if(timestamp <=0 and sequence <= 0) {
+        return reply.error("ERR The ID specified in XADD must be greater than 0-0");
+    }
+
+        
+    if(timestamp < last_timestamp || (timestamp == last_timestamp && sequence <= last_sequence)){
+        return reply.error("ERR The ID specified in XADD is equal or smaller than the target stream top item");
+    }
+    
+
+    StreamFields fields;
+
+    for(int64_t i=3;i<args.size();i+=2) {
+        if(i+1 >= args.size()) {
+            return reply.error("ERR wrong number of arguments for 'xadd'");
+        }
+        if(args[i].get_type() != RESPType::BulkString && args[i].get_type() != RESPType::SimpleString) {
+            return reply.error("ERR invalid field name type");
+        }
+        if(args[i + 1].get_type() != RESPType::BulkString && args[i + 1].get_type() != RESPType::SimpleString) {
+            return reply.error("ERR invalid field value type");
+        }
+        fields[args[i].get_string_value()] = args[i + 1].get_string_value();
+    }
+
+    {
+        StoreLock lock(STREAM_STORE_LOCK);
+        keyspace->streams[key].push_back({id, fields});
+        keyspace->stream_updated = true;
+        keyspace->stream_cv.notify_all();
+        signal_key_ready(key);
+
+        // Replicas must store the ID generated here, not re-generate it.
+        vector<RESPObject> replicated_args = args;
+        replicated_args[2] = RESPObject(RESPType::BulkString, id);
+        touch_key(key);
+        propagate_command(replicated_args);
+    }
+    
+
+    reply.bulk(id);
+}
+
+void handle_xrange(const vector<RESPObject>& args, Reply& reply) {
+    if (args.size() != 4 && args.size() != 6) {
+        return reply.error("ERR wrong number of arguments for 'xrange'");
+    }
+
+    string key = args[1].get_string_value();
+    string start_id = args[2].get_string_value();
+    string end_id = args[3].get_string_value();
+
+    if (start_id == "-") start_id = "0";
+    if (end_id == "+") end_id = "9999999999999-9999999999999"; 
+
+    // COUNT lets a client page through a large stream a bounded slice at a
+    // time, restarting each call just past the last ID it got.
+    size_t count = SIZE_MAX;
+    if (args.size() == 6) {
+        string option = args[4].get_string_value();
+        for (auto& c : option) c = toupper(c);
+        if (option != "COUNT") {
+            return reply.error("ERR syntax error");
+        }
+        try {
+            long long parsed = stoll(args[5].get_string_value());
+            count = parsed < 0 ? 0 : parsed;
+        }
+        catch (...) {
+            return reply.error("ERR value is not an integer or out of range");
+        }
+    }
+
+    StoreLock lock(STREAM_STORE_LOCK);
+    
+    auto it = keyspace->streams.find(key);
+    if (it == keyspace->streams.end()) {
+        return reply.array(0); 
+    }
+
+    const StreamValue& stream = it->second;
+    vector<const StreamEntry*> result;
+
+    for (const auto& entry : stream) {
+        if (result.size() >= count) {
+            break;
+        }
+
+        // size_t separator_pos = entry.id.find('-');
+        // string entry_timestamp = entry.id.substr(0, separator_pos);
+        if (entry.id >= start_id && entry.id <= end_id) {
+            result.push_back(&entry);
+        }
+
+    }
+
+    reply.reserve(stream_entries_reply_size(result));
+    reply.array(result.size());
+    for (const StreamEntry* entry : result) {
+        reply_stream_entry(reply, *entry);
+    }
+}
+
+void handle_xread(const vector<RESPObject>& args, Reply& reply) {
+
+    if(args.size()<3){
+        return reply.error("ERR wrong number of arguments for 'xread'");
+    }
+
+    int64_t block_ms = -1;
+    int64_t index = 1;
+
+    if(args[1].get_string_value() == "block"){
+        if(args.size()<5){
+            return reply.error("ERR wrong number of arguments for 'xread' with BLOCK");
+        }
+        try{
+            block_ms = stoll(args[2].get_string_value());
+            if(block_ms < 0){
+                return reply.error("ERR timeout is negative");
+            }
+        } 
+        catch(...){
+            return reply.error("ERR timeout is not an integer or out of range");
+        }
+        if(args[3].get_string_value() != "streams"){
+            return reply.error("ERR syntax error near 'STREAMS'");
+        }
+        index = 4;
+    } 
+    else if(args[1].get_string_value() == "streams"){
+        index = 2;
+    }
+    else{
+        return reply.error("ERR syntax error near '" + args[1].get_string_value() + "'");
+    }
+
+    int64_t num_keys = (args.size() - index) / 2;
+    if((args.size() - index)%2 != 0 || num_keys<=0){
+        return reply.error("ERR wrong number of arguments for 'xread'");
+    }
+    vector<string> keys;
+    vector<string> ids;
+    vector<string> effective_ids; 
+
+    for(int64_t i=0;i<num_keys;i++){
+        const auto& key_arg = args[index + i];
+        const auto& id_arg = args[index + num_keys + i];
+
+        if((key_arg.get_type() != RESPType::BulkString && key_arg.get_type() != RESPType::SimpleString) ||
+            (id_arg.get_type() != RESPType::BulkString && id_arg.get_type() != RESPType::SimpleString)){
+            return reply.error("ERR invalid key or ID type");
+        }
+
+        keys.push_back(key_arg.get_string_value());
+        string id_str = id_arg.get_string_value();
+        ids.push_back(id_str);
+        
+        if(id_str == "$"){
+            auto it = keyspace->streams.find(key_arg.get_string_value());
+            if(it != keyspace->streams.end() && !it->second.empty()){
+                effective_ids.push_back(it->second.back().id);
+            }
+            else{
+                effective_ids.push_back("0-0");
+            }
+        } 
+        else{
+            effective_ids.push_back(id_str);
+        }
+    }
+    
+    if(keys.size() != ids.size()){
+        return reply.error("ERR keys and IDs count mismatch");
+    }
+
+    
+    StoreLock lock(STREAM_STORE_LOCK);
+
+    // Writes the reply and returns true if any stream has entries past its ID.
+    auto reply_with_matches = [&]() -> bool {
+        vector<pair<size_t, vector<const StreamEntry*>>> matches;
+
+        for(size_t i = 0; i < keys.size(); i++){
+            const string& key = keys[i];
+            const string& min_id = effective_ids[i]; 
+
+            auto it = keyspace->streams.find(key);
+            if(it == keyspace->streams.end()){
+                continue;
+            }
+
+            const StreamValue& stream = it->second;
+            vector<const StreamEntry*> matching_entries;
+            for(const auto& entry : stream){
+                
+                if(entry.id > min_id){
+                    matching_entries.push_back(&entry);
+                }
+            }
+
+            if(!matching_entries.empty()){
+                matches.emplace_back(i, std::move(matching_entries));
+            }
+        }
+
+        if(matches.empty()){
+            return false;
+        }
+
+        size_t reply_size = 16;
+        for(const auto& match : matches){
+            reply_size += Reply::bulk_size(keys[match.first].size()) + stream_entries_reply_size(match.second);
+        }
+        reply.reserve(reply_size);
+
+        reply.array(matches.size());
+        for(const auto& match : matches){
+            reply.array(2);
+            reply.bulk(keys[match.first]);
+            reply.array(match.second.size());
+            for(const StreamEntry* entry : match.second){
+                reply_stream_entry(reply, *entry);
+            }
+        }
+        return true;
+    };
+
+    // For $ IDs with blocking, we need to update effective_ids when blocking starts
+    // to ensure we only get entries added after the blocking begins
+    auto update_dollar_ids = [&]() {
+        for(size_t i = 0; i < keys.size(); i++){
+            if(ids[i] == "$"){
+                const string& key = keys[i];
+                auto it = keyspace->streams.find(key);
+                if(it != keyspace->streams.end() && !it->second.empty()){
+                    // Update to the current last entry ID
+                    effective_ids[i] = it->second.back().id;
+                }
+                else{
+                    // Keep "0-0" if stream still doesn't exist or is empty
+                    effective_ids[i] = "0-0";
+                }
+            }
+        }
+    };
+
+    if(reply_with_matches()){
+        return;
+    }
+
+    if(block_ms >= 0 && block_slot){
+        // An event loop, or EXEC: park until a stream is written. The command
+        // that runs then has $ replaced by the last ID as of now.
+        update_dollar_ids();
+        vector<RESPObject> retry(args.begin(), args.begin() + index);
+        for(const string& key : keys){
+            retry.emplace_back(RESPType::BulkString, key);
+        }
+        for(const string& id : effective_ids){
+            retry.emplace_back(RESPType::BulkString, id);
+        }
+        auto deadline = block_ms == 0 ? steady_clock::time_point::max() : steady_clock::now() + milliseconds(block_ms);
+        if(!block_on_keys(keys, deadline, std::move(retry))){
+            return reply.null_bulk();
+        }
+        return;
+    }
+
+    if(block_ms < 0 || !lock.owns_lock()){
+        return reply.null_bulk(); 
+    }
+
+    // Update $ IDs to current state before starting to block
+    update_dollar_ids();
+
+    if(block_ms == 0){
+        while(true){
+            keyspace->stream_cv.wait(lock.get(), [&] {
+                return keyspace->stream_updated;
+            });
+            
+            keyspace->stream_updated = false;
+            
+            if (reply_with_matches()) {
+                return;
+            }
+        }
+    } 
+    else{
+        auto timeout = milliseconds(block_ms);
+        auto start = steady_clock::now();
+
+        while(steady_clock::now() - start < timeout){
+            auto remaining_time = timeout - duration_cast<milliseconds>(steady_clock::now() - start);
+            
+            bool success = keyspace->stream_cv.wait_for(lock.get(), remaining_time, [&] {
+                return keyspace->stream_updated;
+            });
+
+            if(!success){
+                return reply.null_bulk();
+            }
+
+            keyspace->stream_updated = false;
+
+            if(reply_with_matches()){
+                return;
+            }
+        }
+        
+        return reply.null_bulk();
+    }
+    
+    return reply.null_bulk();
+}
+
+// Resident set size of the process, from /proc.
+static size_t resident_memory_bytes() {
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if(!statm){
+        return 0;
+    }
+    unsigned long pages = 0, resident = 0;
+    if(fscanf(statm, "%lu %lu", &pages, &resident) != 2){
+        resident = 0;
+    }
+    fclose(statm);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void append_replication_info(string& body, const vector<pair<string, string>>& replica_info) {
+    bool is_replica = false;
+    for(const auto& info : replica_info){
+        if(info.first == "role" && info.second == "slave"){
+            is_replica = true;
+        }
+    }
+
+    body += "# Replication\r\n";
+    for(const auto& info : replica_info){
+        if(info.first == "master_repl_offset"){
+            int64_t offset = is_replica ? replica_repl_offset.load() : master_repl_offset.load();
+            body += info.first + ":" + to_string(offset) + "\r\n";
+            continue;
+        }
+        body += info.first + ":" + info.second + "\r\n";
+    }
+
+    if(is_replica){
+        int64_t now_ms = duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+        int64_t last_io_ms = replica_last_io_ms.load();
+        int64_t read_offset = replica_read_offset.load();
+        int64_t applied_offset = replica_repl_offset.load();
+        body += "master_link_status:" + string(replica_link_up ? "up" : "down") + "\r\n";
+        body += "master_last_io_seconds_ago:" + to_string(last_io_ms ? (now_ms - last_io_ms) / 1000 : -1) + "\r\n";
+        body += "slave_read_repl_offset:" + to_string(read_offset) + "\r\n";
+        body += "slave_repl_offset:" + to_string(applied_offset) + "\r\n";
+        body += "slave_repl_lag_bytes:" + to_string(read_offset - applied_offset) + "\r\n";
+    }
+    else{
+        append_master_replication_info(body);
+    }
+}
+
+static void append_memory_info(string& body) {
+    SlabStats slabs = slab_stats();
+    char ratio[32];
+    snprintf(ratio, sizeof(ratio), "%.2f", slabs.allocated_bytes ? (double)slabs.active_bytes / slabs.allocated_bytes : 1.0);
+    body += "# Memory\r\n";
+    body += "used_memory_rss:" + to_string(resident_memory_bytes()) + "\r\n";
+    body += "allocator_allocated:" + to_string(slabs.allocated_bytes) + "\r\n";
+    body += "allocator_active:" + to_string(slabs.active_bytes) + "\r\n";
+    body += "allocator_mapped:" + to_string(slabs.mapped_bytes) + "\r\n";
+    body += "allocator_frag_ratio:" + string(ratio) + "\r\n";
+    body += "allocator_frag_bytes:" + to_string(slabs.active_bytes - slabs.allocated_bytes) + "\r\n";
+    body += "active_defrag_running:" + to_string(active_defrag_running ? 1 : 0) + "\r\n";
+    body += "active_defrag_hits:" + to_string(active_defrag_hits.load()) + "\r\n";
+    body += "lazyfree_pending_objects:" + to_string(lazyfree_pending_objects.load()) + "\r\n";
+    body += "lazyfreed_objects:" + to_string(lazyfreed_objects.load()) + "\r\n";
+}
+
+static void append_keyspace_info(string& body) {
+    size_t keys, expires;
+    count_keys(keys, expires);
+    body += "# Keyspace\r\n";
+    if(keys > 0){
+        body += "db0:keys=" + to_string(keys) + ",expires=" + to_string(expires) + ",avg_ttl=0\r\n";
+    }
+}
+
+void handle_info(const vector<RESPObject>& args, const vector<pair<string, string>>& replica_info, Reply& reply) {
+    // With no argument, or "default", every section but the per-command ones.
+    enum { REPLICATION = 1, MEMORY = 2, STATS = 4, COMMANDSTATS = 8, LATENCYSTATS = 16, KEYSPACE = 32, CLIENTS = 64,
+           HOTKEYS = 128 };
+    unsigned sections = 0;
+    for(size_t i = 1; i < args.size(); ++i){
+        string section = args[i].get_string_value();
+        transform(section.begin(), section.end(), section.begin(), ::tolower);
+        if(section == "replication") sections |= REPLICATION;
+        else if(section == "clients") sections |= CLIENTS;
+        else if(section == "memory") sections |= MEMORY;
+        else if(section == "stats") sections |= STATS;
+        else if(section == "commandstats") sections |= COMMANDSTATS;
+        else if(section == "latencystats") sections |= LATENCYSTATS;
+        else if(section == "keyspace") sections |= KEYSPACE;
+        else if(section == "hotkeys") sections |= HOTKEYS;
+        else if(section == "default") sections |= REPLICATION | CLIENTS | MEMORY | STATS | KEYSPACE;
+        else if(section == "all" || section == "everything") sections |= ~0u;
+    }
+    if(args.size() == 1){
+        sections = REPLICATION | CLIENTS | MEMORY | STATS | KEYSPACE;
+    }
+
+    string body;
+    auto next_section = [&](unsigned section) {
+        if(!(sections & section)){
+            return false;
+        }
+        if(!body.empty()){
+            body += "\r\n";
+        }
+        return true;
+    };
+    if(next_section(REPLICATION)) append_replication_info(body, replica_info);
+    if(next_section(CLIENTS)){
+        append_clients_info(body);
+        append_tracking_info(body);
+    }
+    if(next_section(MEMORY)) append_memory_info(body);
+    if(next_section(STATS)) append_stats_info(body);
+    if(next_section(COMMANDSTATS)) append_commandstats_info(body);
+    if(next_section(LATENCYSTATS)) append_latencystats_info(body);
+    if(next_section(KEYSPACE)) append_keyspace_info(body);
+    if(next_section(HOTKEYS)) append_hotkeys_info(body);
+    reply.bulk(body);
+}
+
+void handle_memory(const vector<RESPObject>& args, Reply& reply) {
+    if(args.size() < 2){
+        return reply.error("ERR wrong number of arguments for 'memory' command");
+    }
+    string subcommand = args[1].get_string_value();
+    transform(subcommand.begin(), subcommand.end(), subcommand.begin(), ::toupper);
+    if(subcommand == "USAGE" && (args.size() == 3 || args.size() == 5)){
+        size_t samples = MEMORY_USAGE_SAMPLES;
+        if(args.size() == 5){
+            string option = args[3].get_string_value();
+            transform(option.begin(), option.end(), option.begin(), ::toupper);
+            if(option != "SAMPLES"){
+                return reply.error("ERR syntax error");
+            }
+            long long parsed;
+            try{
+                parsed = stoll(args[4].get_string_value());
+            }
+            catch(...){
+                return reply.error("ERR value is not an integer or out of range");
+            }
+            if(parsed < 0){
+                return reply.error("ERR syntax error");
+            }
+            samples = parsed;
+        }
+
+        const string& key = args[2].get_string_value();
+        bool found = false;
+        size_t bytes = 0;
+        auto measure = [&](const auto& store) {
+            auto it = store.find(key);
+            if(!found && it != store.end()){
+                found = true;
+                bytes = key_memory_usage(*it, samples);
+            }
+        };
+        {
+            StoreBatchLock lock(ALL_STORE_LOCKS);
+            measure(keyspace->strings);
+            measure(keyspace->lists);
+            measure(keyspace->streams);
+            measure(keyspace->hashes);
+            measure(keyspace->zsets);
+        }
+        if(!found){
+            return reply.null_bulk();
+        }
+        return reply.integer(bytes);
+    }
+    if(subcommand == "STATS" && args.size() == 2){
+        MemoryStats stats = memory_stats();
+        SlabStats slabs = slab_stats();
+        size_t overhead = stats.hashtable_main + stats.hashtable_expires + stats.clients_normal +
+                          stats.clients_replicas + stats.replication_backlog;
+        char percentage[32];
+        snprintf(percentage, sizeof(percentage), "%.2f",
+                 stats.dataset_bytes + overhead ? 100.0 * stats.dataset_bytes / (stats.dataset_bytes + overhead) : 0.0);
+        vector<pair<const char*, size_t>> fields = {
+            {"keys.count", stats.keys},
+            {"keys.bytes-per-key", stats.keys ? (stats.dataset_bytes + stats.hashtable_main) / stats.keys : 0},
+            {"dataset.bytes", stats.dataset_bytes},
+            {"overhead.hashtable.main", stats.hashtable_main},
+            {"overhead.hashtable.expires", stats.hashtable_expires},
+            {"clients.normal", stats.clients_normal},
+            {"clients.slaves", stats.clients_replicas},
+            {"replication.backlog", stats.replication_backlog},
+            {"overhead.total", overhead},
+            {"allocator.allocated", slabs.allocated_bytes},
+            {"allocator.active", slabs.active_bytes},
+            {"process.rss", resident_memory_bytes()},
+        };
+        reply.array(fields.size() * 2 + 2);
+        for(const auto& field : fields){
+            reply.bulk(field.first);
+            reply.integer(field.second);
+        }
+        reply.bulk("dataset.percentage");
+        return reply.bulk(percentage);
+    }
+    reply.error("ERR unknown subcommand or wrong number of arguments for 'MEMORY " + args[1].get_string_value() + "'");
+}
+
+void handle_slowlog(const vector<RESPObject>& args, Reply& reply) {
+    if(args.size() < 2){
+        return reply.error("ERR wrong number of arguments for 'slowlog' command");
+    }
+    string subcommand = args[1].get_string_value();
+    transform(subcommand.begin(), subcommand.end(), subcommand.begin(), ::toupper);
+    if(subcommand == "LEN" && args.size() == 2){
+        return reply.integer(slowlog_len());
+    }
+    if(subcommand == "RESET" && args.size() == 2){
+        slowlog_reset();
+        return reply.simple("OK");
+    }
+    if(subcommand == "GET" && args.size() <= 3){
+        int64_t count = 10;
+        if(args.size() == 3){
+            try{
+                count = stoll(args[2].get_string_value());
+            }
+            catch(...){
+                return reply.error("ERR value is not an integer or out of range");
+            }
+            if(count < -1){
+                return reply.error("ERR count should be greater than or equal to -1");
+            }
+        }
+        vector<SlowlogEntry> entries = slowlog_get(count == -1 ? SIZE_MAX : (size_t)count);
+        reply.array(entries.size());
+        for(const SlowlogEntry& entry : entries){
+            reply.array(6);
+            reply.integer(entry.id);
+            reply.integer(entry.time);
+            reply.integer(entry.duration_us);
+            reply.array(entry.args.size());
+            for(const string& arg : entry.args){
+                reply.bulk(arg);
+            }
+            reply.bulk(entry.client_addr);
+            reply.bulk(entry.client_name);
+        }
+        return;
+    }
+    reply.error("ERR unknown subcommand or wrong number of arguments for 'SLOWLOG " + args[1].get_string_value() + "'");
+}
+
+void handle_latency(const vector<RESPObject>& args, Reply& reply) {
+    if(args.size() < 2){
+        return reply.error("ERR wrong number of arguments for 'latency' command");
+    }
+    string subcommand = args[1].get_string_value();
+    transform(subcommand.begin(), subcommand.end(), subcommand.begin(), ::toupper);
+    if(subcommand == "LATEST" && args.size() == 2){
+        vector<LatencyEventInfo> events = latency_latest();
+        reply.array(events.size());
+        for(const LatencyEventInfo& event : events){
+            reply.array(4);
+            reply.bulk(event.event);
+            reply.integer(event.latest.time);
+            reply.integer(event.latest.latency_ms);
+            reply.integer(event.max_ms);
+        }
+        return;
+    }
+    if(subcommand == "HISTORY" && args.size() == 3){
+        vector<LatencySample> samples = latency_history(args[2].get_string_value());
+        reply.array(samples.size());
+        for(const LatencySample& sample : samples){
+            reply.array(2);
+            reply.integer(sample.time);
+            reply.integer(sample.latency_ms);
+        }
+        return;
+    }
+    if(subcommand == "RESET"){
+        vector<string> events;
+        for(size_t i = 2; i < args.size(); ++i){
+            events.push_back(args[i].get_string_value());
+        }
+        return reply.integer(latency_reset(events));
+    }
+    reply.error("ERR unknown subcommand or wrong number of arguments for 'LATENCY " + args[1].get_string_value() + "'");
+}
+
+void handle_hotkeys(const vector<RESPObject>& args, Reply& reply) {
+    size_t count = HOTKEYS_TOP;
+    if(args.size() >= 2){
+        string subcommand = args[1].get_string_value();
+        transform(subcommand.begin(), subcommand.end(), subcommand.begin(), ::toupper);
+        if(subcommand == "RESET" && args.size() == 2){
+            hotkeys_reset();
+            return reply.simple("OK");
+        }
+        if(subcommand != "COUNT" || args.size() != 3){
+            return reply.error("ERR syntax error");
+        }
+        long long parsed;
+        try{
+            parsed = stoll(args[2].get_string_value());
+        }
+        catch(...){
+            return reply.error("ERR value is not an integer or out of range");
+        }
+        if(parsed < 1){
+            return reply.error("ERR count should be greater than 0");
+        }
+        count = parsed;
+    }
+    vector<HotKey> hot = hotkeys_top(count);
+    reply.array(hot.size());
+    for(const HotKey& entry : hot){
+        reply.array(2);
+        reply.bulk(entry.key);
+        reply.integer(entry.calls);
+    }
+}
+
+static bool parse_client_class(string name, ClientClass& cls) {
+    transform(name.begin(), name.end(), name.begin(), ::tolower);
+    if(name == "normal") cls = ClientClass::Normal;
+    else if(name == "replica" || name == "slave") cls = ClientClass::Replica;
+    else if(name == "pubsub") cls = ClientClass::PubSub;
+    else return false;
+    return true;
+}
+
+// CLIENT SETNAME and HELLO SETNAME. Returns false, having replied with the
+// error, if name has spaces or other characters Redis refuses.
+static bool set_client_name(ClientState& client, const string& name, Reply& reply) {
+    for(char c : name){
+        if(c < '!' || c > '~'){
+            reply.error("ERR Client names cannot contain spaces, newlines or special characters.");
+            return false;
+        }
+    }
+    if(client.info){
+        lock_guard<mutex> lock(client.info->name_mutex);
+        client.info->name = name;
+    }
+    return true;
+}
+
+// CLIENT TRACKING ON|OFF [REDIRECT id] [BCAST] [PREFIX prefix ...] [NOLOOP]
+static void handle_client_tracking(const vector<RESPObject>& args, ClientState& client, Reply& reply) {
+    string mode = args[2].get_string_value();
+    transform(mode.begin(), mode.end(), mode.begin(), ::toupper);
+    if(mode == "OFF" && args.size() == 3){
+        disable_tracking(client);
+        return reply.simple("OK");
+    }
+    if(mode != "ON"){
+        return reply.error("ERR syntax error");
+    }
+    TrackingOptions options;
+    for(size_t i = 3; i < args.size(); ++i){
+        string option = args[i].get_string_value();
+        transform(option.begin(), option.end(), option.begin(), ::toupper);
+        if(option == "BCAST"){
+            options.bcast = true;
+        }
+        else if(option == "NOLOOP"){
+            options.noloop = true;
+        }
+        else if(option == "REDIRECT" && i + 1 < args.size()){
+            const string& value = args[++i].get_string_value();
+            char* end;
+            options.redirect = strtoull(value.c_str(), &end, 10);
+            if(value.empty() || *end != '\0'){
+                return reply.error("ERR value is not an integer or out of range");
+            }
+            uint64_t target = options.redirect;
+            bool found = false;
+            for(const shared_ptr<ClientInfo>& info : list_clients()){
+                found |= info->id == target;
+            }
+            if(!found){
+                return reply.error("ERR The client ID you want redirect to does not exist");
+            }
+        }
+        else if(option == "PREFIX" && i + 1 < args.size()){
+            options.prefixes.push_back(args[++i].get_string_value());
+        }
+        else{
+            return reply.error("ERR syntax error");
+        }
+    }
+    if(!options.prefixes.empty() && !options.bcast){
+        return reply.error("ERR PREFIX option requires BCAST mode to be enabled");
+    }
+    enable_tracking(client, options);
+    reply.simple("OK");
+}
+
+void handle_client_command(const vector<RESPObject>& args, ClientState& client, Reply& reply) {
+    if(args.size() < 2){
+        return reply.error("ERR wrong number of arguments for 'client' command");
+    }
+    string subcommand = args[1].get_string_value();
+    transform(subcommand.begin(), subcommand.end(), subcommand.begin(), ::toupper);
+
+    if(subcommand == "ID" && args.size() == 2){
+        return client.info ? reply.integer(client.info->id) : reply.integer(0);
+    }
+    if(subcommand == "LIST" && (args.size() == 2 || args.size() == 4)){
+        bool by_class = args.size() == 4;
+        ClientClass cls = ClientClass::Normal;
+        if(by_class){
+            string option = args[2].get_string_value();
+            transform(option.begin(), option.end(), option.begin(), ::toupper);
+            if(option != "TYPE" || !parse_client_class(args[3].get_string_value(), cls)){
+                return reply.error("ERR syntax error");
+            }
+        }
+        string list;
+        for(const shared_ptr<ClientInfo>& info : list_clients()){
+            if(!by_class || info->client_class.load() == cls){
+                list += describe_client(*info) + "\n";
+            }
+        }
+        return reply.bulk(list);
+    }
+    if(subcommand == "SETNAME" && args.size() == 3){
+        if(set_client_name(client, args[2].get_string_value(), reply)){
+            reply.simple("OK");
+        }
+        return;
+    }
+    if(subcommand == "TRACKING" && args.size() >= 3){
+        return handle_client_tracking(args, client, reply);
+    }
+    if(subcommand == "GETNAME" && args.size() == 2){
+        string name;
+        if(client.info){
+            lock_guard<mutex> lock(client.info->name_mutex);
+            name = client.info->name;
+        }
+        return name.empty() ? reply.null_bulk() : reply.bulk(name);
+    }
+    if(subcommand == "KILL" && args.size() == 3){
+        // The old form, by address.
+        string addr = args[2].get_string_value();
+        size_t killed = kill_clients([&](ClientInfo& info) { return info.addr == addr; }, client.info.get());
+        return killed > 0 ? reply.simple("OK") : reply.error("ERR No such client");
+    }
+    if(subcommand == "KILL" && args.size() >= 4 && args.size() % 2 == 0){
+        bool by_id = false, by_addr = false, by_class = false, skip_me = true;
+        uint64_t id = 0;
+        string addr;
+        ClientClass cls = ClientClass::Normal;
+        for(size_t i = 2; i < args.size(); i += 2){
+            string filter = args[i].get_string_value();
+            transform(filter.begin(), filter.end(), filter.begin(), ::toupper);
+            string value = args[i + 1].get_string_value();
+            if(filter == "ID"){
+                try{
+                    id = stoull(value);
+                }
+                catch(...){
+                    return reply.error("ERR client-id should be greater than 0");
+                }
+                by_id = true;
+            }
+            else if(filter == "ADDR"){
+                addr = value;
+                by_addr = true;
+            }
+            else if(filter == "TYPE"){
+                if(!parse_client_class(value, cls)){
+                    return reply.error("ERR Unknown client type '" + value + "'");
+                }
+                by_class = true;
+            }
+            else if(filter == "SKIPME"){
+                transform(value.begin(), value.end(), value.begin(), ::tolower);
+                if(value != "yes" && value != "no"){
+                    return reply.error("ERR syntax error");
+                }
+                skip_me = value == "yes";
+            }
+            else{
+                return reply.error("ERR syntax error");
+            }
+        }
+        const ClientInfo* self = client.info.get();
+        size_t killed = kill_clients([&](ClientInfo& info) {
+            return (!by_id || info.id == id) && (!by_addr || info.addr == addr) &&
+                   (!by_class || info.client_class.load() == cls) && (!skip_me || &info != self);
+        }, self);
+        return reply.integer(killed);
+    }
+    reply.error("ERR unknown subcommand or wrong number of arguments for 'CLIENT " + args[1].get_string_value() + "'");
+}
+
+void handle_hello(const vector<RESPObject>& args, ClientState& client, const vector<pair<string, string>>& replica_info, Reply& reply) {
+    int resp = client.info ? client.info->resp.load(memory_order_relaxed) : 2;
+    size_t i = 1;
+    if(args.size() > 1){
+        const string& version = args[1].get_string_value();
+        if(version != "2" && version != "3"){
+            return reply.error("NOPROTO unsupported protocol version");
+        }
+        resp = version[0] - '0';
+        i = 2;
+    }
+    for(; i < args.size(); ++i){
+        string option = args[i].get_string_value();
+        transform(option.begin(), option.end(), option.begin(), ::toupper);
+        if(option == "AUTH" && i + 2 < args.size()){
+            i += 2;     // there are no users or passwords to check
+        }
+        else if(option == "SETNAME" && i + 1 < args.size()){
+            if(!set_client_name(client, args[++i].get_string_value(), reply)){
+                return;
+            }
+        }
+        else{
+            return reply.error("ERR Syntax error in HELLO option '" + args[i].get_string_value() + "'");
+        }
+    }
+    if(client.info){
+        client.info->resp = resp;
+    }
 
-    size_t separator_pos = id.find('-');
-    if (separator_pos == string::npos) {
-        return "-ERR invalid ID format\r\n";
+    // Replies to RESP3 clients are otherwise the RESP2 ones, which RESP3
+    // clients accept; this map, pushes and subscription replies differ.
+    if(resp == 3){
+        reply.map(7);
     }
+    else{
+        reply.array(14);
+    }
+    reply.bulk("server");
+    reply.bulk("ikvdb");
+    reply.bulk("version");
+    reply.bulk("1.0.0");
+    reply.bulk("proto");
+    reply.integer(resp);
+    reply.bulk("id");
+    reply.integer(client.info ? client.info->id : 0);
+    reply.bulk("mode");
+    reply.bulk("standalone");
+    reply.bulk("role");
+    reply.bulk(!replica_info.empty() && replica_info[0].second == "slave" ? "replica" : "master");
+    reply.bulk("modules");
+    reply.array(0);
+}
 
-    string timestamp_str = id.substr(0, separator_pos);
-    string sequence_str = id.substr(separator_pos + 1);
+// Confirms a (P)SUBSCRIBE or (P)UNSUBSCRIBE of one channel or pattern, with the
+// number of subscriptions the client has left.
+static void reply_subscription(const char* kind, const string* name, ClientState& client, Reply& reply) {
+    if(client.info && client.info->resp.load(memory_order_relaxed) == 3){
+        reply.push(3);
+    }
+    else{
+        reply.array(3);
+    }
+    reply.bulk(kind);
+    if(name){
+        reply.bulk(*name);
+    }
+    else{
+        reply.null_bulk();
+    }
+    reply.integer(client.subscriber ? client.subscriber->subscriptions() : 0);
+}
 
-    if (sequence_str == "*"){
-        if (last_timestamp_str == timestamp_str) {
-            int64_t last_sequence = stoll(last_sequence_str);
-            sequence_str = to_string(last_sequence + 1);
+void handle_subscribe(const vector<RESPObject>& args, ClientState& client, Reply& reply) {
+    if(args.size() < 2){
+        return reply.error("ERR wrong number of arguments for '" + args[0].get_string_value() + "'");
+    }
+    // SUBSCRIBE or PSUBSCRIBE.
+    bool patterns = toupper((unsigned char)args[0].get_string_value()[0]) == 'P';
+    for(size_t i = 1; i < args.size(); ++i){
+        const string& name = args[i].get_string_value();
+        if(patterns){
+            subscribe_pattern(client, name);
         }
         else{
-            sequence_str = "0";
+            subscribe_channel(client, name);
         }
-
-        id = timestamp_str + "-" + sequence_str;
-
+        reply_subscription(patterns ? "psubscribe" : "subscribe", &name, client, reply);
     }
+}
 
-    int64_t timestamp = stoll(timestamp_str);
-    int64_t sequence = stoll(sequence_str);
-
-    int64_t last_timestamp = stoll(last_timestamp_str);
-    int64_t last_sequence = stoll(last_sequence_str);
-    
-    if(timestamp <=0 and sequence <= 0) {
-        return "-ERR The ID specified in XADD must be greater than 0-0\r\n";
+void handle_unsubscribe(const vector<RESPObject>& args, ClientState& client, Reply& reply) {
+    // UNSUBSCRIBE or PUNSUBSCRIBE.
+    bool patterns = toupper((unsigned char)args[0].get_string_value()[0]) == 'P';
+    const char* kind = patterns ? "punsubscribe" : "unsubscribe";
+    vector<string> names;
+    for(size_t i = 1; i < args.size(); ++i){
+        names.push_back(args[i].get_string_value());
+    }
+    // With no arguments, everything of that kind.
+    if(names.empty() && client.subscriber){
+        const auto& current = patterns ? client.subscriber->patterns : client.subscriber->channels;
+        names.assign(current.begin(), current.end());
+    }
+    if(names.empty()){
+        return reply_subscription(kind, nullptr, client, reply);
+    }
+    for(const string& name : names){
+        if(patterns){
+            unsubscribe_pattern(client, name);
+        }
+        else{
+            unsubscribe_channel(client, name);
+        }
+        reply_subscription(kind, &name, client, reply);
     }
+}
 
-        
-    if(timestamp < last_timestamp || (timestamp == last_timestamp && sequence <= last_sequence)){
-        return "-ERR The ID specified in XADD is equal or smaller than the target stream top item\r\n";
+void handle_publish(const vector<RESPObject>& args, Reply& reply) {
+    if(args.size() != 3){
+        return reply.error("ERR wrong number of arguments for 'publish'");
     }
-    
-
-    unordered_map<string, string> fields;
+    size_t receivers = publish_message(args[1].get_string_value(), args[2].get_string_value());
+    propagate_command(args);
+    reply.integer(receivers);
+}
 
-    for(int64_t i=3;i<args.size();i+=2) {
-        if(i+1 >= args.size()) {
-            return "-ERR wrong number of arguments for 'xadd'\r\n";
-        }
-        if(args[i].get_type() != RESPType::BulkString && args[i].get_type() != RESPType::SimpleString) {
-            return "-ERR invalid field name type\r\n";
+void handle_pubsub(const vector<RESPObject>& args, Reply& reply) {
+    string subcommand = args.size() > 1 ? args[1].get_string_value() : "";
+    transform(subcommand.begin(), subcommand.end(), subcommand.begin(), ::toupper);
+    if(subcommand == "CHANNELS" && args.size() <= 3){
+        vector<string> channels = active_channels(args.size() == 3 ? args[2].get_string_value() : "");
+        reply.array(channels.size());
+        for(const string& channel : channels){
+            reply.bulk(channel);
         }
-        if(args[i + 1].get_type() != RESPType::BulkString && args[i + 1].get_type() != RESPType::SimpleString) {
-            return "-ERR invalid field value type\r\n";
+        return;
+    }
+    if(subcommand == "NUMSUB"){
+        reply.array((args.size() - 2) * 2);
+        for(size_t i = 2; i < args.size(); ++i){
+            reply.bulk(args[i].get_string_value());
+            reply.integer(channel_subscribers(args[i].get_string_value()));
         }
-        fields[args[i].get_string_value()] = args[i + 1].get_string_value();
+        return;
     }
-
-    {
-        lock_guard<mutex> lock(stream_store_mutex);
-        global_stream_store[key].push_back({id, fields});
-        stream_updated = true;
-        stream_cv.notify_all();
+    if(subcommand == "NUMPAT" && args.size() == 2){
+        return reply.integer(pattern_count());
     }
-    
-
-    string response = "$" + to_string(id.size()) + "\r\n" + id + "\r\n";
-    return response;
+    reply.error("ERR unknown subcommand or wrong number of arguments for 'PUBSUB " + (args.size() > 1 ? args[1].get_string_value() : string()) + "'");
 }
 
-string handle_xrange(const vector<RESPObject>& args) {
-    if (args.size() != 4) {
-        return "-ERR wrong number of arguments for 'xrange'\r\n";
+void handle_replconf(const vector<RESPObject>& args, int client_fd, Reply& reply) {
+    if(args.size() >= 3){
+        string subcommand = args[1].get_string_value();
+        for(size_t i=0; i<subcommand.size();i++){
+            if(subcommand[i] >= 'a' && subcommand[i] <= 'z') {
+                subcommand[i] = subcommand[i] - ('a'-'A');
+            }
+        }
+        if(subcommand == "ACK"){
+            try{
+                record_replica_ack(client_fd, stoll(args[2].get_string_value()));
+            }
+            catch(...){
+            }
+            return; // ACKs are never answered
+        }
     }
+    return reply.simple("OK");
+}
 
-    string key = args[1].get_string_value();
-    string start_id = args[2].get_string_value();
-    string end_id = args[3].get_string_value();
-
-    if (start_id == "-") start_id = "0";
-    if (end_id == "+") end_id = "9999999999999-9999999999999"; 
-
-    lock_guard<mutex> lock(stream_store_mutex);
-    
-    auto it = global_stream_store.find(key);
-    if (it == global_stream_store.end()) {
-        return "*0\r\n"; 
+void handle_wait(const vector<RESPObject>& args, Reply& reply) {
+    if(args.size() != 3){
+        return reply.error("ERR wrong number of arguments for 'wait'");
     }
 
-    const deque<StreamEntry>& stream = it->second;
-    vector<StreamEntry> result;
-
-    for (const auto& entry : stream) {
+    int64_t numreplicas, timeout_ms;
+    try{
+        numreplicas = stoll(args[1].get_string_value());
+        timeout_ms = stoll(args[2].get_string_value());
+    }
+    catch(...){
+        return reply.error("ERR value is not an integer or out of range");
+    }
+    if(timeout_ms < 0){
+        return reply.error("ERR timeout is negative");
+    }
 
-        // size_t separator_pos = entry.id.find('-');
-        // string entry_timestamp = entry.id.substr(0, separator_pos);
-        if (entry.id >= start_id && entry.id <= end_id) {
-            result.push_back(entry);
+    if(block_slot){
+        // An event loop, or EXEC: park until the replicas' ACKs or the
+        // timeout, then answer with the count as it is then.
+        if(block_slot->resumed){
+            return reply.integer(acked_replica_count(block_slot->wait_offset));
         }
-
+        int64_t offset = request_replica_acks(numreplicas);
+        if(offset < 0){
+            return reply.integer(acked_replica_count(master_repl_offset));
+        }
+        auto deadline = timeout_ms == 0 ? chrono::steady_clock::time_point::max()
+                                        : chrono::steady_clock::now() + chrono::milliseconds(timeout_ms);
+        if(!block_for_acks(offset, numreplicas, deadline)){
+            return reply.integer(acked_replica_count(offset));
+        }
+        return;
     }
+    return reply.integer(wait_for_replicas(numreplicas, timeout_ms));
+}
 
-    string response = "*" + to_string(result.size()) + "\r\n";
-
-    for (const auto& entry : result) {
-        response += "*2\r\n";
-        response += "$" + to_string(entry.id.size()) + "\r\n" + entry.id + "\r\n";
-
-        // Number of fields (each field-value is 2 items)
-        response += "*" + to_string(entry.fields.size() * 2) + "\r\n";
-        for (const auto& field : entry.fields) {
-            response += "$" + to_string(field.first.size()) + "\r\n" + field.first + "\r\n";
-            response += "$" + to_string(field.second.size()) + "\r\n" + field.second + "\r\n";
+string command_name(const RESPObject& obj) {
+    if(obj.get_type() != RESPType::Array || obj.get_array().empty()){
+        return "";
+    }
+    string command = obj.get_array()[0].get_string_value();
+    for(size_t i=0; i<command.size();i++){
+        if(command[i] >= 'a' && command[i] <= 'z') {
+            command[i] = command[i] - ('a'-'A');
         }
     }
-    return response;
+    return command;
 }
 
-string handle_xread(const vector<RESPObject>& args){
+bool command_needs_own_thread(const RESPObject& obj) {
+    return command_name(obj) == "PSYNC";
+}
 
-    if(args.size()<3){
-        return "-ERR wrong number of arguments for 'xread'\r\n";
+bool command_may_block(const RESPObject& obj) {
+    string command = command_name(obj);
+    if(command == "BLPOP" || command == "BZPOPMIN" || command == "WAIT" || command == "PSYNC"){
+        return true;
+    }
+    if(command == "XREAD"){
+        const vector<RESPObject>& args = obj.get_array();
+        for(size_t i = 1; i < args.size(); ++i){
+            string option = args[i].get_string_value();
+            transform(option.begin(), option.end(), option.begin(), ::toupper);
+            if(option == "BLOCK"){
+                return true;
+            }
+        }
     }
+    return false;
+}
 
-    int64_t block_ms = -1;
-    int64_t index = 1;
+unsigned store_locks_for_command(const string& command) {
+    if(command == "SET" || command == "INCR" || command == "GET" ||
+       command == "MGET" || command == "MSET") {
+        return STRING_STORE_LOCK;
+    }
+    if(command == "RPUSH" || command == "LPUSH" || command == "LRANGE" ||
+       command == "LLEN" || command == "LPOP" || command == "BLPOP") {
+        return LIST_STORE_LOCK;
+    }
+    if(command == "XADD" || command == "XRANGE" || command == "XREAD") {
+        return STREAM_STORE_LOCK;
+    }
+    if(command == "HSET" || command == "HGET" || command == "HMGET" || command == "HGETALL" ||
+       command == "HDEL" || command == "HINCRBY" || command == "HLEN" || command == "HSCAN") {
+        return HASH_STORE_LOCK;
+    }
+    if(command == "ZADD" || command == "ZINCRBY" || command == "ZRANGE" || command == "ZRANK" ||
+       command == "ZSCORE" || command == "ZCARD" || command == "ZREM" || command == "ZPOPMIN" ||
+       command == "BZPOPMIN") {
+        return ZSET_STORE_LOCK;
+    }
+    if(command == "TYPE" || command == "MSETNX" || command == "DEL" ||
+       command == "UNLINK" || command == "EXISTS" || command == "SCAN" ||
+       command == "FLUSHALL" || command == "FLUSHDB" || command == "INFO" ||
+       command == "BIGKEYS" || command == "MEMORY") {
+        return ALL_STORE_LOCKS;
+    }
+    return 0;
+}
 
-    if(args[1].get_string_value() == "block"){
-        if(args.size()<5){
-            return "-ERR wrong number of arguments for 'xread' with BLOCK\r\n";
-        }
-        try{
-            block_ms = stoll(args[2].get_string_value());
-            if(block_ms < 0){
-                return "-ERR timeout is negative\r\n";
+KeyPositions command_key_positions(const string& command, const vector<RESPObject>& args) {
+    KeyPositions keys;
+    if(command == "DEL" || command == "UNLINK" || command == "EXISTS" || command == "MGET") {
+        keys = {1, args.size(), 1};
+    }
+    else if(command == "MSET" || command == "MSETNX") {
+        keys = {1, args.size(), 2};
+    }
+    else if(command == "BLPOP" || command == "BZPOPMIN") {
+        keys = {1, args.size() - 1, 1};   // the last argument is the timeout
+    }
+    else if(command == "XREAD") {
+        for(size_t i = 1; i < args.size(); ++i){
+            string option = args[i].get_string_value();
+            transform(option.begin(), option.end(), option.begin(), ::toupper);
+            if(option == "STREAMS"){
+                keys = {i + 1, i + 1 + (args.size() - i - 1) / 2, 1};
+                break;
             }
-        } 
-        catch(...){
-            return "-ERR timeout is not an integer or out of range\r\n";
         }
-        if(args[3].get_string_value() != "streams"){
-            return "-ERR syntax error near 'STREAMS'\r\n";
+    }
+    else if(command == "MEMORY") {
+        // MEMORY USAGE key; MEMORY STATS has none.
+        if(args.size() >= 3){
+            string subcommand = args[1].get_string_value();
+            transform(subcommand.begin(), subcommand.end(), subcommand.begin(), ::toupper);
+            if(subcommand == "USAGE"){
+                keys = {2, 3, 1};
+            }
         }
-        index = 4;
-    } 
-    else if(args[1].get_string_value() == "streams"){
-        index = 2;
     }
-    else{
-        return "-ERR syntax error near '" + args[1].get_string_value() + "'\r\n";
+    else if(command == "SCAN" || command == "INFO" || command == "WATCH" ||
+            command == "FLUSHALL" || command == "FLUSHDB" || command == "BIGKEYS") {
+        return keys;
     }
-
-    int64_t num_keys = (args.size() - index) / 2;
-    if((args.size() - index)%2 != 0 || num_keys<=0){
-        return "-ERR wrong number of arguments for 'xread'\r\n";
+    else if(store_locks_for_command(command) != 0) {
+        keys = {1, 2, 1};
     }
-    vector<string> keys;
-    vector<string> ids;
-    vector<string> effective_ids; 
+    if(keys.last > args.size()){
+        keys.last = args.size();
+    }
+    return keys;
+}
 
-    for(int64_t i=0;i<num_keys;i++){
-        const auto& key_arg = args[index + i];
-        const auto& id_arg = args[index + num_keys + i];
+void apply_replication_batch(vector<RESPObject>& commands, ClientState& master_client) {
+    static const vector<pair<string, string>> no_replica_info;
 
-        if((key_arg.get_type() != RESPType::BulkString && key_arg.get_type() != RESPType::SimpleString) ||
-            (id_arg.get_type() != RESPType::BulkString && id_arg.get_type() != RESPType::SimpleString)){
-            return "-ERR invalid key or ID type\r\n";
+    if(shard_count > 0){
+        // Neighbouring commands can be for different shards, so the shards are
+        // stopped for the whole batch and each command runs on its own.
+        ShardPause pause;
+        for(auto& obj : commands){
+            run_on_owning_shard(obj, master_client, no_replica_info);
         }
+        return;
+    }
 
-        keys.push_back(key_arg.get_string_value());
-        string id_str = id_arg.get_string_value();
-        ids.push_back(id_str);
-        
-        if(id_str == "$"){
-            auto it = global_stream_store.find(key_arg.get_string_value());
-            if(it != global_stream_store.end() && !it->second.empty()){
-                effective_ids.push_back(it->second.back().id);
-            }
-            else{
-                effective_ids.push_back("0-0");
-            }
-        } 
-        else{
-            effective_ids.push_back(id_str);
-        }
+    unsigned lock_bits = 0;
+    for(const auto& obj : commands){
+        lock_bits |= store_locks_for_command(command_name(obj));
     }
-    
-    if(keys.size() != ids.size()){
-        return "-ERR keys and IDs count mismatch\r\n";
+
+    StoreBatchLock lock(lock_bits);
+    for(auto& obj : commands){
+        handle_command(obj, master_client, no_replica_info);
     }
+}
 
-    
-    unique_lock<mutex> lock(stream_store_mutex);
+// Over RESP2 a subscribed connection only takes subscription commands and PING.
+static bool resp2_subscribed(const ClientState& client) {
+    return client.subscriber && client.subscriber->subscriptions() > 0 &&
+           client.info && client.info->resp.load(memory_order_relaxed) == 2;
+}
 
-    auto check_for_matches = [&]() -> string {
-        
-        string response = "";
-        int matched_streams = 0;
+static void run_ping(const vector<RESPObject>& args, ClientState& client, const vector<pair<string, string>>&, Reply& reply) {
+    if(resp2_subscribed(client)){
+        reply.array(2);
+        reply.bulk("pong");
+        reply.bulk(args.size() > 1 ? args[1].get_string_value() : "");
+    }
+    else{
+        reply.simple("PONG");
+    }
+}
 
-        for(size_t i = 0; i < keys.size(); i++){
-            const string& key = keys[i];
-            const string& min_id = effective_ids[i]; 
+static void run_replconf(const vector<RESPObject>& args, ClientState& client, const vector<pair<string, string>>&, Reply& reply) {
+    handle_replconf(args, client.fd, reply);
+}
 
-            auto it = global_stream_store.find(key);
-            if(it == global_stream_store.end()){
-                continue;
-            }
+// The replication code writes FULLRESYNC, the snapshot and the stream.
+static void run_psync(const vector<RESPObject>&, ClientState& client, const vector<pair<string, string>>& replica_info, Reply&) {
+    if(client.info){
+        client.info->client_class = ClientClass::Replica;
+        client.info->blocked = false;
+    }
+    start_full_sync(client.fd, replica_info[1].second);
+}
 
-            const deque<StreamEntry>& stream = it->second;
-            vector<StreamEntry> matching_entries;
-            for(const auto& entry : stream){
-                
-                if(entry.id > min_id){
-                    matching_entries.push_back(entry);
-                }
-            }
+static void run_multi(const vector<RESPObject>& args, ClientState& client, const vector<pair<string, string>>&, Reply& reply) {
+    handle_multi(args, client, reply);
+}
 
-            if(!matching_entries.empty()){
-                matched_streams++;
-                response += "*2\r\n";
-                response += "$" + to_string(key.size()) + "\r\n" + key + "\r\n";
-                response += "*" + to_string(matching_entries.size()) + "\r\n";
-
-                for(const auto& entry : matching_entries){
-                    response += "*2\r\n";
-                    response += "$" + to_string(entry.id.size()) + "\r\n" + entry.id + "\r\n";
-                    response += "*" + to_string(entry.fields.size() * 2) + "\r\n";
-
-                    for(const auto& field : entry.fields){
-                        response += "$" + to_string(field.first.size()) + "\r\n" + field.first + "\r\n";
-                        response += "$" + to_string(field.second.size()) + "\r\n" + field.second + "\r\n";
-                    }
-                }
+static void run_discard(const vector<RESPObject>& args, ClientState& client, const vector<pair<string, string>>&, Reply& reply) {
+    handle_discard(args, client, reply);
+}
 
-            }
-        }
+static void run_watch(const vector<RESPObject>& args, ClientState& client, const vector<pair<string, string>>&, Reply& reply) {
+    handle_watch(args, client, reply);
+}
 
-        if(matched_streams > 0){
-            return "*" + to_string(matched_streams) + "\r\n" + response;
-        }
-        return "";
-    };
+static void run_unwatch(const vector<RESPObject>& args, ClientState& client, const vector<pair<string, string>>&, Reply& reply) {
+    handle_unwatch(args, client, reply);
+}
 
-    // For $ IDs with blocking, we need to update effective_ids when blocking starts
-    // to ensure we only get entries added after the blocking begins
-    auto update_dollar_ids = [&]() {
-        for(size_t i = 0; i < keys.size(); i++){
-            if(ids[i] == "$"){
-                const string& key = keys[i];
-                auto it = global_stream_store.find(key);
-                if(it != global_stream_store.end() && !it->second.empty()){
-                    // Update to the current last entry ID
-                    effective_ids[i] = it->second.back().id;
-                }
-                else{
-                    // Keep "0-0" if stream still doesn't exist or is empty
-                    effective_ids[i] = "0-0";
-                }
-            }
-        }
-    };
+static void run_info(const vector<RESPObject>& args, ClientState&, const vector<pair<string, string>>& replica_info, Reply& reply) {
+    handle_info(args, replica_info, reply);
+}
 
-    string initial_result = check_for_matches();
-    if(!initial_result.empty()){
-        return initial_result;
-    }
+static void run_client(const vector<RESPObject>& args, ClientState& client, const vector<pair<string, string>>&, Reply& reply) {
+    handle_client_command(args, client, reply);
+}
 
-    if(block_ms < 0){
-        return "$-1\r\n"; 
-    }
+static void run_subscribe(const vector<RESPObject>& args, ClientState& client, const vector<pair<string, string>>&, Reply& reply) {
+    handle_subscribe(args, client, reply);
+}
 
-    // Update $ IDs to current state before starting to block
-    update_dollar_ids();
+static void run_unsubscribe(const vector<RESPObject>& args, ClientState& client, const vector<pair<string, string>>&, Reply& reply) {
+    handle_unsubscribe(args, client, reply);
+}
 
-    if(block_ms == 0){
-        while(true){
-            stream_cv.wait(lock, [&] {
-                return stream_updated;
-            });
-            
-            stream_updated = false;
-            
-            string result = check_for_matches();
-            if (!result.empty()) {
-                return result;
+// Flags of a command in the dispatch table.
+const unsigned CMD_READS_KEYS = 1;      // read-only with keys, which CLIENT TRACKING remembers
+const unsigned CMD_IN_MULTI = 2;        // runs at once inside MULTI instead of being queued
+const unsigned CMD_NOT_IN_MULTI = 4;    // refused inside MULTI
+const unsigned CMD_SUBSCRIBED = 8;      // allowed on a subscribed RESP2 connection
+const unsigned CMD_MAY_BLOCK = 16;      // counts as blocked while command_may_block says so
+
+// A command's handler and flags. Most handlers only need the arguments; the
+// rest take the connection and replica_info as well.
+struct CommandEntry {
+    const char* name;
+    int arity;  // argument count with the name; -N means at least N
+    unsigned flags;
+    void (*handler)(const vector<RESPObject>& args, Reply& reply) = nullptr;
+    void (*client_handler)(const vector<RESPObject>& args, ClientState& client,
+                           const vector<pair<string, string>>& replica_info, Reply& reply) = nullptr;
+};
+
+static const CommandEntry command_entries[] = {
+    {"PING", -1, CMD_SUBSCRIBED, nullptr, run_ping},
+    {"REPLCONF", -1, 0, nullptr, run_replconf},
+    {"WAIT", 3, CMD_MAY_BLOCK, handle_wait},
+    {"PSYNC", 3, 0, nullptr, run_psync},
+    {"ECHO", 2, 0, handle_echo},
+    {"MULTI", 1, CMD_IN_MULTI, nullptr, run_multi},
+    {"EXEC", 1, CMD_IN_MULTI, nullptr, handle_exec},
+    {"DISCARD", 1, CMD_IN_MULTI, nullptr, run_discard},
+    {"WATCH", -2, CMD_IN_MULTI, nullptr, run_watch},
+    {"UNWATCH", 1, CMD_IN_MULTI, nullptr, run_unwatch},
+    {"SET", -3, 0, handle_set},
+    {"INCR", 2, 0, handle_incr},
+    {"GET", 2, CMD_READS_KEYS, handle_get},
+    {"MGET", -2, CMD_READS_KEYS, handle_mget},
+    {"MSET", -3, 0, handle_mset},
+    {"MSETNX", -3, 0, handle_msetnx},
+    {"DEL", -2, 0, handle_del},
+    {"UNLINK", -2, 0, handle_del},
+    {"FLUSHALL", -1, 0, handle_flushall},
+    {"FLUSHDB", -1, 0, handle_flushall},
+    {"EXISTS", -2, CMD_READS_KEYS, handle_exists},
+    {"SCAN", -2, 0, handle_scan},
+    {"RPUSH", -3, 0, handle_rpush},
+    {"LPUSH", -3, 0, handle_lpush},
+    {"LRANGE", 4, CMD_READS_KEYS, handle_lrange},
+    {"LLEN", 2, CMD_READS_KEYS, handle_llen},
+    {"LPOP", -2, 0, handle_lpop},
+    {"BLPOP", 3, CMD_MAY_BLOCK, handle_blpop},
+    {"TYPE", 2, CMD_READS_KEYS, handle_type},
+    {"XADD", -5, 0, handle_xadd},
+    {"XRANGE", -4, CMD_READS_KEYS, handle_xrange},
+    {"XREAD", -3, CMD_READS_KEYS | CMD_MAY_BLOCK, handle_xread},
+    {"HSET", -4, 0, handle_hset},
+    {"HGET", 3, CMD_READS_KEYS, handle_hget},
+    {"HMGET", -3, CMD_READS_KEYS, handle_hmget},
+    {"HGETALL", 2, CMD_READS_KEYS, handle_hgetall},
+    {"HDEL", -3, 0, handle_hdel},
+    {"HINCRBY", 4, 0, handle_hincrby},
+    {"HLEN", 2, CMD_READS_KEYS, handle_hlen},
+    {"HSCAN", -3, CMD_READS_KEYS, handle_hscan},
+    {"ZADD", -4, 0, handle_zadd},
+    {"ZINCRBY", 4, 0, handle_zincrby},
+    {"ZRANGE", -4, CMD_READS_KEYS, handle_zrange},
+    {"ZRANK", -3, CMD_READS_KEYS, handle_zrank},
+    {"ZSCORE", 3, CMD_READS_KEYS, handle_zscore},
+    {"ZCARD", 2, CMD_READS_KEYS, handle_zcard},
+    {"ZREM", -3, 0, handle_zrem},
+    {"ZPOPMIN", -2, 0, handle_zpopmin},
+    {"BZPOPMIN", -3, CMD_MAY_BLOCK, handle_bzpopmin},
+    {"INFO", -1, 0, nullptr, run_info},
+    {"SLOWLOG", -2, 0, handle_slowlog},
+    {"LATENCY", -2, 0, handle_latency},
+    {"CLIENT", -2, 0, nullptr, run_client},
+    {"SUBSCRIBE", -2, CMD_NOT_IN_MULTI | CMD_SUBSCRIBED, nullptr, run_subscribe},
+    {"PSUBSCRIBE", -2, CMD_NOT_IN_MULTI | CMD_SUBSCRIBED, nullptr, run_subscribe},
+    {"UNSUBSCRIBE", -1, CMD_SUBSCRIBED, nullptr, run_unsubscribe},
+    {"PUNSUBSCRIBE", -1, CMD_SUBSCRIBED, nullptr, run_unsubscribe},
+    {"PUBLISH", 3, 0, handle_publish},
+    {"PUBSUB", -1, 0, handle_pubsub},
+    {"HELLO", -1, 0, nullptr, handle_hello},
+    {"HOTKEYS", -1, 0, handle_hotkeys},
+    {"BIGKEYS", -1, 0, handle_bigkeys},
+    {"MEMORY", -2, 0, handle_memory},
+};
+
+// command_entries indexed by stats id, so the one name lookup in
+// handle_command finds both the handler and the stats slot. Built on first
+// use, after stats.cpp's own table.
+static const CommandEntry* const* commands_by_id() {
+    static const struct ById {
+        const CommandEntry* entries[STATS_COMMANDS] = {};
+        ById() {
+            for(const CommandEntry& entry : command_entries){
+                entries[command_stats_id(entry.name)] = &entry;
             }
         }
-    } 
-    else{
-        auto timeout = milliseconds(block_ms);
-        auto start = steady_clock::now();
-
-        while(steady_clock::now() - start < timeout){
-            auto remaining_time = timeout - duration_cast<milliseconds>(steady_clock::now() - start);
-            
-            bool success = stream_cv.wait_for(lock, remaining_time, [&] {
-                return stream_updated;
-            });
-
-            if(!success){
-                return "$-1\r\n";
-            }
-
-            stream_updated = false;
+    } by_id;
+    return by_id.entries;
+}
 
-            string result = check_for_matches();
-            if(!result.empty()){
-                return result;
-            }
+// Feeds SLOWLOG and the LATENCY "command" event. Only a command over one of the
+// thresholds pays for more than the comparison.
+static void log_slow_command(const RESPObject& obj, const ClientState& client, uint64_t ticks) {
+    int64_t duration_us = ticks_to_ns(ticks) / 1000;
+    bool slow = slowlog_log_slower_than >= 0 && duration_us >= slowlog_log_slower_than;
+    bool spike = latency_monitor_threshold_ms > 0 && duration_us >= latency_monitor_threshold_ms * 1000;
+    if((!slow && !spike) || command_may_block(obj)){
+        return;
+    }
+    if(slow){
+        string addr, name;
+        if(client.info){
+            addr = client.info->addr;
+            lock_guard<mutex> lock(client.info->name_mutex);
+            name = client.info->name;
         }
-        
-        return "$-1\r\n";
+        slowlog_push(obj.get_array(), duration_us, addr, name);
+    }
+    if(spike){
+        latency_add_sample("command", duration_us / 1000);
     }
-    
-    return "$-1\r\n";
 }
 
-string handle_info(const vector<RESPObject>& args, const vector<pair<string, string>>& replica_info) {
-    string body = "# Replication\r\n";
-    for(const auto& info : replica_info){
-        body += info.first + ":" + info.second + "\r\n";
+void handle_command(RESPObject& obj, ClientState& client, const vector<pair<string, string>>& replica_info) {
+    Reply reply(client.output);
+    size_t reply_start = client.output.text.size();
+
+    if(obj.get_type() != RESPType::Array || obj.get_array().empty()){
+        reply.error("ERR Invalid command format");
+        return;
     }
-    string response = "$" + to_string(body.size()) + "\r\n" + body + "\r\n";
-    return response;
-}
 
-string hex_to_binary(const string& hex) {
-    string binary;
-    for (size_t i = 0; i < hex.length(); i += 2) {
-        string byte_str = hex.substr(i, 2);
-        char byte = (char) strtol(byte_str.c_str(), nullptr, 16);
-        binary.push_back(byte);
+    int stats_id = command_stats_id(obj.get_array()[0].get_string_value());
+    const CommandEntry* entry = stats_id >= 0 ? commands_by_id()[stats_id] : nullptr;
+    unsigned flags = entry ? entry->flags : 0;
+
+    if(client.in_multi && !(flags & CMD_IN_MULTI)){
+        // A command refused while queueing aborts the transaction at EXEC.
+        size_t argc = obj.get_array().size();
+        if(!entry){
+            client.multi_failed = true;
+            return reply.error("ERR Unknown command: " + command_name(obj));
+        }
+        if(entry->arity >= 0 ? argc != (size_t)entry->arity : argc < (size_t)-entry->arity){
+            client.multi_failed = true;
+            string name = entry->name;
+            for(auto& c : name) c = tolower(c);
+            return reply.error("ERR wrong number of arguments for '" + name + "'");
+        }
+        if(flags & CMD_NOT_IN_MULTI){
+            client.multi_failed = true;
+            return reply.error("ERR " + string(entry->name) + " inside MULTI is not allowed");
+        }
+        client.queued_commands.push_back(std::move(obj));
+        if(client.fd != -1){
+            reply.simple("QUEUED");
+        }
+        return;
     }
-    return binary;
-}
 
+    const vector<RESPObject>& args = obj.get_array();
+    uint64_t started = stats_clock();
 
-string handle_command(const RESPObject& obj, int client_fd, const vector<pair<string, string>>& replica_info) {
-    if(obj.get_type() != RESPType::Array || obj.get_array().empty()){
-        string response = "-ERR Invalid command format\r\n";
-        return response;
+    // Kept up to date for CLIENT LIST without reading the clock again.
+    ClientInfo* info = client.info.get();
+    bool blocking = false;
+    if(info){
+        if(info->closing.load(memory_order_relaxed)){
+            return;
+        }
+        info->last_ticks.store(started, memory_order_relaxed);
+        info->last_command.store(stats_id, memory_order_relaxed);
+        blocking = (flags & CMD_MAY_BLOCK) && command_may_block(obj);
+        if(blocking){
+            info->blocked.store(true, memory_order_relaxed);
+        }
     }
 
-    string command = obj.get_array()[0].get_string_value();
-    for(int i=0; i<command.size();i++){
-        if(command[i] >= 'a' && command[i] <= 'z') {
-            command[i] = command[i] - ('a'-'A');
+    // Remembered before the read runs, so a write that races it still
+    // invalidates what it returns.
+    tracking_caller_id = info ? info->id : 0;
+    if(client.tracking_reads && (flags & CMD_READS_KEYS)){
+        KeyPositions keys = command_key_positions(entry->name, args);
+        for(size_t i = keys.first; i < keys.last; i += keys.step){
+            tracking_remember_key(client, args[i].get_string_value());
+        }
+    }
+    if(entry && hotkeys_sample_now()){
+        KeyPositions keys = command_key_positions(entry->name, args);
+        for(size_t i = keys.first; i < keys.last; i += keys.step){
+            hotkeys_record(args[i].get_string_value());
         }
     }
 
-    string response;
-
-    if(command == "PING") response = "+PONG\r\n";
-    else if(command == "REPLCONF") response = "+OK\r\n";  
-    else if(command == "PSYNC"){
-        string repl_id = replica_info[1].second;
-        response = "+FULLRESYNC " + repl_id + " 0\r\n";
-        string fake_rdb_in_hex = "524544495330303131fa0972656469732d76657205372e322e30fa0a72656469732d62697473c040fa056374696d65c26d08bc65fa08757365642d6d656dc2b0c41000fa08616f662d62617365c000fff06e3bfec0ff5aa2";
-        string fake_rdb_in_binary = hex_to_binary(fake_rdb_in_hex);
-        response += "$" + to_string(fake_rdb_in_binary.length()) + "\r\n" + fake_rdb_in_binary;
-    }
-    else if(command == "ECHO") response = handle_echo(obj.get_array());
-    else if(command == "MULTI") response = handle_multi(obj.get_array(), client_fd); 
-    else if(command == "EXEC") response = handle_exec(obj.get_array(), client_fd, replica_info);  
-    else if(command == "DISCARD") response = handle_discard(obj.get_array(), client_fd);
-    else if(command == "SET") response = handle_set(obj.get_array(), client_fd);
-    else if(command == "INCR") response = handle_incr(obj.get_array(), client_fd);
-    else if(command == "GET") response = handle_get(obj.get_array(), client_fd);
-    else if(command == "RPUSH") response = handle_rpush(obj.get_array());
-    else if(command == "LPUSH") response = handle_lpush(obj.get_array());
-    else if(command == "LRANGE") response = handle_lrange(obj.get_array());
-    else if(command == "LLEN") response = handle_llen(obj.get_array());
-    else if(command == "LPOP") response = handle_lpop(obj.get_array());
-    else if(command == "BLPOP") response = handle_blpop(obj.get_array());
-    else if(command == "TYPE") response = handle_type(obj.get_array());
-    else if(command == "XADD") response = handle_xadd(obj.get_array());
-    else if(command == "XRANGE") response = handle_xrange(obj.get_array());
-    else if(command == "XREAD") response = handle_xread(obj.get_array());
-    else if(command == "INFO") response = handle_info(obj.get_array(), replica_info);
-    
-    else response = "-ERR Unknown command: " + command + "\r\n";
+    if(!(flags & CMD_SUBSCRIBED) && resp2_subscribed(client)){
+        string name = args[0].get_string_value();
+        reply.error("ERR Can't execute '" + name + "': only (P)SUBSCRIBE / (P)UNSUBSCRIBE / PING are allowed in this context");
+    }
+    else if(!entry) reply.error("ERR Unknown command: " + command_name(obj));
+    else if(entry->handler) entry->handler(args, reply);
+    else entry->client_handler(args, client, replica_info, reply);
 
-    if (client_fd == -1) {
-        return ""; // Empty response for replication
+    // A command parked by an event loop is counted when it runs again and
+    // answers, and stays blocked until then; one on a tour of the shards, on
+    // the shard where it answers.
+    bool parked = (block_slot && block_slot->parked) || (shard_tour && shard_tour->more);
+    uint64_t elapsed = stats_clock() - started;
+    if (stats_id >= 0 && !parked) {
+        bool failed = client.output.text.size() > reply_start && client.output.text[reply_start] == '-';
+        record_command(stats_id, elapsed, failed);
+    }
+    if (!parked) {
+        log_slow_command(obj, client, elapsed);
     }
-    
-    return response;
 
+    if (info) {
+        if (blocking && !parked) {
+            info->blocked.store(false, memory_order_relaxed);
+        }
+        enforce_output_limit(client);
+    }
+
+    if (client.fd == -1) {
+        client.output.truncate(reply_start); // Commands from the master are not answered
+    }
 }
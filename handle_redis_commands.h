@@ -1,26 +1,115 @@
 #pragma once
 #include "redis_parser.h"
+#include "client.h"
+#include "reply.h"
 
 
 using namespace std;
 
-string handle_echo(const vector<RESPObject>& args);
-string handle_multi(const vector<RESPObject>& args, int client_fd);
-string handle_exec(const vector<RESPObject>& args, int client_fd, const vector<pair<string, string>>& replica_info);
-string handle_discard(const vector<RESPObject>& args, int client_fd);
-string handle_set(const vector<RESPObject>& args, int client_fd);
-string handle_incr(const vector<RESPObject>& args, int client_fd);
-string handle_get(const vector<RESPObject>& args, int client_fd);
-string handle_rpush(const vector<RESPObject>& args);
-string handle_lpush(const vector<RESPObject>& args);
-string handle_lrange(const vector<RESPObject>& args);
-string handle_llen(const vector<RESPObject>& args);
-string handle_lpop(const vector<RESPObject>& args);
-string handle_blpop(const vector<RESPObject>& args);
-string handle_type(const vector<RESPObject>& args);
-string handle_xadd(const vector<RESPObject>& args);
-string handle_xrange(const vector<RESPObject>& args);
-string handle_xread(const vector<RESPObject>& args);
-string handle_info(const vector<RESPObject>& args, const vector<pair<string, string>>& replica_info);
-string hex_to_escaped_string(const string& hex);
-string handle_command(const RESPObject& obj, int client_fd, const vector<pair<string, string>>& replica_info);
\ No newline at end of file
+void handle_echo(const vector<RESPObject>& args, Reply& reply);
+void handle_multi(const vector<RESPObject>& args, ClientState& client, Reply& reply);
+void handle_exec(const vector<RESPObject>& args, ClientState& client, const vector<pair<string, string>>& replica_info, Reply& reply);
+void handle_discard(const vector<RESPObject>& args, ClientState& client, Reply& reply);
+void handle_watch(const vector<RESPObject>& args, ClientState& client, Reply& reply);
+void handle_unwatch(const vector<RESPObject>& args, ClientState& client, Reply& reply);
+// Drops a closing connection's transaction and watched keys.
+void release_client_state(ClientState& client);
+void handle_set(const vector<RESPObject>& args, Reply& reply);
+void handle_incr(const vector<RESPObject>& args, Reply& reply);
+void handle_get(const vector<RESPObject>& args, Reply& reply);
+void handle_mget(const vector<RESPObject>& args, Reply& reply);
+void handle_mset(const vector<RESPObject>& args, Reply& reply);
+void handle_msetnx(const vector<RESPObject>& args, Reply& reply);
+// DEL and UNLINK. Values above LAZYFREE_THRESHOLD elements are freed in the background.
+void handle_del(const vector<RESPObject>& args, Reply& reply);
+// FLUSHALL / FLUSHDB [ASYNC|SYNC]. ASYNC swaps in empty stores and frees the old ones in the background.
+void handle_flushall(const vector<RESPObject>& args, Reply& reply);
+void handle_exists(const vector<RESPObject>& args, Reply& reply);
+// SCAN cursor [MATCH pattern] [COUNT count] [TYPE type]. Each call visits a
+// bounded number of buckets and never holds a store lock for long.
+void handle_scan(const vector<RESPObject>& args, Reply& reply);
+// The shard whose keyspace a SCAN cursor is in; 0 for anything else.
+int scan_cursor_shard(const vector<RESPObject>& args);
+// BIGKEYS [COUNT n]: the lists and streams with the most elements, in every
+// shard, walked incrementally like SCAN. Replies with [type, key, elements,
+// MEMORY USAGE] for each.
+void handle_bigkeys(const vector<RESPObject>& args, Reply& reply);
+void handle_hset(const vector<RESPObject>& args, Reply& reply);
+void handle_hget(const vector<RESPObject>& args, Reply& reply);
+void handle_hmget(const vector<RESPObject>& args, Reply& reply);
+void handle_hgetall(const vector<RESPObject>& args, Reply& reply);
+void handle_hdel(const vector<RESPObject>& args, Reply& reply);
+void handle_hincrby(const vector<RESPObject>& args, Reply& reply);
+void handle_hlen(const vector<RESPObject>& args, Reply& reply);
+// HSCAN key cursor [MATCH pattern] [COUNT count]. Packed hashes come back whole.
+void handle_hscan(const vector<RESPObject>& args, Reply& reply);
+void handle_zadd(const vector<RESPObject>& args, Reply& reply);
+void handle_zincrby(const vector<RESPObject>& args, Reply& reply);
+// ZRANGE key start stop [BYSCORE|BYLEX] [REV] [LIMIT offset count] [WITHSCORES]
+void handle_zrange(const vector<RESPObject>& args, Reply& reply);
+void handle_zrank(const vector<RESPObject>& args, Reply& reply);
+void handle_zscore(const vector<RESPObject>& args, Reply& reply);
+void handle_zcard(const vector<RESPObject>& args, Reply& reply);
+void handle_zrem(const vector<RESPObject>& args, Reply& reply);
+void handle_zpopmin(const vector<RESPObject>& args, Reply& reply);
+void handle_bzpopmin(const vector<RESPObject>& args, Reply& reply);
+void handle_rpush(const vector<RESPObject>& args, Reply& reply);
+void handle_lpush(const vector<RESPObject>& args, Reply& reply);
+void handle_lrange(const vector<RESPObject>& args, Reply& reply);
+void handle_llen(const vector<RESPObject>& args, Reply& reply);
+void handle_lpop(const vector<RESPObject>& args, Reply& reply);
+void handle_blpop(const vector<RESPObject>& args, Reply& reply);
+void handle_type(const vector<RESPObject>& args, Reply& reply);
+void handle_xadd(const vector<RESPObject>& args, Reply& reply);
+void handle_xrange(const vector<RESPObject>& args, Reply& reply);
+void handle_xread(const vector<RESPObject>& args, Reply& reply);
+void handle_replconf(const vector<RESPObject>& args, int client_fd, Reply& reply);
+void handle_wait(const vector<RESPObject>& args, Reply& reply);
+void handle_info(const vector<RESPObject>& args, const vector<pair<string, string>>& replica_info, Reply& reply);
+void handle_slowlog(const vector<RESPObject>& args, Reply& reply);
+void handle_latency(const vector<RESPObject>& args, Reply& reply);
+// HOTKEYS [COUNT n] / RESET: the most accessed keys, from hotkeys.h.
+void handle_hotkeys(const vector<RESPObject>& args, Reply& reply);
+// MEMORY USAGE key [SAMPLES n] / STATS, from memory_usage.h.
+void handle_memory(const vector<RESPObject>& args, Reply& reply);
+// CLIENT LIST/KILL/SETNAME/GETNAME/ID, over the registry in clients.h, and
+// CLIENT TRACKING (tracking.h).
+void handle_client_command(const vector<RESPObject>& args, ClientState& client, Reply& reply);
+// SUBSCRIBE and PSUBSCRIBE; UNSUBSCRIBE and PUNSUBSCRIBE, with no arguments
+// dropping every channel or pattern. See pubsub.h.
+void handle_subscribe(const vector<RESPObject>& args, ClientState& client, Reply& reply);
+void handle_unsubscribe(const vector<RESPObject>& args, ClientState& client, Reply& reply);
+// HELLO [protover [AUTH username password] [SETNAME name]]: switches the
+// connection to RESP3 for push messages, or back to RESP2.
+void handle_hello(const vector<RESPObject>& args, ClientState& client, const vector<pair<string, string>>& replica_info, Reply& reply);
+void handle_publish(const vector<RESPObject>& args, Reply& reply);
+// PUBSUB CHANNELS [pattern] / NUMSUB [channel ...] / NUMPAT
+void handle_pubsub(const vector<RESPObject>& args, Reply& reply);
+// Runs one command for client, appending its reply to client.output. While the
+// client is in MULTI the command is moved out of obj into its transaction queue
+// instead.
+void handle_command(RESPObject& obj, ClientState& client, const vector<pair<string, string>>& replica_info);
+// Upper-cased command name of a request, or "" if it is not a command array.
+string command_name(const RESPObject& obj);
+// Whether running obj can wait on other clients (BLPOP, BZPOPMIN, XREAD BLOCK,
+// WAIT) or turns the connection into a replication link (PSYNC).
+bool command_may_block(const RESPObject& obj);
+// Whether the event-loop modes hand the connection to a thread of its own,
+// as in the default mode, to run obj: only PSYNC. Blocking commands they park
+// instead (blocking.h).
+bool command_needs_own_thread(const RESPObject& obj);
+// Glob-style match as in SCAN MATCH and PSUBSCRIBE: '*', '?', character
+// classes such as [abc], [^abc] and [a-z], and '\' escapes.
+bool glob_match(const string& pattern, const string& str);
+// Store lock bits (see database.h) that a command touches.
+unsigned store_locks_for_command(const string& command);
+// Where a command's keys are in its arguments: every step-th argument from
+// first up to, not including, last. first == last for a command without keys.
+struct KeyPositions {
+    size_t first = 0;
+    size_t last = 0;
+    size_t step = 1;
+};
+KeyPositions command_key_positions(const string& command, const vector<RESPObject>& args);
+// Applies commands streamed from the master, taking each store lock once for the batch.
+void apply_replication_batch(vector<RESPObject>& commands, ClientState& master_client);
\ No newline at end of file
@@ -0,0 +1,128 @@
+#include <string>
+#include <string_view>
+#include <memory>
+#include "hash_value.h"
+
+using namespace std;
+
+static void append_length(string& out, size_t length) {
+    while (length >= 0x80) {
+        out += char((length & 0x7F) | 0x80);
+        length >>= 7;
+    }
+    out += char(length);
+}
+
+static size_t read_length(const string& in, size_t& pos) {
+    size_t length = 0;
+    int shift = 0;
+    unsigned char byte;
+    do {
+        byte = in[pos++];
+        length |= size_t(byte & 0x7F) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return length;
+}
+
+void HashValue::read_packed(size_t& pos, string_view& field, string_view& value) const {
+    size_t length = read_length(packed, pos);
+    field = string_view(packed.data() + pos, length);
+    pos += length;
+    length = read_length(packed, pos);
+    value = string_view(packed.data() + pos, length);
+    pos += length;
+}
+
+size_t HashValue::find_packed(const string& field) const {
+    size_t pos = 0;
+    string_view entry_field, entry_value;
+    while (pos < packed.size()) {
+        size_t start = pos;
+        read_packed(pos, entry_field, entry_value);
+        if (entry_field == field) {
+            return start;
+        }
+    }
+    return string::npos;
+}
+
+void HashValue::convert_to_table() {
+    table.reset(new Dict<string>());
+    table->reserve(packed_count * 2);
+    size_t pos = 0;
+    string_view field, value;
+    while (pos < packed.size()) {
+        read_packed(pos, field, value);
+        (*table)[string(field)] = string(value);
+    }
+    string().swap(packed);
+    packed_count = 0;
+}
+
+bool HashValue::get(const string& field, string_view& value) const {
+    if (table) {
+        auto it = table->find(field);
+        if (it == table->end()) {
+            return false;
+        }
+        value = it->second;
+        return true;
+    }
+    size_t pos = find_packed(field);
+    if (pos == string::npos) {
+        return false;
+    }
+    string_view entry_field;
+    read_packed(pos, entry_field, value);
+    return true;
+}
+
+bool HashValue::set(const string& field, const string& value) {
+    if (!table) {
+        size_t pos = find_packed(field);
+        bool fits = field.size() <= HASH_MAX_PACKED_VALUE && value.size() <= HASH_MAX_PACKED_VALUE &&
+                    (pos != string::npos || packed_count < HASH_MAX_PACKED_ENTRIES);
+        if (fits) {
+            string encoded_value;
+            append_length(encoded_value, value.size());
+            encoded_value += value;
+            if (pos == string::npos) {
+                append_length(packed, field.size());
+                packed += field;
+                packed += encoded_value;
+                packed_count++;
+                return true;
+            }
+            // Replace just the value part of the existing entry in place.
+            size_t value_start = pos;
+            size_t field_length = read_length(packed, value_start);
+            value_start += field_length;
+            size_t value_end = value_start;
+            size_t value_length = read_length(packed, value_end);
+            value_end += value_length;
+            packed.replace(value_start, value_end - value_start, encoded_value);
+            return false;
+        }
+        convert_to_table();
+    }
+    size_t before = table->size();
+    (*table)[field] = value;
+    return table->size() > before;
+}
+
+bool HashValue::erase(const string& field) {
+    if (table) {
+        return table->erase(field) > 0;
+    }
+    size_t start = find_packed(field);
+    if (start == string::npos) {
+        return false;
+    }
+    size_t end = start;
+    string_view entry_field, entry_value;
+    read_packed(end, entry_field, entry_value);
+    packed.erase(start, end - start);
+    packed_count--;
+    return true;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <memory>
+#include "dict.h"
+
+using namespace std;
+
+// Small hashes keep every field in one packed buffer; past either limit the
+// hash converts to a Dict and never converts back.
+const size_t HASH_MAX_PACKED_ENTRIES = 128;
+const size_t HASH_MAX_PACKED_VALUE = 64;
+
+// Value of a hash key. A packed hash is a single string holding
+// <len>field<len>value... with varint lengths, so a field costs its bytes plus
+// two or so, against a whole heap node per entry in a table. Lookups scan the
+// buffer, which for a handful of short fields is as fast as hashing.
+class HashValue {
+private:
+    string packed;
+    size_t packed_count = 0;
+    unique_ptr<Dict<string>> table;
+
+    // Offset of field's entry in packed, or string::npos.
+    size_t find_packed(const string& field) const;
+    // Reads the entry at pos and advances pos past it.
+    void read_packed(size_t& pos, string_view& field, string_view& value) const;
+    void convert_to_table();
+
+public:
+    size_t size() const { return table ? table->size() : packed_count; }
+    bool is_packed() const { return !table; }
+    // Capacity of the packed buffer, for MEMORY USAGE.
+    size_t packed_capacity() const { return packed.capacity(); }
+
+    // Points value at field's value and returns true if the field exists. The
+    // view stays valid until the hash is next modified.
+    bool get(const string& field, string_view& value) const;
+    // Returns true if field was added rather than overwritten.
+    bool set(const string& field, const string& value);
+    // Returns true if field existed.
+    bool erase(const string& field);
+
+    // Calls fn(field, value) for every field, as string_views.
+    template <typename Fn>
+    void for_each(Fn&& fn) const {
+        if (table) {
+            for (const auto& entry : *table) {
+                fn(string_view(entry.first), string_view(entry.second));
+            }
+            return;
+        }
+        size_t pos = 0;
+        string_view field, value;
+        while (pos < packed.size()) {
+            read_packed(pos, field, value);
+            fn(field, value);
+        }
+    }
+
+    // The table encoding, for cursor-based HSCAN; null while packed.
+    const Dict<string>* get_table() const { return table.get(); }
+};
@@ -0,0 +1,168 @@
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <functional>
+#include <cstdint>
+#include "hotkeys.h"
+#include "shards.h"
+
+using namespace std;
+
+int hotkeys_sample_rate = 16;
+
+// A key in the top list is only looked at again every this many counts, so
+// the hottest keys don't take top_mutex on every sample.
+const uint32_t HOTKEYS_RECHECK_EVERY = 8;
+
+static atomic<uint32_t> sketch[HOTKEYS_DEPTH][HOTKEYS_WIDTH];
+static atomic<uint64_t> samples{0};
+
+// The top list holds keys only; their counts are read from the sketch when
+// needed, so they age with it.
+static mutex top_mutex;
+static vector<string> top_keys;
+// Smallest estimate in the list once it is full, else 0. A stale value only
+// costs a needless trip through top_mutex.
+static atomic<uint32_t> top_floor{0};
+static mutex decay_mutex;
+
+static void sketch_slots(const string& key, size_t* slots) {
+    uint64_t h = hash<string>()(key);
+    uint32_t h1 = h;
+    uint32_t h2 = (h >> 32) | 1;
+    for (int d = 0; d < HOTKEYS_DEPTH; ++d) {
+        slots[d] = (h1 + d * h2) & (HOTKEYS_WIDTH - 1);
+    }
+}
+
+static uint32_t estimate(const string& key) {
+    size_t slots[HOTKEYS_DEPTH];
+    sketch_slots(key, slots);
+    uint32_t count = UINT32_MAX;
+    for (int d = 0; d < HOTKEYS_DEPTH; ++d) {
+        count = min(count, sketch[d][slots[d]].load(memory_order_relaxed));
+    }
+    return count;
+}
+
+// Admits key to the top list if it beats the coldest member. The caller
+// holds top_mutex.
+static void update_top(const string& key, uint32_t count) {
+    if (find(top_keys.begin(), top_keys.end(), key) == top_keys.end()) {
+        if (top_keys.size() < HOTKEYS_TOP) {
+            top_keys.push_back(key);
+        }
+        else {
+            size_t coldest = 0;
+            uint32_t coldest_count = UINT32_MAX;
+            for (size_t i = 0; i < top_keys.size(); ++i) {
+                uint32_t c = estimate(top_keys[i]);
+                if (c < coldest_count) {
+                    coldest = i;
+                    coldest_count = c;
+                }
+            }
+            if (count <= coldest_count) {
+                top_floor.store(coldest_count, memory_order_relaxed);
+                return;
+            }
+            top_keys[coldest] = key;
+        }
+    }
+    if (top_keys.size() == HOTKEYS_TOP) {
+        uint32_t floor = UINT32_MAX;
+        for (const string& k : top_keys) {
+            floor = min(floor, estimate(k));
+        }
+        top_floor.store(floor, memory_order_relaxed);
+    }
+}
+
+// Halves every count. Samples recorded meanwhile may be halved or not; the
+// estimates stay estimates either way.
+static void decay_counts() {
+    unique_lock<mutex> lock(decay_mutex, try_to_lock);
+    if (!lock.owns_lock()) {
+        return;
+    }
+    for (int d = 0; d < HOTKEYS_DEPTH; ++d) {
+        for (int w = 0; w < HOTKEYS_WIDTH; ++w) {
+            uint32_t c = sketch[d][w].load(memory_order_relaxed);
+            if (c) {
+                sketch[d][w].store(c / 2, memory_order_relaxed);
+            }
+        }
+    }
+    top_floor.store(0, memory_order_relaxed);
+}
+
+void hotkeys_record(const string& key) {
+    size_t slots[HOTKEYS_DEPTH];
+    sketch_slots(key, slots);
+    uint32_t count = UINT32_MAX;
+    for (int d = 0; d < HOTKEYS_DEPTH; ++d) {
+        count = min(count, sketch[d][slots[d]].load(memory_order_relaxed));
+    }
+    count++;
+    // Conservative update: only the rows at the minimum are raised, which keeps
+    // keys that share a counter from inflating each other.
+    for (int d = 0; d < HOTKEYS_DEPTH; ++d) {
+        if (sketch[d][slots[d]].load(memory_order_relaxed) < count) {
+            sketch[d][slots[d]].store(count, memory_order_relaxed);
+        }
+    }
+
+    uint32_t floor = top_floor.load(memory_order_relaxed);
+    if (floor == 0 || (count > floor && count % HOTKEYS_RECHECK_EVERY == 0)) {
+        lock_guard<mutex> lock(top_mutex);
+        update_top(key, count);
+    }
+
+    if ((samples.fetch_add(1, memory_order_relaxed) + 1) % HOTKEYS_DECAY_SAMPLES == 0) {
+        decay_counts();
+    }
+}
+
+vector<HotKey> hotkeys_top(size_t count) {
+    vector<HotKey> hot;
+    {
+        lock_guard<mutex> lock(top_mutex);
+        for (const string& key : top_keys) {
+            hot.push_back({key, (uint64_t)estimate(key) * max(hotkeys_sample_rate, 1)});
+        }
+    }
+    sort(hot.begin(), hot.end(), [](const HotKey& a, const HotKey& b) { return a.calls > b.calls; });
+    if (hot.size() > count) {
+        hot.resize(count);
+    }
+    return hot;
+}
+
+void hotkeys_reset() {
+    lock_guard<mutex> decay_lock(decay_mutex);
+    lock_guard<mutex> lock(top_mutex);
+    for (int d = 0; d < HOTKEYS_DEPTH; ++d) {
+        for (int w = 0; w < HOTKEYS_WIDTH; ++w) {
+            sketch[d][w].store(0, memory_order_relaxed);
+        }
+    }
+    top_keys.clear();
+    top_floor.store(0, memory_order_relaxed);
+    samples.store(0, memory_order_relaxed);
+}
+
+void append_hotkeys_info(string& body) {
+    body += "# Hotkeys\r\n";
+    body += "hotkeys_sample_rate:" + to_string(hotkeys_sample_rate) + "\r\n";
+    body += "hotkeys_sampled:" + to_string(samples.load(memory_order_relaxed)) + "\r\n";
+    vector<HotKey> hot = hotkeys_top(HOTKEYS_TOP);
+    for (size_t i = 0; i < hot.size(); ++i) {
+        body += "hotkey_" + to_string(i) + ":key=" + hot[i].key + ",calls=" + to_string(hot[i].calls);
+        if (shard_count > 0) {
+            body += ",shard=" + to_string(shard_for_key(hot[i].key));
+        }
+        body += "\r\n";
+    }
+}
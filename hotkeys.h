@@ -0,0 +1,58 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstdint>
+
+using namespace std;
+
+// HOTKEYS: an always-on estimate of the most accessed keys. handle_command
+// samples about one command in hotkeys_sample_rate and counts its keys in a
+// count-min sketch, HOTKEYS_DEPTH rows of HOTKEYS_WIDTH relaxed atomic
+// counters, with conservative update. A key whose estimate beats the smallest
+// of the current top HOTKEYS_TOP takes its place; the list's lock is only
+// taken when one might. Every HOTKEYS_DECAY_SAMPLES samples all counts are halved, so the
+// list follows what is hot now rather than since startup.
+//
+// Estimates never undercount; they overcount by about total samples / width.
+// They are reported scaled back up by the sample rate.
+
+extern int hotkeys_sample_rate;         // --hotkeys-sample-rate; 0 turns sampling off
+
+const int HOTKEYS_DEPTH = 4;
+const int HOTKEYS_WIDTH = 1 << 14;
+const size_t HOTKEYS_TOP = 32;
+const uint64_t HOTKEYS_DECAY_SAMPLES = uint64_t(HOTKEYS_WIDTH) * 16;
+
+// Whether the calling thread samples its current command: a countdown with a
+// random reload, so periodic workloads aren't aliased, and one decrement and
+// branch for the commands that aren't sampled.
+inline bool hotkeys_sample_now() {
+    static thread_local int countdown = 0;
+    static thread_local uint32_t random_state = 0x9e3779b9;
+    if (--countdown > 0) {
+        return false;
+    }
+    if (hotkeys_sample_rate <= 0) {
+        countdown = 1 << 20;    // look at the setting again now and then
+        return false;
+    }
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    countdown = 1 + random_state % (2 * hotkeys_sample_rate);
+    return true;
+}
+
+void hotkeys_record(const string& key);
+
+struct HotKey {
+    string key;
+    uint64_t calls;             // estimated, scaled by the sample rate
+};
+// The hottest keys, hottest first, up to count of them.
+vector<HotKey> hotkeys_top(size_t count);
+void hotkeys_reset();
+
+// The Hotkeys section of INFO, with its header.
+void append_hotkeys_info(string& body);
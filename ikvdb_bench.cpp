@@ -0,0 +1,590 @@
+// ikvdb-bench: load generator for ikvdb (or any server speaking RESP).
+//
+// Each thread runs an epoll loop over its share of the clients. A client sends
+// --pipeline requests at once and sends the next batch when every reply is in;
+// a request's latency runs from the moment its batch was written to the moment
+// its reply was parsed, as in redis-benchmark. Tests run one after another, on
+// the same connections, and each prints requests/s and latency percentiles, as
+// text or, with --csv, one line per test for scripts to diff between runs.
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+
+using namespace std;
+using namespace chrono;
+
+struct Options {
+    string host = "127.0.0.1";
+    int port = 6379;
+    int threads = 1;
+    int clients = 50;
+    int pipeline = 1;
+    uint64_t requests = 100000;         // per test, unless duration is set
+    double duration = 0;                // seconds per test
+    uint64_t keyspace = 100000;
+    size_t value_min = 3;
+    size_t value_max = 3;
+    double zipf_theta = 0;              // 0 picks keys uniformly
+    int range_count = 100;              // elements fetched by LRANGE and XRANGE
+    vector<string> tests = {"set", "get", "incr", "lpush", "lrange", "lpop", "xadd", "xrange", "xread"};
+    vector<pair<string, int>> mix;      // command and weight, for the "mix" test
+    bool csv = false;
+};
+
+static Options options;
+
+static const char* const bench_commands[] = {
+    "get", "set", "incr", "lpush", "lpop", "lrange", "xadd", "xrange", "xread",
+};
+
+static bool known_command(const string& name) {
+    return find(begin(bench_commands), end(bench_commands), name) != end(bench_commands);
+}
+
+// Latencies in nanoseconds, in log-linear buckets: HIST_SUB_BUCKETS per power of
+// two, so a reported percentile is within 1/16 of the measured value.
+const int HIST_SUB_BUCKET_BITS = 4;
+const int HIST_SUB_BUCKETS = 1 << HIST_SUB_BUCKET_BITS;
+const int HIST_BUCKETS = (64 - HIST_SUB_BUCKET_BITS + 1) * HIST_SUB_BUCKETS;
+
+struct Histogram {
+    vector<uint64_t> counts = vector<uint64_t>(HIST_BUCKETS);
+    uint64_t total = 0;
+    uint64_t max = 0;
+
+    static int bucket(uint64_t ns) {
+        if (ns < (uint64_t)HIST_SUB_BUCKETS) {
+            return ns;
+        }
+        int msb = 63 - __builtin_clzll(ns);
+        int shift = msb - HIST_SUB_BUCKET_BITS;
+        return (shift + 1) * HIST_SUB_BUCKETS + ((ns >> shift) & (HIST_SUB_BUCKETS - 1));
+    }
+
+    static uint64_t bucket_bound(int b) {
+        if (b < HIST_SUB_BUCKETS) {
+            return b;
+        }
+        int shift = b / HIST_SUB_BUCKETS - 1;
+        uint64_t sub = HIST_SUB_BUCKETS + b % HIST_SUB_BUCKETS;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    void add(uint64_t ns) {
+        counts[bucket(ns)]++;
+        total++;
+        max = std::max(max, ns);
+    }
+
+    void merge(const Histogram& other) {
+        for (int b = 0; b < HIST_BUCKETS; ++b) {
+            counts[b] += other.counts[b];
+        }
+        total += other.total;
+        max = std::max(max, other.max);
+    }
+
+    uint64_t percentile(double p) const {
+        uint64_t rank = std::max<uint64_t>(1, (uint64_t)(p / 100 * total + 0.5));
+        uint64_t seen = 0;
+        for (int b = 0; b < HIST_BUCKETS; ++b) {
+            if ((seen += counts[b]) >= rank) {
+                return std::min(bucket_bound(b), max);
+            }
+        }
+        return max;
+    }
+};
+
+// Zipfian ranks in [0, n) by Gray et al.'s method, as in YCSB: rank 0 is the
+// most popular, and theta close to 1 concentrates the load on fewer keys.
+class ZipfGenerator {
+private:
+    uint64_t n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+
+    static double zeta(uint64_t n, double theta) {
+        double sum = 0;
+        for (uint64_t i = 1; i <= n; ++i) {
+            sum += 1 / pow((double)i, theta);
+        }
+        return sum;
+    }
+
+public:
+    ZipfGenerator(uint64_t n, double theta) : n(n), theta(theta) {
+        if (theta <= 0) {
+            return;
+        }
+        double zeta2 = zeta(2, theta);
+        zetan = zeta(n, theta);
+        alpha = 1 / (1 - theta);
+        eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+    }
+
+    template <typename Rng>
+    uint64_t next(Rng& rng) const {
+        if (theta <= 0) {
+            return uniform_int_distribution<uint64_t>(0, n - 1)(rng);
+        }
+        double u = uniform_real_distribution<double>(0, 1)(rng);
+        double uz = u * zetan;
+        if (uz < 1) {
+            return 0;
+        }
+        if (uz < 1 + pow(0.5, theta)) {
+            return 1;
+        }
+        return std::min<uint64_t>(n - 1, (uint64_t)(n * pow(eta * u - eta + 1, alpha)));
+    }
+};
+
+static const ZipfGenerator* zipf;
+static string value_pool;
+
+// Length of the complete reply at the start of [p, end), or 0 if more input is
+// needed. Sets error if the reply is an error.
+static size_t reply_length(const char* p, const char* end, bool& error) {
+    const char* newline = (const char*)memchr(p, '\n', end - p);
+    if (!newline) {
+        return 0;
+    }
+    size_t header = newline - p + 1;
+    switch (p[0]) {
+    case '-':
+        error = true;
+        return header;
+    case '+':
+    case ':':
+        return header;
+    case '$': {
+        long long length = atoll(p + 1);
+        if (length < 0) {
+            return header;
+        }
+        if ((size_t)(end - p) < header + length + 2) {
+            return 0;
+        }
+        return header + length + 2;
+    }
+    case '*': {
+        long long count = atoll(p + 1);
+        size_t total = header;
+        for (long long i = 0; i < count; ++i) {
+            size_t element = reply_length(p + total, end, error);
+            if (element == 0) {
+                return 0;
+            }
+            total += element;
+        }
+        return total;
+    }
+    default:
+        cerr << "Protocol error in reply\n";
+        exit(1);
+    }
+}
+
+static void append_command(string& out, const vector<string>& args) {
+    out += "*" + to_string(args.size()) + "\r\n";
+    for (const string& arg : args) {
+        out += "$" + to_string(arg.size()) + "\r\n";
+        out += arg;
+        out += "\r\n";
+    }
+}
+
+struct Client {
+    int fd = -1;
+    string out;
+    size_t out_sent = 0;
+    string in;
+    int pending = 0;                    // replies still due for the current batch
+    steady_clock::time_point batch_sent;
+};
+
+// What one thread does for one test: runs its clients until the test's shared
+// request budget, or its time, runs out.
+struct Worker {
+    vector<Client> clients;
+    int epoll_fd = -1;
+    mt19937_64 rng;
+    Histogram histogram;
+    uint64_t errors = 0;
+
+    void append_request(string& out, const string& command) {
+        string key = to_string(zipf->next(rng));
+        size_t value_size = options.value_min == options.value_max
+                                ? options.value_min
+                                : uniform_int_distribution<size_t>(options.value_min, options.value_max)(rng);
+        string value = value_pool.substr(uniform_int_distribution<size_t>(0, value_pool.size() - value_size)(rng), value_size);
+        string range_end = to_string(options.range_count - 1);
+        string range_count = to_string(options.range_count);
+
+        if (command == "get") append_command(out, {"GET", "key:" + key});
+        else if (command == "set") append_command(out, {"SET", "key:" + key, value});
+        else if (command == "incr") append_command(out, {"INCR", "counter:" + key});
+        else if (command == "lpush") append_command(out, {"LPUSH", "list:" + key, value});
+        else if (command == "lpop") append_command(out, {"LPOP", "list:" + key});
+        else if (command == "lrange") append_command(out, {"LRANGE", "list:" + key, "0", range_end});
+        else if (command == "xadd") append_command(out, {"XADD", "stream:" + key, "*", "field", value});
+        else if (command == "xrange") append_command(out, {"XRANGE", "stream:" + key, "-", "+", "COUNT", range_count});
+        // ikvdb's XREAD has no COUNT, so this reads the whole stream.
+        else if (command == "xread") append_command(out, {"XREAD", "streams", "stream:" + key, "0"});
+    }
+
+    const string& pick_command(const string& test, int mix_weight) {
+        if (test != "mix") {
+            return test;
+        }
+        int r = uniform_int_distribution<int>(0, mix_weight - 1)(rng);
+        for (const auto& entry : options.mix) {
+            if ((r -= entry.second) < 0) {
+                return entry.first;
+            }
+        }
+        return options.mix.back().first;
+    }
+
+    void run(const string& test, atomic<int64_t>& budget, steady_clock::time_point deadline);
+    bool send(Client& client);
+};
+
+static void watch(int epoll_fd, int op, Client& client, uint32_t events) {
+    epoll_event event = {};
+    event.events = events;
+    event.data.ptr = &client;
+    epoll_ctl(epoll_fd, op, client.fd, &event);
+}
+
+static int mix_weight() {
+    int total = 0;
+    for (const auto& entry : options.mix) {
+        total += entry.second;
+    }
+    return total;
+}
+
+bool Worker::send(Client& client) {
+    while (client.out_sent < client.out.size()) {
+        ssize_t n = write(client.fd, client.out.data() + client.out_sent, client.out.size() - client.out_sent);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch(epoll_fd, EPOLL_CTL_MOD, client, EPOLLIN | EPOLLOUT);
+                return true;
+            }
+            return false;
+        }
+        client.out_sent += n;
+    }
+    client.out.clear();
+    client.out_sent = 0;
+    return true;
+}
+
+void Worker::run(const string& test, atomic<int64_t>& budget, steady_clock::time_point deadline) {
+    bool timed = options.duration > 0;
+    int weight = mix_weight();
+    size_t active = 0;
+
+    // Claims up to a pipeline's worth of requests and sends them.
+    auto start_batch = [&](Client& client) {
+        int64_t batch = options.pipeline;
+        if (timed) {
+            if (steady_clock::now() >= deadline) {
+                return false;
+            }
+        }
+        else {
+            int64_t left = budget.fetch_sub(batch);
+            if (left <= 0) {
+                return false;
+            }
+            batch = std::min(batch, left);
+        }
+        for (int64_t i = 0; i < batch; ++i) {
+            append_request(client.out, pick_command(test, weight));
+        }
+        client.pending = batch;
+        client.batch_sent = steady_clock::now();
+        if (!send(client)) {
+            cerr << "Error writing to server: " << strerror(errno) << "\n";
+            exit(1);
+        }
+        return true;
+    };
+
+    for (Client& client : clients) {
+        if (start_batch(client)) {
+            active++;
+        }
+    }
+
+    epoll_event events[64];
+    char buffer[65536];
+    while (active > 0) {
+        int n = epoll_wait(epoll_fd, events, 64, 1000);
+        for (int i = 0; i < n; ++i) {
+            Client& client = *(Client*)events[i].data.ptr;
+            if (events[i].events & EPOLLOUT) {
+                if (!send(client)) {
+                    cerr << "Error writing to server: " << strerror(errno) << "\n";
+                    exit(1);
+                }
+                if (client.out.empty()) {
+                    watch(epoll_fd, EPOLL_CTL_MOD, client, EPOLLIN);
+                }
+            }
+            if (!(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                continue;
+            }
+            ssize_t got = read(client.fd, buffer, sizeof(buffer));
+            if (got <= 0) {
+                if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    continue;
+                }
+                cerr << "Connection to server lost\n";
+                exit(1);
+            }
+            client.in.append(buffer, got);
+
+            size_t parsed = 0;
+            auto now = steady_clock::now();
+            while (client.pending > 0) {
+                bool error = false;
+                size_t length = reply_length(client.in.data() + parsed, client.in.data() + client.in.size(), error);
+                if (length == 0) {
+                    break;
+                }
+                parsed += length;
+                errors += error;
+                histogram.add(duration_cast<nanoseconds>(now - client.batch_sent).count());
+                client.pending--;
+            }
+            client.in.erase(0, parsed);
+            if (client.pending == 0 && !start_batch(client)) {
+                active--;
+            }
+        }
+    }
+}
+
+static int connect_to_server() {
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result;
+    if (getaddrinfo(options.host.c_str(), to_string(options.port).c_str(), &hints, &result) != 0) {
+        cerr << "Cannot resolve " << options.host << "\n";
+        exit(1);
+    }
+    int fd = -1;
+    for (addrinfo* ai = result; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(result);
+    if (fd < 0) {
+        cerr << "Cannot connect to " << options.host << ":" << options.port << "\n";
+        exit(1);
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+static vector<string> split(const string& s, char separator) {
+    vector<string> parts;
+    size_t start = 0;
+    while (start <= s.size()) {
+        size_t end = s.find(separator, start);
+        if (end == string::npos) {
+            end = s.size();
+        }
+        if (end > start) {
+            parts.push_back(s.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+    return parts;
+}
+
+static void usage() {
+    cerr << "Usage: ikvdb-bench [options]\n"
+            "  -h, --host <host>          server host (127.0.0.1)\n"
+            "  -p, --port <port>          server port (6379)\n"
+            "  --threads <n>              event-loop threads (1)\n"
+            "  -c, --clients <n>          connections, spread over the threads (50)\n"
+            "  -P, --pipeline <n>         requests in flight per connection (1)\n"
+            "  -n, --requests <n>         requests per test (100000)\n"
+            "  -d, --duration <seconds>   run each test for a time instead of a request count\n"
+            "  -r, --keyspace <n>         distinct keys per test (100000)\n"
+            "  --value-size <n|min-max>   value bytes, fixed or uniform in a range (3)\n"
+            "  --zipf <theta>             zipfian key popularity, e.g. 0.99 (uniform)\n"
+            "  --range-count <n>          elements read by LRANGE and XRANGE (100)\n"
+            "  -t, --tests <list>         comma-separated, from get,set,incr,lpush,lpop,lrange,\n"
+            "                             xadd,xrange,xread (all, writes before reads)\n"
+            "  --mix <cmd:weight,...>     also run a mixed test, e.g. get:90,set:10\n"
+            "  --csv                      print test,rps,requests,errors,p50_ms,p99_ms,p99_9_ms,max_ms\n";
+    exit(1);
+}
+
+static void parse_options(int argc, char** argv) {
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        string value = has_value ? argv[i + 1] : "";
+        if (arg == "--csv") {
+            options.csv = true;
+            continue;
+        }
+        if (!has_value) {
+            usage();
+        }
+        i += 1;
+        if (arg == "-h" || arg == "--host") options.host = value;
+        else if (arg == "-p" || arg == "--port") options.port = atoi(value.c_str());
+        else if (arg == "--threads") options.threads = max(1, atoi(value.c_str()));
+        else if (arg == "-c" || arg == "--clients") options.clients = max(1, atoi(value.c_str()));
+        else if (arg == "-P" || arg == "--pipeline") options.pipeline = max(1, atoi(value.c_str()));
+        else if (arg == "-n" || arg == "--requests") options.requests = strtoull(value.c_str(), nullptr, 10);
+        else if (arg == "-d" || arg == "--duration") options.duration = atof(value.c_str());
+        else if (arg == "-r" || arg == "--keyspace") options.keyspace = max(1ULL, strtoull(value.c_str(), nullptr, 10));
+        else if (arg == "--zipf") options.zipf_theta = atof(value.c_str());
+        else if (arg == "--range-count") options.range_count = max(1, atoi(value.c_str()));
+        else if (arg == "--value-size") {
+            size_t dash = value.find('-');
+            options.value_min = max(1ULL, strtoull(value.c_str(), nullptr, 10));
+            options.value_max = dash == string::npos ? options.value_min
+                                                     : max<size_t>(options.value_min, strtoull(value.c_str() + dash + 1, nullptr, 10));
+        }
+        else if (arg == "-t" || arg == "--tests") {
+            options.tests = split(value, ',');
+            for (string& test : options.tests) {
+                transform(test.begin(), test.end(), test.begin(), ::tolower);
+                if (!known_command(test)) {
+                    cerr << "Unknown test: " << test << "\n";
+                    exit(1);
+                }
+            }
+        }
+        else if (arg == "--mix") {
+            for (const string& part : split(value, ',')) {
+                size_t colon = part.find(':');
+                string command = part.substr(0, colon);
+                transform(command.begin(), command.end(), command.begin(), ::tolower);
+                int weight = colon == string::npos ? 1 : atoi(part.c_str() + colon + 1);
+                if (!known_command(command) || weight <= 0) {
+                    cerr << "Bad --mix entry: " << part << "\n";
+                    exit(1);
+                }
+                options.mix.push_back({command, weight});
+            }
+        }
+        else usage();
+    }
+    if (options.zipf_theta >= 1) {
+        cerr << "--zipf takes a theta below 1\n";
+        exit(1);
+    }
+}
+
+static void print_result(const string& test, const Histogram& histogram, uint64_t errors, double seconds) {
+    double rps = histogram.total / seconds;
+    auto ms = [&](double p) { return histogram.percentile(p) / 1e6; };
+    string name = test;
+    transform(name.begin(), name.end(), name.begin(), ::toupper);
+    if (options.csv) {
+        printf("\"%s\",%.2f,%llu,%llu,%.3f,%.3f,%.3f,%.3f\n", name.c_str(), rps, (unsigned long long)histogram.total,
+               (unsigned long long)errors, ms(50), ms(99), ms(99.9), histogram.max / 1e6);
+        return;
+    }
+    printf("%s: %.2f requests per second, %llu requests in %.2f seconds, %llu errors\n", name.c_str(), rps,
+           (unsigned long long)histogram.total, seconds, (unsigned long long)errors);
+    printf("  latency (ms): p50=%.3f p99=%.3f p99.9=%.3f max=%.3f\n", ms(50), ms(99), ms(99.9), histogram.max / 1e6);
+}
+
+int main(int argc, char** argv) {
+    parse_options(argc, argv);
+
+    ZipfGenerator generator(options.keyspace, options.zipf_theta);
+    zipf = &generator;
+    mt19937_64 seed_rng(random_device{}());
+    value_pool.resize(options.value_max * 2);
+    for (char& c : value_pool) {
+        c = 'a' + seed_rng() % 26;
+    }
+
+    vector<Worker> workers(options.threads);
+    for (int t = 0; t < options.threads; ++t) {
+        Worker& worker = workers[t];
+        worker.rng.seed(seed_rng());
+        worker.epoll_fd = epoll_create1(0);
+        worker.clients.resize(options.clients / options.threads + (t < options.clients % options.threads));
+    }
+    for (Worker& worker : workers) {
+        for (Client& client : worker.clients) {
+            client.fd = connect_to_server();
+            watch(worker.epoll_fd, EPOLL_CTL_ADD, client, EPOLLIN);
+        }
+    }
+
+    vector<string> tests = options.tests;
+    if (!options.mix.empty()) {
+        tests.push_back("mix");
+    }
+    if (options.csv) {
+        printf("\"test\",\"rps\",\"requests\",\"errors\",\"p50_ms\",\"p99_ms\",\"p99_9_ms\",\"max_ms\"\n");
+    }
+    for (const string& test : tests) {
+        atomic<int64_t> budget((int64_t)options.requests);
+        auto started = steady_clock::now();
+        auto deadline = started + duration_cast<steady_clock::duration>(duration<double>(options.duration));
+        vector<thread> threads;
+        for (Worker& worker : workers) {
+            worker.histogram = Histogram();
+            worker.errors = 0;
+            threads.emplace_back([&worker, &test, &budget, deadline] { worker.run(test, budget, deadline); });
+        }
+        for (thread& t : threads) {
+            t.join();
+        }
+        double seconds = duration<double>(steady_clock::now() - started).count();
+
+        Histogram total;
+        uint64_t errors = 0;
+        for (const Worker& worker : workers) {
+            total.merge(worker.histogram);
+            errors += worker.errors;
+        }
+        print_result(test, total, errors, seconds);
+    }
+    return 0;
+}
@@ -0,0 +1,287 @@
+// ikvdb-microbench: in-process benchmarks of the parser, command dispatch and
+// the handlers, with no sockets in the way. Each benchmark repeats one
+// operation until it has run for --time seconds, and reports ns/op along with
+// the heap allocations and bytes allocated per op, counted by the replacement
+// operator new below. Keys and values allocated from the keyspace slabs (see
+// slab_allocator.h) don't go through operator new and so aren't counted.
+//
+// Usage: ikvdb-microbench [--time <seconds>] [--csv] [name-filter ...]
+#include <iostream>
+#include <string>
+#include <vector>
+#include <functional>
+#include <chrono>
+#include <new>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include "redis_parser.h"
+#include "handle_redis_commands.h"
+#include "reply.h"
+#include "client.h"
+#include "io_threads.h"
+#include "stats.h"
+
+using namespace std;
+using namespace chrono;
+
+static thread_local uint64_t allocations = 0;
+static thread_local uint64_t allocated_bytes = 0;
+
+void* operator new(size_t size) {
+    allocations++;
+    allocated_bytes += size;
+    if (void* p = malloc(size ? size : 1)) {
+        return p;
+    }
+    throw bad_alloc();
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void* operator new(size_t size, const nothrow_t&) noexcept {
+    allocations++;
+    allocated_bytes += size;
+    return malloc(size ? size : 1);
+}
+
+void* operator new[](size_t size, const nothrow_t& tag) noexcept {
+    return operator new(size, tag);
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    free(p);
+}
+
+// The server's connection loop is in Server.cpp, next to main(); nothing here
+// accepts connections, but io_threads.cpp and shards.cpp link against it.
+void handle_client(int, const vector<pair<string, string>>&, ClientState, string) {
+    abort();
+}
+
+// Requests are cycled through this many distinct keys.
+const size_t KEY_COUNT = 1024;
+const int LIST_LENGTH = 1000;
+const int STREAM_LENGTH = 1000;
+
+static string encode(const vector<string>& args) {
+    string out = "*" + to_string(args.size()) + "\r\n";
+    for (const string& arg : args) {
+        out += "$" + to_string(arg.size()) + "\r\n" + arg + "\r\n";
+    }
+    return out;
+}
+
+static RESPObject command(const vector<string>& args) {
+    RESPParser parser;
+    return parser.parse(encode(args));
+}
+
+static vector<RESPObject> commands_for_keys(const string& prefix, const function<vector<string>(const string&)>& make) {
+    vector<RESPObject> commands;
+    for (size_t i = 0; i < KEY_COUNT; ++i) {
+        commands.push_back(command(make(prefix + to_string(i))));
+    }
+    return commands;
+}
+
+static const vector<pair<string, string>> replica_info = {
+    {"role", "master"}, {"master_replid", "8371b4fb1155b71f4a04d3e1bc3e18c4a990aeeb"}, {"master_repl_offset", "0"},
+};
+
+static ClientState client;
+
+struct Benchmark {
+    string name;
+    // Runs once before timing, for data the operation needs to find.
+    function<void()> setup;
+    // The operation, for the i-th repetition.
+    function<void(size_t)> op;
+};
+
+// Runs a handler on the i-th prebuilt command and drops its reply.
+static function<void(size_t)> run_handler(const vector<RESPObject>& commands, void (*handler)(const vector<RESPObject>&, Reply&)) {
+    return [&commands, handler](size_t i) {
+        Reply reply(client.output);
+        handler(commands[i % KEY_COUNT].get_array(), reply);
+        client.output.clear();
+    };
+}
+
+struct Result {
+    uint64_t iterations;
+    double ns_per_op;
+    double allocs_per_op;
+    double bytes_per_op;
+};
+
+static Result measure(const Benchmark& benchmark, double min_seconds) {
+    for (size_t i = 0; i < 1000; ++i) {
+        benchmark.op(i);
+    }
+    uint64_t iterations = 1000;
+    while (true) {
+        uint64_t allocations_before = allocations;
+        uint64_t bytes_before = allocated_bytes;
+        auto started = steady_clock::now();
+        for (uint64_t i = 0; i < iterations; ++i) {
+            benchmark.op(i);
+        }
+        double seconds = duration<double>(steady_clock::now() - started).count();
+        if (seconds >= min_seconds || iterations >= (1ULL << 40)) {
+            return {iterations, seconds * 1e9 / iterations, (double)(allocations - allocations_before) / iterations,
+                    (double)(allocated_bytes - bytes_before) / iterations};
+        }
+        // Aim past min_seconds on the next round, without overshooting it wildly.
+        iterations = seconds > 0 ? max(iterations * 2, (uint64_t)(iterations * min_seconds * 1.2 / seconds)) : iterations * 10;
+    }
+}
+
+int main(int argc, char** argv) {
+    double min_seconds = 0.5;
+    bool csv = false;
+    vector<string> filters;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--time") == 0 && i + 1 < argc) {
+            min_seconds = atof(argv[i + 1]);
+            i += 1;
+        }
+        else if (strcmp(argv[i], "--csv") == 0) {
+            csv = true;
+        }
+        else {
+            filters.push_back(argv[i]);
+        }
+    }
+    calibrate_stats_clock();
+
+    string value(16, 'v');
+    vector<string> set_request = {"SET", "key:1234", value};
+    string set_input = encode(set_request);
+    vector<string> mset_request = {"MSET"};
+    for (int i = 0; i < 10; ++i) {
+        mset_request.push_back("key:" + to_string(i));
+        mset_request.push_back(value);
+    }
+    string mset_input = encode(mset_request);
+
+    vector<RESPObject> sets = commands_for_keys("key:", [&](const string& key) { return vector<string>{"SET", key, value}; });
+    vector<RESPObject> gets = commands_for_keys("key:", [](const string& key) { return vector<string>{"GET", key}; });
+    vector<RESPObject> pings = commands_for_keys("", [](const string&) { return vector<string>{"PING"}; });
+    vector<RESPObject> lranges = commands_for_keys("list:", [](const string& key) { return vector<string>{"LRANGE", key, "0", "99"}; });
+    vector<RESPObject> xadds = commands_for_keys("stream:", [&](const string& key) { return vector<string>{"XADD", key, "*", "field", value}; });
+    vector<RESPObject> xranges = commands_for_keys("stream:", [](const string& key) {
+        return vector<string>{"XRANGE", key, "-", "+", "COUNT", "100"};
+    });
+
+    auto fill_strings = [&] {
+        for (const RESPObject& set : sets) {
+            Reply reply(client.output);
+            handle_set(set.get_array(), reply);
+            client.output.clear();
+        }
+    };
+    auto fill_lists = [&] {
+        for (size_t i = 0; i < KEY_COUNT; ++i) {
+            vector<string> rpush = {"RPUSH", "list:" + to_string(i)};
+            for (int j = 0; j < LIST_LENGTH; ++j) {
+                rpush.push_back(value);
+            }
+            RESPObject obj = command(rpush);
+            Reply reply(client.output);
+            handle_rpush(obj.get_array(), reply);
+            client.output.clear();
+        }
+    };
+    auto fill_streams = [&] {
+        for (int j = 0; j < STREAM_LENGTH; ++j) {
+            for (const RESPObject& xadd : xadds) {
+                Reply reply(client.output);
+                handle_xadd(xadd.get_array(), reply);
+                client.output.clear();
+            }
+        }
+    };
+
+    vector<Benchmark> benchmarks = {
+        {"parse/set", nullptr, [&](size_t) {
+            RESPParser parser;
+            RESPObject obj = parser.parse(set_input);
+        }},
+        {"parse/mset-10", nullptr, [&](size_t) {
+            RESPParser parser;
+            RESPObject obj = parser.parse(mset_input);
+        }},
+        {"dispatch/ping", nullptr, [&](size_t i) {
+            handle_command(pings[i % KEY_COUNT], client, replica_info);
+            client.output.clear();
+        }},
+        {"dispatch/set", nullptr, [&](size_t i) {
+            handle_command(sets[i % KEY_COUNT], client, replica_info);
+            client.output.clear();
+        }},
+        {"dispatch/get", fill_strings, [&](size_t i) {
+            handle_command(gets[i % KEY_COUNT], client, replica_info);
+            client.output.clear();
+        }},
+        // What handle_command adds per command for INFO commandstats: the name
+        // lookup, which also picks the handler, and the recording around it.
+        {"stats/lookup", nullptr, [&](size_t i) {
+            volatile int id = command_stats_id(gets[i % KEY_COUNT].get_array()[0].get_string_value());
+            (void)id;
+        }},
+        {"stats/record", nullptr, [&](size_t) {
+            uint64_t started = stats_clock();
+            record_command(0, stats_clock() - started, false);
+        }},
+        {"handle_set", nullptr, run_handler(sets, handle_set)},
+        {"handle_get", fill_strings, run_handler(gets, handle_get)},
+        {"handle_lrange/100", fill_lists, run_handler(lranges, handle_lrange)},
+        {"handle_xadd", nullptr, run_handler(xadds, handle_xadd)},
+        {"handle_xrange/100", fill_streams, run_handler(xranges, handle_xrange)},
+    };
+
+    if (csv) {
+        printf("\"benchmark\",\"iterations\",\"ns_per_op\",\"allocs_per_op\",\"bytes_per_op\"\n");
+    }
+    else {
+        printf("%-20s %12s %12s %12s %12s\n", "benchmark", "iterations", "ns/op", "allocs/op", "bytes/op");
+    }
+    for (const Benchmark& benchmark : benchmarks) {
+        bool selected = filters.empty();
+        for (const string& filter : filters) {
+            selected |= benchmark.name.find(filter) != string::npos;
+        }
+        if (!selected) {
+            continue;
+        }
+        if (benchmark.setup) {
+            benchmark.setup();
+        }
+        Result result = measure(benchmark, min_seconds);
+        if (csv) {
+            printf("\"%s\",%llu,%.1f,%.2f,%.1f\n", benchmark.name.c_str(), (unsigned long long)result.iterations,
+                   result.ns_per_op, result.allocs_per_op, result.bytes_per_op);
+        }
+        else {
+            printf("%-20s %12llu %12.1f %12.2f %12.1f\n", benchmark.name.c_str(), (unsigned long long)result.iterations,
+                   result.ns_per_op, result.allocs_per_op, result.bytes_per_op);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,427 @@
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "io_threads.h"
+#include "handle_redis_commands.h"
+#include "blocking.h"
+#include "redis_parser.h"
+#include "spsc_queue.h"
+#include "clients.h"
+#include "pubsub.h"
+#include "logger.h"
+
+using namespace std;
+
+int io_threads_count = 0;
+
+// Each queue holds at most one entry per connection on its I/O thread, since a
+// connection has at most one batch at the execution thread at a time.
+const size_t IO_QUEUE_CAPACITY = 16 * 1024;
+// Empty polling rounds the execution thread spins through before it sleeps.
+const int EXEC_SPIN_ROUNDS = 2000;
+const size_t OUTPUT_KEEP_CAPACITY = 64 * 1024;
+
+struct IoConnection {
+    int fd;
+    ClientState client;
+    string input;
+
+    // Commands parsed off input, waiting for or being run by the execution
+    // thread. While in_flight is set the execution thread owns client; it
+    // keeps it, with the rest of the batch, while a command is parked there.
+    vector<RESPObject> batch;
+    size_t next_command = 0;
+    string protocol_error;
+    bool in_flight = false;
+    size_t io_index;            // the I/O thread serving the socket
+
+    uint32_t events = 0;        // epoll events registered for fd, 0 if none
+    bool peer_closed = false;   // read hit EOF; close once everything read is answered
+    bool gone = false;          // closed or handed off, freed after this epoll round
+};
+
+struct IoThread {
+    int epoll_fd;
+    int wake_fd;                                    // eventfd, bumped when done or mailboxes have entries
+    SpscQueue<IoConnection*> submitted{IO_QUEUE_CAPACITY};  // to the execution thread
+    SpscQueue<IoConnection*> done{IO_QUEUE_CAPACITY};       // back from it, replies in client.output
+    // Connections closed or handed off this round. Later events from the same
+    // epoll_wait() may still point at them, so they are freed after the round.
+    vector<IoConnection*> retired;
+    // Subscribers served here with new messages, posted by publishers.
+    unique_ptr<MailboxLoop> mailboxes;
+};
+
+static vector<unique_ptr<IoThread>> io_threads;
+static size_t next_io_thread = 0;
+
+static mutex exec_mutex;
+static condition_variable exec_cv;
+static atomic<bool> exec_idle{false};
+
+static void wake_execution_thread() {
+    // Pairs with the fence in execution_loop: either it sees the work before
+    // it sleeps, or this sees it asleep and wakes it.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (exec_idle.load()) {
+        lock_guard<mutex> lock(exec_mutex);
+        exec_idle = false;
+        exec_cv.notify_one();
+    }
+}
+
+// The commands parked on the execution thread.
+static unique_ptr<BlockedClients> exec_blocked;
+
+static void submit(IoThread& io, IoConnection* conn) {
+    while (!io.submitted.push(conn)) {
+        this_thread::yield();
+    }
+    wake_execution_thread();
+}
+
+// Registers interest in input until the peer closes, and in writability while
+// replies are waiting to go out.
+static void update_events(IoThread& io, IoConnection* conn) {
+    uint32_t wanted = conn->peer_closed ? 0u : (uint32_t)EPOLLIN;
+    if (!conn->in_flight && !conn->client.output.empty()) {
+        wanted |= EPOLLOUT;
+    }
+    if (wanted == conn->events) {
+        return;
+    }
+    epoll_event ev = {};
+    ev.events = wanted;
+    ev.data.ptr = conn;
+    int op = conn->events == 0 ? EPOLL_CTL_ADD : wanted == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    epoll_ctl(io.epoll_fd, op, conn->fd, &ev);
+    conn->events = wanted;
+}
+
+static void retire(IoThread& io, IoConnection* conn) {
+    if (conn->events != 0) {
+        epoll_ctl(io.epoll_fd, EPOLL_CTL_DEL, conn->fd, nullptr);
+    }
+    conn->gone = true;
+    io.retired.push_back(conn);
+}
+
+static void close_connection(IoThread& io, IoConnection* conn) {
+    retire(io, conn);
+    release_client_state(conn->client);
+    io.mailboxes->forget(conn);
+    unregister_client(conn->client);
+    close(conn->fd);
+}
+
+// Moves a connection that is about to run PSYNC onto its own thread, which keeps
+// serving it the way the default mode does.
+static void hand_off(IoThread& io, IoConnection* conn, const vector<pair<string, string>>& replica_info) {
+    retire(io, conn);
+    leave_mailbox_loop(conn->client);
+    fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) & ~O_NONBLOCK);
+    thread client_thread(handle_client, conn->fd, ref(replica_info), std::move(conn->client), std::move(conn->input));
+    client_thread.detach();
+}
+
+// Parses the complete requests in input into a batch and sends it to the
+// execution thread, stopping short of any command that needs a thread of its
+// own. If that command is next, the connection is handed off instead.
+static void dispatch(IoThread& io, IoConnection* conn, const vector<pair<string, string>>& replica_info) {
+    RESPParser parser;
+    size_t consumed = 0;
+    bool blocking_next = false;
+    try {
+        while (consumed < conn->input.size()) {
+            RESPObject obj = parser.parse(conn->input);
+            if (command_needs_own_thread(obj)) {
+                blocking_next = true;
+                break;
+            }
+            consumed = parser.get_position();
+            conn->batch.push_back(std::move(obj));
+        }
+    }
+    catch (const RESPIncompleteError&) {
+    }
+    catch (const exception& ex) {
+        conn->protocol_error = ex.what();
+        consumed = conn->input.size();
+    }
+    conn->input.erase(0, consumed);
+
+    if (!conn->batch.empty() || !conn->protocol_error.empty()) {
+        conn->in_flight = true;
+        submit(io, conn);
+    }
+    else if (blocking_next) {
+        hand_off(io, conn, replica_info);
+    }
+}
+
+// Reads until the socket is drained or the peer has closed.
+static void read_input(IoConnection* conn) {
+    char buffer[16 * 1024];
+    while (true) {
+        ssize_t bytes_read = read(conn->fd, buffer, sizeof(buffer));
+        if (bytes_read > 0) {
+            conn->input.append(buffer, bytes_read);
+            if (bytes_read < (ssize_t)sizeof(buffer)) {
+                return;
+            }
+            continue;
+        }
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            conn->peer_closed = true;
+        }
+        return;
+    }
+}
+
+// Moves a connection along once the execution thread doesn't hold it: writes
+// what the socket takes, with any messages published to it, and only when
+// earlier replies are all out sends the next batch, so a client that doesn't
+// read its replies stops being served instead of growing its buffer.
+static void service(IoThread& io, IoConnection* conn, const vector<pair<string, string>>& replica_info) {
+    if (conn->in_flight) {
+        return;
+    }
+    if (conn->client.subscriber) {
+        take_messages(conn->client);
+    }
+    if (!conn->client.output.flush(conn->fd)) {
+        close_connection(io, conn);
+        return;
+    }
+    if (conn->client.output.empty()) {
+        if (conn->client.output.text.capacity() > 16 * OUTPUT_KEEP_CAPACITY) {
+            string().swap(conn->client.output.text);
+        }
+        dispatch(io, conn, replica_info);
+        if (conn->gone) {
+            return;
+        }
+        if (conn->peer_closed && !conn->in_flight) {
+            close_connection(io, conn);
+            return;
+        }
+    }
+    if (!conn->in_flight) {
+        note_client_buffers(conn->client, conn->input.size());
+    }
+    update_events(io, conn);
+}
+
+static void io_loop(IoThread& io, const vector<pair<string, string>>& replica_info) {
+    epoll_event events[256];
+    vector<void*> posted;
+    while (true) {
+        int count = epoll_wait(io.epoll_fd, events, 256, -1);
+        for (int i = 0; i < count; ++i) {
+            IoConnection* conn = (IoConnection*)events[i].data.ptr;
+
+            if (conn == nullptr) {
+                uint64_t wakeups;
+                if (read(io.wake_fd, &wakeups, sizeof(wakeups)) < 0) {
+                    continue;
+                }
+                while (io.done.pop(conn)) {
+                    conn->in_flight = false;
+                    service(io, conn, replica_info);
+                }
+                // A connection at the execution thread takes its messages
+                // when it is back.
+                io.mailboxes->take(posted);
+                for (void* subscriber : posted) {
+                    service(io, (IoConnection*)subscriber, replica_info);
+                }
+                posted.clear();
+                continue;
+            }
+            if (conn->gone) {
+                continue;
+            }
+
+            if ((events[i].events & EPOLLERR) && !conn->in_flight) {
+                // Usually zero-copy completions; a real error shows up in read().
+                conn->client.output.reap_zerocopy(conn->fd);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                read_input(conn);
+            }
+            service(io, conn, replica_info);
+        }
+
+        for (IoConnection* conn : io.retired) {
+            delete conn;
+        }
+        io.retired.clear();
+    }
+}
+
+// Runs the batch from where it stopped. Returns false if a command parked,
+// which leaves the rest of the batch for when it has answered.
+static bool run_batch(IoConnection* conn, const vector<pair<string, string>>& replica_info) {
+    while (conn->next_command < conn->batch.size()) {
+        RESPObject& obj = conn->batch[conn->next_command++];
+        if (run_loop_command(obj, conn->client, replica_info, *exec_blocked, conn)) {
+            return false;
+        }
+    }
+    conn->batch.clear();
+    conn->next_command = 0;
+    if (!conn->protocol_error.empty()) {
+        Reply(conn->client.output).error("ERR Protocol error: " + conn->protocol_error);
+        conn->protocol_error.clear();
+    }
+    return true;
+}
+
+static void hand_back(IoConnection* conn, vector<bool>& woken) {
+    while (!io_threads[conn->io_index]->done.push(conn)) {
+        this_thread::yield();
+    }
+    woken[conn->io_index] = true;
+}
+
+// The one thread that runs commands in this mode. It takes batches from every
+// I/O thread in turn and hands each back with its replies, except while one
+// of its commands is parked.
+static void execution_loop(const vector<pair<string, string>>& replica_info) {
+    exec_blocked->serve_on_this_thread();
+    vector<BlockedClients::Ready> ready;
+    vector<bool> woken(io_threads.size(), false);
+    int idle_rounds = 0;
+    while (true) {
+        bool worked = false;
+        for (size_t i = 0; i < io_threads.size(); ++i) {
+            IoThread& io = *io_threads[i];
+            IoConnection* conn;
+            while (io.submitted.pop(conn)) {
+                if (run_batch(conn, replica_info)) {
+                    hand_back(conn, woken);
+                }
+                worked = true;
+            }
+        }
+        if (exec_blocked->has_ready()) {
+            exec_blocked->take_ready(ready);
+            for (BlockedClients::Ready& entry : ready) {
+                IoConnection* conn = (IoConnection*)entry.connection;
+                if (!resume_loop_command(entry.command, conn->client, replica_info, *exec_blocked, conn) &&
+                    run_batch(conn, replica_info)) {
+                    hand_back(conn, woken);
+                }
+            }
+            ready.clear();
+            worked = true;
+        }
+        // One wakeup per I/O thread per round, however many batches it got back.
+        for (size_t i = 0; i < io_threads.size(); ++i) {
+            if (woken[i]) {
+                uint64_t one = 1;
+                if (write(io_threads[i]->wake_fd, &one, sizeof(one)) < 0) {
+                    static LogRateLimit wake_errors;
+                    log_limited(wake_errors, LogLevel::Warning, "Failed to wake I/O thread: ", strerror(errno));
+                }
+                woken[i] = false;
+            }
+        }
+
+        if (worked) {
+            idle_rounds = 0;
+            continue;
+        }
+        if (++idle_rounds < EXEC_SPIN_ROUNDS) {
+            continue;
+        }
+        idle_rounds = 0;
+
+        unique_lock<mutex> lock(exec_mutex);
+        exec_idle = true;
+        atomic_thread_fence(memory_order_seq_cst);
+        bool pending = exec_blocked->has_ready();
+        for (auto& io : io_threads) {
+            pending = pending || !io->submitted.empty();
+        }
+        if (pending) {
+            exec_idle = false;
+            continue;
+        }
+        // Until something is submitted or signalled, or the first parked
+        // command's deadline.
+        int timeout = exec_blocked->timeout_ms();
+        if (timeout < 0) {
+            exec_cv.wait(lock, [] { return !exec_idle.load(); });
+        }
+        else {
+            exec_cv.wait_for(lock, chrono::milliseconds(timeout), [] { return !exec_idle.load(); });
+        }
+        exec_idle = false;
+    }
+}
+
+void start_io_threads(const vector<pair<string, string>>& replica_info) {
+    exec_blocked.reset(new BlockedClients(wake_execution_thread));
+    for (int i = 0; i < io_threads_count; ++i) {
+        unique_ptr<IoThread> io(new IoThread());
+        io->epoll_fd = epoll_create1(0);
+        io->wake_fd = eventfd(0, EFD_NONBLOCK);
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr;
+        epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, io->wake_fd, &ev);
+        int wake_fd = io->wake_fd;
+        io->mailboxes.reset(new MailboxLoop([wake_fd] {
+            uint64_t one = 1;
+            if (write(wake_fd, &one, sizeof(one)) < 0) {
+                // The counter is already set; the thread is awake or about to be.
+            }
+        }));
+        io_threads.push_back(std::move(io));
+    }
+    for (auto& io : io_threads) {
+        thread io_thread(io_loop, ref(*io), ref(replica_info));
+        io_thread.detach();
+    }
+    thread exec_thread(execution_loop, ref(replica_info));
+    exec_thread.detach();
+}
+
+void add_io_connection(int client_fd) {
+    size_t io_index = next_io_thread;
+    IoThread& io = *io_threads[io_index];
+    next_io_thread = (next_io_thread + 1) % io_threads.size();
+
+    fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+    IoConnection* conn = new IoConnection();
+    conn->fd = client_fd;
+    conn->io_index = io_index;
+    conn->client.fd = client_fd;
+    conn->client.mailbox_loop = io.mailboxes.get();
+    conn->client.loop_connection = conn;
+    register_client(conn->client, client_fd);
+    conn->client.output.text.reserve(OUTPUT_KEEP_CAPACITY);
+    conn->events = EPOLLIN;
+
+    // From here on the I/O thread owns conn.
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    epoll_ctl(io.epoll_fd, EPOLL_CTL_ADD, client_fd, &ev);
+}
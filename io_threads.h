@@ -0,0 +1,27 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <utility>
+#include "client.h"
+
+using namespace std;
+
+// --io-threads N: instead of a thread per connection, N I/O threads own the
+// client sockets. They read and parse requests and write replies, and a single
+// execution thread runs every client command. A blocking command (BLPOP,
+// BZPOPMIN, XREAD BLOCK, WAIT) parks its connection on that thread until it
+// can answer (blocking.h). Handlers still take the store locks: the link to a
+// master, full syncs and active defrag reach the keyspace from threads of
+// their own. Subscribers and tracking connections stay with their I/O thread,
+// which writes out the messages and invalidations pushed to them. Connections
+// about to run PSYNC are handed to a thread of their own, as in the default
+// mode.
+extern int io_threads_count;
+
+void start_io_threads(const vector<pair<string, string>>& replica_info);
+// Gives a newly accepted connection to one of the I/O threads.
+void add_io_connection(int client_fd);
+
+// Serves a connection on the calling thread until it closes, starting with any
+// input already read for it. Defined in Server.cpp.
+void handle_client(int client_fd, const vector<pair<string, string>>& replica_info, ClientState client, string input);
@@ -0,0 +1,574 @@
+#include <string>
+#include <vector>
+#include <thread>
+#include <functional>
+#include <utility>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <signal.h>
+#include "io_uring_loop.h"
+#include "io_threads.h"
+#include "handle_redis_commands.h"
+#include "blocking.h"
+#include "redis_parser.h"
+#include "clients.h"
+#include "pubsub.h"
+#include "logger.h"
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#endif
+// Multishot receive and DEFER_TASKRUN arrived together with the other pieces
+// used here (provided buffer rings, multishot accept) by Linux 6.1.
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_SETUP_DEFER_TASKRUN) && defined(__NR_io_uring_setup)
+#define IKVDB_HAVE_IO_URING 1
+#endif
+
+using namespace std;
+
+bool io_uring_enabled = false;
+
+#ifndef IKVDB_HAVE_IO_URING
+
+void run_io_uring(int listen_fd, const vector<pair<string, string>>& replica_info) {
+}
+
+#else
+
+const unsigned URING_SQ_ENTRIES = 1024;
+const unsigned URING_CQ_ENTRIES = 8192;
+// Provided receive buffers, shared by all connections. Each is copied into its
+// connection's input and handed back to the kernel as soon as it completes.
+const unsigned URING_BUFFER_COUNT = 512;
+const size_t URING_BUFFER_SIZE = 16 * 1024;
+const unsigned short URING_BUFFER_GROUP = 0;
+const size_t OUTPUT_KEEP_CAPACITY = 64 * 1024;
+
+// The low bits of a request's user_data say what it was; the rest is the
+// connection it was for.
+enum UringOp : uint64_t { OP_ACCEPT = 1, OP_RECV = 2, OP_SEND = 3, OP_CANCEL = 4, OP_BUFFERS = 5, OP_WAKE = 6 };
+const uint64_t URING_OP_MASK = 7;
+
+struct Ring {
+    int fd = -1;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe* cqes;
+
+    unsigned sq_filled = 0;     // tail including entries not yet submitted
+    unsigned sq_submitted = 0;  // tail the kernel has been told about
+
+    // Receive buffers go back to the kernel through a shared buffer ring, or
+    // with IORING_OP_PROVIDE_BUFFERS requests where the ring doesn't work.
+    io_uring_buf_ring* buffers = nullptr;
+    unsigned short buffer_tail = 0;
+    bool provide_buffers = false;
+    vector<char> buffer_memory;
+};
+
+struct UringConnection {
+    int fd;
+    ClientState client;
+    string input;
+
+    // The replies a send in flight is writing. client.output collects the next
+    // ones meanwhile, so the memory the kernel reads from never moves.
+    OutputBuffer sending;
+    iovec iov[OUTPUT_MAX_IOV];
+    msghdr msg;
+
+    bool recv_armed = false;
+    bool send_in_flight = false;
+    bool cancel_in_flight = false;
+    bool peer_closed = false;   // recv hit EOF; close once everything read is answered
+    bool failed = false;        // send or recv error; close without answering more
+    bool handing_off = false;   // a command that needs its own thread is next in input
+    bool parked = false;        // a command waits in the loop's BlockedClients
+    bool ready = false;         // queued to be moved along after this round
+};
+
+static bool ring_setup(Ring& ring) {
+    io_uring_params params = {};
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_CQ_ENTRIES;
+    ring.fd = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &params);
+    if (ring.fd < 0) {
+        return false;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(ring.fd);
+        return false;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    size_t rings_size = max(sq_size, cq_size);
+    char* rings = (char*)mmap(nullptr, rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                              ring.fd, IORING_OFF_SQ_RING);
+    void* sqes = mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (rings == MAP_FAILED || sqes == MAP_FAILED) {
+        close(ring.fd);
+        return false;
+    }
+
+    ring.sq_head = (unsigned*)(rings + params.sq_off.head);
+    ring.sq_tail = (unsigned*)(rings + params.sq_off.tail);
+    ring.sq_mask = *(unsigned*)(rings + params.sq_off.ring_mask);
+    ring.sq_entries = params.sq_entries;
+    ring.sqes = (io_uring_sqe*)sqes;
+    ring.cq_head = (unsigned*)(rings + params.cq_off.head);
+    ring.cq_tail = (unsigned*)(rings + params.cq_off.tail);
+    ring.cq_mask = *(unsigned*)(rings + params.cq_off.ring_mask);
+    ring.cqes = (io_uring_cqe*)(rings + params.cq_off.cqes);
+
+    // Submission slot i always names sqes[i].
+    unsigned* sq_array = (unsigned*)(rings + params.sq_off.array);
+    for (unsigned i = 0; i < ring.sq_entries; ++i) {
+        sq_array[i] = i;
+    }
+    ring.sq_filled = ring.sq_submitted = *ring.sq_tail;
+    return true;
+}
+
+// Publishes the filled submissions and, with wait set, blocks until at least
+// one completion is ready or timeout_ms passes (-1: no limit). This is the
+// only system call in the loop.
+static int ring_enter(Ring& ring, bool wait, int timeout_ms = -1) {
+    __atomic_store_n(ring.sq_tail, ring.sq_filled, __ATOMIC_RELEASE);
+    unsigned to_submit = ring.sq_filled - ring.sq_submitted;
+    if (wait && timeout_ms >= 0) {
+        __kernel_timespec ts = {timeout_ms / 1000, (long long)(timeout_ms % 1000) * 1000000};
+        io_uring_getevents_arg arg = {};
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = (uint64_t)&ts;
+        int ret = syscall(__NR_io_uring_enter, ring.fd, to_submit, 1,
+                          IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        if (ret > 0) {
+            ring.sq_submitted += ret;
+        }
+        return ret;
+    }
+    int ret = syscall(__NR_io_uring_enter, ring.fd, to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    if (ret > 0) {
+        ring.sq_submitted += ret;
+    }
+    return ret;
+}
+
+static io_uring_sqe* ring_sqe(Ring& ring, uint64_t user_data) {
+    while (ring.sq_filled - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) == ring.sq_entries) {
+        ring_enter(ring, false);
+    }
+    io_uring_sqe* sqe = &ring.sqes[ring.sq_filled & ring.sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = user_data;
+    ring.sq_filled++;
+    return sqe;
+}
+
+static void recycle_buffer(Ring& ring, unsigned short id) {
+    char* memory = ring.buffer_memory.data() + id * URING_BUFFER_SIZE;
+    if (ring.provide_buffers) {
+        io_uring_sqe* sqe = ring_sqe(ring, OP_BUFFERS);
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = 1;                    // buffer count
+        sqe->addr = (uint64_t)memory;
+        sqe->len = URING_BUFFER_SIZE;
+        sqe->buf_group = URING_BUFFER_GROUP;
+        sqe->off = id;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        return;
+    }
+    // The entries start at the ring's first byte, but in C++ the header's
+    // flexible bufs[] lands 8 bytes in, so they are indexed from the base.
+    io_uring_buf* buf = (io_uring_buf*)ring.buffers + (ring.buffer_tail & (URING_BUFFER_COUNT - 1));
+    buf->addr = (uint64_t)memory;
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = id;
+    ring.buffer_tail++;
+    __atomic_store_n(&ring.buffers->tail, ring.buffer_tail, __ATOMIC_RELEASE);
+}
+
+// Some kernels accept a buffer ring yet never pick buffers from it, so one is
+// checked with a one-byte read from a pipe before it is relied on.
+static bool buffer_ring_works(Ring& ring) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+        return false;
+    }
+    bool works = false;
+    if (write(fds[1], "x", 1) == 1) {
+        io_uring_sqe* sqe = ring_sqe(ring, 0);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fds[0];
+        sqe->off = (uint64_t)-1;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUFFER_GROUP;
+        if (ring_enter(ring, true) >= 0) {
+            unsigned head = *ring.cq_head;
+            const io_uring_cqe& cqe = ring.cqes[head & ring.cq_mask];
+            works = cqe.res == 1;
+            if (cqe.flags & IORING_CQE_F_BUFFER) {
+                recycle_buffer(ring, cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+            __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+        }
+    }
+    close(fds[0]);
+    close(fds[1]);
+    return works;
+}
+
+static void buffers_setup(Ring& ring) {
+    ring.buffer_memory.resize(URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+
+    size_t ring_size = URING_BUFFER_COUNT * sizeof(io_uring_buf);
+    void* memory = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    io_uring_buf_reg reg = {};
+    reg.ring_addr = (uint64_t)memory;
+    reg.ring_entries = URING_BUFFER_COUNT;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (memory != MAP_FAILED && syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) == 0) {
+        ring.buffers = (io_uring_buf_ring*)memory;
+        for (unsigned i = 0; i < URING_BUFFER_COUNT; ++i) {
+            recycle_buffer(ring, i);
+        }
+        if (buffer_ring_works(ring)) {
+            return;
+        }
+        syscall(__NR_io_uring_register, ring.fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        ring.buffers = nullptr;
+    }
+    if (memory != MAP_FAILED) {
+        munmap(memory, ring_size);
+    }
+
+    ring.provide_buffers = true;
+    io_uring_sqe* sqe = ring_sqe(ring, OP_BUFFERS);
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = URING_BUFFER_COUNT;
+    sqe->addr = (uint64_t)ring.buffer_memory.data();
+    sqe->len = URING_BUFFER_SIZE;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->off = 0;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+}
+
+static uint64_t tag(UringConnection* conn, UringOp op) {
+    return (uint64_t)conn | op;
+}
+
+static void arm_accept(Ring& ring, int listen_fd) {
+    io_uring_sqe* sqe = ring_sqe(ring, OP_ACCEPT);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+static void arm_recv(Ring& ring, UringConnection* conn) {
+    io_uring_sqe* sqe = ring_sqe(ring, tag(conn, OP_RECV));
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    conn->recv_armed = true;
+}
+
+// Watches the eventfd that threads other than the loop's bump when they
+// signal its parked commands.
+static void arm_wake(Ring& ring, int wake_fd) {
+    io_uring_sqe* sqe = ring_sqe(ring, OP_WAKE);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = wake_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+static void cancel_recv(Ring& ring, UringConnection* conn) {
+    io_uring_sqe* sqe = ring_sqe(ring, tag(conn, OP_CANCEL));
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = tag(conn, OP_RECV);
+    conn->cancel_in_flight = true;
+}
+
+// Starts a send of whatever replies are waiting, unless one is in flight.
+static void submit_send(Ring& ring, UringConnection* conn) {
+    if (conn->send_in_flight) {
+        return;
+    }
+    if (conn->sending.empty()) {
+        if (conn->client.output.empty()) {
+            return;
+        }
+        swap(conn->sending, conn->client.output);
+    }
+    conn->msg = {};
+    conn->msg.msg_iov = conn->iov;
+    conn->msg.msg_iovlen = conn->sending.pending_iov(conn->iov, OUTPUT_MAX_IOV);
+
+    io_uring_sqe* sqe = ring_sqe(ring, tag(conn, OP_SEND));
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)&conn->msg;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    conn->send_in_flight = true;
+}
+
+// Runs the complete requests in input, stopping after a command that parks
+// and short of any command that needs a thread of its own, so the connection
+// can be handed off with it.
+static void run_input(UringConnection* conn, BlockedClients& blocked, const vector<pair<string, string>>& replica_info) {
+    RESPParser parser;
+    size_t consumed = 0;
+    try {
+        while (consumed < conn->input.size()) {
+            RESPObject obj = parser.parse(conn->input);
+            if (command_needs_own_thread(obj)) {
+                conn->handing_off = true;
+                break;
+            }
+            consumed = parser.get_position();
+            if (run_loop_command(obj, conn->client, replica_info, blocked, conn)) {
+                conn->parked = true;
+                break;
+            }
+        }
+    }
+    catch (const RESPIncompleteError&) {
+    }
+    catch (const exception& ex) {
+        Reply(conn->client.output).error("ERR Protocol error: " + string(ex.what()));
+        consumed = conn->input.size();
+    }
+    conn->input.erase(0, consumed);
+}
+
+// Moves a connection along after its completions this round. Returns false
+// once it is closed or handed off and can be freed.
+static bool progress(Ring& ring, UringConnection* conn, BlockedClients& blocked, MailboxLoop& mailboxes,
+                     const vector<pair<string, string>>& replica_info) {
+    if (conn->client.subscriber && !conn->failed) {
+        take_messages(conn->client);
+    }
+    // While a send is in flight, one more round of replies may queue behind
+    // it; a client that doesn't read them stops being served.
+    bool output_blocked = conn->send_in_flight && !conn->client.output.empty();
+    if (!conn->failed && !conn->handing_off && !conn->parked && !output_blocked) {
+        run_input(conn, blocked, replica_info);
+    }
+    if (!conn->failed) {
+        submit_send(ring, conn);
+    }
+    note_client_buffers(conn->client, conn->input.size());
+
+    bool output_idle = !conn->send_in_flight && conn->sending.empty() && conn->client.output.empty();
+    bool done = conn->failed || (conn->handing_off && output_idle) || (conn->peer_closed && output_idle);
+    if (!done) {
+        return true;
+    }
+    if (conn->parked) {
+        // A client that leaves stops waiting.
+        blocked.remove(conn);
+        conn->parked = false;
+    }
+    if (conn->recv_armed) {
+        if (!conn->cancel_in_flight) {
+            cancel_recv(ring, conn);
+        }
+        return true;
+    }
+    if (conn->send_in_flight || conn->cancel_in_flight) {
+        return true;
+    }
+
+    if (conn->handing_off && !conn->failed) {
+        // Any input received after the command goes along with it.
+        leave_mailbox_loop(conn->client);
+        thread client_thread(handle_client, conn->fd, ref(replica_info), std::move(conn->client), std::move(conn->input));
+        client_thread.detach();
+        return false;
+    }
+    release_client_state(conn->client);
+    mailboxes.forget(conn);
+    unregister_client(conn->client);
+    close(conn->fd);
+    return false;
+}
+
+static void handle_completion(Ring& ring, const io_uring_cqe& cqe, int listen_fd, int wake_fd,
+                              MailboxLoop& mailboxes, vector<UringConnection*>& ready) {
+    UringOp op = (UringOp)(cqe.user_data & URING_OP_MASK);
+    UringConnection* conn = (UringConnection*)(cqe.user_data & ~URING_OP_MASK);
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+
+    if (op == OP_BUFFERS) {
+        return;     // only failures complete, and a buffer lost is only capacity lost
+    }
+    if (op == OP_WAKE) {
+        // Only a wakeup; signalled commands and posted messages are seen to
+        // after this round.
+        uint64_t wakeups;
+        if (read(wake_fd, &wakeups, sizeof(wakeups)) < 0) {
+        }
+        if (!more) {
+            arm_wake(ring, wake_fd);
+        }
+        return;
+    }
+    if (op == OP_ACCEPT) {
+        if (cqe.res >= 0) {
+            conn = new UringConnection();
+            conn->fd = cqe.res;
+            conn->client.fd = cqe.res;
+            conn->client.mailbox_loop = &mailboxes;
+            conn->client.loop_connection = conn;
+            register_client(conn->client, cqe.res);
+            conn->client.output.text.reserve(OUTPUT_KEEP_CAPACITY);
+            arm_recv(ring, conn);
+        }
+        if (!more) {
+            arm_accept(ring, listen_fd);
+        }
+        return;
+    }
+
+    if (op == OP_RECV) {
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+            unsigned short id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            if (cqe.res > 0) {
+                conn->input.append(ring.buffer_memory.data() + id * URING_BUFFER_SIZE, cqe.res);
+            }
+            recycle_buffer(ring, id);
+        }
+        if (!more) {
+            conn->recv_armed = false;
+            if (cqe.res == 0) {
+                conn->peer_closed = true;
+            }
+            else if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED) {
+                conn->failed = true;
+            }
+            else if (!conn->handing_off && !conn->failed && !conn->cancel_in_flight) {
+                // Out of buffers, or the kernel ended the multishot: carry on.
+                arm_recv(ring, conn);
+            }
+        }
+    }
+    else if (op == OP_SEND) {
+        conn->send_in_flight = false;
+        if (cqe.res < 0) {
+            conn->failed = true;
+        }
+        else if (conn->sending.consume(cqe.res) && conn->sending.text.capacity() > 16 * OUTPUT_KEEP_CAPACITY) {
+            // Don't let one huge reply pin its buffer for the rest of the connection.
+            string().swap(conn->sending.text);
+        }
+    }
+    else if (op == OP_CANCEL) {
+        conn->cancel_in_flight = false;
+    }
+
+    if (!conn->ready) {
+        conn->ready = true;
+        ready.push_back(conn);
+    }
+}
+
+void run_io_uring(int listen_fd, const vector<pair<string, string>>& replica_info) {
+    Ring ring;
+    if (!ring_setup(ring)) {
+        return;
+    }
+    buffers_setup(ring);
+    arm_accept(ring, listen_fd);
+    int wake_fd = eventfd(0, EFD_NONBLOCK);
+    arm_wake(ring, wake_fd);
+    auto wake = [wake_fd] {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0) {
+            // The counter is already set; the loop is awake or about to be.
+        }
+    };
+    BlockedClients blocked(wake);
+    blocked.serve_on_this_thread();
+    MailboxLoop mailboxes(wake);
+
+    vector<UringConnection*> ready;
+    vector<void*> posted;
+    vector<BlockedClients::Ready> unblocked;
+    while (true) {
+        // Waits no longer than until the first parked command's deadline.
+        int timeout = blocked.timeout_ms();
+        if (ring_enter(ring, timeout != 0, timeout) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY &&
+            errno != ETIME) {
+            static LogRateLimit enter_errors;
+            log_limited(enter_errors, LogLevel::Warning, "io_uring_enter failed: ", strerror(errno));
+        }
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            handle_completion(ring, ring.cqes[head & ring.cq_mask], listen_fd, wake_fd, mailboxes, ready);
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+        // Subscribers with new messages are moved along like the others.
+        if (mailboxes.has_posts()) {
+            mailboxes.take(posted);
+            for (void* subscriber : posted) {
+                UringConnection* conn = (UringConnection*)subscriber;
+                if (!conn->ready) {
+                    conn->ready = true;
+                    ready.push_back(conn);
+                }
+            }
+            posted.clear();
+        }
+
+        // Everything these queue is submitted by the next ring_enter(), along
+        // with the wait for the next round.
+        for (UringConnection* conn : ready) {
+            conn->ready = false;
+            if (!progress(ring, conn, blocked, mailboxes, replica_info)) {
+                delete conn;
+            }
+        }
+        ready.clear();
+
+        // Parked commands whose keys were written, whose replicas answered or
+        // whose time is up run again, and their connections go on.
+        if (blocked.has_ready()) {
+            blocked.take_ready(unblocked);
+            for (BlockedClients::Ready& entry : unblocked) {
+                UringConnection* conn = (UringConnection*)entry.connection;
+                if (resume_loop_command(entry.command, conn->client, replica_info, blocked, conn)) {
+                    continue;
+                }
+                conn->parked = false;
+                if (!progress(ring, conn, blocked, mailboxes, replica_info)) {
+                    delete conn;
+                }
+            }
+            unblocked.clear();
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,24 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <utility>
+
+using namespace std;
+
+// --io-uring yes: one thread serves every connection through io_uring instead
+// of a thread per connection blocking in read() and write(). Accepts and
+// receives are multishot requests that stay armed, received data lands in a
+// ring of provided buffers the kernel picks from, and the replies to a whole
+// round of completions are submitted by the same io_uring_enter() that waits
+// for the next round, so pipelined load costs next to no system calls per
+// command. Commands run on that thread, and a blocking command parks its
+// connection there until it can answer (blocking.h), and subscribers and
+// tracking connections get their pushes there. A connection about to run
+// PSYNC moves to a thread of its own, as in the default mode.
+extern bool io_uring_enabled;
+
+// Serves the connections accepted on listen_fd and never returns, unless
+// io_uring can't be used: built without the kernel headers for it, or a
+// kernel (before 6.1) or sandbox that refuses the ring. Then it returns
+// straight away and the caller falls back to epoll.
+void run_io_uring(int listen_fd, const vector<pair<string, string>>& replica_info);
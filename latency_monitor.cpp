@@ -0,0 +1,82 @@
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include "latency_monitor.h"
+
+using namespace std;
+using namespace chrono;
+
+int64_t latency_monitor_threshold_ms = 0;
+
+struct LatencyHistory {
+    LatencySample samples[LATENCY_HISTORY_LEN];
+    int next = 0;               // slot the next second's sample goes in
+    int count = 0;
+    int64_t max_ms = 0;
+};
+
+static mutex latency_mutex;
+static map<string, LatencyHistory> latency_events;
+
+void latency_add_sample(const char* event, int64_t latency_ms) {
+    if (latency_monitor_threshold_ms <= 0 || latency_ms < latency_monitor_threshold_ms) {
+        return;
+    }
+    int64_t now = duration_cast<seconds>(system_clock::now().time_since_epoch()).count();
+
+    lock_guard<mutex> lock(latency_mutex);
+    LatencyHistory& history = latency_events[event];
+    history.max_ms = max(history.max_ms, latency_ms);
+    if (history.count > 0) {
+        LatencySample& last = history.samples[(history.next + LATENCY_HISTORY_LEN - 1) % LATENCY_HISTORY_LEN];
+        if (last.time == now) {
+            last.latency_ms = max(last.latency_ms, latency_ms);
+            return;
+        }
+    }
+    history.samples[history.next] = {now, latency_ms};
+    history.next = (history.next + 1) % LATENCY_HISTORY_LEN;
+    history.count = min(history.count + 1, LATENCY_HISTORY_LEN);
+}
+
+vector<LatencyEventInfo> latency_latest() {
+    lock_guard<mutex> lock(latency_mutex);
+    vector<LatencyEventInfo> latest;
+    for (const auto& entry : latency_events) {
+        const LatencyHistory& history = entry.second;
+        latest.push_back({entry.first, history.samples[(history.next + LATENCY_HISTORY_LEN - 1) % LATENCY_HISTORY_LEN],
+                          history.max_ms});
+    }
+    return latest;
+}
+
+vector<LatencySample> latency_history(const string& event) {
+    lock_guard<mutex> lock(latency_mutex);
+    vector<LatencySample> samples;
+    auto it = latency_events.find(event);
+    if (it == latency_events.end()) {
+        return samples;
+    }
+    const LatencyHistory& history = it->second;
+    for (int i = 0; i < history.count; ++i) {
+        samples.push_back(history.samples[(history.next - history.count + i + LATENCY_HISTORY_LEN) % LATENCY_HISTORY_LEN]);
+    }
+    return samples;
+}
+
+size_t latency_reset(const vector<string>& events) {
+    lock_guard<mutex> lock(latency_mutex);
+    if (events.empty()) {
+        size_t dropped = latency_events.size();
+        latency_events.clear();
+        return dropped;
+    }
+    size_t dropped = 0;
+    for (const string& event : events) {
+        dropped += latency_events.erase(event);
+    }
+    return dropped;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+
+using namespace std;
+
+// LATENCY: pauses from internal events, and commands, that took at least
+// latency_monitor_threshold_ms. Each event keeps the worst sample of every
+// second it fired in, for the last LATENCY_HISTORY_LEN such seconds, and its
+// all-time maximum. Events reported:
+//   command              a command, blocking commands excepted
+//   rehash               a resize of a keyspace table of LATENCY_REHASH_MIN_BUCKETS or more
+//   fork                 the fork of a full sync
+//   lazyfree             a batch of values freed by the lazy-free thread
+//   active-defrag-cycle  one step of active defragmentation
+extern int64_t latency_monitor_threshold_ms;    // 0 disables the monitor
+
+const int LATENCY_HISTORY_LEN = 160;
+const size_t LATENCY_REHASH_MIN_BUCKETS = 4096;
+
+struct LatencySample {
+    int64_t time;               // unix seconds
+    int64_t latency_ms;
+};
+
+struct LatencyEventInfo {
+    string event;
+    LatencySample latest;
+    int64_t max_ms;
+};
+
+void latency_add_sample(const char* event, int64_t latency_ms);
+vector<LatencyEventInfo> latency_latest();
+// Oldest first.
+vector<LatencySample> latency_history(const string& event);
+// Forgets the named events, or all of them if events is empty; returns how many were dropped.
+size_t latency_reset(const vector<string>& events);
+
+// Times its own lifetime and reports it as event, if the monitor is on and
+// enabled is set; otherwise it doesn't read the clock.
+class LatencyTimer {
+private:
+    const char* event;
+    chrono::steady_clock::time_point started;
+    bool timing;
+
+public:
+    explicit LatencyTimer(const char* e, bool enabled = true) : event(e), timing(enabled && latency_monitor_threshold_ms > 0) {
+        if (timing) {
+            started = chrono::steady_clock::now();
+        }
+    }
+    ~LatencyTimer() {
+        if (timing) {
+            latency_add_sample(event, chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count());
+        }
+    }
+
+    LatencyTimer(const LatencyTimer&) = delete;
+    LatencyTimer& operator=(const LatencyTimer&) = delete;
+};
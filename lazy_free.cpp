@@ -0,0 +1,45 @@
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include "lazy_free.h"
+#include "latency_monitor.h"
+
+using namespace std;
+
+atomic<size_t> lazyfree_pending_objects(0);
+atomic<uint64_t> lazyfreed_objects(0);
+
+static mutex lazy_free_mutex;
+static condition_variable lazy_free_cv;
+static deque<unique_ptr<LazyFreeJob>> lazy_free_queue;
+
+static void lazy_free_loop() {
+    while (true) {
+        deque<unique_ptr<LazyFreeJob>> jobs;
+        {
+            unique_lock<mutex> lock(lazy_free_mutex);
+            lazy_free_cv.wait(lock, [] { return !lazy_free_queue.empty(); });
+            jobs.swap(lazy_free_queue);
+        }
+        LatencyTimer timer("lazyfree");
+        while (!jobs.empty()) {
+            jobs.pop_front();
+            lazyfree_pending_objects--;
+            lazyfreed_objects++;
+        }
+    }
+}
+
+void lazy_free_job(unique_ptr<LazyFreeJob> job) {
+    static once_flag started;
+    call_once(started, [] { thread(lazy_free_loop).detach(); });
+
+    lazyfree_pending_objects++;
+    {
+        lock_guard<mutex> lock(lazy_free_mutex);
+        lazy_free_queue.push_back(move(job));
+    }
+    lazy_free_cv.notify_one();
+}
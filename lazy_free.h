@@ -0,0 +1,41 @@
+#pragma once
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include <utility>
+#include <type_traits>
+
+using namespace std;
+
+// Deleting a key whose value has millions of elements frees every one of them,
+// which would stall the command, and everything queued behind its store lock,
+// for seconds. Such values are unlinked from the keyspace in O(1) instead and
+// handed to a background thread that destroys them.
+
+// Values with more elements than this are freed in the background; smaller
+// ones cost less to free on the spot than to hand over.
+const size_t LAZYFREE_THRESHOLD = 64;
+
+// Objects handed over and not yet freed, and objects freed so far, for INFO.
+extern atomic<size_t> lazyfree_pending_objects;
+extern atomic<uint64_t> lazyfreed_objects;
+
+struct LazyFreeJob {
+    virtual ~LazyFreeJob() = default;
+};
+
+template <typename T>
+struct LazyFreeObject : LazyFreeJob {
+    T object;
+    explicit LazyFreeObject(T&& o) : object(move(o)) {}
+};
+
+// Queues job for the lazy-free thread, starting it on first use.
+void lazy_free_job(unique_ptr<LazyFreeJob> job);
+
+// Takes object over, leaving it moved-from, and destroys it in the background.
+template <typename T>
+void free_lazily(T&& object) {
+    using Object = decay_t<T>;
+    lazy_free_job(unique_ptr<LazyFreeJob>(new LazyFreeObject<Object>(move(object))));
+}
@@ -0,0 +1,199 @@
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include "logger.h"
+
+using namespace std;
+using namespace chrono;
+
+LogLevel log_level = LogLevel::Notice;
+
+// A bounded multi-producer ring after Vyukov's: a slot is free for the
+// producer that claims position p when its sequence is p, and holds that
+// producer's line once the sequence is p + 1. The writer thread hands it back
+// for the next lap by setting it to p + LOG_RING_SIZE.
+struct LogSlot {
+    atomic<uint64_t> sequence;
+    LogLevel level;
+    int64_t time_ms;
+    string text;
+};
+
+struct LogRing {
+    LogSlot slots[LOG_RING_SIZE];
+    atomic<uint64_t> enqueue_pos{0};
+    atomic<uint64_t> dropped{0};
+
+    // Consumer side, for the writer thread and flush_log.
+    mutex drain_mutex;
+    uint64_t dequeue_pos = 0;
+
+    // The writer sleeps on wake when the ring is empty. Producers only take
+    // wake_mutex to wake it, never while it is busy writing.
+    mutex wake_mutex;
+    condition_variable wake;
+    atomic<bool> writer_sleeping{false};
+
+    LogRing() {
+        for (size_t i = 0; i < LOG_RING_SIZE; ++i) {
+            slots[i].sequence.store(i, memory_order_relaxed);
+        }
+    }
+};
+
+// Never destroyed, so a line logged while the process exits, or the writer
+// thread itself, never touches a dead object.
+static LogRing& ring = *new LogRing;
+
+bool parse_log_level(const string& name, LogLevel& level) {
+    if (name == "debug") level = LogLevel::Debug;
+    else if (name == "verbose") level = LogLevel::Verbose;
+    else if (name == "notice") level = LogLevel::Notice;
+    else if (name == "warning") level = LogLevel::Warning;
+    else return false;
+    return true;
+}
+
+void log_line(LogLevel level, string&& line) {
+    uint64_t pos = ring.enqueue_pos.load(memory_order_relaxed);
+    LogSlot* slot;
+    while (true) {
+        slot = &ring.slots[pos & (LOG_RING_SIZE - 1)];
+        int64_t lap = (int64_t)(slot->sequence.load(memory_order_acquire) - pos);
+        if (lap == 0) {
+            if (ring.enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if (lap < 0) {
+            ring.dropped.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+        else {
+            pos = ring.enqueue_pos.load(memory_order_relaxed);
+        }
+    }
+    slot->level = level;
+    slot->time_ms = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+    slot->text = std::move(line);
+    slot->sequence.store(pos + 1, memory_order_release);
+
+    // Pairs with the writer setting writer_sleeping before it looks at the
+    // ring once more: either it sees this line or this sees it asleep.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (ring.writer_sleeping.load()) {
+        lock_guard<mutex> lock(ring.wake_mutex);
+        ring.wake.notify_one();
+    }
+}
+
+static void write_all(int fd, const string& text) {
+    size_t written = 0;
+    while (written < text.size()) {
+        ssize_t n = write(fd, text.data() + written, text.size() - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        written += n;
+    }
+}
+
+// "19 Oct 2026 09:51:00.123 * text", as Redis writes its log.
+static void format_line(string& out, LogLevel level, int64_t time_ms, const string& text) {
+    static const char marks[] = {'.', '-', '*', '#'};
+    time_t seconds = time_ms / 1000;
+    struct tm local;
+    localtime_r(&seconds, &local);
+    char stamp[64];
+    size_t len = strftime(stamp, sizeof(stamp), "%d %b %Y %H:%M:%S", &local);
+    len += snprintf(stamp + len, sizeof(stamp) - len, ".%03d %c ", (int)(time_ms % 1000), marks[(int)level]);
+    out.append(stamp, len);
+    out += text;
+    out += '\n';
+}
+
+// Writes out what is queued, one write per stream. Returns the lines written.
+static size_t drain() {
+    lock_guard<mutex> lock(ring.drain_mutex);
+    string out;
+    string err;
+    size_t lines = 0;
+    uint64_t dropped = ring.dropped.exchange(0, memory_order_relaxed);
+    if (dropped) {
+        int64_t now = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+        format_line(err, LogLevel::Warning, now, to_string(dropped) + " log lines dropped, the log ring was full");
+    }
+    while (true) {
+        LogSlot& slot = ring.slots[ring.dequeue_pos & (LOG_RING_SIZE - 1)];
+        if (slot.sequence.load(memory_order_acquire) != ring.dequeue_pos + 1) {
+            break;
+        }
+        format_line(slot.level == LogLevel::Warning ? err : out, slot.level, slot.time_ms, slot.text);
+        slot.text.clear();
+        slot.sequence.store(ring.dequeue_pos + LOG_RING_SIZE, memory_order_release);
+        ring.dequeue_pos++;
+        lines++;
+    }
+    if (!out.empty()) {
+        write_all(STDOUT_FILENO, out);
+    }
+    if (!err.empty()) {
+        write_all(STDERR_FILENO, err);
+    }
+    return lines;
+}
+
+static bool ring_empty() {
+    lock_guard<mutex> lock(ring.drain_mutex);
+    const LogSlot& slot = ring.slots[ring.dequeue_pos & (LOG_RING_SIZE - 1)];
+    return slot.sequence.load() != ring.dequeue_pos + 1 && ring.dropped.load(memory_order_relaxed) == 0;
+}
+
+static void writer_loop() {
+    while (true) {
+        if (drain() > 0) {
+            continue;
+        }
+        unique_lock<mutex> lock(ring.wake_mutex);
+        ring.writer_sleeping.store(true);
+        // A producer that queued before the flag was set didn't wake us.
+        if (ring_empty()) {
+            // Dropped lines don't wake the writer; the timeout reports them.
+            ring.wake.wait_for(lock, milliseconds(100));
+        }
+        ring.writer_sleeping.store(false);
+    }
+}
+
+void flush_log() {
+    drain();
+}
+
+void start_logger() {
+    thread(writer_loop).detach();
+    atexit(flush_log);
+}
+
+bool LogRateLimit::allow(uint64_t& dropped) {
+    int64_t now = duration_cast<seconds>(steady_clock::now().time_since_epoch()).count();
+    int64_t current = second.load(memory_order_relaxed);
+    if (now != current && second.compare_exchange_strong(current, now, memory_order_relaxed)) {
+        count.store(0, memory_order_relaxed);
+    }
+    if (count.fetch_add(1, memory_order_relaxed) >= LOG_RATE_LIMIT) {
+        suppressed.fetch_add(1, memory_order_relaxed);
+        return false;
+    }
+    dropped = suppressed.exchange(0, memory_order_relaxed);
+    return true;
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <atomic>
+#include <cstdint>
+#include <type_traits>
+
+using namespace std;
+
+// Server log. A thread that logs formats its line and puts it in a bounded
+// lock-free ring; a background thread drains the ring and writes the lines in
+// batches, Warning to stderr and the rest to stdout. Logging never blocks on
+// the terminal or the iostream lock: when the ring is full the line is dropped
+// and counted, and the count is logged once there is room. Call sites that can
+// fire once per request (parse errors, failed writes) go through a
+// LogRateLimit, so a flood of one error costs little more than a counter.
+//
+// Levels are Redis's: debug, verbose, notice (the default) and warning.
+
+enum class LogLevel { Debug, Verbose, Notice, Warning };
+
+extern LogLevel log_level;              // --loglevel
+
+const size_t LOG_RING_SIZE = 4096;      // lines; a power of two
+const int LOG_RATE_LIMIT = 10;          // lines a second per rate-limited call site
+
+// Parses debug/verbose/notice/warning into level.
+bool parse_log_level(const string& name, LogLevel& level);
+
+// Starts the writer thread, and makes exit() write out what is still queued.
+// Lines logged before it starts wait in the ring.
+void start_logger();
+// Writes out every line queued so far, from the calling thread.
+void flush_log();
+
+// Queues a formatted line; the arguments are appended in order.
+void log_line(LogLevel level, string&& line);
+
+inline void log_append(string& line, const string& s) { line += s; }
+inline void log_append(string& line, string_view s) { line += s; }
+inline void log_append(string& line, const char* s) { line += s; }
+inline void log_append(string& line, char c) { line += c; }
+template <typename T>
+enable_if_t<is_arithmetic_v<T>> log_append(string& line, T value) { line += to_string(value); }
+
+inline bool log_enabled(LogLevel level) {
+    return level >= log_level;
+}
+
+// log_message(LogLevel::Warning, "Failed to connect to master: ", strerror(errno))
+template <typename... Args>
+void log_message(LogLevel level, const Args&... args) {
+    if (!log_enabled(level)) {
+        return;
+    }
+    string line;
+    (log_append(line, args), ...);
+    log_line(level, std::move(line));
+}
+
+// Lets a call site through at most LOG_RATE_LIMIT times a second. Declared
+// static at the call site.
+class LogRateLimit {
+private:
+    atomic<int64_t> second{0};
+    atomic<int> count{0};
+    atomic<uint64_t> suppressed{0};
+
+public:
+    // Returns false for a line to drop. Otherwise returns true and sets
+    // dropped to the lines dropped since the last one let through.
+    bool allow(uint64_t& dropped);
+};
+
+template <typename... Args>
+void log_limited(LogRateLimit& limit, LogLevel level, const Args&... args) {
+    uint64_t dropped;
+    if (!log_enabled(level) || !limit.allow(dropped)) {
+        return;
+    }
+    string line;
+    (log_append(line, args), ...);
+    if (dropped) {
+        line += " (" + to_string(dropped) + " similar lines suppressed)";
+    }
+    log_line(level, std::move(line));
+}
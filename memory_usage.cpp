@@ -0,0 +1,171 @@
+#include <string>
+#include <vector>
+#include <memory>
+#include <random>
+#include <algorithm>
+#include "memory_usage.h"
+#include "clients.h"
+#include "replication.h"
+
+using namespace std;
+
+static const size_t STRING_INLINE_CAPACITY = string().capacity();
+
+// Sum of element_bytes(i) over count elements, estimated from samples of them
+// spread evenly across the range, or exact for samples == 0.
+template <typename Fn>
+static size_t sampled_bytes(size_t count, size_t samples, Fn&& element_bytes) {
+    if (count == 0) {
+        return 0;
+    }
+    if (samples == 0 || samples > count) {
+        samples = count;
+    }
+    size_t step = count / samples;
+    size_t bytes = 0;
+    for (size_t n = 0; n < samples; ++n) {
+        bytes += element_bytes(n * step);
+    }
+    return bytes * count / samples;
+}
+
+// The blocks of a libstdc++ deque over the slabs: 512-byte blocks, or one
+// element per block for larger elements, and the map of block pointers.
+template <typename T>
+static size_t deque_bytes(size_t size) {
+    size_t per_block = sizeof(T) < 512 ? 512 / sizeof(T) : 1;
+    size_t blocks = size / per_block + 1;
+    return blocks * slab_usable_size(per_block * sizeof(T)) + slab_usable_size(max<size_t>(8, blocks + 2) * sizeof(T*));
+}
+
+size_t allocated_bytes(const string& s) {
+    return s.capacity() > STRING_INLINE_CAPACITY ? heap_usable_size(s.capacity() + 1) : 0;
+}
+
+size_t allocated_bytes(const StringValue& value, size_t) {
+    return value.allocated_bytes();
+}
+
+size_t allocated_bytes(const ListValue& value, size_t samples) {
+    return deque_bytes<string>(value.size()) +
+           sampled_bytes(value.size(), samples, [&](size_t i) { return allocated_bytes(value[i]); });
+}
+
+static size_t allocated_bytes(const StreamFields& fields) {
+    // A node holds the next pointer, the pair and the cached hash. A map of
+    // one bucket keeps it inside the map object.
+    const size_t node_size = sizeof(void*) + sizeof(StreamFields::value_type) + sizeof(size_t);
+    size_t bytes = fields.bucket_count() > 1 ? slab_usable_size(fields.bucket_count() * sizeof(void*)) : 0;
+    for (const auto& field : fields) {
+        bytes += slab_usable_size(node_size) + allocated_bytes(field.first) + allocated_bytes(field.second);
+    }
+    return bytes;
+}
+
+size_t allocated_bytes(const StreamValue& value, size_t samples) {
+    return deque_bytes<StreamEntry>(value.size()) +
+           sampled_bytes(value.size(), samples, [&](size_t i) {
+               return allocated_bytes(value[i].id) + allocated_bytes(value[i].fields);
+           });
+}
+
+size_t allocated_bytes(const HashValue& value, size_t samples) {
+    const Dict<string>* table = value.get_table();
+    if (!table) {
+        return value.packed_capacity() > STRING_INLINE_CAPACITY ? heap_usable_size(value.packed_capacity() + 1) : 0;
+    }
+    // A Dict can't be indexed, so the sample is its first entries.
+    size_t bytes = heap_usable_size(sizeof(Dict<string>)) + table->overhead_bytes();
+    size_t sampled = 0;
+    size_t sample_bytes = 0;
+    for (auto it = table->begin(); it != table->end() && (samples == 0 || sampled < samples); ++it, ++sampled) {
+        sample_bytes += allocated_bytes(it->first) + allocated_bytes(it->second);
+    }
+    return bytes + (sampled ? sample_bytes * table->size() / sampled : 0);
+}
+
+size_t allocated_bytes(const ZSetValue& value, size_t samples) {
+    // A tree holds each member twice, in its entry and as a key of the scores.
+    size_t copies = value.is_packed() ? 1 : 2;
+    return value.structure_bytes() +
+           sampled_bytes(value.size(), samples, [&](size_t i) {
+               size_t bytes = 0;
+               value.for_range(i, i + 1, [&](const ZEntry& entry) { bytes = allocated_bytes(entry.member); });
+               return bytes * copies;
+           });
+}
+
+// Estimated bytes the keys and values of a store point to: exact for a small
+// store, otherwise measured on the keys of buckets picked at random, which
+// makes every key equally likely to be measured whatever its bucket holds.
+template <typename V>
+static size_t store_dataset_bytes(const Dict<V>& store) {
+    static thread_local mt19937_64 random_bucket(random_device{}());
+    size_t sampled = 0;
+    size_t bytes = 0;
+    auto measure = [&](const typename Dict<V>::value_type& entry) {
+        bytes += allocated_bytes(entry.first) + allocated_bytes(entry.second, MEMORY_USAGE_SAMPLES);
+        sampled++;
+    };
+    if (store.size() <= MEMORY_STATS_SAMPLE_KEYS) {
+        uint64_t cursor = 0;
+        do {
+            cursor = store.scan(cursor, measure);
+        } while (cursor != 0);
+        return bytes;
+    }
+    for (size_t buckets = 0; sampled < MEMORY_STATS_SAMPLE_KEYS && buckets < MEMORY_STATS_SAMPLE_KEYS * 4; ++buckets) {
+        store.scan(random_bucket(), measure);
+    }
+    return sampled ? bytes * store.size() / sampled : 0;
+}
+
+MemoryStats memory_stats() {
+    MemoryStats stats;
+    for_each_store([&](Keyspace& ks, unsigned bit) {
+        switch (bit) {
+            case STRING_STORE_LOCK: {
+                stats.keys += ks.strings.size();
+                stats.dataset_bytes += store_dataset_bytes(ks.strings);
+                stats.hashtable_main += ks.strings.overhead_bytes();
+                // A node holds the next pointer, the pair and the cached hash.
+                const size_t node_size = sizeof(void*) + sizeof(decltype(ks.expirations)::value_type) + sizeof(size_t);
+                stats.hashtable_expires += heap_usable_size(ks.expirations.bucket_count() * sizeof(void*)) +
+                                           ks.expirations.size() * heap_usable_size(node_size);
+                break;
+            }
+            case LIST_STORE_LOCK:
+                stats.keys += ks.lists.size();
+                stats.dataset_bytes += store_dataset_bytes(ks.lists);
+                stats.hashtable_main += ks.lists.overhead_bytes();
+                break;
+            case STREAM_STORE_LOCK:
+                stats.keys += ks.streams.size();
+                stats.dataset_bytes += store_dataset_bytes(ks.streams);
+                stats.hashtable_main += ks.streams.overhead_bytes();
+                break;
+            case HASH_STORE_LOCK:
+                stats.keys += ks.hashes.size();
+                stats.dataset_bytes += store_dataset_bytes(ks.hashes);
+                stats.hashtable_main += ks.hashes.overhead_bytes();
+                break;
+            default:
+                stats.keys += ks.zsets.size();
+                stats.dataset_bytes += store_dataset_bytes(ks.zsets);
+                stats.hashtable_main += ks.zsets.overhead_bytes();
+                break;
+        }
+    });
+
+    for (const shared_ptr<ClientInfo>& info : list_clients()) {
+        size_t bytes = info->input_bytes.load(memory_order_relaxed) + info->output_bytes.load(memory_order_relaxed);
+        if (info->client_class.load(memory_order_relaxed) == ClientClass::Replica) {
+            stats.clients_replicas += bytes;
+        }
+        else {
+            stats.clients_normal += bytes;
+        }
+    }
+    stats.clients_replicas += replica_pending_bytes();
+    return stats;
+}
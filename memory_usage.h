@@ -0,0 +1,49 @@
+#pragma once
+#include <string>
+#include <cstddef>
+#include "database.h"
+
+using namespace std;
+
+// MEMORY USAGE and MEMORY STATS: what keys cost, counted from the structures
+// themselves rather than from allocator totals. Every allocation is rounded
+// the way the slabs or malloc round it (slab_usable_size, heap_usable_size),
+// and the elements of lists, streams, hashes and sorted sets are estimated
+// from a sample of them, so a key costs O(samples) to measure however large.
+
+// Elements measured per key unless SAMPLES says otherwise.
+const size_t MEMORY_USAGE_SAMPLES = 5;
+// Keys measured per store for MEMORY STATS; larger stores are estimated from
+// keys in buckets picked at random.
+const size_t MEMORY_STATS_SAMPLE_KEYS = 1024;
+
+// Bytes a key or value holds outside its own object: a string's heap buffer,
+// a container's blocks and, estimated from samples of them spread across it
+// (all of them for samples == 0), its elements' own allocations.
+size_t allocated_bytes(const string& s);
+size_t allocated_bytes(const StringValue& value, size_t samples);
+size_t allocated_bytes(const ListValue& value, size_t samples);
+size_t allocated_bytes(const StreamValue& value, size_t samples);
+size_t allocated_bytes(const HashValue& value, size_t samples);
+size_t allocated_bytes(const ZSetValue& value, size_t samples);
+
+// MEMORY USAGE: a key's node in its store, with the key and the value in it,
+// plus everything they point to.
+template <typename V>
+size_t key_memory_usage(const pair<const string, V>& entry, size_t samples) {
+    return Dict<V>::node_bytes() + allocated_bytes(entry.first) + allocated_bytes(entry.second, samples);
+}
+
+struct MemoryStats {
+    size_t keys = 0;
+    size_t dataset_bytes = 0;           // what keys and values point to, estimated
+    size_t hashtable_main = 0;          // store bucket arrays and nodes
+    size_t hashtable_expires = 0;       // the expiry table
+    size_t clients_normal = 0;          // connections' pending input and output
+    size_t clients_replicas = 0;        // replica links, with their pending stream
+    size_t replication_backlog = 0;     // always 0: a reconnecting replica resyncs in full
+};
+
+// Measures every keyspace through for_each_store: one store lock at a time, or
+// with --shards the shards stopped meanwhile.
+MemoryStats memory_stats();
@@ -0,0 +1,194 @@
+#include <string>
+#include <vector>
+#include <memory>
+#include <cerrno>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include "output_buffer.h"
+
+using namespace std;
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+void OutputBuffer::truncate(size_t text_size) {
+    text.resize(text_size);
+    while (!segments.empty() && segments.back().offset >= text_size) {
+        segment_bytes -= segments.back().value->size();
+        segments.pop_back();
+    }
+}
+
+
+void OutputBuffer::clear() {
+    text.clear();
+    segments.clear();
+    text_sent = 0;
+    next_segment = 0;
+    segment_sent = 0;
+    segment_bytes = 0;
+    sent_bytes = 0;
+}
+
+bool OutputBuffer::wants_zerocopy(const Segment& segment) const {
+    return zerocopy_state != ZEROCOPY_OFF && segment.value->size() >= OUTPUT_ZEROCOPY_MIN_SIZE;
+}
+
+// Moves the send position forward over bytes that went out.
+void OutputBuffer::advance(size_t bytes) {
+    sent_bytes += bytes;
+    while (true) {
+        if (at_segment()) {
+            size_t left = segments[next_segment].value->size() - segment_sent;
+            if (bytes < left) {
+                segment_sent += bytes;
+                return;
+            }
+            bytes -= left;
+            next_segment++;
+            segment_sent = 0;
+            continue;
+        }
+        size_t end = next_segment < segments.size() ? segments[next_segment].offset : text.size();
+        size_t step = min(bytes, end - text_sent);
+        if (step == 0) {
+            return;
+        }
+        text_sent += step;
+        bytes -= step;
+    }
+}
+
+// Fills iov with the unsent bytes from the send position on, stopping before
+// a value that should go out zero-copy when stop_at_zerocopy is set.
+int OutputBuffer::gather(iovec* iov, int max_iov, bool stop_at_zerocopy) const {
+    int count = 0;
+    size_t pos = text_sent;
+    size_t segment = next_segment;
+    size_t skip = segment_sent;
+    while (count < max_iov) {
+        if (segment < segments.size() && segments[segment].offset == pos) {
+            const string& value = *segments[segment].value;
+            if (stop_at_zerocopy && count > 0 && wants_zerocopy(segments[segment])) {
+                break;
+            }
+            iov[count++] = {(void*)(value.data() + skip), value.size() - skip};
+            segment++;
+            skip = 0;
+            continue;
+        }
+        size_t end = segment < segments.size() ? segments[segment].offset : text.size();
+        if (end == pos) {
+            break;
+        }
+        iov[count++] = {(void*)(text.data() + pos), end - pos};
+        pos = end;
+    }
+    return count;
+}
+
+// One sendmsg() over everything from the send position up to the next value
+// that should go out zero-copy, or as much of it as fits in one iovec array.
+ssize_t OutputBuffer::send_gathered(int fd) {
+    iovec iov[OUTPUT_MAX_IOV];
+    msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = gather(iov, OUTPUT_MAX_IOV, true);
+    return sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+// Sends the rest of the value at the send position with MSG_ZEROCOPY, keeping
+// it referenced until the kernel reports the send complete. Falls back to an
+// ordinary send if the socket can't do zero-copy or the kernel is out of
+// option memory for it.
+ssize_t OutputBuffer::send_zerocopy(int fd) {
+    if (zerocopy_state == ZEROCOPY_UNTRIED) {
+        int one = 1;
+        zerocopy_state = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0 ? ZEROCOPY_ON : ZEROCOPY_OFF;
+    }
+    const shared_ptr<const string>& value = segments[next_segment].value;
+    const char* data = value->data() + segment_sent;
+    size_t left = value->size() - segment_sent;
+
+    if (zerocopy_state == ZEROCOPY_ON) {
+        ssize_t sent = send(fd, data, left, MSG_ZEROCOPY | MSG_NOSIGNAL);
+        if (sent >= 0) {
+            // Every zero-copy send that succeeds takes the next notification id.
+            zerocopy_pending.push_back({zerocopy_next_id++, value});
+            return sent;
+        }
+        if (errno != ENOBUFS) {
+            return sent;
+        }
+    }
+    return send(fd, data, left, MSG_NOSIGNAL);
+}
+
+void OutputBuffer::reap_zerocopy(int fd) {
+    while (!zerocopy_pending.empty()) {
+        char control[128];
+        msghdr msg = {};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            return;
+        }
+        for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            bool is_recverr = (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                              (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR);
+            if (!is_recverr) {
+                continue;
+            }
+            const sock_extended_err* err = (const sock_extended_err*)CMSG_DATA(cm);
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // The kernel had to copy after all (loopback, or a device without
+            // scatter-gather), so zero-copy only adds overhead on this socket.
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                zerocopy_state = ZEROCOPY_OFF;
+            }
+            uint32_t last_done = err->ee_data;
+            while (!zerocopy_pending.empty() && (int32_t)(zerocopy_pending.front().id - last_done) <= 0) {
+                zerocopy_pending.pop_front();
+            }
+        }
+    }
+}
+
+bool OutputBuffer::flush(int fd) {
+    reap_zerocopy(fd);
+    while (text_sent < text.size() || next_segment < segments.size()) {
+        ssize_t sent = at_segment() && wants_zerocopy(segments[next_segment]) ? send_zerocopy(fd) : send_gathered(fd);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        advance(sent);
+    }
+    clear();
+    return true;
+}
+
+int OutputBuffer::pending_iov(iovec* iov, int max_iov) const {
+    return gather(iov, max_iov, false);
+}
+
+bool OutputBuffer::consume(size_t bytes) {
+    advance(bytes);
+    if (text_sent < text.size() || next_segment < segments.size()) {
+        return false;
+    }
+    clear();
+    return true;
+}
@@ -0,0 +1,90 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <cstdint>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+using namespace std;
+
+// Referenced values at least this long are sent with MSG_ZEROCOPY, where the
+// kernel supports it on the socket. Below this the page pinning and completion
+// handling cost more than the copy they save.
+const size_t OUTPUT_ZEROCOPY_MIN_SIZE = 64 * 1024;
+// Most pieces one gathered write covers.
+const int OUTPUT_MAX_IOV = 64;
+
+// A connection's pending output. Most of it is RESP text in text, but large
+// values aren't copied in: they are referenced from segments and spliced into
+// the byte stream at their offset when the buffer is written, with a gathered
+// send or a zero-copy send straight from the stored value.
+class OutputBuffer {
+private:
+    struct Segment {
+        size_t offset;                      // position in text the value goes before
+        shared_ptr<const string> value;
+    };
+
+    // A value sent with MSG_ZEROCOPY stays referenced until the kernel reports
+    // it has finished with the pages, which is after the send returns.
+    struct ZeroCopySend {
+        uint32_t id;
+        shared_ptr<const string> value;
+    };
+
+    vector<Segment> segments;
+
+    // How far flush() has got: all of text before text_sent, all segments
+    // before next_segment, and segment_sent bytes of the next one.
+    size_t text_sent = 0;
+    size_t next_segment = 0;
+    size_t segment_sent = 0;
+
+    // Bytes of all segments, sent or not, and of everything sent; size() is
+    // kept O(1) for the per-command output limit check.
+    size_t segment_bytes = 0;
+    size_t sent_bytes = 0;
+
+    deque<ZeroCopySend> zerocopy_pending;
+    uint32_t zerocopy_next_id = 0;
+    enum { ZEROCOPY_UNTRIED, ZEROCOPY_ON, ZEROCOPY_OFF } zerocopy_state = ZEROCOPY_UNTRIED;
+
+    bool at_segment() const { return next_segment < segments.size() && segments[next_segment].offset == text_sent; }
+    bool wants_zerocopy(const Segment& segment) const;
+    void advance(size_t bytes);
+    int gather(iovec* iov, int max_iov, bool stop_at_zerocopy) const;
+    ssize_t send_gathered(int fd);
+    ssize_t send_zerocopy(int fd);
+
+public:
+    string text;
+
+    bool empty() const { return text.empty() && segments.empty(); }
+    void append_shared(const shared_ptr<const string>& value) {
+        segments.push_back({text.size(), value});
+        segment_bytes += value->size();
+    }
+    // Bytes appended and not yet sent.
+    size_t size() const { return text.size() + segment_bytes - sent_bytes; }
+    // Drops everything appended since text was text_size bytes long.
+    void truncate(size_t text_size);
+    void clear();
+
+    // Sends as much of the buffer as fd takes and clears it once all of it is
+    // out. On a blocking socket that is everything; on a non-blocking one the
+    // rest waits for the next call. Returns false if the connection failed.
+    bool flush(int fd);
+    // Releases values whose zero-copy sends the kernel has finished with.
+    // Completions arrive on the socket's error queue, which also makes epoll
+    // report EPOLLERR for it until they are read.
+    void reap_zerocopy(int fd);
+
+    // For callers that submit the write themselves (io_uring): fills iov with
+    // the unsent data, up to max_iov pieces, and returns how many. Nothing may
+    // be appended until the write completes and its length is passed to
+    // consume(), which clears the buffer and returns true once all of it is out.
+    int pending_iov(iovec* iov, int max_iov) const;
+    bool consume(size_t bytes);
+};
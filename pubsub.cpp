@@ -0,0 +1,459 @@
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <algorithm>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "pubsub.h"
+#include "clients.h"
+#include "reply.h"
+#include "handle_redis_commands.h"
+#include "logger.h"
+
+using namespace std;
+
+// A trie node for pattern subscriptions: the path from the root spells a
+// literal prefix, and patterns holds the patterns with exactly that prefix.
+struct PatternNode {
+    map<unsigned char, unique_ptr<PatternNode>> children;
+    unordered_map<string, vector<Subscriber*>> patterns;
+};
+
+// Publishers share the index; subscribing and unsubscribing take it
+// exclusively, so a Subscriber found in it stays alive until PUBLISH is done.
+static shared_mutex pubsub_mutex;
+static unordered_map<string, vector<Subscriber*>> channel_index;
+// Every connection with a mailbox, for invalidations sent to a client by id.
+static unordered_map<uint64_t, Subscriber*> subscribers_by_id;
+static PatternNode pattern_root;
+static size_t distinct_patterns = 0;
+
+Subscriber::Subscriber(const ClientState& client)
+    : fd(client.fd), info(client.info), client_id(info ? info->id : 0),
+      wake_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), loop(client.mailbox_loop), connection(client.loop_connection) {
+}
+
+Subscriber::~Subscriber() {
+    {
+        unique_lock<shared_mutex> lock(pubsub_mutex);
+        subscribers_by_id.erase(client_id);
+    }
+    close(wake_fd);
+}
+
+// The part of a pattern before its first glob character.
+static string literal_prefix(const string& pattern) {
+    return pattern.substr(0, pattern.find_first_of("*?[\\"));
+}
+
+static void remove_subscriber(vector<Subscriber*>& subscribers, Subscriber* subscriber) {
+    auto it = find(subscribers.begin(), subscribers.end(), subscriber);
+    if (it != subscribers.end()) {
+        *it = subscribers.back();
+        subscribers.pop_back();
+    }
+}
+
+static void add_pattern(const string& pattern, Subscriber* subscriber) {
+    PatternNode* node = &pattern_root;
+    for (unsigned char c : literal_prefix(pattern)) {
+        unique_ptr<PatternNode>& child = node->children[c];
+        if (!child) {
+            child = make_unique<PatternNode>();
+        }
+        node = child.get();
+    }
+    vector<Subscriber*>& subscribers = node->patterns[pattern];
+    if (subscribers.empty()) {
+        distinct_patterns++;
+    }
+    subscribers.push_back(subscriber);
+}
+
+// Removes the subscription and prunes the trie nodes it leaves empty.
+static void remove_pattern(const string& pattern, Subscriber* subscriber) {
+    string prefix = literal_prefix(pattern);
+    vector<PatternNode*> path = {&pattern_root};
+    for (unsigned char c : prefix) {
+        auto it = path.back()->children.find(c);
+        if (it == path.back()->children.end()) {
+            return;
+        }
+        path.push_back(it->second.get());
+    }
+    auto it = path.back()->patterns.find(pattern);
+    if (it == path.back()->patterns.end()) {
+        return;
+    }
+    remove_subscriber(it->second, subscriber);
+    if (!it->second.empty()) {
+        return;
+    }
+    path.back()->patterns.erase(it);
+    distinct_patterns--;
+    for (size_t depth = prefix.size(); depth > 0; --depth) {
+        PatternNode* node = path[depth];
+        if (!node->patterns.empty() || !node->children.empty()) {
+            break;
+        }
+        path[depth - 1]->children.erase((unsigned char)prefix[depth - 1]);
+    }
+}
+
+Subscriber& open_mailbox(ClientState& client) {
+    if (!client.subscriber) {
+        client.subscriber = make_shared<Subscriber>(client);
+        unique_lock<shared_mutex> lock(pubsub_mutex);
+        subscribers_by_id[client.subscriber->client_id] = client.subscriber.get();
+    }
+    return *client.subscriber;
+}
+
+void close_mailbox_if_unused(ClientState& client) {
+    if (client.subscriber && client.subscriber->subscriptions() == 0 &&
+        !(client.info && client.info->tracking.load(memory_order_relaxed))) {
+        client.subscriber.reset();
+    }
+}
+
+// A client with subscriptions is listed, and held to output limits, as pubsub.
+static void update_client_class(ClientState& client) {
+    if (!client.info || client.info->client_class == ClientClass::Replica) {
+        return;
+    }
+    bool subscribed = client.subscriber && client.subscriber->subscriptions() > 0;
+    client.info->client_class = subscribed ? ClientClass::PubSub : ClientClass::Normal;
+}
+
+// Messages published before the last unsubscription are still delivered,
+// ahead of its confirmation; then the connection stops being a subscriber.
+static void after_unsubscribe(ClientState& client) {
+    take_messages(client);
+    close_mailbox_if_unused(client);
+    update_client_class(client);
+}
+
+bool subscribe_channel(ClientState& client, const string& channel) {
+    Subscriber& subscriber = open_mailbox(client);
+    if (!subscriber.channels.insert(channel).second) {
+        return false;
+    }
+    {
+        unique_lock<shared_mutex> lock(pubsub_mutex);
+        channel_index[channel].push_back(&subscriber);
+    }
+    update_client_class(client);
+    return true;
+}
+
+bool unsubscribe_channel(ClientState& client, const string& channel) {
+    if (!client.subscriber || client.subscriber->channels.erase(channel) == 0) {
+        return false;
+    }
+    {
+        unique_lock<shared_mutex> lock(pubsub_mutex);
+        auto it = channel_index.find(channel);
+        if (it != channel_index.end()) {
+            remove_subscriber(it->second, client.subscriber.get());
+            if (it->second.empty()) {
+                channel_index.erase(it);
+            }
+        }
+    }
+    after_unsubscribe(client);
+    return true;
+}
+
+bool subscribe_pattern(ClientState& client, const string& pattern) {
+    Subscriber& subscriber = open_mailbox(client);
+    if (!subscriber.patterns.insert(pattern).second) {
+        return false;
+    }
+    {
+        unique_lock<shared_mutex> lock(pubsub_mutex);
+        add_pattern(pattern, &subscriber);
+    }
+    update_client_class(client);
+    return true;
+}
+
+bool unsubscribe_pattern(ClientState& client, const string& pattern) {
+    if (!client.subscriber || client.subscriber->patterns.erase(pattern) == 0) {
+        return false;
+    }
+    {
+        unique_lock<shared_mutex> lock(pubsub_mutex);
+        remove_pattern(pattern, client.subscriber.get());
+    }
+    after_unsubscribe(client);
+    return true;
+}
+
+void unsubscribe_all(ClientState& client) {
+    if (!client.subscriber) {
+        return;
+    }
+    Subscriber* subscriber = client.subscriber.get();
+    {
+        unique_lock<shared_mutex> lock(pubsub_mutex);
+        for (const string& channel : subscriber->channels) {
+            auto it = channel_index.find(channel);
+            if (it != channel_index.end()) {
+                remove_subscriber(it->second, subscriber);
+                if (it->second.empty()) {
+                    channel_index.erase(it);
+                }
+            }
+        }
+        for (const string& pattern : subscriber->patterns) {
+            remove_pattern(pattern, subscriber);
+        }
+    }
+    client.subscriber.reset();
+    update_client_class(client);
+}
+
+static bool speaks_resp3(const Subscriber& subscriber) {
+    return subscriber.info && subscriber.info->resp.load(memory_order_relaxed) == 3;
+}
+
+// A message in the form each protocol wants, encoded the first time a
+// subscriber speaking that protocol is found: an array for RESP2, a push for
+// RESP3.
+class Message {
+private:
+    vector<const string*> parts;
+    shared_ptr<const string> encoded[2];
+
+public:
+    explicit Message(initializer_list<const string*> parts) : parts(parts) {}
+
+    const shared_ptr<const string>& for_subscriber(const Subscriber& subscriber) {
+        bool push = speaks_resp3(subscriber);
+        shared_ptr<const string>& message = encoded[push];
+        if (!message) {
+            OutputBuffer buffer;
+            Reply reply(buffer);
+            size_t bytes = 16;
+            for (const string* part : parts) {
+                bytes += Reply::bulk_size(part->size());
+            }
+            reply.reserve(bytes);
+            if (push) {
+                reply.push(parts.size());
+            }
+            else {
+                reply.array(parts.size());
+            }
+            for (const string* part : parts) {
+                reply.bulk(*part);
+            }
+            message = make_shared<const string>(std::move(buffer.text));
+        }
+        return message;
+    }
+};
+
+void MailboxLoop::post(void* connection) {
+    {
+        lock_guard<mutex> lock(posts_mutex);
+        posts.push_back(connection);
+        posted = true;
+    }
+    wake();
+}
+
+void MailboxLoop::take(vector<void*>& connections) {
+    lock_guard<mutex> lock(posts_mutex);
+    connections.swap(posts);
+    posted = false;
+}
+
+void MailboxLoop::forget(void* connection) {
+    lock_guard<mutex> lock(posts_mutex);
+    posts.erase(remove(posts.begin(), posts.end(), connection), posts.end());
+}
+
+// Called with the mailbox locked.
+static void wake_subscriber(Subscriber& subscriber) {
+    if (subscriber.loop) {
+        subscriber.loop->post(subscriber.connection);
+        return;
+    }
+    uint64_t one = 1;
+    if (write(subscriber.wake_fd, &one, sizeof(one)) < 0) {
+        // The counter is already set; the thread is awake or about to be.
+    }
+}
+
+// Queues message for subscriber, waking its loop or thread if the mailbox
+// was empty.
+// A subscriber whose backlog breaks the pubsub output limits is disconnected:
+// its socket is shut down, which its thread sees as the connection closing.
+static void deliver(Subscriber& subscriber, const shared_ptr<const string>& message) {
+    lock_guard<mutex> lock(subscriber.mailbox_mutex);
+    if (subscriber.overflowed) {
+        return;
+    }
+    bool was_empty = subscriber.mailbox.empty();
+    subscriber.mailbox.push_back(message);
+    subscriber.mailbox_bytes += message->size();
+
+    size_t pending = subscriber.mailbox_bytes;
+    if (subscriber.info) {
+        pending += subscriber.info->output_bytes.load(memory_order_relaxed);
+    }
+    ClientClass cls = subscriber.info ? subscriber.info->client_class.load(memory_order_relaxed) : ClientClass::PubSub;
+    if (output_limit_reached(cls, pending, subscriber.soft_limit_since_ms)) {
+        subscriber.overflowed = true;
+        subscriber.mailbox.clear();
+        subscriber.mailbox_bytes = 0;
+        if (subscriber.info) {
+            static LogRateLimit limit_closes;
+            log_limited(limit_closes, LogLevel::Warning, "Client ", describe_client(*subscriber.info),
+                        " closed for overcoming of output buffer limits.");
+            subscriber.info->closing = true;
+        }
+        // The index holds the subscriber, so its thread hasn't closed the socket yet.
+        shutdown(subscriber.fd, SHUT_RDWR);
+        return;
+    }
+    if (was_empty) {
+        wake_subscriber(subscriber);
+    }
+}
+
+size_t publish_message(const string& channel, const string& message) {
+    static const string message_type = "message";
+    static const string pmessage_type = "pmessage";
+
+    size_t receivers = 0;
+    shared_lock<shared_mutex> lock(pubsub_mutex);
+
+    auto it = channel_index.find(channel);
+    if (it != channel_index.end()) {
+        Message encoded({&message_type, &channel, &message});
+        for (Subscriber* subscriber : it->second) {
+            deliver(*subscriber, encoded.for_subscriber(*subscriber));
+        }
+        receivers += it->second.size();
+    }
+
+    // Only the patterns on the channel's path through the trie can match it.
+    const PatternNode* node = &pattern_root;
+    size_t depth = 0;
+    while (node) {
+        for (const auto& entry : node->patterns) {
+            if (!glob_match(entry.first, channel)) {
+                continue;
+            }
+            Message encoded({&pmessage_type, &entry.first, &channel, &message});
+            for (Subscriber* subscriber : entry.second) {
+                deliver(*subscriber, encoded.for_subscriber(*subscriber));
+            }
+            receivers += entry.second.size();
+        }
+        if (depth == channel.size()) {
+            break;
+        }
+        auto child = node->children.find((unsigned char)channel[depth++]);
+        node = child == node->children.end() ? nullptr : child->second.get();
+    }
+    return receivers;
+}
+
+bool push_to_client(uint64_t client_id, const shared_ptr<const string>& resp3, const shared_ptr<const string>& resp2) {
+    shared_lock<shared_mutex> lock(pubsub_mutex);
+    auto it = subscribers_by_id.find(client_id);
+    if (it == subscribers_by_id.end()) {
+        return false;
+    }
+    Subscriber& subscriber = *it->second;
+    if (speaks_resp3(subscriber)) {
+        deliver(subscriber, resp3);
+    }
+    else if (subscriber.info && subscriber.info->client_class.load(memory_order_relaxed) == ClientClass::PubSub) {
+        deliver(subscriber, resp2);
+    }
+    return true;
+}
+
+void take_messages(ClientState& client) {
+    Subscriber& subscriber = *client.subscriber;
+    vector<shared_ptr<const string>> messages;
+    {
+        lock_guard<mutex> lock(subscriber.mailbox_mutex);
+        if (subscriber.mailbox.empty()) {
+            return;
+        }
+        messages.swap(subscriber.mailbox);
+        subscriber.mailbox_bytes = 0;
+    }
+    for (const shared_ptr<const string>& message : messages) {
+        client.output.append_shared(message);
+    }
+}
+
+void leave_mailbox_loop(ClientState& client) {
+    if (client.subscriber) {
+        Subscriber& subscriber = *client.subscriber;
+        lock_guard<mutex> lock(subscriber.mailbox_mutex);
+        subscriber.loop = nullptr;
+        subscriber.connection = nullptr;
+        if (!subscriber.mailbox.empty()) {
+            wake_subscriber(subscriber);
+        }
+    }
+    if (client.mailbox_loop) {
+        client.mailbox_loop->forget(client.loop_connection);
+    }
+    client.mailbox_loop = nullptr;
+    client.loop_connection = nullptr;
+}
+
+bool wait_for_input_or_messages(ClientState& client) {
+    Subscriber& subscriber = *client.subscriber;
+    pollfd fds[2] = {{client.fd, POLLIN, 0}, {subscriber.wake_fd, POLLIN, 0}};
+    while (poll(fds, 2, -1) < 0) {
+        if (errno != EINTR) {
+            return true;
+        }
+    }
+    if (fds[1].revents & POLLIN) {
+        uint64_t count;
+        if (read(subscriber.wake_fd, &count, sizeof(count)) < 0) {
+            // Another wakeup raced this one and already reset the counter.
+        }
+        take_messages(client);
+    }
+    return fds[0].revents != 0;
+}
+
+vector<string> active_channels(const string& pattern) {
+    vector<string> channels;
+    shared_lock<shared_mutex> lock(pubsub_mutex);
+    for (const auto& entry : channel_index) {
+        if (pattern.empty() || glob_match(pattern, entry.first)) {
+            channels.push_back(entry.first);
+        }
+    }
+    return channels;
+}
+
+size_t channel_subscribers(const string& channel) {
+    shared_lock<shared_mutex> lock(pubsub_mutex);
+    auto it = channel_index.find(channel);
+    return it == channel_index.end() ? 0 : it->second.size();
+}
+
+size_t pattern_count() {
+    shared_lock<shared_mutex> lock(pubsub_mutex);
+    return distinct_patterns;
+}
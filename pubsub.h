@@ -0,0 +1,115 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <unordered_set>
+#include <cstdint>
+#include "client.h"
+
+using namespace std;
+
+// PUBLISH/SUBSCRIBE. A published message is RESP-encoded once into a shared
+// buffer, and each subscriber gets a reference to it: PUBLISH to n subscribers
+// costs n pointer appends, not n copies of the payload. The buffer is spliced
+// into the subscriber's output by OutputBuffer::append_shared when its thread
+// writes it out, and freed once the last subscriber has sent it.
+//
+// Channels are a hash map from name to subscribers. Patterns are indexed in a
+// trie by their literal prefix, the part before the first glob character, so a
+// message is matched only against the patterns whose prefix it starts with
+// rather than against every pattern.
+//
+// Messages go to RESP3 (HELLO 3) connections as push messages, encoded
+// separately from the RESP2 form when a channel has subscribers of both.
+//
+// A subscribed connection stays with whatever serves it. A thread of its own
+// sleeps on its socket and its mailbox at once; an event loop is woken
+// through its MailboxLoop and moves the messages to the connection's output
+// itself.
+
+// An event loop's side of the mailboxes of the connections it serves. A
+// publisher that fills an empty mailbox posts the connection here and wakes
+// the loop.
+class MailboxLoop {
+public:
+    explicit MailboxLoop(function<void()> wake) : wake(std::move(wake)) {}
+    void post(void* connection);
+    // Moves the connections posted since the last call to connections.
+    void take(vector<void*>& connections);
+    bool has_posts() const { return posted.load(); }
+    // Drops a connection that is closing or leaving the loop.
+    void forget(void* connection);
+
+private:
+    function<void()> wake;
+    mutex posts_mutex;
+    vector<void*> posts;
+    atomic<bool> posted{false};
+};
+
+// A subscribed connection's side of the index. Publishers, on any thread,
+// append to the mailbox and wake the connection's loop, or its thread through
+// wake_fd. Tracking connections (tracking.h) have one too, for their
+// invalidations.
+struct Subscriber {
+    int fd;
+    shared_ptr<ClientInfo> info;
+    uint64_t client_id;
+    int wake_fd;                            // eventfd, signalled when the mailbox fills
+    MailboxLoop* loop;                      // instead, when an event loop serves the connection
+    void* connection;                       // ...as this connection of its own
+
+    mutex mailbox_mutex;
+    vector<shared_ptr<const string>> mailbox;
+    size_t mailbox_bytes = 0;
+    int64_t soft_limit_since_ms = 0;
+    bool overflowed = false;                // over the pubsub output limit; being closed
+
+    // What the connection is subscribed to; only its own thread touches these.
+    unordered_set<string> channels;
+    unordered_set<string> patterns;
+
+    Subscriber(const ClientState& client);
+    ~Subscriber();
+    size_t subscriptions() const { return channels.size() + patterns.size(); }
+};
+
+// The client's Subscriber, created if it has none yet, and dropped again once
+// it has neither subscriptions nor tracking.
+Subscriber& open_mailbox(ClientState& client);
+void close_mailbox_if_unused(ClientState& client);
+
+// Each returns false if the client already was, or wasn't, subscribed.
+bool subscribe_channel(ClientState& client, const string& channel);
+bool unsubscribe_channel(ClientState& client, const string& channel);
+bool subscribe_pattern(ClientState& client, const string& pattern);
+bool unsubscribe_pattern(ClientState& client, const string& pattern);
+// Drops every subscription of a closing connection.
+void unsubscribe_all(ClientState& client);
+
+// Sends message to channel's subscribers and to those of matching patterns.
+// Returns how many received it.
+size_t publish_message(const string& channel, const string& message);
+
+// Queues a message for the client with that id: resp3 if it speaks RESP3,
+// resp2 if it is subscribed to something, nothing otherwise (it couldn't tell
+// the message from a reply). Returns false if the client has no mailbox.
+bool push_to_client(uint64_t client_id, const shared_ptr<const string>& resp3, const shared_ptr<const string>& resp2);
+
+// Moves messages waiting in the client's mailbox to its output buffer.
+void take_messages(ClientState& client);
+// For an event loop handing the connection to a thread of its own: its
+// messages wake that thread from now on.
+void leave_mailbox_loop(ClientState& client);
+// Blocks a subscribed client's thread until its socket has input or messages
+// arrive, and moves the messages to its output. Returns false if only
+// messages arrived, so there is nothing to read.
+bool wait_for_input_or_messages(ClientState& client);
+
+// PUBSUB CHANNELS, NUMSUB and NUMPAT.
+vector<string> active_channels(const string& pattern);
+size_t channel_subscribers(const string& channel);
+size_t pattern_count();
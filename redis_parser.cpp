@@ -1,3 +1,4 @@
+#include <algorithm>
 #include "redis_parser.h"
 
 using namespace std;
@@ -7,7 +8,7 @@ RESPObject::RESPObject(RESPType t, const string& value, int64_t integer, vector<
     type = t;
     string_value = value;
     integer_value = integer;
-    array = arr;
+    array = std::move(arr);
 }
 
 const RESPType RESPObject::get_type() const {
@@ -22,7 +23,7 @@ int64_t RESPObject::get_int_value() {
     return integer_value;
 }
 
-const vector<RESPObject> RESPObject::get_array() const {
+const vector<RESPObject>& RESPObject::get_array() const {
     return array;
 }
 
@@ -30,7 +31,7 @@ const vector<RESPObject> RESPObject::get_array() const {
 string RESPParser::read_line(const string& input) {
     size_t end_pos = input.find("\r\n", position);
     if (end_pos == string::npos) {
-        throw runtime_error("Missing CRLF");
+        throw RESPIncompleteError("Missing CRLF");
     }
     string line = input.substr(position, end_pos - position);
     position = end_pos + 2;
@@ -61,6 +62,9 @@ RESPObject RESPParser::parse_bulk_string(const string& input) {
     if (length < 0) {
         return RESPObject(RESPType::BulkString, "");
     }
+    if (position + length + 2 > input.size()) {
+        throw RESPIncompleteError("Incomplete bulk string");
+    }
     string string_value = input.substr(position, length);
     position += length + 2; // skip \r\n
     return RESPObject(RESPType::BulkString, string_value);
@@ -69,16 +73,18 @@ RESPObject RESPParser::parse_bulk_string(const string& input) {
 RESPObject RESPParser::parse_array(const string& input) {
     int64_t length = read_integer(input);
     vector<RESPObject> array;
+    if (length > 0) {
+        array.reserve(min<int64_t>(length, 1024));
+    }
     for (int64_t i = 0; i < length; ++i) {
-        RESPObject obj = parse(input);
-        array.push_back(obj);
+        array.push_back(parse(input));
     }
-    return RESPObject(RESPType::Array, "", 0, array);
+    return RESPObject(RESPType::Array, "", 0, std::move(array));
 }
 
 RESPObject RESPParser::parse(const string& input) {
     if (position >= input.size()) {
-        throw runtime_error("Empty input");
+        throw RESPIncompleteError("Empty input");
     }
 
     char type_char = input[position++];
@@ -92,3 +98,27 @@ RESPObject RESPParser::parse(const string& input) {
             throw runtime_error("Unknown RESP type");
     }
 }
+
+
+RESPObject RESPParser::parse_rdb_transfer(const string& input) {
+    if (position >= input.size()) {
+        throw RESPIncompleteError("Empty input");
+    }
+    if (input[position++] != '$') {
+        throw runtime_error("Expected RDB transfer");
+    }
+    int64_t length = read_integer(input);
+    if (length < 0) {
+        throw runtime_error("Invalid RDB length");
+    }
+    if (position + length > input.size()) {
+        throw RESPIncompleteError("Incomplete RDB payload");
+    }
+    string payload = input.substr(position, length);
+    position += length;
+    return RESPObject(RESPType::BulkString, payload);
+}
+
+size_t RESPParser::get_position() const {
+    return position;
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <iostream>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -25,7 +26,14 @@ public:
     const RESPType get_type() const;
     const std::string& get_string_value() const;
     int64_t get_int_value();
-    const std::vector<RESPObject> get_array() const;
+    const std::vector<RESPObject>& get_array() const;
+};
+
+// Thrown when the input ends before a complete RESP value. Callers reading from a
+// socket should keep the unparsed bytes, read more and parse again.
+class RESPIncompleteError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
 };
 
 class RESPParser {
@@ -43,4 +51,8 @@ private:
 
 public:
     RESPObject parse(const std::string& input);
+    // Reads the "$<len>\r\n<payload>" RDB transfer sent after FULLRESYNC, which
+    // unlike a bulk string has no trailing CRLF.
+    RESPObject parse_rdb_transfer(const std::string& input);
+    size_t get_position() const;
 };
@@ -0,0 +1,573 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/wait.h>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <mutex>
+#include <memory>
+#include <random>
+#include <thread>
+#include <chrono>
+#include <unordered_map>
+#include <list>
+#include <condition_variable>
+#include "replication.h"
+#include "database.h"
+#include "latency_monitor.h"
+#include "clients.h"
+#include "blocking.h"
+#include "logger.h"
+
+using namespace std;
+
+bool repl_diskless_sync = false;
+int repl_diskless_sync_delay = 5;
+
+atomic<int64_t> master_repl_offset(0);
+
+enum class ReplicaState {
+    WaitingForSync,   // queued for the next diskless full sync
+    Syncing,          // snapshot being written by the sync child; stream is buffered
+    Online            // stream is forwarded as it is produced
+};
+
+struct ReplicaLink {
+    int fd;                     // dup of the client socket, owned by the writer thread
+    ReplicaState state;
+    string pending;             // stream bytes not yet written to the socket
+    bool closed = false;
+    condition_variable cv;
+    int64_t ack_offset = -1;    // last offset the replica acknowledged; -1 until its first ACK
+    steady_clock::time_point last_ack_time = steady_clock::now();
+    int64_t soft_limit_since_ms = 0;    // pending over the replica class's soft limit since then
+};
+
+// A connection blocked in WAIT in the default mode. It sleeps on its own
+// condition variable and is woken by record_replica_ack once enough replicas
+// reach target_offset. The event-loop modes park WAIT in their BlockedClients
+// (blocking.h) instead, which record_replica_ack signals.
+struct WaitRequest {
+    int64_t target_offset;
+    int needed;
+    condition_variable cv;
+};
+
+// Stats reported by the sync child over a pipe when it finishes.
+struct FullSyncResult {
+    int64_t bytes_written;
+    int64_t cow_bytes;
+    uint64_t failed_mask;       // bit i set if targets[i] could not be written
+};
+
+static mutex replication_mutex;
+static unordered_map<int, shared_ptr<ReplicaLink>> replicas;
+static atomic<int> replica_count(0);
+static string master_replid;
+static bool full_sync_running = false;
+static list<WaitRequest*> waiters;
+
+static int64_t full_syncs = 0;
+static int64_t last_sync_time_ms = 0;
+static int64_t last_sync_bytes = 0;
+static int64_t last_sync_cow_bytes = 0;
+static int64_t last_sync_replicas = 0;
+
+static void append_bulk(string& out, string_view value) {
+    out += "$" + to_string(value.size()) + "\r\n";
+    out += value;
+    out += "\r\n";
+}
+
+static string hex_to_binary(const string& hex) {
+    string binary;
+    for (size_t i = 0; i < hex.length(); i += 2) {
+        string byte_str = hex.substr(i, 2);
+        char byte = (char) strtol(byte_str.c_str(), nullptr, 16);
+        binary.push_back(byte);
+    }
+    return binary;
+}
+
+static bool send_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+static void replica_writer(shared_ptr<ReplicaLink> link) {
+    unique_lock<mutex> lock(replication_mutex);
+    while (true) {
+        link->cv.wait(lock, [&] {
+            return link->closed || (link->state == ReplicaState::Online && !link->pending.empty());
+        });
+        if (link->closed) {
+            break;
+        }
+
+        string out;
+        out.swap(link->pending);
+        lock.unlock();
+        bool ok = send_all(link->fd, out.data(), out.size());
+        lock.lock();
+
+        if (!ok) {
+            // Wake the connection's reader so it detaches the replica.
+            link->closed = true;
+            shutdown(link->fd, SHUT_RDWR);
+            break;
+        }
+    }
+    lock.unlock();
+    close(link->fd);
+}
+
+static int64_t read_private_dirty_bytes() {
+    int fd = open("/proc/self/smaps_rollup", O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    char buffer[4096];
+    ssize_t len = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (len <= 0) {
+        return 0;
+    }
+    buffer[len] = '\0';
+
+    // Pages the child had to copy, either because the parent kept writing to
+    // them or because the child touched them itself.
+    const char* field = "Private_Dirty:";
+    const char* pos = strstr(buffer, field);
+    if (!pos) {
+        return 0;
+    }
+    return strtoll(pos + strlen(field), nullptr, 10) * 1024;
+}
+
+// Runs in the forked child. The keyspace is a copy-on-write image taken while the
+// parent held every store lock, so it is read here without locking. The snapshot
+// is sent as RESP commands that rebuild it, framed like Redis' diskless transfer:
+// "$EOF:<mark>\r\n" <commands> <mark>, so its length need not be known up front.
+static FullSyncResult write_snapshot(const vector<shared_ptr<ReplicaLink>>& targets, int64_t offset, const string& mark) {
+    const size_t chunk_limit = 64 * 1024;
+    FullSyncResult result = {0, 0, 0};
+    string chunk;
+    chunk.reserve(chunk_limit * 2);
+
+    auto flush = [&]() {
+        for (size_t i = 0; i < targets.size(); ++i) {
+            if (!(result.failed_mask & (1ULL << i)) && !send_all(targets[i]->fd, chunk.data(), chunk.size())) {
+                result.failed_mask |= 1ULL << i;
+            }
+        }
+        result.bytes_written += chunk.size();
+        chunk.clear();
+    };
+
+    chunk += "+FULLRESYNC " + master_replid + " " + to_string(offset) + "\r\n";
+    chunk += "$EOF:" + mark + "\r\n";
+
+    auto now = steady_clock::now();
+    for (Keyspace* ks : keyspaces) {
+        for (const auto& entry : ks->strings) {
+            auto exp_it = ks->expirations.find(entry.first);
+            int64_t ttl_ms = -1;
+            if (exp_it != ks->expirations.end()) {
+                ttl_ms = duration_cast<milliseconds>(exp_it->second - now).count();
+                if (ttl_ms <= 0) {
+                    continue;
+                }
+            }
+            chunk += ttl_ms < 0 ? "*3\r\n" : "*5\r\n";
+            append_bulk(chunk, "SET");
+            append_bulk(chunk, entry.first);
+            append_bulk(chunk, entry.second.view());
+            if (ttl_ms >= 0) {
+                append_bulk(chunk, "PX");
+                append_bulk(chunk, to_string(ttl_ms));
+            }
+            if (chunk.size() >= chunk_limit) flush();
+        }
+
+        const size_t list_batch = 512;
+        for (const auto& entry : ks->lists) {
+            const ListValue& list = entry.second;
+            for (size_t start = 0; start < list.size(); start += list_batch) {
+                size_t end = min(list.size(), start + list_batch);
+                chunk += "*" + to_string(end - start + 2) + "\r\n";
+                append_bulk(chunk, "RPUSH");
+                append_bulk(chunk, entry.first);
+                for (size_t i = start; i < end; ++i) {
+                    append_bulk(chunk, list[i]);
+                }
+                if (chunk.size() >= chunk_limit) flush();
+            }
+        }
+
+        for (const auto& entry : ks->streams) {
+            for (const auto& stream_entry : entry.second) {
+                chunk += "*" + to_string(3 + stream_entry.fields.size() * 2) + "\r\n";
+                append_bulk(chunk, "XADD");
+                append_bulk(chunk, entry.first);
+                append_bulk(chunk, stream_entry.id);
+                for (const auto& field : stream_entry.fields) {
+                    append_bulk(chunk, field.first);
+                    append_bulk(chunk, field.second);
+                }
+                if (chunk.size() >= chunk_limit) flush();
+            }
+        }
+
+        const size_t hash_batch = 256;
+        for (const auto& entry : ks->hashes) {
+            size_t remaining = entry.second.size();
+            size_t in_batch = 0;
+            entry.second.for_each([&](string_view field, string_view value) {
+                if (in_batch == 0) {
+                    size_t batch = min(remaining, hash_batch);
+                    chunk += "*" + to_string(2 + batch * 2) + "\r\n";
+                    append_bulk(chunk, "HSET");
+                    append_bulk(chunk, entry.first);
+                }
+                append_bulk(chunk, field);
+                append_bulk(chunk, value);
+                remaining--;
+                if (++in_batch == hash_batch) {
+                    in_batch = 0;
+                    if (chunk.size() >= chunk_limit) flush();
+                }
+            });
+            if (chunk.size() >= chunk_limit) flush();
+        }
+
+        const size_t zset_batch = 256;
+        for (const auto& entry : ks->zsets) {
+            const ZSetValue& zset = entry.second;
+            for (size_t start = 0; start < zset.size(); start += zset_batch) {
+                size_t end = min(zset.size(), start + zset_batch);
+                chunk += "*" + to_string(2 + (end - start) * 2) + "\r\n";
+                append_bulk(chunk, "ZADD");
+                append_bulk(chunk, entry.first);
+                zset.for_range(start, end, [&](const ZEntry& member) {
+                    char score[32];
+                    append_bulk(chunk, string_view(score, snprintf(score, sizeof(score), "%.17g", member.score)));
+                    append_bulk(chunk, member.member);
+                });
+                if (chunk.size() >= chunk_limit) flush();
+            }
+        }
+    }
+
+    chunk += mark;
+    flush();
+
+    result.cow_bytes = read_private_dirty_bytes();
+    return result;
+}
+
+static string random_mark() {
+    static const char hex_digits[] = "0123456789abcdef";
+    random_device rd;
+    string mark;
+    for (int i = 0; i < 40; ++i) {
+        mark.push_back(hex_digits[rd() % 16]);
+    }
+    return mark;
+}
+
+// Serves every replica waiting for a full sync. Replicas that attach during the
+// delay window, or while a child is running, share the next serialization pass.
+static void run_full_sync() {
+    while (true) {
+        this_thread::sleep_for(seconds(repl_diskless_sync_delay));
+
+        vector<shared_ptr<ReplicaLink>> targets;
+        int64_t offset;
+        string mark = random_mark();
+        int stats_pipe[2];
+        if (pipe(stats_pipe) != 0) {
+            log_message(LogLevel::Warning, "Full sync: failed to create pipe");
+            continue;
+        }
+
+        auto start = steady_clock::now();
+        pid_t child;
+        {
+            // No write can run while every store is locked, so the image the child
+            // sees and the offset the stream resumes from describe the same point.
+            AllKeyspacesLock store_lock;
+            {
+                lock_guard<mutex> lock(replication_mutex);
+                for (auto& entry : replicas) {
+                    if (entry.second->state == ReplicaState::WaitingForSync && targets.size() < 64) {
+                        entry.second->state = ReplicaState::Syncing;
+                        targets.push_back(entry.second);
+                    }
+                }
+                if (targets.empty()) {
+                    full_sync_running = false;
+                    close(stats_pipe[0]);
+                    close(stats_pipe[1]);
+                    return;
+                }
+                offset = master_repl_offset;
+            }
+
+            auto fork_started = steady_clock::now();
+            child = fork();
+            if (child == 0) {
+                close(stats_pipe[0]);
+                FullSyncResult result = write_snapshot(targets, offset, mark);
+                write(stats_pipe[1], &result, sizeof(result));
+                _exit(0);
+            }
+            latency_add_sample("fork", duration_cast<milliseconds>(steady_clock::now() - fork_started).count());
+        }
+        close(stats_pipe[1]);
+
+        FullSyncResult result = {0, 0, ~0ULL};
+        if (child < 0) {
+            log_message(LogLevel::Warning, "Full sync: fork failed: ", strerror(errno));
+        }
+        else {
+            if (read(stats_pipe[0], &result, sizeof(result)) != sizeof(result)) {
+                result.failed_mask = ~0ULL;
+            }
+            waitpid(child, nullptr, 0);
+        }
+        close(stats_pipe[0]);
+
+        int64_t elapsed_ms = duration_cast<milliseconds>(steady_clock::now() - start).count();
+        log_message(LogLevel::Notice, "Full sync of ", targets.size(), " replica(s) finished in ", elapsed_ms, " ms, ",
+                    result.bytes_written, " bytes");
+
+        lock_guard<mutex> lock(replication_mutex);
+        for (size_t i = 0; i < targets.size(); ++i) {
+            if (result.failed_mask & (1ULL << i)) {
+                targets[i]->closed = true;
+                shutdown(targets[i]->fd, SHUT_RDWR);
+            }
+            else {
+                targets[i]->state = ReplicaState::Online;
+            }
+            targets[i]->cv.notify_all();
+        }
+        full_syncs++;
+        last_sync_time_ms = elapsed_ms;
+        last_sync_bytes = result.bytes_written;
+        last_sync_cow_bytes = result.cow_bytes;
+        last_sync_replicas = targets.size();
+    }
+}
+
+void start_full_sync(int client_fd, const string& repl_id) {
+    auto link = make_shared<ReplicaLink>();
+    link->fd = dup(client_fd);
+    int nodelay = 1;
+    setsockopt(link->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    lock_guard<mutex> lock(replication_mutex);
+    master_replid = repl_id;
+
+    if (repl_diskless_sync) {
+        link->state = ReplicaState::WaitingForSync;
+        if (!full_sync_running) {
+            full_sync_running = true;
+            thread(run_full_sync).detach();
+        }
+    }
+    else {
+        // Without diskless sync there is no snapshot to send: the replica gets an
+        // empty RDB and the stream from the current offset.
+        string empty_rdb = hex_to_binary("524544495330303131fa0972656469732d76657205372e322e30fa0a72656469732d62697473c040fa056374696d65c26d08bc65fa08757365642d6d656dc2b0c41000fa08616f662d62617365c000fff06e3bfec0ff5aa2");
+        link->state = ReplicaState::Online;
+        link->pending = "+FULLRESYNC " + repl_id + " " + to_string(master_repl_offset.load()) + "\r\n";
+        link->pending += "$" + to_string(empty_rdb.length()) + "\r\n" + empty_rdb;
+    }
+
+    replicas[client_fd] = link;
+    replica_count++;
+    thread(replica_writer, link).detach();
+}
+
+void propagate_command(const vector<RESPObject>& args) {
+    if (replica_count.load() == 0) {
+        return;
+    }
+
+    string encoded = "*" + to_string(args.size()) + "\r\n";
+    for (const auto& arg : args) {
+        append_bulk(encoded, arg.get_string_value());
+    }
+
+    lock_guard<mutex> lock(replication_mutex);
+    master_repl_offset += encoded.size();
+    for (auto& entry : replicas) {
+        ReplicaLink& link = *entry.second;
+        if (link.state == ReplicaState::WaitingForSync) {
+            continue; // the snapshot it is waiting for will include this write
+        }
+        if (link.closed) {
+            continue;
+        }
+        link.pending += encoded;
+        if (output_limit_reached(ClientClass::Replica, link.pending.size(), link.soft_limit_since_ms)) {
+            // The writer thread closes its socket once it sees closed; shutting
+            // it down also ends the connection's reader, which detaches it.
+            log_message(LogLevel::Warning, "Replica on fd ", entry.first, " closed for overcoming of output buffer limits.");
+            link.closed = true;
+            link.pending.clear();
+            shutdown(link.fd, SHUT_RDWR);
+            link.cv.notify_one();
+            continue;
+        }
+        if (link.state == ReplicaState::Online) {
+            link.cv.notify_one();
+        }
+    }
+}
+
+void remove_replica(int client_fd) {
+    if (replica_count.load() == 0) {
+        return;
+    }
+
+    lock_guard<mutex> lock(replication_mutex);
+    auto it = replicas.find(client_fd);
+    if (it == replicas.end()) {
+        return;
+    }
+    it->second->closed = true;
+    it->second->cv.notify_all();
+    replicas.erase(it);
+    replica_count--;
+}
+
+// Replicas that have acknowledged everything up to offset. Caller holds
+// replication_mutex.
+static int count_acked_replicas(int64_t offset) {
+    int count = 0;
+    for (const auto& entry : replicas) {
+        if (entry.second->ack_offset >= offset) {
+            count++;
+        }
+    }
+    return count;
+}
+
+void record_replica_ack(int client_fd, int64_t offset) {
+    {
+        lock_guard<mutex> lock(replication_mutex);
+        auto it = replicas.find(client_fd);
+        if (it == replicas.end()) {
+            return;
+        }
+        it->second->ack_offset = max(it->second->ack_offset, offset);
+        it->second->last_ack_time = steady_clock::now();
+
+        for (WaitRequest* waiter : waiters) {
+            if (offset >= waiter->target_offset && count_acked_replicas(waiter->target_offset) >= waiter->needed) {
+                waiter->cv.notify_one();
+            }
+        }
+    }
+    signal_replica_acks(offset);
+}
+
+int acked_replica_count(int64_t offset) {
+    lock_guard<mutex> lock(replication_mutex);
+    return count_acked_replicas(offset);
+}
+
+// Asks every replica for an ACK now rather than waiting for the periodic one.
+static void request_acks() {
+    propagate_command({RESPObject(RESPType::BulkString, "REPLCONF"),
+                       RESPObject(RESPType::BulkString, "GETACK"),
+                       RESPObject(RESPType::BulkString, "*")});
+}
+
+int64_t request_replica_acks(int numreplicas) {
+    int64_t target_offset = master_repl_offset;
+    {
+        lock_guard<mutex> lock(replication_mutex);
+        if (count_acked_replicas(target_offset) >= numreplicas || replicas.empty()) {
+            return -1;
+        }
+    }
+    request_acks();
+    return target_offset;
+}
+
+int wait_for_replicas(int numreplicas, int64_t timeout_ms) {
+    int64_t target_offset = master_repl_offset;
+    {
+        lock_guard<mutex> lock(replication_mutex);
+        int acked = count_acked_replicas(target_offset);
+        if (acked >= numreplicas || replicas.empty()) {
+            return acked;
+        }
+    }
+
+    request_acks();
+
+    unique_lock<mutex> lock(replication_mutex);
+    WaitRequest request;
+    request.target_offset = target_offset;
+    request.needed = numreplicas;
+    auto it = waiters.insert(waiters.end(), &request);
+
+    auto satisfied = [&] { return count_acked_replicas(target_offset) >= numreplicas; };
+    if (timeout_ms == 0) {
+        request.cv.wait(lock, satisfied);
+    }
+    else {
+        request.cv.wait_for(lock, milliseconds(timeout_ms), satisfied);
+    }
+
+    waiters.erase(it);
+    return count_acked_replicas(target_offset);
+}
+
+size_t replica_pending_bytes() {
+    lock_guard<mutex> lock(replication_mutex);
+    size_t bytes = 0;
+    for (const auto& entry : replicas) {
+        bytes += entry.second->pending.size();
+    }
+    return bytes;
+}
+
+void append_master_replication_info(string& body) {
+    lock_guard<mutex> lock(replication_mutex);
+    body += "connected_slaves:" + to_string(replicas.size()) + "\r\n";
+
+    int index = 0;
+    for (const auto& entry : replicas) {
+        const ReplicaLink& link = *entry.second;
+        string state = link.state == ReplicaState::Online ? "online" :
+                       link.state == ReplicaState::Syncing ? "send_bulk" : "wait_bgsave";
+        int64_t lag = duration_cast<seconds>(steady_clock::now() - link.last_ack_time).count();
+        body += "slave" + to_string(index++) + ":fd=" + to_string(entry.first) +
+                ",state=" + state + ",offset=" + to_string(link.ack_offset) + ",lag=" + to_string(lag) +
+                ",lag_bytes=" + to_string(master_repl_offset - max<int64_t>(link.ack_offset, 0)) +
+                ",pending_bytes=" + to_string(link.pending.size()) + "\r\n";
+    }
+
+    body += "repl_diskless_sync:" + string(repl_diskless_sync ? "yes" : "no") + "\r\n";
+    body += "sync_full:" + to_string(full_syncs) + "\r\n";
+    body += "repl_last_full_sync_replicas:" + to_string(last_sync_replicas) + "\r\n";
+    body += "repl_last_full_sync_time_ms:" + to_string(last_sync_time_ms) + "\r\n";
+    body += "repl_last_full_sync_bytes:" + to_string(last_sync_bytes) + "\r\n";
+    body += "repl_last_full_sync_cow_bytes:" + to_string(last_sync_cow_bytes) + "\r\n";
+}
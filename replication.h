@@ -0,0 +1,49 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <atomic>
+#include "redis_parser.h"
+
+using namespace std;
+
+// Full synchronization settings, set from the command line in main().
+// With diskless sync the master forks and serializes the keyspace straight into
+// the replica sockets; otherwise replicas get an empty RDB and only the stream.
+extern bool repl_diskless_sync;
+extern int repl_diskless_sync_delay;
+
+// Bytes of write commands propagated to replicas so far.
+extern atomic<int64_t> master_repl_offset;
+
+// Attaches client_fd as a replica after PSYNC. All further writes to the socket
+// (the FULLRESYNC reply, the snapshot and the command stream) are made by the
+// replication code, so the caller must not reply itself.
+void start_full_sync(int client_fd, const string& repl_id);
+
+// Appends a write command to every attached replica's stream. Handlers call this
+// while still holding the store lock so replicas see writes in the same order.
+void propagate_command(const vector<RESPObject>& args);
+
+// Detaches a replica whose connection has closed. No-op for ordinary clients.
+void remove_replica(int client_fd);
+
+// Records a "REPLCONF ACK <offset>" from the replica on client_fd.
+void record_replica_ack(int client_fd, int64_t offset);
+
+// Implements WAIT: asks replicas for an ACK and parks the calling connection
+// until numreplicas have acknowledged every write made so far, or timeout_ms
+// passes (0 waits forever). Returns how many replicas had acknowledged. A
+// replica only counts once it has sent an ACK, not when its sync starts.
+int wait_for_replicas(int numreplicas, int64_t timeout_ms);
+// WAIT in the event-loop modes, which park the connection rather than sleep:
+// asks the replicas for an ACK and returns the offset numreplicas of them must
+// acknowledge, or -1 if enough already have or there are no replicas.
+int64_t request_replica_acks(int numreplicas);
+// Replicas that have acknowledged everything up to offset.
+int acked_replica_count(int64_t offset);
+
+// Stream bytes buffered for replicas and not yet written, for MEMORY STATS.
+size_t replica_pending_bytes();
+
+// Appends the master side of INFO replication (replicas and full-sync stats).
+void append_master_replication_info(string& body);
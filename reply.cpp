@@ -0,0 +1,68 @@
+#include <string>
+#include <string_view>
+#include <charconv>
+#include <memory>
+#include "reply.h"
+
+using namespace std;
+
+void Reply::append_header(char type, int64_t value) {
+    char buffer[24];
+    buffer[0] = type;
+    char* end = to_chars(buffer + 1, buffer + sizeof(buffer) - 2, value).ptr;
+    *end++ = '\r';
+    *end++ = '\n';
+    out.append(buffer, end - buffer);
+}
+
+void Reply::simple(string_view text) {
+    out += '+';
+    out.append(text);
+    out.append("\r\n", 2);
+}
+
+void Reply::error(string_view message) {
+    out += '-';
+    out.append(message);
+    out.append("\r\n", 2);
+}
+
+void Reply::integer(int64_t value) {
+    append_header(':', value);
+}
+
+void Reply::bulk(string_view value) {
+    append_header('$', value.size());
+    out.append(value);
+    out.append("\r\n", 2);
+}
+
+void Reply::bulk(const shared_ptr<const string>& value) {
+    append_header('$', value->size());
+    output.append_shared(value);
+    out.append("\r\n", 2);
+}
+
+void Reply::null_bulk() {
+    out.append("$-1\r\n", 5);
+}
+
+void Reply::array(size_t count) {
+    append_header('*', count);
+}
+
+void Reply::null_array() {
+    out.append("*-1\r\n", 5);
+}
+
+void Reply::push(size_t count) {
+    append_header('>', count);
+}
+
+void Reply::map(size_t count) {
+    append_header('%', count);
+}
+
+void Reply::raw(string_view encoded) {
+    out.append(encoded);
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <memory>
+#include "output_buffer.h"
+
+using namespace std;
+
+// Writes RESP replies straight into a connection's output buffer. Lengths and
+// integers are formatted in place with to_chars, so building a reply creates no
+// temporary strings. Handlers that know roughly how large a reply will be call
+// reserve() first, so a long array grows the buffer once instead of per element.
+class Reply {
+private:
+    OutputBuffer& output;
+    string& out;
+
+    void append_header(char type, int64_t value);
+
+public:
+    explicit Reply(OutputBuffer& buffer) : output(buffer), out(buffer.text) {}
+
+    void reserve(size_t bytes) { out.reserve(out.size() + bytes); }
+    // Upper bound on what bulk() writes for a value of this length.
+    static size_t bulk_size(size_t length) { return length + 25; }
+
+    void simple(string_view text);
+    // message carries its own prefix, e.g. "ERR syntax error".
+    void error(string_view message);
+    void integer(int64_t value);
+    void bulk(string_view value);
+    // Same reply, but the value is sent from its shared buffer rather than
+    // copied into the output.
+    void bulk(const shared_ptr<const string>& value);
+    void null_bulk();
+    void array(size_t count);
+    void null_array();
+    // RESP3 only: an out-of-band push message and a map of count pairs.
+    void push(size_t count);
+    void map(size_t count);
+    // Appends bytes that are already RESP encoded.
+    void raw(string_view encoded);
+
+    size_t size() const { return out.size(); }
+};
@@ -0,0 +1,872 @@
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include "shards.h"
+#include "database.h"
+#include "handle_redis_commands.h"
+#include "blocking.h"
+#include "io_threads.h"
+#include "spsc_queue.h"
+#include "clients.h"
+#include "pubsub.h"
+#include "logger.h"
+
+using namespace std;
+
+int shard_count = 0;
+thread_local ShardTour* shard_tour = nullptr;
+
+// Entries per queue between two shards. A queue holds at most one entry per
+// connection, and entries that don't fit wait in the sender's outbox, so this
+// only bounds memory: there are shard_count^2 queues.
+const size_t SHARD_QUEUE_CAPACITY = 256;
+const size_t OUTPUT_KEEP_CAPACITY = 64 * 1024;
+
+struct ShardConnection {
+    int fd;
+    int home;                   // the shard whose thread serves the socket
+    ClientState client;
+    string input;
+
+    // Commands sent to another shard to run. While in_flight is set that shard
+    // owns client and batch, or a command of the connection is parked on a
+    // shard, which keeps it until the command has answered.
+    vector<RESPObject> batch;
+    size_t next_command = 0;
+    bool in_flight = false;
+    unique_ptr<ShardTour> tour;     // batch is one command visiting every shard
+
+    uint32_t events = 0;        // epoll events registered for fd, 0 if none
+    bool peer_closed = false;   // read hit EOF; close once everything read is answered
+    bool gone = false;          // closed or handed off, freed after this epoll round
+};
+
+struct Shard {
+    int index;
+    int epoll_fd = -1;
+    int listen_fd = -1;
+    int wake_fd = -1;           // eventfd, bumped when the inbox gets entries
+    // Set while the thread may be blocked in epoll_wait(); a sender that sees it
+    // writes wake_fd.
+    atomic<bool> sleeping{false};
+    // Set by a ShardPause: stop at the top of the loop until it is cleared.
+    atomic<bool> pause_requested{false};
+    bool paused = false;        // stopped; guarded by pause_state_mutex
+
+    // inbox[i] carries connections from shard i: batches to run here, or, for a
+    // connection served here, its batch coming back with the replies.
+    vector<unique_ptr<SpscQueue<ShardConnection*>>> inbox;
+    // outbox[i] holds connections for shard i that didn't fit in its inbox yet.
+    vector<deque<ShardConnection*>> outbox;
+    vector<ShardConnection*> retired;
+
+    // Commands parked on this shard, which owns their keys.
+    unique_ptr<BlockedClients> blocked;
+    // Subscribers served here with new messages, posted by publishers.
+    unique_ptr<MailboxLoop> mailboxes;
+};
+
+static vector<unique_ptr<Shard>> shards;
+// The shard the calling thread runs, if it is a shard thread.
+static thread_local Shard* current_shard = nullptr;
+
+// One ShardPause at a time; recursive, as they nest.
+static recursive_mutex pause_mutex;
+static mutex pause_state_mutex;
+static condition_variable pause_cv;
+
+int shard_for_key(const string& key) {
+    string_view tag = key;
+    size_t open = key.find('{');
+    if (open != string::npos) {
+        size_t close = key.find('}', open + 1);
+        if (close != string::npos && close > open + 1) {
+            tag = tag.substr(open + 1, close - open - 1);
+        }
+    }
+    // The stores pick buckets by the low bits of this same hash, so the shard
+    // comes from the high bits of a remix of it.
+    uint64_t hash = std::hash<string_view>()(tag);
+    return (int)(((hash * 0x9E3779B97F4A7C15ULL) >> 32) % shard_count);
+}
+
+static int merge_shards(int a, int b) {
+    if (a == SHARD_ANY) {
+        return b;
+    }
+    if (b == SHARD_ANY || a == b) {
+        return a;
+    }
+    return SHARD_CROSSSLOT;
+}
+
+static int keys_shard(const string& command, const vector<RESPObject>& args) {
+    KeyPositions keys = command_key_positions(command, args);
+    int shard = SHARD_ANY;
+    for (size_t i = keys.first; i < keys.last && shard != SHARD_CROSSSLOT; i += keys.step) {
+        shard = merge_shards(shard, shard_for_key(args[i].get_string_value()));
+    }
+    return shard;
+}
+
+int command_shard(const RESPObject& obj, const ClientState& client) {
+    string command = command_name(obj);
+    if (command.empty()) {
+        return SHARD_ANY;
+    }
+    bool transaction_control = command == "MULTI" || command == "EXEC" || command == "DISCARD" ||
+                               command == "WATCH" || command == "UNWATCH";
+    if (client.in_multi && !transaction_control) {
+        return SHARD_ANY;   // only queued; EXEC goes to the shard of the queued keys
+    }
+    if (command == "SCAN" || command == "BIGKEYS") {
+        return SHARD_TOUR;
+    }
+    if (command != "EXEC") {
+        return keys_shard(command, obj.get_array());
+    }
+    if (!client.in_multi || client.multi_failed) {
+        return SHARD_ANY;   // answered with an error wherever it runs
+    }
+
+    int shard = SHARD_ANY;
+    for (const RESPObject& queued : client.queued_commands) {
+        string queued_command = command_name(queued);
+        if (queued_command == "SCAN" || queued_command == "FLUSHALL" || queued_command == "FLUSHDB" ||
+            queued_command == "BIGKEYS") {
+            // SCAN, BIGKEYS and FLUSHALL touch every shard, which EXEC can't do while
+            // it holds the locks of one.
+            return SHARD_CROSSSLOT;
+        }
+        shard = merge_shards(shard, keys_shard(queued_command, queued.get_array()));
+        if (shard == SHARD_CROSSSLOT) {
+            break;
+        }
+    }
+    return shard;
+}
+
+// Answers a request refused for spanning shards. A transaction refused at EXEC
+// is discarded, like one that fails its WATCH.
+static void reject_crossslot(const RESPObject& obj, ClientState& client) {
+    if (command_name(obj) == "EXEC") {
+        release_client_state(client);
+    }
+    if (client.fd != -1) {
+        Reply(client.output).error("CROSSSLOT Keys in request don't hash to the same slot");
+    }
+}
+
+// Runs one part of a split write, or one shard's part of a tour. A handler
+// that throws answers with an error, as handle_client does, so the other parts
+// still run.
+static void run_guarded(RESPObject& obj, ClientState& client, const vector<pair<string, string>>& replica_info) {
+    size_t reply_start = client.output.text.size();
+    try {
+        handle_command(obj, client, replica_info);
+    }
+    catch (const exception& ex) {
+        client.output.truncate(reply_start);
+        Reply(client.output).error("ERR Protocol error: " + string(ex.what()));
+    }
+}
+
+// A master sharded differently, or not at all, can send one write for keys on
+// several shards here. Its effect is per key, so it is applied as one command
+// per shard, each with the keys that shard owns.
+static void apply_split(const RESPObject& obj, ClientState& client, const vector<pair<string, string>>& replica_info) {
+    const vector<RESPObject>& args = obj.get_array();
+    KeyPositions keys = command_key_positions(command_name(obj), args);
+    vector<vector<RESPObject>> parts(shard_count);
+    for (size_t i = keys.first; i < keys.last; i += keys.step) {
+        vector<RESPObject>& part = parts[shard_for_key(args[i].get_string_value())];
+        if (part.empty()) {
+            part.push_back(args[0]);
+        }
+        for (size_t j = i; j < i + keys.step && j < args.size(); ++j) {
+            part.push_back(args[j]);
+        }
+    }
+
+    Keyspace* previous = keyspace;
+    for (int shard = 0; shard < shard_count; ++shard) {
+        if (parts[shard].empty()) {
+            continue;
+        }
+        parts[shard].insert(parts[shard].end(), args.begin() + keys.last, args.end());
+        RESPObject part(RESPType::Array, "", 0, std::move(parts[shard]));
+        keyspace = keyspaces[shard];
+        run_guarded(part, client, replica_info);
+    }
+    keyspace = previous;
+}
+
+// The shard a tour starts on.
+static int tour_start(const RESPObject& obj) {
+    return command_name(obj) == "SCAN" ? scan_cursor_shard(obj.get_array()) : 0;
+}
+
+// Runs a whole tour from a thread that has the shards paused.
+static void run_tour_here(RESPObject& obj, ClientState& client, const vector<pair<string, string>>& replica_info) {
+    Keyspace* previous = keyspace;
+    ShardTour tour;
+    shard_tour = &tour;
+    for (int shard = tour_start(obj); shard < shard_count; ++shard) {
+        keyspace = keyspaces[shard];
+        tour.last = shard == shard_count - 1;
+        tour.more = false;
+        run_guarded(obj, client, replica_info);
+        if (!tour.more) {
+            break;
+        }
+    }
+    shard_tour = nullptr;
+    keyspace = previous;
+}
+
+void run_on_owning_shard(RESPObject& obj, ClientState& client, const vector<pair<string, string>>& replica_info) {
+    ShardPause pause;
+    // Nothing waits while the shards are stopped: a blocking command answers
+    // as if its timeout had passed.
+    BlockedCommand no_wait;
+    no_wait.expired = true;
+    BlockedCommand* saved_slot = block_slot;
+    block_slot = &no_wait;
+
+    int shard = command_shard(obj, client);
+    if (shard == SHARD_TOUR) {
+        run_tour_here(obj, client, replica_info);
+        block_slot = saved_slot;
+        return;
+    }
+    if (shard == SHARD_CROSSSLOT) {
+        if (client.fd == -1 && command_name(obj) != "EXEC") {
+            apply_split(obj, client, replica_info);
+        }
+        else {
+            reject_crossslot(obj, client);
+        }
+        block_slot = saved_slot;
+        return;
+    }
+
+    Keyspace* previous = keyspace;
+    if (shard != SHARD_ANY) {
+        keyspace = keyspaces[shard];
+    }
+    handle_command(obj, client, replica_info);
+    keyspace = previous;
+    block_slot = saved_slot;
+}
+
+// Registers interest in input until the peer closes, and in writability while
+// replies are waiting to go out.
+static void update_events(Shard& shard, ShardConnection* conn) {
+    uint32_t wanted = conn->peer_closed ? 0u : (uint32_t)EPOLLIN;
+    if (!conn->in_flight && !conn->client.output.empty()) {
+        wanted |= EPOLLOUT;
+    }
+    if (wanted == conn->events) {
+        return;
+    }
+    epoll_event ev = {};
+    ev.events = wanted;
+    ev.data.ptr = conn;
+    int op = conn->events == 0 ? EPOLL_CTL_ADD : wanted == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    epoll_ctl(shard.epoll_fd, op, conn->fd, &ev);
+    conn->events = wanted;
+}
+
+static void retire(Shard& shard, ShardConnection* conn) {
+    if (conn->events != 0) {
+        epoll_ctl(shard.epoll_fd, EPOLL_CTL_DEL, conn->fd, nullptr);
+    }
+    conn->gone = true;
+    shard.retired.push_back(conn);
+}
+
+static void close_connection(Shard& shard, ShardConnection* conn) {
+    retire(shard, conn);
+    release_client_state(conn->client);
+    shard.mailboxes->forget(conn);
+    unregister_client(conn->client);
+    close(conn->fd);
+}
+
+// Moves a connection that is about to run PSYNC onto its own thread, which runs
+// each of its commands on the owning shard's keyspace under the store locks.
+static void hand_off(Shard& shard, ShardConnection* conn, const vector<pair<string, string>>& replica_info) {
+    retire(shard, conn);
+    leave_mailbox_loop(conn->client);
+    fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) & ~O_NONBLOCK);
+    thread client_thread(handle_client, conn->fd, ref(replica_info), std::move(conn->client), std::move(conn->input));
+    client_thread.detach();
+}
+
+// Runs the command of conn's tour on this shard. Returns the shard the
+// connection goes to next: the next one if the command goes on, else its home
+// with the reply.
+static int run_tour_step(Shard& shard, ShardConnection* conn, const vector<pair<string, string>>& replica_info) {
+    ShardTour& tour = *conn->tour;
+    tour.last = shard.index == shard_count - 1;
+    tour.more = false;
+    shard_tour = &tour;
+    run_guarded(conn->batch.front(), conn->client, replica_info);
+    shard_tour = nullptr;
+    if (tour.more) {
+        return shard.index + 1;
+    }
+    conn->batch.clear();
+    conn->tour.reset();
+    return conn->home;
+}
+
+// Runs the complete requests in input in order. Those for this shard's keys,
+// or for no keys, run right here; a run of consecutive requests for another
+// shard's keys is sent there as one batch, and nothing more is run until it
+// is back, nor after a command that parks here or goes on a tour. A command
+// that needs a thread of its own is left for one.
+static void execute(Shard& shard, ShardConnection* conn, const vector<pair<string, string>>& replica_info) {
+    RESPParser parser;
+    size_t consumed = 0;
+    int remote = SHARD_ANY;
+    bool blocking_next = false;
+    try {
+        while (consumed < conn->input.size()) {
+            RESPObject obj = parser.parse(conn->input);
+            if (command_needs_own_thread(obj)) {
+                blocking_next = true;
+                break;
+            }
+            int owner = command_shard(obj, conn->client);
+            if (remote != SHARD_ANY) {
+                // Routed on the state before the batch runs, so only requests
+                // for the same keyspace may join it.
+                if (owner != remote) {
+                    break;
+                }
+                conn->batch.push_back(std::move(obj));
+            }
+            else if (owner == SHARD_CROSSSLOT) {
+                reject_crossslot(obj, conn->client);
+            }
+            else if (owner == SHARD_TOUR) {
+                conn->tour.reset(new ShardTour());
+                conn->batch.push_back(std::move(obj));
+                int first = tour_start(conn->batch.front());
+                remote = first == shard.index ? run_tour_step(shard, conn, replica_info) : first;
+                consumed = parser.get_position();
+                if (!conn->batch.empty()) {
+                    break;
+                }
+                remote = SHARD_ANY;     // answered here
+            }
+            else if (owner != SHARD_ANY && owner != shard.index) {
+                remote = owner;
+                conn->batch.push_back(std::move(obj));
+            }
+            else if (run_loop_command(obj, conn->client, replica_info, *shard.blocked, conn)) {
+                consumed = parser.get_position();
+                conn->in_flight = true;
+                break;
+            }
+            consumed = parser.get_position();
+        }
+    }
+    catch (const RESPIncompleteError&) {
+    }
+    catch (const exception& ex) {
+        // Reported once the batch ahead of it has answered.
+        if (conn->batch.empty()) {
+            Reply(conn->client.output).error("ERR Protocol error: " + string(ex.what()));
+            consumed = conn->input.size();
+        }
+    }
+    conn->input.erase(0, consumed);
+
+    if (!conn->batch.empty()) {
+        conn->in_flight = true;
+        shard.outbox[remote].push_back(conn);
+    }
+    else if (blocking_next) {
+        hand_off(shard, conn, replica_info);
+    }
+}
+
+// Reads until the socket is drained or the peer has closed.
+static void read_input(ShardConnection* conn) {
+    char buffer[16 * 1024];
+    while (true) {
+        ssize_t bytes_read = read(conn->fd, buffer, sizeof(buffer));
+        if (bytes_read > 0) {
+            conn->input.append(buffer, bytes_read);
+            if (bytes_read < (ssize_t)sizeof(buffer)) {
+                return;
+            }
+            continue;
+        }
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            conn->peer_closed = true;
+        }
+        return;
+    }
+}
+
+// Moves a connection along while no other shard holds it: writes what the
+// socket takes, with any messages published to it, and, once earlier replies
+// are all out, runs what has been read.
+static void service(Shard& shard, ShardConnection* conn, const vector<pair<string, string>>& replica_info) {
+    if (!conn->in_flight && conn->client.subscriber) {
+        take_messages(conn->client);
+    }
+    while (!conn->in_flight) {
+        if (!conn->client.output.flush(conn->fd)) {
+            close_connection(shard, conn);
+            return;
+        }
+        if (!conn->client.output.empty()) {
+            break;
+        }
+        if (conn->client.output.text.capacity() > 16 * OUTPUT_KEEP_CAPACITY) {
+            string().swap(conn->client.output.text);
+        }
+        execute(shard, conn, replica_info);
+        if (conn->gone) {
+            return;
+        }
+        if (conn->client.output.empty() && !conn->in_flight) {
+            if (conn->peer_closed) {
+                close_connection(shard, conn);
+                return;
+            }
+            break;
+        }
+    }
+    if (!conn->in_flight) {
+        note_client_buffers(conn->client, conn->input.size());
+    }
+    update_events(shard, conn);
+}
+
+// Runs a batch sent here from where it stopped. Returns false if a command
+// parked, which keeps the connection here until it has answered.
+static bool run_batch(Shard& shard, ShardConnection* conn, const vector<pair<string, string>>& replica_info) {
+    while (conn->next_command < conn->batch.size()) {
+        RESPObject& obj = conn->batch[conn->next_command++];
+        if (run_loop_command(obj, conn->client, replica_info, *shard.blocked, conn)) {
+            return false;
+        }
+    }
+    conn->batch.clear();
+    conn->next_command = 0;
+    return true;
+}
+
+// Takes batches sent here to run and batches coming back to connections
+// served here.
+static bool drain_inbox(Shard& shard, const vector<pair<string, string>>& replica_info) {
+    bool worked = false;
+    for (int from = 0; from < shard_count; ++from) {
+        if (from == shard.index) {
+            continue;
+        }
+        ShardConnection* conn;
+        while (shard.inbox[from]->pop(conn)) {
+            worked = true;
+            if (conn->tour) {
+                int next = run_tour_step(shard, conn, replica_info);
+                if (next != shard.index) {
+                    shard.outbox[next].push_back(conn);
+                    continue;
+                }
+            }
+            if (conn->home == shard.index) {
+                conn->in_flight = false;
+                service(shard, conn, replica_info);
+                continue;
+            }
+            if (run_batch(shard, conn, replica_info)) {
+                shard.outbox[conn->home].push_back(conn);
+            }
+        }
+    }
+    return worked;
+}
+
+// Runs the commands parked here that can answer now. A connection from
+// another shard goes on with its batch and home; one served here goes on with
+// its input.
+static bool resume_blocked(Shard& shard, const vector<pair<string, string>>& replica_info) {
+    if (!shard.blocked->has_ready()) {
+        return false;
+    }
+    static thread_local vector<BlockedClients::Ready> ready;
+    shard.blocked->take_ready(ready);
+    for (BlockedClients::Ready& entry : ready) {
+        ShardConnection* conn = (ShardConnection*)entry.connection;
+        if (resume_loop_command(entry.command, conn->client, replica_info, *shard.blocked, conn)) {
+            continue;
+        }
+        if (conn->home != shard.index) {
+            if (run_batch(shard, conn, replica_info)) {
+                shard.outbox[conn->home].push_back(conn);
+            }
+            continue;
+        }
+        conn->in_flight = false;
+        service(shard, conn, replica_info);
+    }
+    ready.clear();
+    return true;
+}
+
+// Moves the messages published to subscribers served here to their output. A
+// connection away at another shard takes them when it is back.
+static bool deliver_messages(Shard& shard, const vector<pair<string, string>>& replica_info) {
+    if (!shard.mailboxes->has_posts()) {
+        return false;
+    }
+    static thread_local vector<void*> posted;
+    shard.mailboxes->take(posted);
+    for (void* subscriber : posted) {
+        ShardConnection* conn = (ShardConnection*)subscriber;
+        if (!conn->in_flight) {
+            service(shard, conn, replica_info);
+        }
+    }
+    posted.clear();
+    return true;
+}
+
+static bool inbox_pending(const Shard& shard) {
+    for (int from = 0; from < shard_count; ++from) {
+        if (from != shard.index && !shard.inbox[from]->empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Wakes a shard that may be asleep. The caller has published the work first,
+// then issued a fence that pairs with the one in shard_loop: either the shard
+// sees the work before it sleeps, or this sees it asleep and wakes it.
+static void wake_shard(Shard& target) {
+    if (target.sleeping.exchange(false)) {
+        uint64_t one = 1;
+        if (write(target.wake_fd, &one, sizeof(one)) < 0) {
+            static LogRateLimit wake_errors;
+            log_limited(wake_errors, LogLevel::Warning, "Failed to wake shard ", target.index, ": ", strerror(errno));
+        }
+    }
+}
+
+// Stops here while a ShardPause asks for it.
+static void hold_if_paused(Shard& shard) {
+    if (!shard.pause_requested.load(memory_order_acquire)) {
+        return;
+    }
+    unique_lock<mutex> lock(pause_state_mutex);
+    shard.paused = true;
+    pause_cv.notify_all();
+    pause_cv.wait(lock, [&] { return !shard.pause_requested.load(memory_order_relaxed); });
+    shard.paused = false;
+}
+
+ShardPause::ShardPause(int only) : saved_store_locks(held_store_locks) {
+    if (shards.empty()) {
+        return;
+    }
+    if (current_shard) {
+        // Another pauser may be waiting for this very shard to stop.
+        while (!pause_mutex.try_lock()) {
+            hold_if_paused(*current_shard);
+            this_thread::yield();
+        }
+    }
+    else {
+        pause_mutex.lock();
+    }
+    locked = true;
+
+    for (auto& shard : shards) {
+        if (shard.get() == current_shard || (only != SHARD_ANY && shard->index != only) || shard->pause_requested) {
+            continue;   // the caller's own, or already stopped by an outer pause
+        }
+        shard->pause_requested = true;
+        paused.set(shard->index);
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+    for (auto& shard : shards) {
+        if (paused.test(shard->index)) {
+            wake_shard(*shard);
+        }
+    }
+    unique_lock<mutex> lock(pause_state_mutex);
+    pause_cv.wait(lock, [&] {
+        for (auto& shard : shards) {
+            if (paused.test(shard->index) && !shard->paused) {
+                return false;
+            }
+        }
+        return true;
+    });
+    held_store_locks = ALL_STORE_LOCKS;
+}
+
+ShardPause::~ShardPause() {
+    if (!locked) {
+        return;
+    }
+    {
+        lock_guard<mutex> lock(pause_state_mutex);
+        for (auto& shard : shards) {
+            if (paused.test(shard->index)) {
+                shard->pause_requested = false;
+            }
+        }
+    }
+    pause_cv.notify_all();
+    held_store_locks = saved_store_locks;
+    pause_mutex.unlock();
+}
+
+// Moves what the queues take from the outboxes and wakes each shard that got
+// something and may be asleep. Returns true if anything is left over.
+static bool flush_outboxes(Shard& shard) {
+    bool left_over = false;
+    vector<int> sent_to;
+    for (int to = 0; to < shard_count; ++to) {
+        deque<ShardConnection*>& outbox = shard.outbox[to];
+        if (outbox.empty()) {
+            continue;
+        }
+        SpscQueue<ShardConnection*>& queue = *shards[to]->inbox[shard.index];
+        bool sent = false;
+        while (!outbox.empty() && queue.push(outbox.front())) {
+            outbox.pop_front();
+            sent = true;
+        }
+        if (sent) {
+            sent_to.push_back(to);
+        }
+        left_over = left_over || !outbox.empty();
+    }
+    if (sent_to.empty()) {
+        return left_over;
+    }
+
+    atomic_thread_fence(memory_order_seq_cst);
+    for (int to : sent_to) {
+        wake_shard(*shards[to]);
+    }
+    return left_over;
+}
+
+static void accept_connections(Shard& shard) {
+    while (true) {
+        int client_fd = accept4(shard.listen_fd, nullptr, nullptr, SOCK_NONBLOCK);
+        if (client_fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        ShardConnection* conn = new ShardConnection();
+        conn->fd = client_fd;
+        conn->home = shard.index;
+        conn->client.fd = client_fd;
+        conn->client.mailbox_loop = shard.mailboxes.get();
+        conn->client.loop_connection = conn;
+        register_client(conn->client, client_fd);
+        conn->client.output.text.reserve(OUTPUT_KEEP_CAPACITY);
+        conn->events = EPOLLIN;
+
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        epoll_ctl(shard.epoll_fd, EPOLL_CTL_ADD, client_fd, &ev);
+    }
+}
+
+static void pin_to_core(int index) {
+    unsigned cores = thread::hardware_concurrency();
+    if (cores == 0) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % cores, &set);
+    // Best effort: a restricted cpuset just leaves the thread unpinned.
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void shard_loop(Shard& shard, const vector<pair<string, string>>& replica_info) {
+    keyspace = keyspaces[shard.index];
+    current_shard = &shard;
+    // Only this thread runs commands on the keyspace; whatever else needs it
+    // stops the shard first. So the store locks are as good as held.
+    held_store_locks = ALL_STORE_LOCKS;
+    shard.blocked->serve_on_this_thread();
+    pin_to_core(shard.index);
+
+    epoll_event events[256];
+    while (true) {
+        hold_if_paused(shard);
+        bool worked = drain_inbox(shard, replica_info);
+        worked = resume_blocked(shard, replica_info) || worked;
+        worked = deliver_messages(shard, replica_info) || worked;
+        bool left_over = flush_outboxes(shard);
+
+        // Sleeps until woken or the first parked command's deadline.
+        int timeout = worked || left_over ? 0 : shard.blocked->timeout_ms();
+        if (timeout != 0) {
+            shard.sleeping = true;
+            atomic_thread_fence(memory_order_seq_cst);
+            if (inbox_pending(shard) || shard.blocked->has_ready() || shard.mailboxes->has_posts() ||
+                shard.pause_requested.load()) {
+                shard.sleeping = false;
+                timeout = 0;
+            }
+        }
+        int count = epoll_wait(shard.epoll_fd, events, 256, timeout);
+        shard.sleeping = false;
+
+        for (int i = 0; i < count; ++i) {
+            void* tag = events[i].data.ptr;
+            if (tag == nullptr) {
+                // Only a wakeup; the inbox is drained at the top of the loop.
+                uint64_t wakeups;
+                if (read(shard.wake_fd, &wakeups, sizeof(wakeups)) < 0) {
+                }
+                continue;
+            }
+            if (tag == &shard) {
+                accept_connections(shard);
+                continue;
+            }
+
+            ShardConnection* conn = (ShardConnection*)tag;
+            if (conn->gone) {
+                continue;
+            }
+            if ((events[i].events & EPOLLERR) && !conn->in_flight) {
+                // Usually zero-copy completions; a real error shows up in read().
+                conn->client.output.reap_zerocopy(conn->fd);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                read_input(conn);
+            }
+            service(shard, conn, replica_info);
+        }
+
+        for (ShardConnection* conn : shard.retired) {
+            delete conn;
+        }
+        shard.retired.clear();
+    }
+}
+
+static int open_listener(int port) {
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listen_fd < 0) {
+        log_message(LogLevel::Warning, "Failed to create server socket");
+        return -1;
+    }
+    // Every shard binds the port itself and the kernel spreads connections
+    // across the listeners.
+    int reuse = 1;
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0 ||
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+        log_message(LogLevel::Warning, "setsockopt failed");
+        close(listen_fd);
+        return -1;
+    }
+
+    struct sockaddr_in server_addr = {};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+    if (bind(listen_fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) != 0) {
+        log_message(LogLevel::Warning, "Failed to bind to port ", port);
+        close(listen_fd);
+        return -1;
+    }
+    if (listen(listen_fd, 511) != 0) {
+        log_message(LogLevel::Warning, "listen failed");
+        close(listen_fd);
+        return -1;
+    }
+    return listen_fd;
+}
+
+void init_shards() {
+    for (int i = 1; i < shard_count; ++i) {
+        keyspaces.push_back(new Keyspace());
+    }
+    for (int i = 0; i < shard_count; ++i) {
+        unique_ptr<Shard> shard(new Shard());
+        shard->index = i;
+        shard->epoll_fd = epoll_create1(0);
+        shard->wake_fd = eventfd(0, EFD_NONBLOCK);
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr;
+        epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->wake_fd, &ev);
+
+        shard->inbox.resize(shard_count);
+        for (int from = 0; from < shard_count; ++from) {
+            if (from != i) {
+                shard->inbox[from].reset(new SpscQueue<ShardConnection*>(SHARD_QUEUE_CAPACITY));
+            }
+        }
+        shard->outbox.resize(shard_count);
+        Shard* target = shard.get();
+        auto wake = [target] {
+            atomic_thread_fence(memory_order_seq_cst);
+            wake_shard(*target);
+        };
+        shard->blocked.reset(new BlockedClients(wake));
+        shard->mailboxes.reset(new MailboxLoop(wake));
+        shards.push_back(std::move(shard));
+    }
+}
+
+void run_shards(int port, const vector<pair<string, string>>& replica_info) {
+    for (auto& shard : shards) {
+        shard->listen_fd = open_listener(port);
+        if (shard->listen_fd < 0) {
+            return;
+        }
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.ptr = shard.get();
+        epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->listen_fd, &ev);
+    }
+
+    for (size_t i = 1; i < shards.size(); ++i) {
+        thread shard_thread(shard_loop, ref(*shards[i]), ref(replica_info));
+        shard_thread.detach();
+    }
+    shard_loop(*shards[0], replica_info);
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <utility>
+#include <memory>
+#include <bitset>
+#include "client.h"
+#include "redis_parser.h"
+
+using namespace std;
+
+// --shards N: each of N threads, pinned to a core, owns one keyspace
+// (keyspaces[i]) holding the keys that hash to it, plus the connections the
+// kernel hands its own SO_REUSEPORT listener. A command for another shard's
+// keys is sent to that shard over a lock-free queue, run there and sent back
+// with its reply, and a command parked in BLPOP and the like waits on the
+// shard that owns its keys. SCAN and BIGKEYS go from shard to shard the same
+// way, each shard adding its own keys. A shard thread takes no store locks.
+//
+// What isn't split is shared, under locks of its own: the WATCH and tracking
+// registries of a keyspace (touched by other shards only for connections they
+// serve), pubsub, the client list, the replication stream and the allocator.
+// Whatever needs another shard's keyspace in place, without a message to it,
+// stops that shard between two rounds of its loop with a ShardPause: FLUSHALL,
+// INFO keyspace and MEMORY STATS for a consistent view, the fork of a full
+// sync, the link to a master, active defrag and connections handed off to a
+// thread of their own.
+//
+// Keys hash by their {hashtag} when they have one, as in Redis Cluster, so
+// related keys can be kept on one shard. A command or transaction whose keys
+// are on more than one shard is refused with a CROSSSLOT error.
+extern int shard_count;
+const int MAX_SHARDS = 256;         // SCAN cursors carry the shard in 8 bits
+
+const int SHARD_ANY = -1;           // no keys: runs on whichever shard has the connection
+const int SHARD_CROSSSLOT = -2;     // keys on more than one shard
+const int SHARD_TOUR = -3;          // runs on one shard after another (ShardTour)
+
+int shard_for_key(const string& key);
+// The shard a request must run on, given the state of the connection sending it.
+int command_shard(const RESPObject& obj, const ClientState& client);
+// Runs a request against the keyspace of the shard that owns its keys, from a
+// thread that isn't a shard thread: connections handed off to a thread of their
+// own and the replication link. The shards are paused meanwhile.
+void run_on_owning_shard(RESPObject& obj, ClientState& client, const vector<pair<string, string>>& replica_info);
+
+// A command that visits the shards in turn (SCAN, BIGKEYS), starting with the
+// one its SCAN cursor names or shard 0. Its handler runs once per shard, with
+// shard_tour set and that shard's keyspace, keeps what it has found so far in
+// state, and sets more to go on to the next shard rather than reply. Without
+// --shards shard_tour is null and the one keyspace is all there is.
+struct ShardTour {
+    bool last = false;              // the last shard: reply now
+    bool more = false;              // set by the handler: no reply yet
+    shared_ptr<void> state;
+};
+
+extern thread_local ShardTour* shard_tour;
+
+// Stops shard threads between two rounds of their loop until destroyed, and
+// meanwhile lets the calling thread use their keyspaces as if it held every
+// store lock: every shard but the caller's own, or only the one given. A
+// shard thread takes it before it touches anything, since it may itself be
+// stopped while it waits for its turn. Does nothing without --shards, and
+// nests.
+class ShardPause {
+public:
+    explicit ShardPause(int only = SHARD_ANY);
+    ~ShardPause();
+
+    ShardPause(const ShardPause&) = delete;
+    ShardPause& operator=(const ShardPause&) = delete;
+
+private:
+    bitset<MAX_SHARDS> paused;      // the shards this one stopped
+    bool locked = false;
+    unsigned saved_store_locks;
+};
+
+// Creates the shard keyspaces. Called before any thread that touches the
+// keyspace is started.
+void init_shards();
+// Starts the shard threads, each listening on port, and runs shard 0 on the
+// calling thread. Returns only if a listener can't be set up.
+void run_shards(int port, const vector<pair<string, string>>& replica_info);
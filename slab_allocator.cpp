@@ -0,0 +1,359 @@
+#include <mutex>
+#include <atomic>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "slab_allocator.h"
+
+using namespace std;
+
+const size_t SLAB_HEADER_SIZE = 64;
+const size_t SLAB_CHUNK_SLABS = 32;         // slabs mapped from the kernel at a time
+const int SLAB_CACHE_SIZE = 32;             // free objects a thread keeps per class
+const int SLAB_CACHE_BATCH = 16;            // objects moved between a cache and its class at once
+
+static constexpr uint32_t class_sizes[SLAB_CLASS_COUNT] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512, 640, 768, 896, 1024,
+};
+
+// Size class for every request size, in steps of 16 bytes.
+struct ClassIndex {
+    uint8_t of[SLAB_MAX_OBJECT / 16 + 1];
+
+    constexpr ClassIndex() : of() {
+        int c = 0;
+        for (size_t i = 0; i <= SLAB_MAX_OBJECT / 16; ++i) {
+            while (class_sizes[c] < i * 16) {
+                c++;
+            }
+            of[i] = c;
+        }
+    }
+};
+static constexpr ClassIndex class_index;
+
+enum SlabList : uint8_t { SLAB_UNLISTED, SLAB_PARTIAL, SLAB_DRAINING };
+
+// Header at the start of every slab; slabs are SLAB_SIZE-aligned, so the slab
+// of any object is its address with the low bits cleared. Everything but
+// draining is guarded by the class lock.
+struct Slab {
+    uint32_t size_class;
+    uint32_t capacity;
+    uint32_t used;
+    uint32_t bump;              // offset of the first slot never handed out
+    void* free_list;
+    Slab* prev;
+    Slab* next;
+    SlabList list;
+    atomic<bool> draining;
+};
+static_assert(sizeof(Slab) <= SLAB_HEADER_SIZE, "slab header too large");
+
+// Full slabs aren't on any list; they come back onto partial when an object
+// in them is freed.
+struct SlabClass {
+    mutex lock;
+    Slab* partial = nullptr;
+    Slab* draining = nullptr;
+    size_t slabs = 0;
+    size_t draining_slabs = 0;
+    size_t used = 0;
+};
+
+static SlabClass classes[SLAB_CLASS_COUNT];
+
+// Slabs not in use by any class, with their pages returned to the kernel.
+static mutex pool_mutex;
+static Slab* empty_slabs = nullptr;
+static size_t mapped_slabs = 0;
+
+static Slab* slab_of(const void* p) {
+    return (Slab*)((uintptr_t)p & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+static void list_push(Slab*& head, Slab* s, SlabList list) {
+    s->prev = nullptr;
+    s->next = head;
+    if (head) {
+        head->prev = s;
+    }
+    head = s;
+    s->list = list;
+}
+
+static void list_remove(Slab*& head, Slab* s) {
+    if (s->prev) {
+        s->prev->next = s->next;
+    }
+    else {
+        head = s->next;
+    }
+    if (s->next) {
+        s->next->prev = s->prev;
+    }
+    s->list = SLAB_UNLISTED;
+}
+
+// Maps SLAB_CHUNK_SLABS slabs at a SLAB_SIZE-aligned address. The caller holds
+// pool_mutex.
+static bool map_chunk() {
+    size_t length = SLAB_CHUNK_SLABS * SLAB_SIZE;
+    char* raw = (char*)mmap(nullptr, length + SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return false;
+    }
+    char* start = (char*)(((uintptr_t)raw + SLAB_SIZE - 1) & ~(uintptr_t)(SLAB_SIZE - 1));
+    if (start > raw) {
+        munmap(raw, start - raw);
+    }
+    munmap(start + length, raw + SLAB_SIZE - start);
+
+    for (size_t i = 0; i < SLAB_CHUNK_SLABS; ++i) {
+        Slab* s = (Slab*)(start + i * SLAB_SIZE);
+        s->next = empty_slabs;
+        empty_slabs = s;
+    }
+    mapped_slabs += SLAB_CHUNK_SLABS;
+    return true;
+}
+
+// Takes an empty slab for class c and puts it on the partial list. The caller
+// holds the class lock.
+static Slab* new_slab(int c) {
+    Slab* s;
+    {
+        lock_guard<mutex> lock(pool_mutex);
+        if (!empty_slabs && !map_chunk()) {
+            throw bad_alloc();
+        }
+        s = empty_slabs;
+        empty_slabs = s->next;
+    }
+    s = new (s) Slab();
+    s->size_class = c;
+    s->capacity = (SLAB_SIZE - SLAB_HEADER_SIZE) / class_sizes[c];
+    s->bump = SLAB_HEADER_SIZE;
+    list_push(classes[c].partial, s, SLAB_PARTIAL);
+    classes[c].slabs++;
+    return s;
+}
+
+// Returns an emptied slab's pages to the kernel and the slab to the pool. The
+// caller holds the class lock.
+static void release_slab(int c, Slab* s) {
+    classes[c].slabs--;
+    madvise(s, SLAB_SIZE, MADV_DONTNEED);
+    lock_guard<mutex> lock(pool_mutex);
+    s->next = empty_slabs;
+    empty_slabs = s;
+}
+
+// Fills out with up to n objects of class c, from the partial slabs first.
+static int central_alloc(int c, void** out, int n) {
+    SlabClass& cls = classes[c];
+    lock_guard<mutex> lock(cls.lock);
+    for (int i = 0; i < n; ++i) {
+        Slab* s = cls.partial ? cls.partial : new_slab(c);
+        void* p;
+        if (s->free_list) {
+            p = s->free_list;
+            s->free_list = *(void**)p;
+        }
+        else {
+            p = (char*)s + s->bump;
+            s->bump += class_sizes[c];
+        }
+        if (++s->used == s->capacity) {
+            list_remove(cls.partial, s);
+        }
+        out[i] = p;
+    }
+    cls.used += n;
+    return n;
+}
+
+static void central_free(int c, void* const* objects, int n) {
+    SlabClass& cls = classes[c];
+    lock_guard<mutex> lock(cls.lock);
+    for (int i = 0; i < n; ++i) {
+        void* p = objects[i];
+        Slab* s = slab_of(p);
+        *(void**)p = s->free_list;
+        s->free_list = p;
+        s->used--;
+        if (s->list == SLAB_UNLISTED) {
+            list_push(cls.partial, s, SLAB_PARTIAL);
+        }
+        if (s->used > 0) {
+            continue;
+        }
+        if (s->list == SLAB_DRAINING) {
+            list_remove(cls.draining, s);
+            cls.draining_slabs--;
+        }
+        else if (cls.partial == s && !s->next) {
+            continue;           // keep the class's last slab around for the next allocation
+        }
+        else {
+            list_remove(cls.partial, s);
+        }
+        release_slab(c, s);
+    }
+    cls.used -= n;
+}
+
+struct ThreadCache {
+    void* objects[SLAB_CLASS_COUNT][SLAB_CACHE_SIZE];
+    int count[SLAB_CLASS_COUNT] = {};
+
+    ~ThreadCache();
+};
+
+static thread_local ThreadCache thread_cache;
+// Set once the exiting thread's cache is gone; later frees go to the classes.
+static thread_local bool thread_cache_gone = false;
+
+ThreadCache::~ThreadCache() {
+    thread_cache_gone = true;
+    for (int c = 0; c < SLAB_CLASS_COUNT; ++c) {
+        central_free(c, objects[c], count[c]);
+        count[c] = 0;
+    }
+}
+
+void* slab_alloc(size_t size) {
+    if (size > SLAB_MAX_OBJECT) {
+        return ::operator new(size);
+    }
+    int c = class_index.of[(size + 15) / 16];
+    if (thread_cache_gone) {
+        void* p;
+        central_alloc(c, &p, 1);
+        return p;
+    }
+    ThreadCache& cache = thread_cache;
+    if (cache.count[c] == 0) {
+        cache.count[c] = central_alloc(c, cache.objects[c], SLAB_CACHE_BATCH);
+    }
+    return cache.objects[c][--cache.count[c]];
+}
+
+void slab_free(void* p, size_t size) {
+    if (size > SLAB_MAX_OBJECT) {
+        ::operator delete(p);
+        return;
+    }
+    Slab* s = slab_of(p);
+    int c = s->size_class;
+    // Objects of a draining slab go straight back so it can empty.
+    if (thread_cache_gone || s->draining.load(memory_order_relaxed)) {
+        central_free(c, &p, 1);
+        return;
+    }
+    ThreadCache& cache = thread_cache;
+    if (cache.count[c] == SLAB_CACHE_SIZE) {
+        central_free(c, cache.objects[c], SLAB_CACHE_BATCH);
+        memmove(cache.objects[c], cache.objects[c] + SLAB_CACHE_BATCH, (SLAB_CACHE_SIZE - SLAB_CACHE_BATCH) * sizeof(void*));
+        cache.count[c] -= SLAB_CACHE_BATCH;
+    }
+    cache.objects[c][cache.count[c]++] = p;
+}
+
+bool slab_should_move(const void* p, size_t size) {
+    return size <= SLAB_MAX_OBJECT && slab_of(p)->draining.load(memory_order_relaxed);
+}
+
+size_t slab_usable_size(size_t size) {
+    if (size > SLAB_MAX_OBJECT) {
+        return heap_usable_size(size);
+    }
+    return class_sizes[class_index.of[(size + 15) / 16]];
+}
+
+size_t heap_usable_size(size_t size) {
+    return max<size_t>(32, (size + 8 + 15) & ~size_t(15));
+}
+
+SlabStats slab_stats() {
+    SlabStats stats;
+    for (int c = 0; c < SLAB_CLASS_COUNT; ++c) {
+        SlabClass& cls = classes[c];
+        lock_guard<mutex> lock(cls.lock);
+        SlabClassStats& out = stats.classes[c];
+        out.object_size = class_sizes[c];
+        out.slabs = cls.slabs;
+        out.draining_slabs = cls.draining_slabs;
+        out.used_objects = cls.used;
+        out.capacity = cls.slabs * ((SLAB_SIZE - SLAB_HEADER_SIZE) / class_sizes[c]);
+        stats.allocated_bytes += cls.used * class_sizes[c];
+        stats.active_bytes += cls.slabs * SLAB_SIZE;
+    }
+    lock_guard<mutex> lock(pool_mutex);
+    stats.mapped_bytes = mapped_slabs * SLAB_SIZE;
+    return stats;
+}
+
+size_t slab_start_draining(size_t min_waste) {
+    size_t marked = 0;
+    for (int c = 0; c < SLAB_CLASS_COUNT; ++c) {
+        SlabClass& cls = classes[c];
+        lock_guard<mutex> lock(cls.lock);
+        if (cls.slabs < 2) {
+            continue;
+        }
+        size_t per_slab = (SLAB_SIZE - SLAB_HEADER_SIZE) / class_sizes[c];
+        size_t waste = (cls.slabs * per_slab - cls.used) * class_sizes[c];
+        if (waste <= min_waste) {
+            continue;
+        }
+        size_t average = cls.used / cls.slabs;
+        Slab* s = cls.partial;
+        while (s) {
+            Slab* next = s->next;
+            if (s->used < average) {
+                list_remove(cls.partial, s);
+                list_push(cls.draining, s, SLAB_DRAINING);
+                s->draining.store(true, memory_order_relaxed);
+                cls.draining_slabs++;
+                marked++;
+            }
+            s = next;
+        }
+    }
+    return marked;
+}
+
+void slab_stop_draining() {
+    for (int c = 0; c < SLAB_CLASS_COUNT; ++c) {
+        SlabClass& cls = classes[c];
+        lock_guard<mutex> lock(cls.lock);
+        while (cls.draining) {
+            Slab* s = cls.draining;
+            list_remove(cls.draining, s);
+            s->draining.store(false, memory_order_relaxed);
+            list_push(cls.partial, s, SLAB_PARTIAL);
+        }
+        cls.draining_slabs = 0;
+    }
+}
+
+// A full sync forks with other threads running; holding every allocator lock
+// across the fork keeps the child from inheriting one mid-update.
+static void lock_all_classes() {
+    for (SlabClass& cls : classes) {
+        cls.lock.lock();
+    }
+    pool_mutex.lock();
+}
+
+static void unlock_all_classes() {
+    pool_mutex.unlock();
+    for (int c = SLAB_CLASS_COUNT - 1; c >= 0; --c) {
+        classes[c].lock.unlock();
+    }
+}
+
+static int fork_handlers_registered = pthread_atfork(lock_all_classes, unlock_all_classes, unlock_all_classes);
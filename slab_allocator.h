@@ -0,0 +1,81 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <new>
+
+using namespace std;
+
+// Size-class slab allocator for keyspace objects: Dict nodes, string values,
+// and the blocks of lists, streams and stream field maps. Objects of one size
+// class are packed into SLAB_SIZE slabs, so a slab emptied by deletes goes back
+// to the kernel whole instead of leaving holes between other allocations the
+// way the general-purpose heap does after long churn. Each thread keeps a small
+// cache of free objects per class, so allocating and freeing only take the
+// class lock once per batch.
+//
+// Active defragmentation (defrag.h) marks the sparsest slabs of a class as
+// draining: no new objects are handed out from them, and the defragger moves
+// the live objects it can reach out of them until they empty.
+const size_t SLAB_SIZE = 64 * 1024;
+const size_t SLAB_MAX_OBJECT = 1024;        // larger requests go to operator new
+const int SLAB_CLASS_COUNT = 20;
+
+void* slab_alloc(size_t size);
+void slab_free(void* p, size_t size);
+
+// Whether the object at p, allocated with size bytes, sits in a draining slab
+// and should be moved to a fresh allocation.
+bool slab_should_move(const void* p, size_t size);
+
+// Bytes an allocation of size bytes really takes: its size class, or for a
+// request too large for the slabs, what malloc makes of it.
+size_t slab_usable_size(size_t size);
+// Bytes malloc takes for a request of size bytes: an 8-byte header, rounded
+// up to 16, at least 32.
+size_t heap_usable_size(size_t size);
+
+struct SlabClassStats {
+    size_t object_size;
+    size_t slabs;
+    size_t draining_slabs;
+    size_t used_objects;            // handed out, including those in thread caches
+    size_t capacity;                // object slots across the class's slabs
+};
+
+struct SlabStats {
+    size_t allocated_bytes = 0;     // object slots in use
+    size_t active_bytes = 0;        // slabs holding at least one object
+    size_t mapped_bytes = 0;        // address space taken from the kernel, emptied slabs included
+    SlabClassStats classes[SLAB_CLASS_COUNT];
+};
+
+SlabStats slab_stats();
+
+// Marks as draining, in each class, the partial slabs filled below the class's
+// average, as long as the class wastes more than min_waste bytes in free slots.
+// Returns the number of slabs marked.
+size_t slab_start_draining(size_t min_waste);
+// Puts every draining slab that still holds objects back into use.
+void slab_stop_draining();
+
+// Standard allocator over slab_alloc, for containers whose elements should
+// come from the slabs.
+template <typename T>
+struct SlabAllocator {
+    using value_type = T;
+
+    SlabAllocator() = default;
+    template <typename U>
+    SlabAllocator(const SlabAllocator<U>&) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(slab_alloc(n * sizeof(T))); }
+    void deallocate(T* p, size_t n) { slab_free(p, n * sizeof(T)); }
+
+    template <typename U>
+    bool operator==(const SlabAllocator<U>&) const { return true; }
+    template <typename U>
+    bool operator!=(const SlabAllocator<U>&) const { return false; }
+};
+
+using SlabString = basic_string<char, char_traits<char>, SlabAllocator<char>>;
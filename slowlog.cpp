@@ -0,0 +1,64 @@
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include "slowlog.h"
+
+using namespace std;
+using namespace chrono;
+
+int64_t slowlog_log_slower_than = 10000;
+size_t slowlog_max_len = 128;
+
+static mutex slowlog_mutex;
+static deque<SlowlogEntry> slowlog;     // newest at the front
+static int64_t slowlog_next_id = 0;
+
+void slowlog_push(const vector<RESPObject>& args, int64_t duration_us, const string& client_addr, const string& client_name) {
+    SlowlogEntry entry;
+    entry.time = duration_cast<seconds>(system_clock::now().time_since_epoch()).count();
+    entry.duration_us = duration_us;
+    entry.client_addr = client_addr;
+    entry.client_name = client_name;
+
+    // Like Redis, the last kept argument says how many more there were.
+    size_t kept = min(args.size(), SLOWLOG_ENTRY_MAX_ARGC);
+    for (size_t i = 0; i < kept; ++i) {
+        if (kept < args.size() && i == kept - 1) {
+            entry.args.push_back("... (" + to_string(args.size() - kept + 1) + " more arguments)");
+            break;
+        }
+        const string& arg = args[i].get_string_value();
+        if (arg.size() > SLOWLOG_ENTRY_MAX_STRING) {
+            entry.args.push_back(arg.substr(0, SLOWLOG_ENTRY_MAX_STRING) + "... (" +
+                                 to_string(arg.size() - SLOWLOG_ENTRY_MAX_STRING) + " more bytes)");
+        }
+        else {
+            entry.args.push_back(arg);
+        }
+    }
+
+    lock_guard<mutex> lock(slowlog_mutex);
+    entry.id = slowlog_next_id++;
+    slowlog.push_front(std::move(entry));
+    while (slowlog.size() > slowlog_max_len) {
+        slowlog.pop_back();
+    }
+}
+
+vector<SlowlogEntry> slowlog_get(size_t count) {
+    lock_guard<mutex> lock(slowlog_mutex);
+    count = min(count, slowlog.size());
+    return vector<SlowlogEntry>(slowlog.begin(), slowlog.begin() + count);
+}
+
+size_t slowlog_len() {
+    lock_guard<mutex> lock(slowlog_mutex);
+    return slowlog.size();
+}
+
+void slowlog_reset() {
+    lock_guard<mutex> lock(slowlog_mutex);
+    slowlog.clear();
+}
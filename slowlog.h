@@ -0,0 +1,33 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "redis_parser.h"
+
+using namespace std;
+
+// SLOWLOG: the last slowlog_max_len commands that took at least
+// slowlog_log_slower_than microseconds to run, newest first. Time a blocking
+// command spends waiting isn't execution time, so those are never logged.
+extern int64_t slowlog_log_slower_than;     // negative disables, 0 logs every command
+extern size_t slowlog_max_len;
+
+// Arguments kept per entry, and bytes kept per argument.
+const size_t SLOWLOG_ENTRY_MAX_ARGC = 32;
+const size_t SLOWLOG_ENTRY_MAX_STRING = 128;
+
+struct SlowlogEntry {
+    int64_t id;
+    int64_t time;               // unix seconds
+    int64_t duration_us;
+    vector<string> args;
+    string client_addr;
+    string client_name;
+};
+
+// client_addr and client_name are those of the connection that ran it.
+void slowlog_push(const vector<RESPObject>& args, int64_t duration_us, const string& client_addr, const string& client_name);
+// Up to count entries, newest first.
+vector<SlowlogEntry> slowlog_get(size_t count);
+size_t slowlog_len();
+void slowlog_reset();
@@ -0,0 +1,68 @@
+#pragma once
+#include <vector>
+#include <atomic>
+#include <cstddef>
+
+using namespace std;
+
+// Bounded single-producer single-consumer ring. One thread may push and one
+// other thread may pop, with no locks: each side owns one index and only reads
+// the other's. Both sides also keep a cached copy of the other's index, so in
+// the common case a push or pop touches no cache line the other thread writes.
+template <typename T>
+class SpscQueue {
+private:
+    vector<T> slots;
+    size_t mask;
+
+    alignas(64) atomic<size_t> head{0};     // next slot to pop, written by the consumer
+    size_t cached_tail = 0;
+    alignas(64) atomic<size_t> tail{0};     // next slot to push, written by the producer
+    size_t cached_head = 0;
+
+public:
+    // capacity is rounded up to a power of two.
+    explicit SpscQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) {
+            size *= 2;
+        }
+        slots.resize(size);
+        mask = size - 1;
+    }
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    // Producer side. Returns false if the ring is full.
+    bool push(const T& value) {
+        size_t t = tail.load(memory_order_relaxed);
+        if (t - cached_head == slots.size()) {
+            cached_head = head.load(memory_order_acquire);
+            if (t - cached_head == slots.size()) {
+                return false;
+            }
+        }
+        slots[t & mask] = value;
+        tail.store(t + 1, memory_order_release);
+        return true;
+    }
+
+    // Consumer side. Returns false if the ring is empty.
+    bool pop(T& value) {
+        size_t h = head.load(memory_order_relaxed);
+        if (h == cached_tail) {
+            cached_tail = tail.load(memory_order_acquire);
+            if (h == cached_tail) {
+                return false;
+            }
+        }
+        value = slots[h & mask];
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+
+    // Either side; only a hint while the other side is running.
+    bool empty() const {
+        return head.load(memory_order_acquire) == tail.load(memory_order_acquire);
+    }
+};
@@ -0,0 +1,292 @@
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include "stats.h"
+
+using namespace std;
+using namespace chrono;
+
+static const char* const command_names[] = {
+    "PING", "REPLCONF", "WAIT", "PSYNC", "ECHO", "MULTI", "EXEC", "DISCARD", "WATCH", "UNWATCH",
+    "SET", "INCR", "GET", "MGET", "MSET", "MSETNX", "DEL", "UNLINK", "FLUSHALL", "FLUSHDB",
+    "EXISTS", "SCAN", "RPUSH", "LPUSH", "LRANGE", "LLEN", "LPOP", "BLPOP", "TYPE",
+    "XADD", "XRANGE", "XREAD", "HSET", "HGET", "HMGET", "HGETALL", "HDEL", "HINCRBY", "HLEN", "HSCAN",
+    "ZADD", "ZINCRBY", "ZRANGE", "ZRANK", "ZSCORE", "ZCARD", "ZREM", "ZPOPMIN", "BZPOPMIN", "INFO",
+    "SLOWLOG", "LATENCY", "CLIENT", "SUBSCRIBE", "PSUBSCRIBE", "UNSUBSCRIBE", "PUNSUBSCRIBE", "PUBLISH",
+    "PUBSUB", "HELLO", "HOTKEYS", "BIGKEYS", "MEMORY",
+};
+static_assert(sizeof(command_names) / sizeof(command_names[0]) == STATS_COMMANDS, "STATS_COMMANDS is out of date");
+
+// Counters of one command on one thread. Only the owning thread writes them.
+struct CommandCounters {
+    atomic<uint64_t> calls{0};
+    atomic<uint64_t> ticks{0};
+    atomic<uint64_t> failed{0};
+    atomic<uint64_t> latency[LATENCY_BUCKETS]{};
+};
+
+struct ThreadStats {
+    // Allocated on the thread's first call of each command.
+    atomic<CommandCounters*> commands[STATS_COMMANDS]{};
+
+    ThreadStats();
+    ~ThreadStats();
+};
+
+// Guards the list of live threads' stats and the totals of exited threads.
+static mutex stats_mutex;
+static vector<ThreadStats*> live_stats;
+static CommandCounters retired_stats[STATS_COMMANDS];
+
+static thread_local ThreadStats thread_stats;
+// &thread_stats once the thread has recorded something; a plain pointer, so the
+// recording path skips thread_stats' initialization check.
+static thread_local ThreadStats* current_stats = nullptr;
+
+static void add_counter(atomic<uint64_t>& counter, uint64_t n) {
+    counter.store(counter.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+ThreadStats::ThreadStats() {
+    lock_guard<mutex> lock(stats_mutex);
+    live_stats.push_back(this);
+}
+
+ThreadStats::~ThreadStats() {
+    lock_guard<mutex> lock(stats_mutex);
+    live_stats.erase(find(live_stats.begin(), live_stats.end(), this));
+    for (int id = 0; id < STATS_COMMANDS; ++id) {
+        CommandCounters* counters = commands[id].load(memory_order_relaxed);
+        if (!counters) {
+            continue;
+        }
+        CommandCounters& retired = retired_stats[id];
+        add_counter(retired.calls, counters->calls.load(memory_order_relaxed));
+        add_counter(retired.ticks, counters->ticks.load(memory_order_relaxed));
+        add_counter(retired.failed, counters->failed.load(memory_order_relaxed));
+        for (int b = 0; b < LATENCY_BUCKETS; ++b) {
+            add_counter(retired.latency[b], counters->latency[b].load(memory_order_relaxed));
+        }
+        delete counters;
+    }
+}
+
+// Open-addressed table from command name to id, keyed on the length and a few
+// characters so a lookup costs one or two string compares. Names are matched
+// in any case: clearing bit 5 upper-cases a letter, and a character that
+// isn't one can't match the letters the names are made of.
+const int COMMAND_TABLE_SIZE = 256;
+
+static unsigned upper(char c) {
+    return (unsigned char)c & 0xdf;
+}
+
+static unsigned command_hash(const char* name, size_t length) {
+    return (length * 31 + upper(name[0]) * 7 + upper(name[length / 2]) * 3 + upper(name[length - 1])) &
+           (COMMAND_TABLE_SIZE - 1);
+}
+
+static bool same_name(const char* name, const char* command_name, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+        if (upper(name[i]) != (unsigned char)command_name[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+struct CommandTable {
+    int8_t ids[COMMAND_TABLE_SIZE];
+    uint8_t lengths[STATS_COMMANDS];
+
+    CommandTable() {
+        fill(begin(ids), end(ids), -1);
+        for (int id = 0; id < STATS_COMMANDS; ++id) {
+            lengths[id] = strlen(command_names[id]);
+            unsigned slot = command_hash(command_names[id], lengths[id]);
+            while (ids[slot] >= 0) {
+                slot = (slot + 1) & (COMMAND_TABLE_SIZE - 1);
+            }
+            ids[slot] = id;
+        }
+    }
+};
+static const CommandTable command_table;
+
+int command_stats_id(string_view command) {
+    if (command.empty()) {
+        return -1;
+    }
+    for (unsigned slot = command_hash(command.data(), command.size()); command_table.ids[slot] >= 0;
+         slot = (slot + 1) & (COMMAND_TABLE_SIZE - 1)) {
+        int id = command_table.ids[slot];
+        if (command.size() == command_table.lengths[id] && same_name(command.data(), command_names[id], command.size())) {
+            return id;
+        }
+    }
+    return -1;
+}
+
+const char* command_stats_name(int id) {
+    return command_names[id];
+}
+
+static int latency_bucket(uint64_t ticks) {
+    if (ticks < (uint64_t)LATENCY_SUB_BUCKETS) {
+        return ticks;
+    }
+    int msb = 63 - __builtin_clzll(ticks);
+    int shift = msb - LATENCY_SUB_BUCKET_BITS;
+    return (shift + 1) * LATENCY_SUB_BUCKETS + ((ticks >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+// Largest tick count that falls in bucket.
+static uint64_t latency_bucket_bound(int bucket) {
+    if (bucket < LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+    int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    uint64_t sub = LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+void record_command(int id, uint64_t ticks, bool failed) {
+    ThreadStats* stats = current_stats;
+    if (!stats) {
+        stats = current_stats = &thread_stats;
+    }
+    CommandCounters* counters = stats->commands[id].load(memory_order_relaxed);
+    if (!counters) {
+        counters = new CommandCounters();
+        stats->commands[id].store(counters, memory_order_release);
+    }
+    add_counter(counters->calls, 1);
+    add_counter(counters->ticks, ticks);
+    if (failed) {
+        add_counter(counters->failed, 1);
+    }
+    add_counter(counters->latency[latency_bucket(ticks)], 1);
+}
+
+// The TSC rate, measured once against steady_clock by calibrate_stats_clock()
+// so converting a duration on the command path is a single multiply.
+static double ns_per_tick = 1.0;
+static const steady_clock::time_point start_time = steady_clock::now();
+
+void calibrate_stats_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+    uint64_t first_tick = stats_clock();
+    steady_clock::time_point first = steady_clock::now();
+    while (steady_clock::now() - first < milliseconds(10)) {
+    }
+    int64_t elapsed_ns = duration_cast<nanoseconds>(steady_clock::now() - first).count();
+    ns_per_tick = (double)elapsed_ns / (stats_clock() - first_tick);
+#endif
+}
+
+double ticks_to_ns(uint64_t ticks) {
+    return ticks * ns_per_tick;
+}
+
+// Sums the counters of every thread, live or exited, for one command.
+static void collect(int id, uint64_t& calls, uint64_t& ticks, uint64_t& failed, uint64_t* latency) {
+    const CommandCounters& retired = retired_stats[id];
+    calls = retired.calls.load(memory_order_relaxed);
+    ticks = retired.ticks.load(memory_order_relaxed);
+    failed = retired.failed.load(memory_order_relaxed);
+    if (latency) {
+        for (int b = 0; b < LATENCY_BUCKETS; ++b) {
+            latency[b] = retired.latency[b].load(memory_order_relaxed);
+        }
+    }
+    for (ThreadStats* stats : live_stats) {
+        const CommandCounters* counters = stats->commands[id].load(memory_order_acquire);
+        if (!counters) {
+            continue;
+        }
+        calls += counters->calls.load(memory_order_relaxed);
+        ticks += counters->ticks.load(memory_order_relaxed);
+        failed += counters->failed.load(memory_order_relaxed);
+        if (latency) {
+            for (int b = 0; b < LATENCY_BUCKETS; ++b) {
+                latency[b] += counters->latency[b].load(memory_order_relaxed);
+            }
+        }
+    }
+}
+
+static string lowercase(const char* name) {
+    string s = name;
+    transform(s.begin(), s.end(), s.begin(), ::tolower);
+    return s;
+}
+
+void append_stats_info(string& body) {
+    uint64_t total_calls = 0;
+    uint64_t total_failed = 0;
+    {
+        lock_guard<mutex> lock(stats_mutex);
+        for (int id = 0; id < STATS_COMMANDS; ++id) {
+            uint64_t calls, ticks, failed;
+            collect(id, calls, ticks, failed, nullptr);
+            total_calls += calls;
+            total_failed += failed;
+        }
+    }
+    body += "# Stats\r\n";
+    body += "uptime_in_seconds:" + to_string(duration_cast<seconds>(steady_clock::now() - start_time).count()) + "\r\n";
+    body += "total_commands_processed:" + to_string(total_calls) + "\r\n";
+    body += "total_error_replies:" + to_string(total_failed) + "\r\n";
+}
+
+void append_commandstats_info(string& body) {
+    body += "# Commandstats\r\n";
+    lock_guard<mutex> lock(stats_mutex);
+    for (int id = 0; id < STATS_COMMANDS; ++id) {
+        uint64_t calls, ticks, failed;
+        collect(id, calls, ticks, failed, nullptr);
+        if (calls == 0) {
+            continue;
+        }
+        double usec = ticks_to_ns(ticks) / 1000;
+        char line[256];
+        snprintf(line, sizeof(line), "cmdstat_%s:calls=%llu,usec=%llu,usec_per_call=%.2f,rejected_calls=0,failed_calls=%llu\r\n",
+                 lowercase(command_names[id]).c_str(), (unsigned long long)calls, (unsigned long long)usec,
+                 usec / calls, (unsigned long long)failed);
+        body += line;
+    }
+}
+
+void append_latencystats_info(string& body) {
+    static const double percentiles[] = {50, 99, 99.9};
+
+    body += "# Latencystats\r\n";
+    lock_guard<mutex> lock(stats_mutex);
+    vector<uint64_t> latency(LATENCY_BUCKETS);
+    for (int id = 0; id < STATS_COMMANDS; ++id) {
+        uint64_t calls, ticks, failed;
+        collect(id, calls, ticks, failed, latency.data());
+        if (calls == 0) {
+            continue;
+        }
+        body += "latency_percentiles_usec_" + lowercase(command_names[id]) + ":";
+        for (size_t p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); ++p) {
+            uint64_t rank = max<uint64_t>(1, (uint64_t)(percentiles[p] / 100 * calls + 0.5));
+            uint64_t seen = 0;
+            int bucket = 0;
+            while (bucket < LATENCY_BUCKETS - 1 && (seen += latency[bucket]) < rank) {
+                bucket++;
+            }
+            char value[64];
+            snprintf(value, sizeof(value), "%sp%g=%.3f", p ? "," : "", percentiles[p],
+                     ticks_to_ns(latency_bucket_bound(bucket)) / 1000);
+            body += value;
+        }
+        body += "\r\n";
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <chrono>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+using namespace std;
+
+// Per-command call counts, time and latency histograms, recorded by
+// handle_command around every command it dispatches. Each thread writes only
+// its own counters, with plain relaxed stores, so recording costs two clock
+// reads and a few increments; INFO sums the counters of all threads, plus
+// those left behind by threads that have exited.
+//
+// Latencies go into log-linear buckets, HDR style: LATENCY_SUB_BUCKETS per
+// power of two, so any recorded value is within 1/8 of its bucket's bound.
+
+const int LATENCY_SUB_BUCKET_BITS = 3;
+const int LATENCY_SUB_BUCKETS = 1 << LATENCY_SUB_BUCKET_BITS;
+const int LATENCY_BUCKETS = (64 - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS;
+
+// Timestamp in clock ticks: the TSC where there is one, nanoseconds otherwise.
+inline uint64_t stats_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// Measures the tick rate, spinning for 10 ms. Called once at startup, before
+// any other thread runs commands.
+void calibrate_stats_clock();
+
+// Converts a tick count from stats_clock() to nanoseconds.
+double ticks_to_ns(uint64_t ticks);
+
+// Commands the server knows; their ids run from 0 to STATS_COMMANDS - 1.
+const int STATS_COMMANDS = 63;
+
+// Index of command, named in any case, in the stats tables, or -1 for a
+// command the server doesn't know. handle_command's dispatch table is indexed
+// by the same ids.
+int command_stats_id(string_view command);
+// Upper-case name of the command with that id.
+const char* command_stats_name(int id);
+void record_command(int id, uint64_t ticks, bool failed);
+
+// INFO sections, appended to body with their headers.
+void append_stats_info(string& body);
+void append_commandstats_info(string& body);
+void append_latencystats_info(string& body);
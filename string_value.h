@@ -0,0 +1,62 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <memory>
+#include "slab_allocator.h"
+
+using namespace std;
+
+// Values at least this long are kept in a shared buffer instead of inline.
+const size_t STRING_SHARED_MIN_SIZE = 16 * 1024;
+
+// Value of a string key. Short values are stored inline, in the keyspace slabs
+// once past the small-string buffer. Long ones live in a
+// reference-counted buffer that is never modified once written, so a reply can
+// take a reference to it under the store lock and send the bytes from there
+// after the lock is gone, even if the key is overwritten or deleted meanwhile.
+class StringValue {
+private:
+    SlabString inline_value;
+    shared_ptr<const string> shared_value;
+
+public:
+    StringValue() = default;
+
+    StringValue& operator=(string value) {
+        if (value.size() >= STRING_SHARED_MIN_SIZE) {
+            shared_value = make_shared<const string>(std::move(value));
+            SlabString().swap(inline_value);
+        }
+        else {
+            inline_value.assign(value.data(), value.size());
+            shared_value.reset();
+        }
+        return *this;
+    }
+
+    // Moves an inline value out of a draining slab; returns true if it did.
+    bool defrag() {
+        if (inline_value.capacity() <= SlabString().capacity() ||
+            !slab_should_move(inline_value.data(), inline_value.capacity() + 1)) {
+            return false;
+        }
+        SlabString(inline_value).swap(inline_value);
+        return true;
+    }
+
+    string_view view() const { return shared_value ? string_view(*shared_value) : string_view(inline_value); }
+    size_t size() const { return view().size(); }
+    // The shared buffer, or null if the value is stored inline.
+    const shared_ptr<const string>& shared() const { return shared_value; }
+    // Bytes the value takes beyond the object itself: its slab block, or the
+    // shared buffer with the string and control block allocated next to it.
+    size_t allocated_bytes() const {
+        if (shared_value) {
+            return heap_usable_size(sizeof(string) + 16) + heap_usable_size(shared_value->capacity() + 1);
+        }
+        if (inline_value.capacity() <= SlabString().capacity()) {
+            return 0;
+        }
+        return slab_usable_size(inline_value.capacity() + 1);
+    }
+};
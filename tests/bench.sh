@@ -0,0 +1,33 @@
+#!/bin/bash
+# ikvdb-bench runs every test and the --mix one against the server in each
+# threading mode without errors, in text and in CSV, and refuses unknown tests.
+#
+# Usage: tests/bench.sh [path-to-ikvdb] [port] [path-to-ikvdb-bench]
+source "$(dirname "$0")/lib.sh"
+BENCH=${3:-./ikvdb-bench}
+
+checks() {
+    local line name rps requests errors rest seen=()
+    reply=$("$BENCH" -p "$PORT" -n 1000 -c 8 -P 4 -r 100 --value-size 3-64 --zipf 0.99 --mix get:3,set:1 --csv)
+    while IFS=, read -r name rps requests errors rest; do
+        [[ $name == '"test"' ]] && continue
+        seen+=("${name//\"/}")
+        line="$name,$rps,$requests,$errors"
+        [[ $requests == 1000 && $errors == 0 && $rps != 0.00 ]] && report "bench $name" "1000 requests, 0 errors" ok ||
+            report "bench $name" "1000 requests, 0 errors: $line"
+    done <<< "$reply"
+    reply=${seen[*]}
+    [[ $reply == "SET GET INCR LPUSH LRANGE LPOP XADD XRANGE XREAD MIX" ]] && report "bench runs every test" "$reply" ok ||
+        report "bench runs every test" "SET GET INCR LPUSH LRANGE LPOP XADD XRANGE XREAD MIX"
+
+    reply=$("$BENCH" -p "$PORT" -n 200 -t get,set 2>&1)
+    [[ $reply == "GET: "*"200 requests in "*", 0 errors"*"p99.9="*"SET: "*", 0 errors"* ]] &&
+        report "bench -t get,set" "GET and SET, 0 errors" ok || report "bench -t get,set" "GET and SET, 0 errors"
+    reply=$("$BENCH" -p "$PORT" -t nope 2>&1)
+    [[ $? == 1 && $reply == "Unknown test: nope" ]] && report "bench -t nope" "Unknown test: nope" ok ||
+        report "bench -t nope" "Unknown test: nope"
+    expect 'PING' '+PONG'
+}
+
+in_each_mode checks
+finish
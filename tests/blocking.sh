@@ -0,0 +1,71 @@
+#!/bin/bash
+# BLPOP, BZPOPMIN and XREAD BLOCK: answering at once, timing out, being woken
+# by another client in the order they blocked, pipelining behind a blocked
+# command, and not blocking inside MULTI.
+#
+# Usage: tests/blocking.sh [path-to-ikvdb] [port]
+source "$(dirname "$0")/lib.sh"
+
+checks() {
+    connect 4
+    connect 5
+
+    expect 'RPUSH {b}l a' ':1'
+    expect 'BLPOP {b}l 1' '*2 {b}l a'
+    expect 'BLPOP {b}l 0.1' '*-1'
+    expect 'BLPOP {b}l x' '-ERR invalid timeout value'
+
+    # The event loops serve blocked clients in the order they blocked, one
+    # element each. (Threads blocked in the default mode race for it.)
+    send 'BLPOP {b}l 2'
+    sleep 0.1
+    CONN=4 expect_like 'INFO clients' '*blocked_clients:1*'
+    if [[ $MODE != default ]]; then
+        CONN=5 send 'BLPOP {b}l 2'
+        sleep 0.1
+        CONN=4 expect_like 'INFO clients' '*blocked_clients:2*'
+        CONN=4 expect 'RPUSH {b}l x' ':1'
+        expect_pushed '*2 {b}l x'
+        CONN=4 expect 'RPUSH {b}l y' ':1'
+        CONN=5 expect_pushed '*2 {b}l y'
+    else
+        CONN=4 expect 'RPUSH {b}l x' ':1'
+        expect_pushed '*2 {b}l x'
+    fi
+
+    # Commands pipelined behind a blocked one wait for it.
+    send 'BLPOP {b}l 2'
+    send 'PING'
+    sleep 0.1
+    CONN=4 expect 'LPUSH {b}l z' ':1'
+    expect_pushed '*2 {b}l z'
+    expect_pushed '+PONG'
+
+    expect 'ZADD {b}z 1 m' ':1'
+    expect 'BZPOPMIN {b}z {b}y 1' '*3 {b}z m 1'
+    send 'BZPOPMIN {b}y {b}z 2'
+    sleep 0.1
+    CONN=4 expect 'ZADD {b}z 2 n' ':1'
+    expect_pushed '*3 {b}z n 2'
+    expect 'BZPOPMIN {b}z 0.1' '*-1'
+
+    # $ means entries added after the command blocked.
+    expect_like 'XADD {b}s * f old' '*-*'
+    send 'XREAD block 2000 streams {b}s $'
+    sleep 0.1
+    CONN=4 expect_like 'XADD {b}s * f new' '*-*'
+    expect_pushed_like '[*]1 [*]2 {b}s [*]1 [*]2 *-* [*]2 f new'
+    expect 'XREAD block 100 streams {b}s $' '$-1'
+
+    # Nothing blocks inside a transaction.
+    expect 'MULTI' '+OK'
+    expect 'BLPOP {b}l 0' '+QUEUED'
+    expect 'BZPOPMIN {b}z 0' '+QUEUED'
+    expect 'EXEC' '*2 *-1 *-1'
+
+    disconnect 4
+    disconnect 5
+}
+
+in_each_mode checks
+finish
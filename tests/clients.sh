@@ -0,0 +1,63 @@
+#!/bin/bash
+# CLIENT ID/SETNAME/GETNAME/LIST/KILL, the blocked flag, the client recorded
+# in SLOWLOG entries, and a normal client dropped once its replies pass the
+# hard output-buffer limit.
+#
+# Usage: tests/clients.sh [path-to-ikvdb] [port]
+source "$(dirname "$0")/lib.sh"
+
+checks() {
+    local id id4 id5
+    connect 4
+    connect 5
+    call 'CLIENT ID'
+    id=${reply#:}
+    CONN=4 call 'CLIENT ID'
+    id4=${reply#:}
+    CONN=5 call 'CLIENT ID'
+    id5=${reply#:}
+
+    expect 'CLIENT GETNAME' '$-1'
+    expect 'CLIENT SETNAME me' '+OK'
+    expect 'CLIENT GETNAME' 'me'
+    expect_like 'SLOWLOG GET 1' '[*]1 [*]6 * [*]2 CLIENT GETNAME 127.0.0.1:+([0-9]) me'
+    expect_like 'CLIENT LIST' "*id=$id addr=127.0.0.1:+([0-9]) fd=+([0-9]) name=me *cmd=client"$'\n'"*"
+    [[ $reply == *"id=$id4 "* && $reply == *"id=$id5 "* ]] && report "CLIENT LIST shows every client" "id=$id4, id=$id5" ok ||
+        report "CLIENT LIST shows every client" "id=$id4, id=$id5"
+    expect 'CLIENT LIST TYPE pubsub' ''
+    expect 'CLIENT LIST TYPE nope' '-ERR syntax error'
+    expect 'CLIENT SETNAME' "-ERR unknown subcommand or wrong number of arguments for 'CLIENT SETNAME'"
+    expect_like 'INFO clients' "*connected_clients:3"$'\r'"*blocked_clients:0"$'\r'"*"
+
+    CONN=4 send 'BLPOP {c}x 5'
+    sleep 0.2
+    expect_like 'CLIENT LIST' "*id=$id4 * flags=b *cmd=blpop*"
+    expect_like 'INFO clients' "*blocked_clients:1"$'\r'"*"
+
+    expect 'CLIENT KILL 1.2.3.4:5' '-ERR No such client'
+    expect 'CLIENT KILL ADDR 1.2.3.4:5' ':0'
+    expect "CLIENT KILL ID $id" ':0'
+    expect 'CLIENT KILL ID x' '-ERR client-id should be greater than 0'
+    expect 'CLIENT KILL TYPE nope' "-ERR Unknown client type 'nope'"
+    expect "CLIENT KILL ID $id4" ':1'
+    # Read rather than write: writing to the closed socket would raise SIGPIPE.
+    reply=
+    CONN=4 read_reply
+    [[ $reply == '<timeout>' ]] && report "killed client is closed" "EOF" ok || report "killed client is closed" "EOF"
+    disconnect 4
+
+    # 20000 elements of 100 bytes: about 2MB of reply against a 1MB limit.
+    awk 'BEGIN { n = 20000; v = sprintf("%100s", ""); printf "*%d\r\n$5\r\nRPUSH\r\n$3\r\nbig\r\n", n + 2
+                 for (i = 0; i < n; i++) printf "$100\r\n%s\r\n", v }' >&3
+    expect_pushed ':20000'
+    CONN=5 send 'LRANGE big 0 -1'
+    sleep 0.3
+    call 'CLIENT LIST'
+    [[ $reply != *"id=$id5 "* ]] && report "client over its output limit is dropped" "no id=$id5" ok ||
+        report "client over its output limit is dropped" "no id=$id5"
+    disconnect 5
+    expect 'LRANGE big 0 0' "*1 $(printf '%100s' '')"
+}
+
+in_each_mode checks --client-output-buffer-limit "normal 1mb 0 0" --slowlog-log-slower-than 0
+finish
@@ -0,0 +1,59 @@
+#!/bin/bash
+# Slab allocator statistics in INFO memory, and active defragmentation moving
+# live objects out of the slabs that half the keys were deleted from.
+#
+# Usage: tests/defrag.sh [path-to-ikvdb] [port]
+source "$(dirname "$0")/lib.sh"
+
+KEYS=200000
+
+# Pipelines "$1 k<i> [value]" for every $2-th of the KEYS keys and reads past
+# the replies, which are $3 bytes each.
+bulk() {
+    awk -v cmd="$1" -v step="$2" -v n="$KEYS" 'BEGIN {
+        value = sprintf("%100s", ""); gsub(/ /, "v", value)
+        for (i = 0; i < n; i += step) {
+            key = sprintf("k%06d", i)
+            if (cmd == "SET") printf "*3\r\n$3\r\nSET\r\n$7\r\n%s\r\n$100\r\n%s\r\n", key, value
+            else printf "*2\r\n$3\r\nDEL\r\n$7\r\n%s\r\n", key
+        }
+    }' >&3
+    head -c $(((KEYS + $2 - 1) / $2 * $3)) <&3 >/dev/null
+}
+
+# Leaves the value of INFO memory field $1 in $value.
+info_field() {
+    call 'INFO memory'
+    value=${reply#*$'\n'$1:}
+    value=${value%%$'\r'*}
+}
+
+checks() {
+    local before after
+    info_field allocator_allocated
+    before=$value
+    bulk SET 1 5
+    expect 'EXISTS k199999' ':1'
+    info_field allocator_allocated
+    after=$value
+    ((after > before + KEYS * 100)) && report "allocator_allocated grows with the keys" ">$((KEYS * 100))" ok ||
+        report "allocator_allocated grows with the keys" ">$((KEYS * 100))"
+    expect_like 'INFO memory' '*allocator_active:*allocator_mapped:*allocator_frag_ratio:*'
+
+    # Every other key deleted: the slabs are left half full.
+    bulk DEL 2 4
+    for _ in $(seq 100); do
+        info_field active_defrag_hits
+        ((value > 0)) && break
+        sleep 0.1
+    done
+    reply="active_defrag_hits:$value"
+    ((value > 0)) && report "active defrag moves objects" "active_defrag_hits > 0" ok ||
+        report "active defrag moves objects" "active_defrag_hits > 0"
+    expect 'GET k000001' "$(printf 'v%.0s' $(seq 100))"
+    expect 'GET k199999' "$(printf 'v%.0s' $(seq 100))"
+    expect 'GET k000002' '$-1'
+}
+
+in_each_mode checks --activedefrag yes --active-defrag-threshold 1
+finish
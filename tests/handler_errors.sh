@@ -0,0 +1,43 @@
+#!/bin/bash
+# Regression check: a handler that throws (XADD with a malformed id makes
+# handle_xadd's stoll throw) must answer with an error and leave the server
+# serving, on every threading mode.
+#
+# Usage: tests/handler_errors.sh [path-to-ikvdb] [port]
+IKVDB=${1:-./ikvdb}
+PORT=${2:-7390}
+failed=0
+
+check_mode() {
+    local name=$1
+    shift
+    "$IKVDB" --port "$PORT" "$@" >/dev/null 2>&1 &
+    local pid=$!
+    for _ in $(seq 50); do
+        (exec 3<>/dev/tcp/127.0.0.1/"$PORT") 2>/dev/null && break
+        sleep 0.1
+    done
+
+    exec 3<>/dev/tcp/127.0.0.1/"$PORT"
+    local first second
+    printf '*5\r\n$4\r\nXADD\r\n$1\r\ns\r\n$5\r\nabc-1\r\n$1\r\nf\r\n$1\r\nv\r\n' >&3
+    read -r -t 2 first <&3
+    printf '*1\r\n$4\r\nPING\r\n' >&3
+    read -r -t 2 second <&3
+    exec 3<&-
+
+    if [[ $first == -ERR* && $second == "+PONG"* ]] && kill -0 "$pid" 2>/dev/null; then
+        echo "ok   $name"
+    else
+        echo "FAIL $name: got '${first%$'\r'}' then '${second%$'\r'}'"
+        failed=1
+    fi
+    kill "$pid" 2>/dev/null
+    wait "$pid" 2>/dev/null
+}
+
+check_mode default
+check_mode io-threads --io-threads 2
+check_mode shards --shards 2
+check_mode io-uring --io-uring yes
+exit $failed
@@ -0,0 +1,64 @@
+#!/bin/bash
+# HSET, HGET, HMGET, HGETALL, HDEL, HINCRBY, HLEN and HSCAN, on a packed hash
+# and on one past HASH_MAX_PACKED_ENTRIES that has moved to a table.
+#
+# Usage: tests/hashes.sh [path-to-ikvdb] [port]
+source "$(dirname "$0")/lib.sh"
+
+checks() {
+    expect 'HSET h a 1 b 2' ':2'
+    expect 'HSET h b 3 c 4' ':1'
+    expect 'HGET h b' '3'
+    expect 'HGET h x' '$-1'
+    expect 'HGET nohash a' '$-1'
+    expect 'HMGET h a x c' '*3 1 $-1 4'
+    expect 'HGETALL h' '*6 a 1 b 3 c 4'
+    expect 'HGETALL nohash' '*0'
+    expect 'HLEN h' ':3'
+    expect 'HDEL h a x' ':1'
+    expect 'HLEN h' ':2'
+    expect 'HINCRBY h c 10' ':14'
+    expect 'HINCRBY h new -2' ':-2'
+    expect 'HINCRBY h c x' '-ERR value is not an integer or out of range'
+    expect 'HSET h s text' ':1'
+    expect 'HINCRBY h s 1' '-ERR hash value is not an integer'
+    expect 'HSET h m 9223372036854775807' ':1'
+    expect 'HINCRBY h m 1' '-ERR increment or decrement would overflow'
+    expect 'HDEL h b c new s m' ':5'
+    expect 'EXISTS h' ':0'
+    expect 'HSET h a' "-ERR wrong number of arguments for 'hset'"
+
+    # A long value moves the hash to a table; so do many fields.
+    local long
+    long=$(printf 'v%.0s' $(seq 100))
+    expect 'HSET t a 1' ':1'
+    expect "HSET t b $long" ':1'
+    expect 'HGET t b' "$long"
+    expect 'HMGET t a b' "*2 1 $long"
+    for i in $(seq 200); do
+        call "HSET big f$i $i"
+    done
+    expect 'HLEN big' ':200'
+    expect 'HGET big f150' '150'
+    expect 'HINCRBY big f150 1' ':151'
+
+    # HSCAN to the end sees every field once.
+    local cursor=0 words i fields=()
+    for _ in $(seq 1000); do
+        call "HSCAN big $cursor COUNT 20"
+        read -ra words <<< "$reply"
+        cursor=${words[1]}
+        for ((i = 3; i < ${#words[@]}; i += 2)); do
+            fields+=("${words[i]}")
+        done
+        [[ $cursor == 0 ]] && break
+    done
+    reply=$(printf '%s\n' "${fields[@]}" | sort -u | wc -l)
+    [[ $reply == 200 ]] && report "HSCAN visits every field" 200 ok || report "HSCAN visits every field" 200
+    # A packed hash comes back whole.
+    expect 'HSET p a 1 b 2 c 3' ':3'
+    expect 'HSCAN p 0 MATCH [ab]' '*2 0 *4 a 1 b 2'
+}
+
+in_each_mode checks
+finish
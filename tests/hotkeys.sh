@@ -0,0 +1,46 @@
+#!/bin/bash
+# HOTKEYS and INFO hotkeys pick out the key most commands touch; BIGKEYS lists
+# the longest lists and streams, from every shard with --shards.
+#
+# Usage: tests/hotkeys.sh [path-to-ikvdb] [port]
+source "$(dirname "$0")/lib.sh"
+
+# Pipelines GET $1 $2 times and reads past the replies, "$1\r\n1\r\n" each.
+hammer() {
+    awk -v key="$1" -v n="$2" 'BEGIN {
+        for (i = 0; i < n; i++) printf "*2\r\n$3\r\nGET\r\n$%d\r\n%s\r\n", length(key), key
+    }' >&3
+    head -c $(($2 * 7)) <&3 >/dev/null
+}
+
+checks() {
+    expect 'HOTKEYS RESET' '+OK'
+    expect 'SET hot 1' '+OK'
+    expect 'SET warm 1' '+OK'
+    hammer hot 4000
+    hammer warm 400
+    expect_like 'HOTKEYS COUNT 2' '[*]2 [*]2 hot :+([0-9]) [*]2 warm :+([0-9])'
+    expect_like 'HOTKEYS' '[*]+([0-9]) [*]2 hot :*'
+    expect_like 'INFO hotkeys' '# Hotkeys*hotkeys_sample_rate:+([0-9])*hotkeys_sampled:+([0-9])*'
+    expect 'HOTKEYS COUNT 0' '-ERR count should be greater than 0'
+    expect 'HOTKEYS COUNT x' '-ERR value is not an integer or out of range'
+    expect 'HOTKEYS 1' '-ERR syntax error'
+    expect 'HOTKEYS RESET' '+OK'
+    expect 'HOTKEYS' '*0'
+
+    # Spread over the shards by their names.
+    local i
+    for i in 1 2 3 4 5 6; do
+        call "RPUSH list$i $(seq -s ' ' $((i * 10)))"
+    done
+    expect 'XADD stream1 1-1 f v' '1-1'
+    expect 'XADD stream2 1-1 f v' '1-1'
+    expect 'XADD stream2 1-2 f v' '1-2'
+    expect_like 'BIGKEYS COUNT 3' '[*]5 [*]4 list list6 :60 :+([0-9]) [*]4 list list5 :50 :+([0-9]) [*]4 list list4 :40 :+([0-9]) [*]4 stream stream2 :2 :+([0-9]) [*]4 stream stream1 :1 :+([0-9])'
+    expect_like 'BIGKEYS' '[*]8 [*]4 list list6 :60 *[*]4 list list1 :10 :+([0-9]) [*]4 stream stream2 :2 *'
+    expect 'BIGKEYS COUNT 0' '-ERR syntax error'
+    expect 'BIGKEYS 1' "-ERR wrong number of arguments for 'bigkeys'"
+}
+
+in_each_mode checks
+finish
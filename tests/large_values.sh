@@ -0,0 +1,57 @@
+#!/bin/bash
+# Values of 16KB and more are kept in shared buffers and sent with gathered
+# writes, above OUTPUT_ZEROCOPY_MIN_SIZE with MSG_ZEROCOPY where the socket
+# allows it: they must come back whole and in order with small replies
+# around them.
+#
+# Usage: tests/large_values.sh [path-to-ikvdb] [port]
+source "$(dirname "$0")/lib.sh"
+
+# Prints a value of $1 bytes, ending with the marker $2.
+value() {
+    printf '%*s' $(($1 - ${#2})) '' | tr ' ' x
+    printf '%s' "$2"
+}
+
+checks() {
+    local mid big huge
+    mid=$(value 20000 mid)
+    big=$(value 100000 big)
+    huge=$(value 200000 huge)
+    expect "SET {v}mid $mid" '+OK'
+    expect "SET {v}big $big" '+OK'
+    expect "SET {v}huge $huge" '+OK'
+
+    call 'GET {v}mid'
+    [[ $reply == "$mid" ]] && report "GET 20KB value" "20000 bytes" ok || report "GET 20KB value" "20000 bytes"
+    call 'GET {v}huge'
+    [[ $reply == "$huge" ]] && report "GET 200KB value" "200000 bytes" ok || report "GET 200KB value" "200000 bytes"
+    call 'MGET {v}big {v}none {v}mid'
+    [[ $reply == "*3 $big \$-1 $mid" ]] && report "MGET large values" "*3 big \$-1 mid" ok ||
+        report "MGET large values" "*3 big \$-1 mid"
+
+    # Pipelined: the large values and the small replies between them keep
+    # their order.
+    send 'GET {v}big'
+    send 'PING'
+    send 'GET {v}huge'
+    send 'GET {v}mid'
+    reply=
+    read_reply && read_reply && read_reply && read_reply
+    [[ $reply == "$big +PONG $huge $mid" ]] && report "pipelined large GETs" "big +PONG huge mid" ok ||
+        report "pipelined large GETs" "big +PONG huge mid"
+
+    # A GET sent before an overwrite still gets the old value.
+    send 'GET {v}big'
+    send 'SET {v}big small'
+    reply=
+    read_reply && read_reply
+    [[ $reply == "$big +OK" ]] && report "GET then SET over a large value" "big +OK" ok ||
+        report "GET then SET over a large value" "big +OK"
+    expect 'GET {v}big' 'small'
+    expect 'DEL {v}huge {v}mid' ':2'
+    expect 'GET {v}huge' '$-1'
+}
+
+in_each_mode checks
+finish
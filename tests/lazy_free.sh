@@ -0,0 +1,46 @@
+#!/bin/bash
+# DEL, UNLINK and FLUSHALL ASYNC hand values above LAZYFREE_THRESHOLD elements
+# to the lazy-free thread; INFO memory counts them once freed.
+#
+# Usage: tests/lazy_free.sh [path-to-ikvdb] [port]
+source "$(dirname "$0")/lib.sh"
+
+# Waits for INFO memory to report $1 lazily freed objects.
+expect_lazyfreed() {
+    for _ in $(seq 50); do
+        call 'INFO memory'
+        [[ $reply == *"lazyfreed_objects:$1"$'\r'* && $reply == *"lazyfree_pending_objects:0"$'\r'* ]] && break
+        sleep 0.1
+    done
+    [[ $reply == *"lazyfreed_objects:$1"$'\r'* ]] && report "lazyfreed_objects:$1" "$1" ok ||
+        report "lazyfreed_objects:$1" "$1"
+}
+
+checks() {
+    local many
+    many=$(printf ' e%d' $(seq 100))
+    expect "RPUSH {z}big$many" ':100'
+    expect 'RPUSH {z}small a b c' ':3'
+    expect 'DEL {z}small' ':1'
+    expect_lazyfreed 0
+    expect 'DEL {z}big' ':1'
+    expect_lazyfreed 1
+    expect 'LRANGE {z}big 0 -1' '*0'
+
+    expect "RPUSH {z}big$many" ':100'
+    expect "HSET {z}h$(printf ' f%d v' $(seq 100))" ':100'
+    expect 'UNLINK {z}big {z}h' ':2'
+    expect_lazyfreed 3
+
+    # FLUSHALL ASYNC frees the old stores in the background, whatever their size.
+    expect "RPUSH {z}big$many" ':100'
+    expect 'SET {z}s v' '+OK'
+    expect 'FLUSHALL ASYNC' '+OK'
+    expect 'EXISTS {z}big {z}s' ':0'
+    expect_like 'INFO memory' '*lazyfreed_objects:@([4-9]|[1-9][0-9])'$'\r''*'
+    expect 'FLUSHALL SYNC' '+OK'
+    expect 'FLUSHALL LATER' '-ERR syntax error'
+}
+
+in_each_mode checks
+finish
@@ -0,0 +1,152 @@
+# Helpers for the shell tests, which talk RESP to a live server over bash's
+# /dev/tcp. A test sources this file, defines its checks in a function and
+# hands it to in_each_mode, or calls start_server itself:
+#
+#   expect 'RPUSH l a b' ':2'          send a command, compare the reply
+#   expect 'LRANGE l 0 -1' '*2 a b'
+#   expect_like 'INFO' '*lazyfree*'    same, against a glob pattern
+#
+# Replies are flattened to one line: each element of an aggregate follows its
+# header (*2, %1, >3, ~2) and bulk strings are shown by their contents, so
+# "*2\r\n$1\r\na\r\n$1\r\nb\r\n" reads "*2 a b". Arguments are split on
+# spaces. Commands go out on connection 3 unless CONN names another one
+# opened with connect.
+#
+# Usage of a test: tests/<name>.sh [path-to-ikvdb] [port]
+export LC_ALL=C
+shopt -s extglob
+IKVDB=${1:-./ikvdb}
+PORT=${2:-7391}
+MODE=default
+CONN=3
+failed=0
+server_pid=
+
+# Opens connection number $1 (3-9) to the server.
+connect() {
+    eval "exec $1<>/dev/tcp/127.0.0.1/$PORT"
+}
+
+disconnect() {
+    eval "exec $1<&-"
+}
+
+start_server() {
+    "$IKVDB" --port "$PORT" "$@" >/dev/null 2>&1 &
+    server_pid=$!
+    for _ in $(seq 50); do
+        (exec 3<>/dev/tcp/127.0.0.1/"$PORT") 2>/dev/null && break
+        sleep 0.1
+    done
+    connect 3
+}
+
+stop_server() {
+    disconnect 3
+    kill "$server_pid" 2>/dev/null
+    wait "$server_pid" 2>/dev/null
+}
+
+# Sends one command, split on spaces, on $CONN.
+send() {
+    local words out word
+    read -ra words <<< "$1"
+    out="*${#words[@]}\r\n"
+    for word in "${words[@]}"; do
+        out+="\$${#word}\r\n${word//\\/\\\\}\r\n"
+    done
+    printf "${out//%/%%}" >&"$CONN"
+}
+
+# Reads one reply from $CONN and appends it, flattened, to $reply.
+read_reply() {
+    local line data n i
+    if ! IFS= read -r -t 2 line <&"$CONN"; then
+        reply+="${reply:+ }<timeout>"
+        return 1
+    fi
+    line=${line%$'\r'}
+    case $line in
+        '$-1' | '*-1')
+            reply+="${reply:+ }$line" ;;
+        '$'* | '='*)
+            n=${line:1}
+            IFS= read -r -N $((n + 2)) -t 2 data <&"$CONN"
+            reply+="${reply:+ }${data:0:n}" ;;
+        '*'* | '~'* | '>'*)
+            n=${line:1}
+            reply+="${reply:+ }$line"
+            for ((i = 0; i < n; i++)); do
+                read_reply || return 1
+            done ;;
+        '%'*)
+            n=${line:1}
+            reply+="${reply:+ }$line"
+            for ((i = 0; i < 2 * n; i++)); do
+                read_reply || return 1
+            done ;;
+        *)
+            reply+="${reply:+ }$line" ;;
+    esac
+}
+
+# Sends a command and leaves its flattened reply in $reply.
+call() {
+    send "$1"
+    reply=
+    read_reply
+}
+
+report() {
+    if [[ $3 == ok ]]; then
+        echo "ok   [$MODE] $1"
+    else
+        echo "FAIL [$MODE] $1: got '$reply', want '$2'"
+        failed=1
+    fi
+}
+
+expect() {
+    call "$1"
+    [[ $reply == "$2" ]] && report "$1" "$2" ok || report "$1" "$2"
+}
+
+expect_like() {
+    call "$1"
+    [[ $reply == $2 ]] && report "$1" "$2" ok || report "$1" "$2"
+}
+
+# Checks the next reply on $CONN without sending anything, for push messages
+# and replies to commands sent earlier.
+expect_pushed() {
+    reply=
+    read_reply
+    [[ $reply == "$1" ]] && report "(pushed)" "$1" ok || report "(pushed)" "$1"
+}
+
+expect_pushed_like() {
+    reply=
+    read_reply
+    [[ $reply == $1 ]] && report "(pushed)" "$1" ok || report "(pushed)" "$1"
+}
+
+# Runs the checks in function $1 against a fresh server in every threading
+# mode. Further arguments are passed to the server.
+in_each_mode() {
+    local args
+    for MODE in default io-threads shards io-uring; do
+        case $MODE in
+            default) args=() ;;
+            io-threads) args=(--io-threads 2) ;;
+            shards) args=(--shards 2) ;;
+            io-uring) args=(--io-uring yes) ;;
+        esac
+        start_server "${args[@]}" "${@:2}"
+        "$1"
+        stop_server
+    done
+}
+
+finish() {
+    exit $failed
+}
@@ -0,0 +1,61 @@
+#!/bin/bash
+# MEMORY USAGE for every type, exact and sampled, and MEMORY STATS counting the
+# keys of every shard.
+#
+# Usage: tests/memory.sh [path-to-ikvdb] [port]
+source "$(dirname "$0")/lib.sh"
+
+# Leaves MEMORY USAGE of the key and options in $1 in $bytes.
+usage() {
+    call "MEMORY USAGE $1"
+    bytes=${reply#:}
+}
+
+# Reports whether $1 holds.
+check() {
+    (($1)) && report "$2" "$1" ok || report "$2" "$1"
+}
+
+checks() {
+    local bytes small long list10 list1000 exact sampled
+    expect 'MEMORY USAGE missing' '$-1'
+    expect 'SET small v' '+OK'
+    usage small
+    small=$bytes
+    expect "SET long $(printf 'v%.0s' $(seq 1000))" '+OK'
+    usage long
+    long=$bytes
+    reply="small=$small long=$long"
+    check "small > 0 && long > small + 1000" "MEMORY USAGE of strings"
+
+    expect "RPUSH list10 $(seq -s ' ' 10)" ':10'
+    expect "RPUSH list1000 $(seq -s ' ' 1000)" ':1000'
+    usage list10
+    list10=$bytes
+    usage list1000
+    list1000=$bytes
+    usage 'list1000 SAMPLES 0'
+    exact=$bytes
+    usage 'list1000 SAMPLES 5'
+    sampled=$bytes
+    reply="list10=$list10 list1000=$list1000 exact=$exact sampled=$sampled"
+    check "list1000 > list10 * 10 && sampled > exact / 2 && sampled < exact * 2" "MEMORY USAGE of lists"
+
+    expect 'HSET h f v' ':1'
+    expect 'ZADD z 1 m' ':1'
+    expect 'XADD s 1-1 f v' '1-1'
+    expect_like 'MEMORY USAGE h' ':[1-9]*([0-9])'
+    expect_like 'MEMORY USAGE z' ':[1-9]*([0-9])'
+    expect_like 'MEMORY USAGE s' ':[1-9]*([0-9])'
+    expect 'MEMORY USAGE h SAMPLES x' '-ERR value is not an integer or out of range'
+    expect 'MEMORY USAGE h SAMPLES -1' '-ERR syntax error'
+    expect 'MEMORY USAGE h COUNT 1' '-ERR syntax error'
+    expect 'MEMORY DOCTOR' "-ERR unknown subcommand or wrong number of arguments for 'MEMORY DOCTOR'"
+
+    expect_like 'MEMORY STATS' '[*]26 keys.count :7 keys.bytes-per-key :+([0-9]) dataset.bytes :+([0-9]) overhead.hashtable.main :+([0-9]) *overhead.total :+([0-9]) *process.rss :+([0-9]) dataset.percentage +([0-9.])'
+    expect 'FLUSHALL' '+OK'
+    expect_like 'MEMORY STATS' '[*]26 keys.count :0 keys.bytes-per-key :0 dataset.bytes :0 *'
+}
+
+in_each_mode checks
+finish
@@ -0,0 +1,32 @@
+#!/bin/bash
+# ikvdb-microbench runs every benchmark, honours its name filters, and the
+# paths that allocate nothing per op today still don't.
+#
+# Usage: tests/microbench.sh [path-to-ikvdb-microbench]
+source "$(dirname "$0")/lib.sh"
+MICROBENCH=${1:-./ikvdb-microbench}
+MODE=in-process
+
+reply=$("$MICROBENCH" --time 0.01 --csv)
+names=()
+while IFS=, read -r name iterations ns allocs bytes; do
+    [[ $name == '"benchmark"' ]] && continue
+    name=${name//\"/}
+    names+=("$name")
+    line="$name,$iterations,$ns,$allocs,$bytes"
+    ((iterations >= 1000)) && report "$name runs" "1000 iterations or more" ok || report "$name runs" "$line"
+    case $name in
+        dispatch/ping | dispatch/get | stats/* | handle_get | handle_lrange/*)
+            [[ $allocs == 0.00 ]] && report "$name allocates nothing" "0.00 allocs/op" ok ||
+                report "$name allocates nothing" "0.00 allocs/op: $line" ;;
+    esac
+done <<< "$reply"
+reply=${names[*]}
+want="parse/set parse/mset-10 dispatch/ping dispatch/set dispatch/get stats/lookup stats/record handle_set handle_get handle_lrange/100 handle_xadd handle_xrange/100"
+[[ $reply == "$want" ]] && report "every benchmark" "$want" ok || report "every benchmark" "$want"
+
+reply=$("$MICROBENCH" --time 0.01 handle_x parse/ | awk 'NR > 1 { print $1 }' | tr '\n' ' ')
+want="parse/set parse/mset-10 handle_xadd handle_xrange/100 "
+[[ $reply == "$want" ]] && report "name filters" "$want" ok || report "name filters" "$want"
+
+finish
@@ -0,0 +1,38 @@
+#!/bin/bash
+# MGET, MSET, MSETNX, DEL, UNLINK and EXISTS. The keys share a hash tag so
+# they stay on one shard with --shards, where keys on different shards are
+# refused with CROSSSLOT.
+#
+# Usage: tests/multikey.sh [path-to-ikvdb] [port]
+source "$(dirname "$0")/lib.sh"
+
+checks() {
+    expect 'MSET {u}a 1 {u}b 2 {u}c 3' '+OK'
+    expect 'MGET {u}a {u}b {u}c {u}x' '*4 1 2 3 $-1'
+    expect 'MSETNX {u}a 9 {u}d 4' ':0'
+    expect 'GET {u}d' '$-1'
+    expect 'MSETNX {u}d 4 {u}e 5' ':1'
+    expect 'EXISTS {u}a {u}b {u}x {u}a' ':3'
+    expect 'DEL {u}a {u}x' ':1'
+    expect 'UNLINK {u}b {u}c' ':2'
+    expect 'MGET {u}a {u}b {u}c {u}d' '*4 $-1 $-1 $-1 4'
+
+    # MGET answers nil for keys of another type; DEL and EXISTS see them.
+    expect 'RPUSH {u}l x' ':1'
+    expect 'MGET {u}l {u}d' '*2 $-1 4'
+    expect 'EXISTS {u}l' ':1'
+    expect 'DEL {u}l {u}d {u}e' ':3'
+    expect 'EXISTS {u}l {u}d {u}e' ':0'
+
+    expect 'MSET {u}a' "-ERR wrong number of arguments for 'mset'"
+    expect 'MSET {u}a 1 {u}b' "-ERR wrong number of arguments for 'mset'"
+    expect 'MGET' "-ERR wrong number of arguments for 'mget'"
+    expect 'DEL' "-ERR wrong number of arguments for 'DEL'"
+
+    if [[ $MODE == shards ]]; then
+        expect 'MGET {x}k {y}k' "-CROSSSLOT Keys in request don't hash to the same slot"
+    fi
+}
+
+in_each_mode checks
+finish
@@ -0,0 +1,63 @@
+#!/bin/bash
+# SUBSCRIBE, PSUBSCRIBE, UNSUBSCRIBE, PUNSUBSCRIBE, PUBLISH and PUBSUB, with
+# messages reaching subscribers in every threading mode.
+#
+# Usage: tests/pubsub.sh [path-to-ikvdb] [port]
+source "$(dirname "$0")/lib.sh"
+
+checks() {
+    connect 4
+    connect 5
+
+    expect 'SUBSCRIBE news sport' '*3 subscribe news :1'
+    expect_pushed '*3 subscribe sport :2'
+    CONN=5 expect 'PSUBSCRIBE n*' '*3 psubscribe n* :1'
+    CONN=4 expect 'PUBLISH news hello' ':2'
+    expect_pushed '*3 message news hello'
+    CONN=5 expect_pushed '*4 pmessage n* news hello'
+    CONN=4 expect 'PUBLISH sport goal' ':1'
+    expect_pushed '*3 message sport goal'
+    CONN=4 expect 'PUBLISH weather rain' ':0'
+
+    # Many messages in a row arrive whole and in order.
+    for i in $(seq 50); do
+        CONN=4 call "PUBLISH news m$i"
+    done
+    local got=ok
+    for i in $(seq 50); do
+        reply=
+        read_reply
+        [[ $reply == "*3 message news m$i" ]] || got=$reply
+        reply=
+        CONN=5 read_reply
+        [[ $reply == "*4 pmessage n* news m$i" ]] || got=$reply
+    done
+    [[ $got == ok ]] && report 'PUBLISH x50' '' ok || report 'PUBLISH x50' "*3 message news m<i>"
+
+    # A RESP2 subscriber may only (un)subscribe and PING.
+    expect 'GET k' "-ERR Can't execute 'GET': only (P)SUBSCRIBE / (P)UNSUBSCRIBE / PING are allowed in this context"
+    expect 'PING' '*2 pong '
+
+    CONN=4 expect_like 'PUBSUB CHANNELS' '[*]2 @(news sport|sport news)'
+    CONN=4 expect 'PUBSUB CHANNELS s*' '*1 sport'
+    CONN=4 expect 'PUBSUB NUMSUB news weather' '*4 news :1 weather :0'
+    CONN=4 expect 'PUBSUB NUMPAT' ':1'
+
+    expect 'UNSUBSCRIBE sport' '*3 unsubscribe sport :1'
+    CONN=4 expect 'PUBLISH sport goal' ':0'
+    expect 'UNSUBSCRIBE' '*3 unsubscribe news :0'
+    expect 'GET k' '$-1'
+    CONN=5 expect 'PUNSUBSCRIBE' '*3 punsubscribe n* :0'
+    CONN=4 expect 'PUBSUB NUMPAT' ':0'
+
+    # A subscriber that leaves is dropped from its channels.
+    CONN=5 expect 'SUBSCRIBE gone' '*3 subscribe gone :1'
+    disconnect 5
+    sleep 0.1
+    CONN=4 expect 'PUBLISH gone x' ':0'
+
+    disconnect 4
+}
+
+in_each_mode checks
+finish
@@ -0,0 +1,59 @@
+#!/bin/bash
+# Replies written through Reply: large arrays from LRANGE and XRANGE, XREAD,
+# integers at the edges of int64, scores, EXEC's nested replies and
+# pipelined commands answered in order.
+#
+# Usage: tests/replies.sh [path-to-ikvdb] [port]
+source "$(dirname "$0")/lib.sh"
+
+checks() {
+    local args i words
+    args=$(printf ' e%d' $(seq 3000))
+    expect "RPUSH {l}l$args" ':3000'
+    call 'LRANGE {l}l 0 -1'
+    read -ra words <<< "$reply"
+    [[ ${words[0]} == '*3000' && ${words[1]} == e1 && ${words[3000]} == e3000 && ${#words[@]} == 3001 ]] &&
+        report "LRANGE 3000 elements" "*3000 e1 ... e3000" ok || report "LRANGE 3000 elements" "*3000 e1 ... e3000"
+    expect 'LRANGE {l}l -2 -1' '*2 e2999 e3000'
+    expect 'LRANGE {l}l 5 1' '*0'
+
+    for i in $(seq 500); do
+        call "XADD s $i-0 f v$i"
+    done
+    call 'XRANGE s - +'
+    read -ra words <<< "$reply"
+    [[ ${words[0]} == '*500' && ${words[2]} == 1-0 && ${words[-1]} == v500 ]] &&
+        report "XRANGE 500 entries" "*500 *2 1-0 ... v500" ok || report "XRANGE 500 entries" "*500 *2 1-0 ... v500"
+    expect 'XADD t 1-1 f a' '1-1'
+    expect 'XADD t 1-2 f b' '1-2'
+    expect 'XREAD streams t 1-1' '*1 *2 t *1 *2 1-2 *2 f b'
+
+    expect 'SET n 9223372036854775806' '+OK'
+    expect 'INCR n' ':9223372036854775807'
+    expect 'HINCRBY h f -9223372036854775808' ':-9223372036854775808'
+    expect 'ZADD z 1e300 a -0.25 b' ':2'
+    expect 'ZRANGE z 0 -1 WITHSCORES' '*4 b -0.25 a 1e+300'
+    expect 'ECHO hello' 'hello'
+
+    expect 'MULTI' '+OK'
+    expect 'LRANGE {l}l 0 1' '+QUEUED'
+    expect 'INCR {l}m' '+QUEUED'
+    expect 'GET {l}missing' '+QUEUED'
+    expect 'EXEC' '*3 *2 e1 e2 :1 $-1'
+
+    # Pipelined: every reply comes back, in order.
+    local out=
+    for i in $(seq 100); do
+        out+="*2\r\n\$4\r\nECHO\r\n\$${#i}\r\n$i\r\n"
+    done
+    printf "$out" >&3
+    reply=
+    for i in $(seq 100); do
+        read_reply
+    done
+    [[ $reply == "$(seq -s ' ' 100)" ]] && report "100 pipelined ECHOs" "1 ... 100" ok || report "100 pipelined ECHOs" "1 ... 100"
+    expect 'PING' '+PONG'
+}
+
+in_each_mode checks
+finish
@@ -0,0 +1,66 @@
+#!/bin/bash
+# SCAN with MATCH, COUNT and TYPE, XRANGE with COUNT, and LPOP with a count.
+#
+# Usage: tests/scan.sh [path-to-ikvdb] [port]
+source "$(dirname "$0")/lib.sh"
+
+# Runs SCAN with the options in $1 to the end and leaves the keys it returned,
+# sorted, in $scanned.
+scan_all() {
+    local cursor=0 words i keys=()
+    for _ in $(seq 1000); do
+        call "SCAN $cursor $1"
+        read -ra words <<< "$reply"
+        cursor=${words[1]}
+        for ((i = 3; i < ${#words[@]}; i++)); do
+            keys+=("${words[i]}")
+        done
+        [[ $cursor == 0 ]] && break
+    done
+    scanned=$(printf '%s\n' "${keys[@]}" | sort -u | tr '\n' ' ')
+    scanned=${scanned% }
+}
+
+checks() {
+    for i in $(seq 30); do
+        call "SET str:$i v"
+    done
+    expect 'RPUSH list:1 a b c' ':3'
+    expect 'HSET hash:1 f v' ':1'
+    expect 'ZADD zset:1 1 m' ':1'
+    expect 'XADD stream:1 1-1 f v' '1-1'
+
+    scan_all "COUNT 7"
+    [[ $(wc -w <<< "$scanned") == 34 ]] && report "SCAN visits every key" 34 ok || report "SCAN visits every key" 34
+    scan_all "MATCH str:1* COUNT 5"
+    reply=$scanned
+    [[ $scanned == "str:1 str:10 str:11 str:12 str:13 str:14 str:15 str:16 str:17 str:18 str:19" ]] &&
+        report "SCAN MATCH" "str:1*" ok || report "SCAN MATCH" "str:1*"
+    scan_all "TYPE list"
+    reply=$scanned
+    [[ $scanned == "list:1" ]] && report "SCAN TYPE list" "list:1" ok || report "SCAN TYPE list" "list:1"
+    scan_all "TYPE zset"
+    reply=$scanned
+    [[ $scanned == "zset:1" ]] && report "SCAN TYPE zset" "zset:1" ok || report "SCAN TYPE zset" "zset:1"
+
+    expect 'SCAN 0 COUNT 0' '-ERR syntax error'
+    expect 'SCAN x' '-ERR invalid cursor'
+    expect 'SCAN 0 TYPE nope' "-ERR unknown type name 'nope'"
+    expect 'SCAN 0 MATCH' "-ERR wrong number of arguments for 'scan'"
+
+    expect 'XADD stream:1 1-2 f w' '1-2'
+    expect 'XADD stream:1 1-3 f x' '1-3'
+    expect 'XRANGE stream:1 - + COUNT 2' '*2 *2 1-1 *2 f v *2 1-2 *2 f w'
+    expect 'XRANGE stream:1 - + COUNT 0' '*0'
+
+    expect 'LPOP list:1 2' '*2 a b'
+    expect 'LPOP list:1 0' '*0'
+    expect 'LPOP list:1' 'c'
+    expect 'LPOP list:1' '$-1'
+    expect 'LPOP missing 0' '*0'
+    expect 'LPOP missing 3' '*0'
+    expect 'LPOP missing -1' '-ERR count must be a non-negative integer'
+}
+
+in_each_mode checks
+finish
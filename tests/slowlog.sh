@@ -0,0 +1,44 @@
+#!/bin/bash
+# SLOWLOG GET/LEN/RESET with every command logged, its ring bounded by
+# --slowlog-max-len and long arguments cut short, and the LATENCY "command"
+# event fed by a command over --latency-monitor-threshold.
+#
+# Usage: tests/slowlog.sh [path-to-ikvdb] [port]
+source "$(dirname "$0")/lib.sh"
+
+checks() {
+    local long args
+    expect 'SLOWLOG RESET' '+OK'
+    expect 'SET a 1' '+OK'
+    expect 'GET a' '1'
+    expect 'SLOWLOG LEN' ':3'
+    expect_like 'SLOWLOG GET 2' '[*]2 [*]6 :3 :+([0-9]) :+([0-9]) [*]2 SLOWLOG LEN * [*]6 :2 :+([0-9]) :+([0-9]) [*]2 GET a *'
+    # The ring keeps the newest --slowlog-max-len entries.
+    expect 'SLOWLOG LEN' ':4'
+    expect 'SLOWLOG LEN' ':4'
+    expect_like 'SLOWLOG GET -1' '[*]4 [*]6 :6 *'
+    expect 'SLOWLOG GET -2' '-ERR count should be greater than or equal to -1'
+    expect 'SLOWLOG GET x' '-ERR value is not an integer or out of range'
+    expect 'SLOWLOG NOPE' "-ERR unknown subcommand or wrong number of arguments for 'SLOWLOG NOPE'"
+
+    long=$(printf 'v%.0s' $(seq 200))
+    expect "SET b $long" '+OK'
+    expect_like 'SLOWLOG GET 1' "*[*]3 SET b $(printf 'v%.0s' $(seq 128))... (72 more bytes) *"
+    args=$(printf ' %d' $(seq 40))
+    expect "RPUSH l$args" ':40'
+    expect_like 'SLOWLOG GET 1' '*[*]32 RPUSH l 1 2 * 29 ... (11 more arguments) *'
+
+    # A 50000-element RPUSH takes more than the 1ms threshold.
+    expect 'LATENCY RESET' ':0'
+    awk 'BEGIN { n = 50000; printf "*%d\r\n$5\r\nRPUSH\r\n$3\r\nbig\r\n", n + 2
+                 for (i = 0; i < n; i++) printf "$6\r\n%06d\r\n", i }' >&3
+    expect_pushed ':50000'
+    expect_like 'LATENCY LATEST' '[*]1 [*]4 command :+([0-9]) :+([0-9]) :+([0-9])'
+    expect_like 'LATENCY HISTORY command' '[*]1 [*]2 :+([0-9]) :+([0-9])'
+    expect 'LATENCY HISTORY fork' '*0'
+    expect 'LATENCY RESET command' ':1'
+    expect 'LATENCY LATEST' '*0'
+}
+
+in_each_mode checks --slowlog-log-slower-than 0 --slowlog-max-len 4 --latency-monitor-threshold 1
+finish
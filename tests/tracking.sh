@@ -0,0 +1,57 @@
+#!/bin/bash
+# CLIENT TRACKING: invalidations pushed over RESP3, BCAST prefixes, NOLOOP and
+# REDIRECT to a RESP2 subscriber, in every threading mode.
+#
+# Usage: tests/tracking.sh [path-to-ikvdb] [port]
+source "$(dirname "$0")/lib.sh"
+
+checks() {
+    connect 4
+    connect 5
+
+    expect_like 'HELLO 3' '%7 server ikvdb *proto :3*'
+    expect 'CLIENT TRACKING ON' '+OK'
+    expect 'GET k' '$-1'
+    CONN=4 expect 'SET k 1' '+OK'
+    expect_pushed '>2 invalidate *1 k'
+    # Invalidated once; the next write goes unnoticed until k is read again.
+    CONN=4 expect 'SET k 2' '+OK'
+    expect 'PING' '+PONG'
+    expect 'GET k' '2'
+    CONN=4 expect 'DEL k' ':1'
+    expect_pushed '>2 invalidate *1 k'
+    expect 'GET k' '$-1'
+    CONN=4 expect 'FLUSHALL' '+OK'
+    expect_pushed '>2 invalidate _'
+    CONN=4 expect_like 'INFO clients' '*tracking_clients:1*'
+
+    # NOLOOP: the connection's own writes aren't sent back to it.
+    expect 'CLIENT TRACKING ON NOLOOP' '+OK'
+    expect 'GET k' '$-1'
+    expect 'SET k 3' '+OK'
+    expect 'PING' '+PONG'
+
+    # BCAST: every key under a prefix, without reads.
+    expect 'CLIENT TRACKING OFF' '+OK'
+    expect 'CLIENT TRACKING ON BCAST PREFIX user:' '+OK'
+    CONN=4 expect 'SET user:1 a' '+OK'
+    expect_pushed '>2 invalidate *1 user:1'
+    CONN=4 expect 'SET other 1' '+OK'
+    expect 'PING' '+PONG'
+    expect 'CLIENT TRACKING OFF' '+OK'
+
+    # REDIRECT to a RESP2 connection subscribed to __redis__:invalidate.
+    CONN=5 call 'CLIENT ID'
+    local id=${reply#:}
+    CONN=5 expect 'SUBSCRIBE __redis__:invalidate' '*3 subscribe __redis__:invalidate :1'
+    CONN=4 expect "CLIENT TRACKING ON REDIRECT $id" '+OK'
+    CONN=4 expect 'GET r' '$-1'
+    expect 'SET r 1' '+OK'
+    CONN=5 expect_pushed '*3 message __redis__:invalidate *1 r'
+
+    disconnect 5
+    disconnect 4
+}
+
+in_each_mode checks
+finish
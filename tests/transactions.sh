@@ -0,0 +1,73 @@
+#!/bin/bash
+# MULTI/EXEC: queueing, aborting on a refused command, DISCARD and WATCH.
+#
+# Usage: tests/transactions.sh [path-to-ikvdb] [port]
+source "$(dirname "$0")/lib.sh"
+
+checks() {
+    expect 'MULTI' '+OK'
+    expect 'SET t 1' '+QUEUED'
+    expect 'INCR t' '+QUEUED'
+    expect 'GET t' '+QUEUED'
+    expect 'EXEC' '*3 +OK :2 2'
+    expect 'EXEC' '-ERR EXEC without MULTI'
+
+    # A command that can't be queued discards the whole transaction.
+    expect 'MULTI' '+OK'
+    expect 'SET t 10' '+QUEUED'
+    expect 'NOSUCHCOMMAND a' '-ERR Unknown command: NOSUCHCOMMAND'
+    expect 'EXEC' '-EXECABORT Transaction discarded because of previous errors.'
+    expect 'GET t' '2'
+    expect 'MULTI' '+OK'
+    expect 'GET' "-ERR wrong number of arguments for 'get'"
+    expect 'INCR t' '+QUEUED'
+    expect 'EXEC' '-EXECABORT Transaction discarded because of previous errors.'
+    expect 'MULTI' '+OK'
+    expect 'SUBSCRIBE c' '-ERR SUBSCRIBE inside MULTI is not allowed'
+    expect 'EXEC' '-EXECABORT Transaction discarded because of previous errors.'
+    expect 'GET t' '2'
+
+    # A runtime error inside EXEC doesn't stop the rest.
+    expect 'MULTI' '+OK'
+    expect 'SET {t}u abc' '+QUEUED'
+    expect 'INCR {t}u' '+QUEUED'
+    expect 'INCR t' '+QUEUED'
+    expect 'EXEC' '*3 +OK -ERR value is not an integer or out of range :3'
+
+    expect 'MULTI' '+OK'
+    expect 'MULTI' '-ERR MULTI is already in progress for this client'
+    expect 'INCR t' '+QUEUED'
+    expect 'DISCARD' '+OK'
+    expect 'DISCARD' '-ERR DISCARD without MULTI'
+    expect 'GET t' '3'
+
+    # WATCH: a write by another client between WATCH and EXEC aborts it.
+    expect 'WATCH w' '+OK'
+    connect 4
+    CONN=4 expect 'SET w other' '+OK'
+    expect 'MULTI' '+OK'
+    expect 'SET w mine' '+QUEUED'
+    expect 'EXEC' '*-1'
+    expect 'GET w' 'other'
+    expect 'WATCH w' '+OK'
+    expect 'MULTI' '+OK'
+    expect 'WATCH x' '-ERR WATCH inside MULTI is not allowed'
+    expect 'SET w mine' '+QUEUED'
+    expect 'EXEC' '*1 +OK'
+    expect 'WATCH w' '+OK'
+    expect 'UNWATCH' '+OK'
+    CONN=4 expect 'SET w again' '+OK'
+    expect 'MULTI' '+OK'
+    expect 'GET w' '+QUEUED'
+    expect 'EXEC' '*1 again'
+    # Watched keys that live on different shards.
+    expect 'WATCH wa wb wc wd we wf' '+OK'
+    CONN=4 expect 'SET wf other' '+OK'
+    expect 'MULTI' '+OK'
+    expect 'GET wa' '+QUEUED'
+    expect 'EXEC' '*-1'
+    disconnect 4
+}
+
+in_each_mode checks
+finish
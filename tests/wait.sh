@@ -0,0 +1,48 @@
+#!/bin/bash
+# WAIT without replicas, with one replica, timing out, inside MULTI, and
+# other clients being served while a WAIT is pending.
+#
+# Usage: tests/wait.sh [path-to-ikvdb] [port]
+source "$(dirname "$0")/lib.sh"
+
+checks() {
+    expect 'WAIT 0 0' ':0'
+    expect 'WAIT 1 100' ':0'
+    expect 'WAIT 1' '-ERR wrong number of arguments for '"'"'wait'"'"''
+    expect 'WAIT x 0' '-ERR value is not an integer or out of range'
+    expect 'WAIT 1 -1' '-ERR timeout is negative'
+
+    "$IKVDB" --port $((PORT + 1)) --replicaof "127.0.0.1 $PORT" >/dev/null 2>&1 &
+    local replica=$!
+    for _ in $(seq 50); do
+        call 'INFO replication'
+        [[ $reply == *connected_slaves:1* ]] && break
+        sleep 0.1
+    done
+
+    expect 'SET w 1' '+OK'
+    expect 'WAIT 1 2000' ':1'
+    expect 'WAIT 2 300' ':1'
+
+    # A pending WAIT holds its own connection only.
+    connect 4
+    call 'SET w 2'
+    send 'WAIT 2 500'
+    CONN=4 expect 'GET w' '2'
+    expect_pushed ':1'
+    disconnect 4
+
+    # Inside a transaction WAIT answers at once, whether or not the replica
+    # has acknowledged the latest GETACK yet.
+    expect 'MULTI' '+OK'
+    expect 'WAIT 2 0' '+QUEUED'
+    expect_like 'EXEC' '[*]1 :[01]'
+
+    kill $replica
+    wait $replica 2>/dev/null
+    expect 'SET w 3' '+OK'
+    expect 'WAIT 1 200' ':0'
+}
+
+in_each_mode checks
+finish
@@ -0,0 +1,67 @@
+#!/bin/bash
+# ZADD and its flags, ZINCRBY, ZRANGE by rank, score and lex, ZRANK, ZSCORE,
+# ZCARD, ZREM and ZPOPMIN, on a packed set and on one past
+# ZSET_MAX_PACKED_ENTRIES that has moved to the B+-tree. BZPOPMIN is in
+# blocking.sh.
+#
+# Usage: tests/zsets.sh [path-to-ikvdb] [port]
+source "$(dirname "$0")/lib.sh"
+
+checks() {
+    expect 'ZADD z 1 a 2 b 3 c' ':3'
+    expect 'ZADD z 1.5 a 4 d' ':1'
+    expect 'ZADD z CH 2 a 5 e' ':2'
+    expect 'ZADD z NX 9 a' ':0'
+    expect 'ZADD z XX 9 nope' ':0'
+    expect 'ZADD z GT CH 1 b' ':0'
+    expect 'ZADD z LT CH 1 b' ':1'
+    expect 'ZADD z INCR 10 e' '15'
+    expect 'ZADD z NX XX 1 a' '-ERR XX and NX options at the same time are not compatible'
+    expect 'ZADD z GT NX 1 a' '-ERR GT, LT, and/or NX options at the same time are not compatible'
+    expect 'ZADD z x a' '-ERR value is not a valid float'
+    expect 'ZINCRBY z 0.5 a' '2.5'
+    expect 'ZSCORE z a' '2.5'
+    expect 'ZSCORE z nope' '$-1'
+    expect 'ZCARD z' ':5'
+
+    expect 'ZRANGE z 0 -1' '*5 b a c d e'
+    expect 'ZRANGE z 0 1 WITHSCORES' '*4 b 1 a 2.5'
+    expect 'ZRANGE z 0 1 REV' '*2 e d'
+    expect 'ZRANGE z (1 3 BYSCORE' '*2 a c'
+    expect 'ZRANGE z -inf +inf BYSCORE LIMIT 1 2' '*2 a c'
+    expect 'ZRANGE z +inf 3 BYSCORE REV' '*3 e d c'
+    expect 'ZRANGE z 0 -1 LIMIT 0 1' '-ERR syntax error, LIMIT is only supported in combination with either BYSCORE or BYLEX'
+    expect 'ZRANGE z x 1 BYSCORE' '-ERR min or max is not a float'
+    expect 'ZRANK z c' ':2'
+    expect 'ZRANK z nope' '$-1'
+    expect 'ZREM z a nope' ':1'
+    expect 'ZPOPMIN z' '*2 b 1'
+    expect 'ZPOPMIN z 2' '*4 c 3 d 4'
+    expect 'ZPOPMIN z 0' '*0'
+    expect 'ZPOPMIN z -1' '-ERR value is out of range, must be positive'
+    expect 'ZPOPMIN z 5' '*2 e 15'
+    expect 'EXISTS z' ':0'
+
+    expect 'ZADD lex 0 a 0 b 0 c 0 d' ':4'
+    expect 'ZRANGE lex [b (d BYLEX' '*2 b c'
+    expect 'ZRANGE lex - + BYLEX LIMIT 1 1' '*1 b'
+    expect 'ZRANGE lex + [c BYLEX REV' '*2 d c'
+    expect 'ZRANGE lex b d BYLEX' '-ERR min or max not valid string range item'
+
+    # Past the packed limit: ranks and scores still agree.
+    for i in $(seq 200); do
+        call "ZADD big $i m$i"
+    done
+    expect 'ZCARD big' ':200'
+    expect 'ZRANK big m150' ':149'
+    expect 'ZRANGE big 99 101' '*3 m100 m101 m102'
+    expect 'ZRANGE big 10 12 BYSCORE' '*3 m10 m11 m12'
+    expect 'ZINCRBY big -1000 m150' '-850'
+    expect 'ZRANGE big 0 0 WITHSCORES' '*2 m150 -850'
+    expect 'ZREM big m1 m2' ':2'
+    expect 'ZPOPMIN big 2' '*4 m150 -850 m3 3'
+    expect 'ZCARD big' ':196'
+}
+
+in_each_mode checks
+finish
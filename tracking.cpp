@@ -0,0 +1,226 @@
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include "tracking.h"
+#include "database.h"
+#include "pubsub.h"
+#include "clients.h"
+#include "reply.h"
+
+using namespace std;
+
+size_t tracking_table_max_keys = 1000000;
+atomic<int> tracking_client_count{0};
+thread_local uint64_t tracking_caller_id = 0;
+
+
+// One invalidation, encoded once for every client it goes to: a push for
+// RESP3, a message on __redis__:invalidate for RESP2. key is null for a flush,
+// which invalidates everything.
+struct Invalidation {
+    shared_ptr<const string> resp3;
+    shared_ptr<const string> resp2;
+
+    explicit Invalidation(const string* key) {
+        static const string invalidate = "invalidate";
+        static const string message = "message";
+        static const string channel = "__redis__:invalidate";
+
+        OutputBuffer buffer;
+        Reply reply(buffer);
+        reply.push(2);
+        reply.bulk(invalidate);
+        size_t keys_at = buffer.text.size();
+        if (key) {
+            reply.array(1);
+            reply.bulk(*key);
+        }
+        else {
+            reply.raw("_\r\n");
+        }
+        string keys = buffer.text.substr(keys_at);
+        resp3 = make_shared<const string>(std::move(buffer.text));
+
+        buffer.text.clear();
+        reply.array(3);
+        reply.bulk(message);
+        reply.bulk(channel);
+        if (key) {
+            reply.raw(keys);
+        }
+        else {
+            reply.null_bulk();
+        }
+        resp2 = make_shared<const string>(std::move(buffer.text));
+    }
+};
+
+// Sends an invalidation to the client with that id, or to where it redirects
+// them. The caller holds the table's mutex.
+static void send_invalidation(TrackingTable& table, uint64_t id, uint64_t caller_id, const Invalidation& invalidation) {
+    auto it = table.clients.find(id);
+    if (it == table.clients.end() || (it->second.noloop && id == caller_id)) {
+        return;
+    }
+    uint64_t target = it->second.redirect ? it->second.redirect : id;
+    push_to_client(target, invalidation.resp3, invalidation.resp2);
+}
+
+// Drops keys, with their invalidations, until the table is back within its
+// share of the bound. The caller holds the table's mutex.
+static void shrink_tracking_table(TrackingTable& table) {
+    if (tracking_table_max_keys == 0) {
+        return;
+    }
+    size_t bound = max<size_t>(1, tracking_table_max_keys / keyspaces.size());
+    while (table.keys.size() > bound) {
+        auto it = table.keys.begin();
+        Invalidation invalidation(&it->first);
+        for (uint64_t id : it->second) {
+            send_invalidation(table, id, 0, invalidation);
+        }
+        table.items -= it->second.size();
+        table.keys.erase(it);
+    }
+}
+
+static void remove_broadcast_prefixes(TrackingTable& table, uint64_t id, const vector<string>& prefixes) {
+    for (const string& prefix : prefixes) {
+        auto it = table.broadcast_prefixes.find(prefix);
+        if (it == table.broadcast_prefixes.end()) {
+            continue;
+        }
+        it->second.erase(remove(it->second.begin(), it->second.end(), id), it->second.end());
+        if (it->second.empty()) {
+            table.broadcast_prefixes.erase(it);
+        }
+    }
+}
+
+void enable_tracking(ClientState& client, const TrackingOptions& options) {
+    if (!client.info) {
+        return;
+    }
+    disable_tracking(client);
+    uint64_t id = client.info->id;
+    TrackingOptions stored = options;
+    if (stored.bcast && stored.prefixes.empty()) {
+        stored.prefixes.push_back("");
+    }
+    for (Keyspace* ks : keyspaces) {
+        TrackingTable& table = ks->tracking;
+        lock_guard<mutex> lock(table.tracking_mutex);
+        table.clients[id] = stored;
+        if (stored.bcast) {
+            for (const string& prefix : stored.prefixes) {
+                table.broadcast_prefixes[prefix].push_back(id);
+            }
+        }
+    }
+    client.info->tracking = true;
+    client.tracking_reads = !options.bcast;
+    tracking_client_count++;
+    if (!options.redirect) {
+        open_mailbox(client);
+    }
+}
+
+void disable_tracking(ClientState& client) {
+    if (!client.info || !client.info->tracking.load(memory_order_relaxed)) {
+        return;
+    }
+    for (Keyspace* ks : keyspaces) {
+        TrackingTable& table = ks->tracking;
+        lock_guard<mutex> lock(table.tracking_mutex);
+        auto it = table.clients.find(client.info->id);
+        if (it != table.clients.end()) {
+            remove_broadcast_prefixes(table, it->first, it->second.prefixes);
+            table.clients.erase(it);
+        }
+        // Its entries in table.keys go when their keys are next invalidated.
+    }
+    client.info->tracking = false;
+    client.tracking_reads = false;
+    tracking_client_count--;
+    close_mailbox_if_unused(client);
+}
+
+void tracking_remember_key(ClientState& client, const string& key) {
+    uint64_t id = client.info->id;
+    TrackingTable& table = keyspace->tracking;
+    lock_guard<mutex> lock(table.tracking_mutex);
+    vector<uint64_t>& ids = table.keys[key];
+    if (find(ids.begin(), ids.end(), id) != ids.end()) {
+        return;
+    }
+    ids.push_back(id);
+    table.items++;
+    shrink_tracking_table(table);
+}
+
+void tracking_invalidate_key(const string& key, uint64_t caller_id) {
+    TrackingTable& table = keyspace->tracking;
+    lock_guard<mutex> lock(table.tracking_mutex);
+    vector<uint64_t> ids;
+    auto it = table.keys.find(key);
+    if (it != table.keys.end()) {
+        ids = std::move(it->second);
+        table.items -= ids.size();
+        table.keys.erase(it);
+    }
+    for (const auto& entry : table.broadcast_prefixes) {
+        if (key.compare(0, entry.first.size(), entry.first) == 0) {
+            ids.insert(ids.end(), entry.second.begin(), entry.second.end());
+        }
+    }
+    if (ids.empty()) {
+        return;
+    }
+    // A BCAST client whose prefixes overlap gets the key once.
+    sort(ids.begin(), ids.end());
+    ids.erase(unique(ids.begin(), ids.end()), ids.end());
+    Invalidation invalidation(&key);
+    for (uint64_t id : ids) {
+        send_invalidation(table, id, caller_id, invalidation);
+    }
+}
+
+void tracking_invalidate_all() {
+    if (tracking_client_count.load(memory_order_relaxed) == 0) {
+        return;
+    }
+    for (Keyspace* ks : keyspaces) {
+        TrackingTable& table = ks->tracking;
+        lock_guard<mutex> lock(table.tracking_mutex);
+        table.keys.clear();
+        table.items = 0;
+    }
+    // Every table lists every tracking client; the first one tells them all.
+    TrackingTable& table = keyspaces[0]->tracking;
+    lock_guard<mutex> lock(table.tracking_mutex);
+    Invalidation invalidation(nullptr);
+    for (const auto& entry : table.clients) {
+        send_invalidation(table, entry.first, 0, invalidation);
+    }
+}
+
+void append_tracking_info(string& body) {
+    size_t clients = 0, keys = 0, items = 0, prefixes = 0;
+    for (Keyspace* ks : keyspaces) {
+        TrackingTable& table = ks->tracking;
+        lock_guard<mutex> lock(table.tracking_mutex);
+        clients = table.clients.size();
+        keys += table.keys.size();
+        items += table.items;
+        prefixes = table.broadcast_prefixes.size();
+    }
+    body += "tracking_clients:" + to_string(clients) + "\r\n";
+    body += "tracking_total_keys:" + to_string(keys) + "\r\n";
+    body += "tracking_total_items:" + to_string(items) + "\r\n";
+    body += "tracking_total_prefixes:" + to_string(prefixes) + "\r\n";
+}
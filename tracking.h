@@ -0,0 +1,77 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include "client.h"
+
+using namespace std;
+
+// CLIENT TRACKING: server-assisted invalidation for client-side caches.
+//
+// In the default mode the server remembers, for each key a tracking client
+// reads, which clients read it (in the table of the keyspace holding the key), and when the key is written (touch_key),
+// expires or is flushed, sends each of them one invalidation and forgets them;
+// a client that reads the key again is remembered again. The table is bounded
+// by tracking_table_max_keys, shared out among the keyspaces: past it, keys are dropped with an invalidation,
+// as if they had been written. In broadcast mode (BCAST) nothing is
+// remembered; clients get invalidations for every key under the prefixes
+// they registered, or for every key.
+//
+// Invalidations are pushed to the client itself over RESP3 (HELLO 3), or with
+// REDIRECT to another connection: a RESP3 one, or a RESP2 one subscribed to
+// __redis__:invalidate. They travel through the pubsub mailboxes (pubsub.h),
+// so the loop or thread serving that connection writes them out, as it does
+// a subscriber's messages.
+
+// --tracking-table-max-keys; 0 for no limit.
+extern size_t tracking_table_max_keys;
+
+struct TrackingOptions {
+    bool bcast = false;
+    bool noloop = false;                // no invalidations for the client's own writes
+    uint64_t redirect = 0;              // client id, or 0 for the client itself
+    vector<string> prefixes;            // BCAST only; none means every key
+};
+
+// The tracking state of one keyspace (database.h). Every table has its own
+// copy of the tracking clients and their prefixes, so a write, on whichever
+// shard owns the key, only reads the table of that shard; CLIENT TRACKING
+// updates them all. Writers take the mutex from touch_key, under their store
+// lock; it is taken before the pubsub index lock, never after.
+struct TrackingTable {
+    mutex tracking_mutex;
+    // Key to the ids of the default-mode clients that read it since it last changed.
+    unordered_map<string, vector<uint64_t>> keys;
+    size_t items = 0;
+    // BCAST prefix to the ids of the clients that registered it; "" is every key.
+    map<string, vector<uint64_t>> broadcast_prefixes;
+    unordered_map<uint64_t, TrackingOptions> clients;
+};
+
+// CLIENT TRACKING ON/OFF for client.
+void enable_tracking(ClientState& client, const TrackingOptions& options);
+void disable_tracking(ClientState& client);
+
+// Remembers that a tracking client, in the default mode, read key, which is in
+// the calling thread's keyspace.
+void tracking_remember_key(ClientState& client, const string& key);
+// Sends the invalidations for a key of the calling thread's keyspace that was
+// modified, expired or deleted. caller_id is the client that wrote it, for
+// NOLOOP.
+void tracking_invalidate_key(const string& key, uint64_t caller_id);
+// After FLUSHALL: every tracking client drops its whole cache. The caller
+// holds an AllKeyspacesLock.
+void tracking_invalidate_all();
+
+// Nonzero while some client has tracking on, so writers can skip the lookup.
+extern atomic<int> tracking_client_count;
+
+// The client whose command the calling thread is running, for NOLOOP.
+extern thread_local uint64_t tracking_caller_id;
+
+// The tracking_* lines of INFO clients.
+void append_tracking_info(string& body);
@@ -0,0 +1,339 @@
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <iterator>
+#include "zset_value.h"
+
+using namespace std;
+
+ZSetTree::ZSetTree() : root(new_leaf()) {}
+
+ZSetTree::~ZSetTree() {
+    destroy(root);
+}
+
+ZSetTree::Leaf* ZSetTree::new_leaf() {
+    Leaf* leaf = new Leaf();
+    leaf->leaf = true;
+    leaf->entries.reserve(LEAF_CAPACITY + 1);
+    return leaf;
+}
+
+void ZSetTree::destroy(Node* node) {
+    if (node->leaf) {
+        delete static_cast<Leaf*>(node);
+        return;
+    }
+    Inner* inner = static_cast<Inner*>(node);
+    for (Node* child : inner->children) {
+        destroy(child);
+    }
+    delete inner;
+}
+
+size_t ZSetTree::node_size(const Node* node) {
+    if (node->leaf) {
+        return static_cast<const Leaf*>(node)->entries.size();
+    }
+    size_t size = 0;
+    for (size_t count : static_cast<const Inner*>(node)->counts) {
+        size += count;
+    }
+    return size;
+}
+
+size_t ZSetTree::node_bytes(const Node* node) {
+    if (node->leaf) {
+        const Leaf* leaf = static_cast<const Leaf*>(node);
+        return heap_usable_size(sizeof(Leaf)) + heap_usable_size(leaf->entries.capacity() * sizeof(ZEntry));
+    }
+    const Inner* inner = static_cast<const Inner*>(node);
+    size_t bytes = heap_usable_size(sizeof(Inner)) +
+                   heap_usable_size(inner->children.capacity() * sizeof(Node*)) +
+                   heap_usable_size(inner->counts.capacity() * sizeof(size_t)) +
+                   heap_usable_size(inner->keys.capacity() * sizeof(ZEntry));
+    if (inner->children[0]->leaf) {
+        // Leaves are reserved at full capacity when made and never grow, so
+        // one stands for all of them.
+        return bytes + inner->children.size() * node_bytes(inner->children[0]);
+    }
+    for (const Node* child : inner->children) {
+        bytes += node_bytes(child);
+    }
+    return bytes;
+}
+
+// Inserts entry below node. If node overflows it splits, and the new right
+// half is returned with the key separating the two halves in separator.
+ZSetTree::Node* ZSetTree::insert_into(Node* node, ZEntry&& entry, ZEntry& separator) {
+    if (node->leaf) {
+        Leaf* leaf = static_cast<Leaf*>(node);
+        auto pos = upper_bound(leaf->entries.begin(), leaf->entries.end(), entry);
+        leaf->entries.insert(pos, std::move(entry));
+        if (leaf->entries.size() <= LEAF_CAPACITY) {
+            return nullptr;
+        }
+
+        Leaf* right = new_leaf();
+        size_t half = leaf->entries.size() / 2;
+        right->entries.assign(make_move_iterator(leaf->entries.begin() + half),
+                              make_move_iterator(leaf->entries.end()));
+        leaf->entries.erase(leaf->entries.begin() + half, leaf->entries.end());
+        right->next = leaf->next;
+        if (right->next) {
+            right->next->prev = right;
+        }
+        right->prev = leaf;
+        leaf->next = right;
+        separator = right->entries[0];
+        return right;
+    }
+
+    Inner* inner = static_cast<Inner*>(node);
+    size_t i = upper_bound(inner->keys.begin(), inner->keys.end(), entry) - inner->keys.begin();
+    inner->counts[i]++;
+    ZEntry child_separator;
+    Node* split = insert_into(inner->children[i], std::move(entry), child_separator);
+    if (!split) {
+        return nullptr;
+    }
+    inner->counts[i] = node_size(inner->children[i]);
+    inner->children.insert(inner->children.begin() + i + 1, split);
+    inner->counts.insert(inner->counts.begin() + i + 1, node_size(split));
+    inner->keys.insert(inner->keys.begin() + i, std::move(child_separator));
+    if (inner->children.size() <= INNER_CAPACITY) {
+        return nullptr;
+    }
+
+    Inner* right = new Inner();
+    right->leaf = false;
+    size_t half = inner->children.size() / 2;
+    right->children.assign(inner->children.begin() + half, inner->children.end());
+    right->counts.assign(inner->counts.begin() + half, inner->counts.end());
+    right->keys.assign(make_move_iterator(inner->keys.begin() + half), make_move_iterator(inner->keys.end()));
+    separator = std::move(inner->keys[half - 1]);
+    inner->children.resize(half);
+    inner->counts.resize(half);
+    inner->keys.erase(inner->keys.begin() + half - 1, inner->keys.end());
+    return right;
+}
+
+void ZSetTree::insert(ZEntry entry) {
+    ZEntry separator;
+    Node* split = insert_into(root, std::move(entry), separator);
+    if (split) {
+        Inner* new_root = new Inner();
+        new_root->leaf = false;
+        new_root->children = {root, split};
+        new_root->counts = {node_size(root), node_size(split)};
+        new_root->keys.push_back(std::move(separator));
+        root = new_root;
+    }
+    total++;
+}
+
+// Drops an empty (or already merged) child and the separator next to it.
+void ZSetTree::remove_child(Inner* inner, size_t index) {
+    Node* child = inner->children[index];
+    if (child->leaf) {
+        Leaf* leaf = static_cast<Leaf*>(child);
+        if (leaf->prev) {
+            leaf->prev->next = leaf->next;
+        }
+        if (leaf->next) {
+            leaf->next->prev = leaf->prev;
+        }
+    }
+    destroy(child);
+    inner->children.erase(inner->children.begin() + index);
+    inner->counts.erase(inner->counts.begin() + index);
+    if (!inner->keys.empty()) {
+        inner->keys.erase(inner->keys.begin() + (index > 0 ? index - 1 : 0));
+    }
+}
+
+bool ZSetTree::erase_from(Node* node, const ZEntry& entry) {
+    if (node->leaf) {
+        Leaf* leaf = static_cast<Leaf*>(node);
+        auto pos = lower_bound(leaf->entries.begin(), leaf->entries.end(), entry);
+        if (pos == leaf->entries.end() || entry < *pos) {
+            return false;
+        }
+        leaf->entries.erase(pos);
+        return true;
+    }
+
+    Inner* inner = static_cast<Inner*>(node);
+    size_t i = upper_bound(inner->keys.begin(), inner->keys.end(), entry) - inner->keys.begin();
+    Node* child = inner->children[i];
+    if (!erase_from(child, entry)) {
+        return false;
+    }
+    inner->counts[i]--;
+    if (inner->counts[i] == 0) {
+        remove_child(inner, i);
+    }
+    else if (child->leaf && i > 0 && inner->counts[i - 1] + inner->counts[i] <= LEAF_CAPACITY / 2) {
+        // Fold a thinning leaf into its left neighbour so leaves stay dense.
+        Leaf* left = static_cast<Leaf*>(inner->children[i - 1]);
+        Leaf* leaf = static_cast<Leaf*>(child);
+        left->entries.insert(left->entries.end(), make_move_iterator(leaf->entries.begin()),
+                             make_move_iterator(leaf->entries.end()));
+        inner->counts[i - 1] += inner->counts[i];
+        remove_child(inner, i);
+    }
+    return true;
+}
+
+bool ZSetTree::erase(const ZEntry& entry) {
+    if (!erase_from(root, entry)) {
+        return false;
+    }
+    total--;
+    while (!root->leaf) {
+        Inner* inner = static_cast<Inner*>(root);
+        if (inner->children.size() > 1) {
+            break;
+        }
+        root = inner->children.empty() ? new_leaf() : inner->children[0];
+        inner->children.clear();
+        delete inner;
+    }
+    return true;
+}
+
+const ZSetTree::Leaf* ZSetTree::find_rank(size_t& rank) const {
+    const Node* node = root;
+    while (!node->leaf) {
+        const Inner* inner = static_cast<const Inner*>(node);
+        size_t i = 0;
+        while (i + 1 < inner->children.size() && rank >= inner->counts[i]) {
+            rank -= inner->counts[i];
+            i++;
+        }
+        node = inner->children[i];
+    }
+    return static_cast<const Leaf*>(node);
+}
+
+const ZEntry& ZSetTree::at(size_t rank) const {
+    const Leaf* leaf = find_rank(rank);
+    return leaf->entries[rank];
+}
+
+vector<ZEntry>::const_iterator ZSetValue::find_packed(const string& member) const {
+    return find_if(packed.begin(), packed.end(), [&](const ZEntry& entry) { return entry.member == member; });
+}
+
+void ZSetValue::convert_to_tree() {
+    tree.reset(new ZSetTree());
+    scores.reset(new Dict<double>());
+    scores->reserve(packed.size() * 2);
+    for (ZEntry& entry : packed) {
+        (*scores)[entry.member] = entry.score;
+        tree->insert(std::move(entry));
+    }
+    vector<ZEntry>().swap(packed);
+}
+
+size_t ZSetValue::structure_bytes() const {
+    if (!tree) {
+        return packed.capacity() ? heap_usable_size(packed.capacity() * sizeof(ZEntry)) : 0;
+    }
+    return heap_usable_size(sizeof(ZSetTree)) + tree->structure_bytes() +
+           heap_usable_size(sizeof(Dict<double>)) + scores->overhead_bytes();
+}
+
+bool ZSetValue::get_score(const string& member, double& score) const {
+    if (tree) {
+        auto it = scores->find(member);
+        if (it == scores->end()) {
+            return false;
+        }
+        score = it->second;
+        return true;
+    }
+    auto it = find_packed(member);
+    if (it == packed.end()) {
+        return false;
+    }
+    score = it->score;
+    return true;
+}
+
+bool ZSetValue::set(const string& member, double score) {
+    if (!tree) {
+        auto it = find_packed(member);
+        if (it != packed.end()) {
+            if (it->score != score) {
+                packed.erase(it);
+                ZEntry entry{score, member};
+                packed.insert(upper_bound(packed.begin(), packed.end(), entry), std::move(entry));
+            }
+            return false;
+        }
+        if (packed.size() < ZSET_MAX_PACKED_ENTRIES && member.size() <= ZSET_MAX_PACKED_VALUE) {
+            ZEntry entry{score, member};
+            packed.insert(upper_bound(packed.begin(), packed.end(), entry), std::move(entry));
+            return true;
+        }
+        convert_to_tree();
+    }
+
+    auto it = scores->find(member);
+    if (it != scores->end()) {
+        if (it->second != score) {
+            tree->erase(ZEntry{it->second, member});
+            it->second = score;
+            tree->insert(ZEntry{score, member});
+        }
+        return false;
+    }
+    (*scores)[member] = score;
+    tree->insert(ZEntry{score, member});
+    return true;
+}
+
+bool ZSetValue::erase(const string& member) {
+    if (!tree) {
+        auto it = find_packed(member);
+        if (it == packed.end()) {
+            return false;
+        }
+        packed.erase(it);
+        return true;
+    }
+    auto it = scores->find(member);
+    if (it == scores->end()) {
+        return false;
+    }
+    tree->erase(ZEntry{it->second, member});
+    scores->erase(it);
+    return true;
+}
+
+int64_t ZSetValue::rank(const string& member) const {
+    if (!tree) {
+        auto it = find_packed(member);
+        return it == packed.end() ? -1 : it - packed.begin();
+    }
+    auto it = scores->find(member);
+    if (it == scores->end()) {
+        return -1;
+    }
+    ZEntry target{it->second, member};
+    return tree->count_before([&](const ZEntry& entry) { return entry < target; });
+}
+
+ZEntry ZSetValue::pop_min() {
+    if (!tree) {
+        ZEntry entry = std::move(packed.front());
+        packed.erase(packed.begin());
+        return entry;
+    }
+    ZEntry entry = tree->at(0);
+    tree->erase(entry);
+    scores->erase(entry.member);
+    return entry;
+}
@@ -0,0 +1,155 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include "dict.h"
+
+using namespace std;
+
+struct ZEntry {
+    double score;
+    string member;
+};
+
+// Sorted set order: by score, ties broken by member bytes.
+inline bool operator<(const ZEntry& a, const ZEntry& b) {
+    return a.score < b.score || (a.score == b.score && a.member < b.member);
+}
+
+// Small sorted sets are a single sorted vector of entries; past either limit
+// the set converts to a ZSetTree plus a member-to-score Dict.
+const size_t ZSET_MAX_PACKED_ENTRIES = 128;
+const size_t ZSET_MAX_PACKED_VALUE = 64;
+
+// B+-tree of entries that also counts, in every inner node, how many entries
+// sit under each child. Leaves are contiguous arrays linked in order, so a
+// range walk streams through memory, and rank lookups are a few binary
+// searches over short arrays instead of a pointer chase per element.
+class ZSetTree {
+private:
+    static const size_t LEAF_CAPACITY = 64;
+    static const size_t INNER_CAPACITY = 64;
+
+    struct Node {
+        bool leaf;
+    };
+    struct Leaf : Node {
+        vector<ZEntry> entries;
+        Leaf* prev = nullptr;
+        Leaf* next = nullptr;
+    };
+    // keys[i] separates children[i] (all entries below it) from children[i + 1]
+    // (all entries at or above it). counts[i] is the size of children[i].
+    struct Inner : Node {
+        vector<Node*> children;
+        vector<size_t> counts;
+        vector<ZEntry> keys;
+    };
+
+    Node* root;
+    size_t total = 0;
+
+    static Leaf* new_leaf();
+    static void destroy(Node* node);
+    static size_t node_size(const Node* node);
+    static size_t node_bytes(const Node* node);
+    Node* insert_into(Node* node, ZEntry&& entry, ZEntry& separator);
+    bool erase_from(Node* node, const ZEntry& entry);
+    void remove_child(Inner* inner, size_t index);
+    // Leaf holding the entry at rank, with rank reduced to its index there.
+    const Leaf* find_rank(size_t& rank) const;
+
+public:
+    ZSetTree();
+    ~ZSetTree();
+    ZSetTree(const ZSetTree&) = delete;
+    ZSetTree& operator=(const ZSetTree&) = delete;
+
+    size_t size() const { return total; }
+    // Heap bytes of the nodes and their arrays, not counting the members'
+    // own buffers. Walks the inner nodes only.
+    size_t structure_bytes() const { return node_bytes(root); }
+    void insert(ZEntry entry);
+    bool erase(const ZEntry& entry);
+    const ZEntry& at(size_t rank) const;
+
+    // Number of entries e for which is_before(e) holds. is_before must be true
+    // for some prefix of the set and false for the rest, such as "score < 5".
+    template <typename Pred>
+    size_t count_before(Pred is_before) const {
+        size_t count = 0;
+        const Node* node = root;
+        while (!node->leaf) {
+            const Inner* inner = static_cast<const Inner*>(node);
+            size_t i = partition_point(inner->keys.begin(), inner->keys.end(), is_before) - inner->keys.begin();
+            for (size_t k = 0; k < i; ++k) {
+                count += inner->counts[k];
+            }
+            node = inner->children[i];
+        }
+        const Leaf* leaf = static_cast<const Leaf*>(node);
+        return count + (partition_point(leaf->entries.begin(), leaf->entries.end(), is_before) - leaf->entries.begin());
+    }
+
+    // Calls fn on the entries with ranks in [start, end), in order.
+    template <typename Fn>
+    void for_range(size_t start, size_t end, Fn&& fn) const {
+        if (start >= end) {
+            return;
+        }
+        size_t index = start;
+        const Leaf* leaf = find_rank(index);
+        for (size_t remaining = end - start; remaining > 0 && leaf; leaf = leaf->next, index = 0) {
+            for (; index < leaf->entries.size() && remaining > 0; ++index, --remaining) {
+                fn(leaf->entries[index]);
+            }
+        }
+    }
+};
+
+// Value of a sorted set key.
+class ZSetValue {
+private:
+    vector<ZEntry> packed;
+    unique_ptr<ZSetTree> tree;
+    unique_ptr<Dict<double>> scores;
+
+    void convert_to_tree();
+    vector<ZEntry>::const_iterator find_packed(const string& member) const;
+
+public:
+    size_t size() const { return tree ? tree->size() : packed.size(); }
+    bool is_packed() const { return !tree; }
+    // Heap bytes of the encoding, not counting the members' own buffers, which
+    // a tree holds twice: in its entries and as keys of the score table.
+    size_t structure_bytes() const;
+
+    bool get_score(const string& member, double& score) const;
+    // Adds member with score, or moves it there. Returns true if it was added.
+    bool set(const string& member, double score);
+    bool erase(const string& member);
+    // 0-based rank of member in ascending order, or -1.
+    int64_t rank(const string& member) const;
+    // Removes and returns the lowest entry; the set must not be empty.
+    ZEntry pop_min();
+
+    template <typename Pred>
+    size_t count_before(Pred is_before) const {
+        if (tree) {
+            return tree->count_before(is_before);
+        }
+        return partition_point(packed.begin(), packed.end(), is_before) - packed.begin();
+    }
+
+    template <typename Fn>
+    void for_range(size_t start, size_t end, Fn&& fn) const {
+        if (tree) {
+            tree->for_range(start, end, fn);
+            return;
+        }
+        for (size_t i = start; i < end && i < packed.size(); ++i) {
+            fn(packed[i]);
+        }
+    }
+};